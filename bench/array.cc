@@ -0,0 +1,488 @@
+#include "bench.h"
+#include <immutable/array.h>
+#include <immutable/alloc.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+using namespace immutable;
+
+// Same as int64_t but stored in boxed Value objects, for comparison with the
+// default unboxed storage of int64_t.
+struct BoxedInt64 {
+  int64_t v;
+  BoxedInt64(int64_t v) : v(v) {}
+  bool operator<(const BoxedInt64& o) const { return v < o.v; }
+  bool operator>(const BoxedInt64& o) const { return v > o.v; }
+};
+namespace std {
+  template <> struct hash<BoxedInt64> {
+    size_t operator()(const BoxedInt64& b) const { return hash<int64_t>()(b.v); }
+  };
+}
+// Boxed like BoxedInt64, but with non-atomic reference counting of its Value objects
+struct LocalBoxedInt64 {
+  int64_t v;
+  LocalBoxedInt64(int64_t v) : v(v) {}
+};
+namespace immutable {
+  template <> struct ArrayUnboxed<BoxedInt64> : std::false_type {};
+  template <> struct ArrayUnboxed<LocalBoxedInt64> : std::false_type {};
+  template <> struct RefCountPolicy<Value<LocalBoxedInt64>> { using type = LocalRefCount; };
+}
+
+static constexpr uint32 COUNT = 1000000;
+
+template <typename T>
+static ref<Array<T>> mkarray(uint32 count) {
+  auto t = Array<T>::empty()->asTransient();
+  for (uint32 i = 0; i < count; ++i) {
+    t->push(int64_t(i));
+  }
+  return t->makePersistent();
+}
+
+// Note: created lazily as ArrayImp::EMPTY might not be initialized yet during
+// static initialization of this file.
+template <typename T>
+static const ref<Array<T>>& sample() {
+  static auto a = mkarray<T>(COUNT);
+  return a;
+}
+
+static int64_t get(int64_t v) { return v; }
+static int64_t get(const BoxedInt64& v) { return v.v; }
+static int64_t get(const LocalBoxedInt64& v) { return v.v; }
+
+// Runs f with node free-list caching disabled, for comparison with the default
+template <typename F>
+static uint64_t withoutNodeCache(F f) {
+  bool prev = NodeAlloc::setCaching(false);
+  auto n = f();
+  NodeAlloc::setCaching(prev);
+  return n;
+}
+
+template <typename T>
+static uint64_t benchPush() {
+  auto a = Array<T>::empty();
+  for (uint32 i = 0; i < COUNT; ++i) {
+    a = a->push(int64_t(i));
+  }
+  BenchUse(a->size());
+  return COUNT;
+}
+
+template <typename T>
+static uint64_t benchTransientPush() {
+  auto a = mkarray<T>(COUNT);
+  BenchUse(a->size());
+  return COUNT;
+}
+
+// Creates arrays from a vector of COUNT values. threads=0 uses create, which fills
+// leaves on the calling thread, otherwise createParallel is used.
+template <typename T>
+static uint64_t benchCreate(uint32 threads = 0) {
+  static const std::vector<int64_t> v = [] {
+    std::vector<int64_t> v;
+    for (uint32 i = 0; i < COUNT; ++i) {
+      v.push_back(int64_t(i));
+    }
+    return v;
+  }();
+  auto a = threads ? Array<T>::createParallel(v, threads) : Array<T>::create(v);
+  BenchUse(a->size());
+  return COUNT;
+}
+
+// Builds COUNT values into arrays of n values each, with ArrayBuilder or TransientArray
+template <typename T>
+static uint64_t benchBuilder(uint32 n) {
+  ArrayBuilder<T> b;
+  for (uint32 i = 0; i < COUNT; i += n) {
+    b.reserve(n);
+    for (uint32 k = 0; k < n; ++k) {
+      b.emplace_back(int64_t(k));
+    }
+    BenchUse(b.build()->size());
+  }
+  return COUNT;
+}
+
+template <typename T>
+static uint64_t benchTransientBuild(uint32 n) {
+  for (uint32 i = 0; i < COUNT; i += n) {
+    auto t = Array<T>::empty()->asTransient();
+    for (uint32 k = 0; k < n; ++k) {
+      t = t->push(int64_t(k));
+    }
+    BenchUse(t->makePersistent()->size());
+  }
+  return COUNT;
+}
+
+// Maps a with map (threads=0), parallelMap or by creating an array from an iterator
+template <typename T>
+static uint64_t benchMap(const ref<Array<T>>& a, uint32 threads = 0) {
+  auto fn = [] (const T& v) { return get(v) * 2; };
+  auto m = threads ? a->parallelMap(fn, threads) : a->map(fn);
+  BenchUse(m->size());
+  return COUNT;
+}
+
+template <typename T>
+static uint64_t benchMapIterator(const ref<Array<T>>& a) {
+  struct It : Array<T>::Iterator {
+    typedef std::forward_iterator_tag iterator_category; // operator[] is not mapped
+    It(const typename Array<T>::Iterator& it) : Array<T>::Iterator(it) {}
+    int64_t operator*() { return get(Array<T>::Iterator::operator*()) * 2; }
+  };
+  auto m = Array<int64_t>::create(It(a->begin()), It(a->end()));
+  BenchUse(m->size());
+  return COUNT;
+}
+
+template <typename T>
+static uint64_t benchGet(const ref<Array<T>>& a) {
+  int64_t sum = 0;
+  for (uint32 i = 0; i < COUNT; ++i) {
+    sum += get(a->get(i));
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+template <typename T>
+static uint64_t benchIterate(const ref<Array<T>>& a) {
+  int64_t sum = 0;
+  for (auto& v : *a) {
+    sum += get(v);
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+template <typename T>
+static uint64_t benchIterateReverse(const ref<Array<T>>& a) {
+  int64_t sum = 0;
+  for (auto I = a->rbegin(); I != a->rend(); ++I) {
+    sum += get(*I);
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+template <typename T>
+static uint64_t benchGetReverse(const ref<Array<T>>& a) {
+  int64_t sum = 0;
+  for (uint32 i = COUNT; i > 0; --i) {
+    sum += get(a->get(i - 1));
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+// Compares arrays with equal values which don't share any nodes, or which share
+// all but the nodes on the path to one value
+template <typename T, bool Shared>
+static uint64_t benchCompare(const ref<Array<T>>& a) {
+  static auto b = Shared ? a->set(COUNT / 2, int64_t(COUNT / 2)) : mkarray<T>(COUNT);
+  BenchUse(a->compare(b));
+  return COUNT;
+}
+
+// Diffs an array against a version with 10 values changed and 100 values added
+template <typename T, const ref<Array<T>>& Sample()>
+static uint64_t benchDiff() {
+  auto& a = Sample();
+  static auto b = [&] {
+    auto b = a;
+    for (uint32 i = 0; i < 10; ++i) {
+      b = b->set(i * (COUNT / 10), int64_t(-1));
+    }
+    for (uint32 i = 0; i < 100; ++i) {
+      b = b->push(int64_t(i));
+    }
+    return b;
+  }();
+  uint32 n = 0;
+  a->diff(b, [&] (const ArrayDiff& d) { n += d.end - d.start; });
+  BenchUse(n);
+  return 1;
+}
+
+// Binary search for every 16th value with std::lower_bound
+template <typename T>
+static uint64_t benchLowerBound(const ref<Array<T>>& a) {
+  int64_t sum = 0;
+  auto E = a->end();
+  for (uint32 i = 0; i < COUNT; i += 16) {
+    auto I = std::lower_bound(a->begin(), E, int64_t(i), [] (const T& v, int64_t k) {
+      return get(v) < k;
+    });
+    sum += get(*I);
+  }
+  BenchUse(sum);
+  return COUNT / 16;
+}
+
+// Visits every 7th value by moving an iterator
+template <typename T>
+static uint64_t benchIterateStride(const ref<Array<T>>& a) {
+  int64_t sum = 0;
+  auto E = a->end();
+  for (auto I = a->begin(); I < E; I += 7) {
+    sum += get(*I);
+  }
+  BenchUse(sum);
+  return COUNT / 7;
+}
+
+// Sums values chunk by chunk, with forEachChunk or chunks
+template <typename T>
+static uint64_t benchForEachChunk(const ref<Array<T>>& a) {
+  int64_t sum = 0;
+  a->forEachChunk([&] (const ArrayChunk<T>& chunk) {
+    // Note: a local sum can't alias the values, which lets the loop be vectorized
+    int64_t s = 0;
+    for (uint32 k = 0; k < chunk.size(); ++k) {
+      s += get(chunk[k]);
+    }
+    sum += s;
+  });
+  BenchUse(sum);
+  return COUNT;
+}
+
+template <typename T>
+static uint64_t benchChunks(const ref<Array<T>>& a) {
+  int64_t sum = 0;
+  for (auto& chunk : a->chunks()) {
+    int64_t s = 0;
+    for (auto& v : chunk) {
+      s += get(v);
+    }
+    sum += s;
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+// Sums values with reduce (threads=0) or parallelReduce
+template <typename T>
+static uint64_t benchReduce(const ref<Array<T>>& a, uint32 threads = 0) {
+  auto op = [] (int64_t acc, const T& v) { return acc + get(v); };
+  int64_t sum = threads ?
+    a->parallelReduce(int64_t(0), op, [] (int64_t a, int64_t b) { return a + b; }, threads) :
+    a->reduce(int64_t(0), op);
+  BenchUse(sum);
+  return COUNT;
+}
+
+// Like benchGet but retains and releases each value
+template <typename T>
+static uint64_t benchGetValue(const ref<Array<T>>& a) {
+  int64_t sum = 0;
+  for (uint32 i = 0; i < COUNT; ++i) {
+    sum += get(a->getValue(i)->value);
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+template <typename T>
+static uint64_t benchSet(ref<Array<T>> a) {
+  for (uint32 i = 0; i < COUNT; i += 10) {
+    a = a->set(i, int64_t(i) * 2);
+  }
+  BenchUse(a->size());
+  return COUNT / 10;
+}
+
+// Like benchSet, but hashes every version, which only hashes the nodes it doesn't
+// share with the previous version
+template <typename T>
+static uint64_t benchSetHash(ref<Array<T>> a) {
+  uint64_t h = a->hash();
+  for (uint32 i = 0; i < COUNT; i += 10) {
+    a = a->set(i, int64_t(i) * 2);
+    h ^= a->hash();
+  }
+  BenchUse(h);
+  return COUNT / 10;
+}
+
+template <typename T>
+static uint64_t benchPop(ref<Array<T>> a) {
+  while (a->size()) {
+    a = a->pop();
+  }
+  BenchUse(a->size());
+  return COUNT;
+}
+
+// Concatenates COUNT values in chunks of an odd size, which produces relaxed nodes
+template <typename T>
+static uint64_t benchConcat() {
+  auto chunk = mkarray<T>(1001);
+  auto a = Array<T>::empty();
+  for (uint32 i = 0; i < COUNT / 1001; ++i) {
+    a = a->concat(chunk);
+  }
+  BenchUse(a->size());
+  return COUNT / 1001;
+}
+
+template <typename T>
+static uint64_t benchSplice(ref<Array<T>> a) {
+  auto b = mkarray<T>(100);
+  for (uint32 i = 0; i < 1000; ++i) {
+    a = a->splice(COUNT / 3 + i, COUNT / 3 + i + 50, b);
+  }
+  BenchUse(a->size());
+  return 1000;
+}
+
+template <typename T>
+static uint64_t benchCons(ref<Array<T>> a) {
+  for (uint32 i = 0; i < 10000; ++i) {
+    a = a->cons(int64_t(i));
+  }
+  BenchUse(a->size());
+  return 10000;
+}
+
+// Like the ArrayMultiThreaded test: threads concurrently take snapshots of a shared
+// array, read values and derive new versions of it. Returns total operations.
+template <typename T>
+static uint64_t benchMultiThreaded(const ref<Array<T>>& a, uint32 threads = 4) {
+  uint32 count = COUNT / threads;
+  auto thread = [&] (uint32 n) {
+    auto b = a;
+    int64_t sum = 0;
+    for (uint32 i = n; i < count; i += 10) {
+      ref<Array<T>> snapshot = a;
+      b = b->set(i, int64_t(i) * n);
+      sum += get(b->getValue(i / 2)->value) + get(snapshot->get(i));
+    }
+    for (uint32 i = 0; i < count / 10; ++i) {
+      b = b->push(int64_t(i));
+    }
+    BenchUse(sum);
+    BenchUse(b->size());
+  };
+  std::vector<std::thread> v;
+  for (uint32 n = 0; n < threads; ++n) {
+    v.emplace_back(thread, n + 1);
+  }
+  for (auto& t : v) {
+    t.join();
+  }
+  return threads * (count / 10) * 2;
+}
+
+// Arrays of COUNT values made up of many concatenated pieces
+template <typename T>
+static const ref<Array<T>>& relaxedSample() {
+  static auto a = [] {
+    auto a = Array<T>::empty();
+    for (uint32 i = 0; a->size() < COUNT; ++i) {
+      a = a->concat(mkarray<T>(min(COUNT - a->size(), 500 + (i * 7919) % 1000)));
+    }
+    return a;
+  }();
+  return a;
+}
+
+BENCH(ArrayPushUnboxed) { return benchPush<int64_t>(); }
+BENCH(ArrayPushBoxed) { return benchPush<BoxedInt64>(); }
+BENCH(ArrayPushBoxedLocalRC) { return benchPush<LocalBoxedInt64>(); }
+BENCH(ArrayTransientPushUnboxed) { return benchTransientPush<int64_t>(); }
+BENCH(ArrayTransientPushBoxed) { return benchTransientPush<BoxedInt64>(); }
+BENCH(ArrayCreateUnboxed) { return benchCreate<int64_t>(); }
+BENCH(ArrayCreateBoxed) { return benchCreate<BoxedInt64>(); }
+BENCH(ArrayCreateParallelUnboxed) { return benchCreate<int64_t>(4); }
+BENCH(ArrayCreateParallelBoxed) { return benchCreate<BoxedInt64>(4); }
+BENCH(ArrayBuilderUnboxed) { return benchBuilder<int64_t>(COUNT); }
+BENCH(ArrayBuilderBoxed) { return benchBuilder<BoxedInt64>(COUNT); }
+BENCH(ArrayBuilderSmallUnboxed) { return benchBuilder<int64_t>(10); }
+BENCH(ArrayTransientSmallUnboxed) { return benchTransientBuild<int64_t>(10); }
+BENCH(ArrayBuilderSmallBoxed) { return benchBuilder<BoxedInt64>(10); }
+BENCH(ArrayTransientSmallBoxed) { return benchTransientBuild<BoxedInt64>(10); }
+BENCH(ArrayMapUnboxed) { return benchMap(sample<int64_t>()); }
+BENCH(ArrayMapBoxed) { return benchMap(sample<BoxedInt64>()); }
+BENCH(ArrayMapIteratorUnboxed) { return benchMapIterator(sample<int64_t>()); }
+BENCH(ArrayMapIteratorBoxed) { return benchMapIterator(sample<BoxedInt64>()); }
+BENCH(ArrayParallelMap1Thread) { return benchMap(sample<BoxedInt64>(), 1); }
+BENCH(ArrayParallelMap2Threads) { return benchMap(sample<BoxedInt64>(), 2); }
+BENCH(ArrayParallelMap4Threads) { return benchMap(sample<BoxedInt64>(), 4); }
+BENCH(ArrayGetUnboxed) { return benchGet(sample<int64_t>()); }
+BENCH(ArrayGetBoxed) { return benchGet(sample<BoxedInt64>()); }
+BENCH(ArrayGetValueBoxed) { return benchGetValue(sample<BoxedInt64>()); }
+BENCH(ArrayGetValueBoxedLocalRC) { return benchGetValue(sample<LocalBoxedInt64>()); }
+BENCH(ArrayIterateUnboxed) { return benchIterate(sample<int64_t>()); }
+BENCH(ArrayIterateBoxed) { return benchIterate(sample<BoxedInt64>()); }
+BENCH(ArrayIterateReverseUnboxed) { return benchIterateReverse(sample<int64_t>()); }
+BENCH(ArrayIterateReverseBoxed) { return benchIterateReverse(sample<BoxedInt64>()); }
+BENCH(ArrayGetReverseUnboxed) { return benchGetReverse(sample<int64_t>()); }
+BENCH(ArrayCompareUnboxed) { return benchCompare<int64_t, false>(sample<int64_t>()); }
+BENCH(ArrayCompareBoxed) { return benchCompare<BoxedInt64, false>(sample<BoxedInt64>()); }
+BENCH(ArrayCompareSharedUnboxed) { return benchCompare<int64_t, true>(sample<int64_t>()); }
+BENCH(ArrayDiffUnboxed) { return benchDiff<int64_t, sample<int64_t>>(); }
+BENCH(ArrayDiffBoxed) { return benchDiff<BoxedInt64, sample<BoxedInt64>>(); }
+BENCH(ArrayDiffRelaxedUnboxed) { return benchDiff<int64_t, relaxedSample<int64_t>>(); }
+BENCH(ArrayLowerBoundUnboxed) { return benchLowerBound(sample<int64_t>()); }
+BENCH(ArrayLowerBoundBoxed) { return benchLowerBound(sample<BoxedInt64>()); }
+BENCH(ArrayIterateStrideUnboxed) { return benchIterateStride(sample<int64_t>()); }
+BENCH(ArrayForEachChunkUnboxed) { return benchForEachChunk(sample<int64_t>()); }
+BENCH(ArrayForEachChunkBoxed) { return benchForEachChunk(sample<BoxedInt64>()); }
+BENCH(ArrayChunksUnboxed) { return benchChunks(sample<int64_t>()); }
+BENCH(ArrayChunksBoxed) { return benchChunks(sample<BoxedInt64>()); }
+BENCH(ArrayReduceUnboxed) { return benchReduce(sample<int64_t>()); }
+BENCH(ArrayReduceBoxed) { return benchReduce(sample<BoxedInt64>()); }
+BENCH(ArrayReduceRelaxedUnboxed) { return benchReduce(relaxedSample<int64_t>()); }
+BENCH(ArrayParallelReduce1Thread) { return benchReduce(sample<int64_t>(), 1); }
+BENCH(ArrayParallelReduce2Threads) { return benchReduce(sample<int64_t>(), 2); }
+BENCH(ArrayParallelReduce4Threads) { return benchReduce(sample<int64_t>(), 4); }
+BENCH(ArrayParallelReduce8Threads) { return benchReduce(sample<int64_t>(), 8); }
+BENCH(ArrayParallelReduceCPUs) { return benchReduce(sample<int64_t>(), 0); }
+BENCH(ArraySetUnboxed) { return benchSet(sample<int64_t>()); }
+BENCH(ArraySetBoxed) { return benchSet(sample<BoxedInt64>()); }
+BENCH(ArraySetBoxedLocalRC) { return benchSet(sample<LocalBoxedInt64>()); }
+BENCH(ArraySetHashUnboxed) { return benchSetHash(sample<int64_t>()); }
+BENCH(ArraySetHashBoxed) { return benchSetHash(sample<BoxedInt64>()); }
+BENCH(ArrayPopUnboxed) { return benchPop(sample<int64_t>()); }
+BENCH(ArrayPopBoxed) { return benchPop(sample<BoxedInt64>()); }
+BENCH(ArrayConcatUnboxed) { return benchConcat<int64_t>(); }
+BENCH(ArrayConcatBoxed) { return benchConcat<BoxedInt64>(); }
+BENCH(ArraySpliceUnboxed) { return benchSplice(sample<int64_t>()); }
+BENCH(ArraySpliceBoxed) { return benchSplice(sample<BoxedInt64>()); }
+BENCH(ArrayConsUnboxed) { return benchCons(sample<int64_t>()); }
+BENCH(ArrayConsBoxed) { return benchCons(sample<BoxedInt64>()); }
+BENCH(ArrayGetRelaxedUnboxed) { return benchGet(relaxedSample<int64_t>()); }
+BENCH(ArrayIterateRelaxedUnboxed) { return benchIterate(relaxedSample<int64_t>()); }
+BENCH(ArrayIterateReverseRelaxedUnboxed) { return benchIterateReverse(relaxedSample<int64_t>()); }
+BENCH(ArrayIterateStrideRelaxedUnboxed) { return benchIterateStride(relaxedSample<int64_t>()); }
+BENCH(ArraySetRelaxedUnboxed) { return benchSet(relaxedSample<int64_t>()); }
+
+BENCH(ArrayMultiThreadedUnboxed) { return benchMultiThreaded(sample<int64_t>()); }
+BENCH(ArrayMultiThreadedBoxed) { return benchMultiThreaded(sample<BoxedInt64>()); }
+// scaling with the number of threads; ns/op is wall time over all threads' operations
+BENCH(ArrayMultiThreaded1Thread) { return benchMultiThreaded(sample<BoxedInt64>(), 1); }
+BENCH(ArrayMultiThreaded2Threads) { return benchMultiThreaded(sample<BoxedInt64>(), 2); }
+BENCH(ArrayMultiThreaded8Threads) { return benchMultiThreaded(sample<BoxedInt64>(), 8); }
+BENCH(ArrayMultiThreaded32Threads) { return benchMultiThreaded(sample<BoxedInt64>(), 32); }
+
+BENCH(ArrayPushUnboxedNoNodeCache) {
+  return withoutNodeCache([] { return benchPush<int64_t>(); });
+}
+BENCH(ArrayPushBoxedNoNodeCache) {
+  return withoutNodeCache([] { return benchPush<BoxedInt64>(); });
+}
+BENCH(ArraySetUnboxedNoNodeCache) {
+  return withoutNodeCache([] { return benchSet(sample<int64_t>()); });
+}
+BENCH(ArraySetBoxedNoNodeCache) {
+  return withoutNodeCache([] { return benchSet(sample<BoxedInt64>()); });
+}
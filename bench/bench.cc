@@ -0,0 +1,51 @@
+#include "bench.h"
+#include <chrono>
+#include <map>
+#include <string>
+#include <string.h>
+
+struct Bench {
+  const char* name;
+  BenchFunc   fn;
+};
+
+static std::map<std::string,Bench>* benchmarks = nullptr;
+
+void BenchAdd(const char* name, BenchFunc f, unsigned int priority) {
+  if (!benchmarks) {
+    benchmarks = new std::map<std::string,Bench>;
+  }
+  char buf[12];
+  snprintf(buf, sizeof(buf)-1, "%08x", priority);
+  benchmarks->emplace(std::string(buf) + "-" + name, Bench{name, f});
+}
+
+
+// Number of times each benchmark is run. The fastest run is reported.
+static constexpr int ROUNDS = 5;
+
+
+// Usage: bench [filter]
+// Runs all benchmarks, or only those with names containing filter.
+int main(int argc, const char* argv[]) {
+  const char* filter = argc > 1 ? argv[1] : nullptr;
+  if (benchmarks) for (auto& p : *benchmarks) {
+    auto& bench = p.second;
+    if (filter && !strstr(bench.name, filter)) {
+      continue;
+    }
+    double best = 0;
+    uint64_t ops = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+      auto start = std::chrono::steady_clock::now();
+      ops = bench.fn();
+      std::chrono::duration<double,std::nano> d = std::chrono::steady_clock::now() - start;
+      if (round == 0 || d.count() < best) {
+        best = d.count();
+      }
+    }
+    printf("%-40s %10.2f ns/op  (%llu ops)\n",
+      bench.name, ops ? best / double(ops) : best, (unsigned long long)ops);
+  }
+  return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+
+// A benchmark function performs some work and returns the number of operations it
+// performed. The harness times the function and reports time per operation.
+using BenchFunc = uint64_t(*)();
+void BenchAdd(const char* name, BenchFunc, unsigned int priority);
+
+// Prevents the compiler from optimizing away the computation of a value
+template <typename T> inline void BenchUse(const T& v) {
+  asm volatile("" : : "r,m"(v) : "memory");
+}
+
+#define BENCH(name) \
+  static uint64_t name##_bench(); \
+  static void __attribute__((constructor)) name##_init() { \
+    BenchAdd(#name, name##_bench, (unsigned int)__LINE__); \
+  } \
+  static uint64_t name##_bench()
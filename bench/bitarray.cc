@@ -0,0 +1,98 @@
+#include "bench.h"
+#include <immutable/bitarray.h>
+
+using namespace immutable;
+
+static constexpr uint32 COUNT = 1000000;
+
+// BitArray, compared with Array<bool> which uses one byte per value
+
+static const ref<BitArray>& bitSample() {
+  static auto a = BitArray::empty()->modify([] (ref<TransientBitArray> t) {
+    for (uint32 i = 0; i < COUNT; ++i) {
+      t->push(i % 3 == 0);
+    }
+  });
+  return a;
+}
+
+static const ref<Array<bool>>& boolSample() {
+  static auto a = Array<bool>::empty()->modify([] (ref<TransientArray<bool>> t) {
+    for (uint32 i = 0; i < COUNT; ++i) {
+      t->push(i % 3 == 0);
+    }
+  });
+  return a;
+}
+
+BENCH(BitArrayPush) {
+  auto a = BitArray::empty();
+  for (uint32 i = 0; i < COUNT; ++i) {
+    a = a->push(i % 3 == 0);
+  }
+  BenchUse(a->size());
+  return COUNT;
+}
+
+BENCH(ArrayBoolPush) {
+  auto a = Array<bool>::empty();
+  for (uint32 i = 0; i < COUNT; ++i) {
+    a = a->push(i % 3 == 0);
+  }
+  BenchUse(a->size());
+  return COUNT;
+}
+
+BENCH(BitArrayPushTransient) {
+  auto a = BitArray::empty()->modify([] (ref<TransientBitArray> t) {
+    for (uint32 i = 0; i < COUNT; ++i) {
+      t->push(i % 3 == 0);
+    }
+  });
+  BenchUse(a->size());
+  return COUNT;
+}
+
+BENCH(BitArraySet) {
+  auto a = bitSample();
+  for (uint32 i = 0; i < COUNT / 10; ++i) {
+    a = a->set(uint32((uint64_t(i) * 2654435761u) % COUNT), true);
+  }
+  BenchUse(a->size());
+  return COUNT / 10;
+}
+
+BENCH(ArrayBoolSet) {
+  auto a = boolSample();
+  for (uint32 i = 0; i < COUNT / 10; ++i) {
+    a = a->set(uint32((uint64_t(i) * 2654435761u) % COUNT), true);
+  }
+  BenchUse(a->size());
+  return COUNT / 10;
+}
+
+BENCH(BitArrayIterate) {
+  uint32 n = 0;
+  for (bool v : *bitSample()) {
+    n += v;
+  }
+  BenchUse(n);
+  return COUNT;
+}
+
+// Counting true values, reported per value
+BENCH(BitArrayPopcount) {
+  BenchUse(bitSample()->popcount());
+  return COUNT;
+}
+
+BENCH(ArrayBoolPopcount) {
+  BenchUse(boolSample()->reduce(uint32(0), [] (uint32 n, bool v) { return n + v; }));
+  return COUNT;
+}
+
+BENCH(BitArrayFindFirstSet) {
+  static auto a = BitArray::create(COUNT, false)->set(COUNT - 1, true);
+  BenchUse(a->findFirstSet());
+  return COUNT;
+}
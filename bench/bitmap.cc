@@ -0,0 +1,134 @@
+#include "bench.h"
+#include <immutable/bitmap.h>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+using namespace immutable;
+
+static constexpr uint32 SIZE = 1000000;
+
+// Every valueAt(i, step) for i in [0, SIZE) is distinct and ascending. With step 3 the
+// containers are bitsets, with step 30 they are arrays.
+static uint32 valueAt(uint32 i, uint32 step) {
+  return i * step + (i % 7 == 0);
+}
+
+static ref<Bitmap> bitmapOf(uint32 step) {
+  return Bitmap::empty()->modify([&](ref<TransientBitmap> t) {
+    for (uint32 i = 0; i < SIZE; ++i) {
+      t->add(valueAt(i, step));
+    }
+  });
+}
+
+static std::vector<uint32> vectorOf(uint32 step) {
+  std::vector<uint32> v(SIZE);
+  for (uint32 i = 0; i < SIZE; ++i) {
+    v[i] = valueAt(i, step);
+  }
+  return v;
+}
+
+// Dense (bitset) and sparse (array) bitmaps, and the same values in sorted vectors
+struct Bitmaps {
+  ref<Bitmap> dense2 = bitmapOf(2), dense3 = bitmapOf(3);
+  ref<Bitmap> sparse20 = bitmapOf(20), sparse30 = bitmapOf(30);
+  std::vector<uint32> v2 = vectorOf(2), v3 = vectorOf(3);
+};
+
+static const Bitmaps& bitmaps() {
+  static Bitmaps b;
+  return b;
+}
+
+
+BENCH(BitmapAdd) {
+  auto b = Bitmap::empty();
+  for (uint32 i = 0; i < SIZE / 10; ++i) {
+    b = b->add(valueAt(i, 3));
+  }
+  BenchUse(b->cardinality());
+  return SIZE / 10;
+}
+
+BENCH(BitmapAddTransient) {
+  auto b = bitmapOf(3);
+  BenchUse(b->cardinality());
+  return SIZE;
+}
+
+BENCH(BitmapContains) {
+  auto& b = bitmaps();
+  uint32 n = 0;
+  for (uint32 i = 0; i < SIZE; ++i) {
+    n += b.dense3->contains(i * 5) + b.sparse30->contains(i * 5);
+  }
+  BenchUse(n);
+  return SIZE * 2;
+}
+
+
+// Set operations, reporting time per value of the operands
+BENCH(BitmapIntersectDense) {
+  auto& b = bitmaps();
+  auto r = b.dense2->intersect(b.dense3);
+  BenchUse(r->cardinality());
+  return SIZE * 2;
+}
+
+BENCH(BitmapIntersectSparse) {
+  auto& b = bitmaps();
+  auto r = b.sparse20->intersect(b.sparse30);
+  BenchUse(r->cardinality());
+  return SIZE * 2;
+}
+
+BENCH(VectorIntersect) {
+  auto& b = bitmaps();
+  std::vector<uint32> r;
+  std::set_intersection(b.v2.begin(), b.v2.end(), b.v3.begin(), b.v3.end(),
+                        std::back_inserter(r));
+  BenchUse(r.size());
+  return SIZE * 2;
+}
+
+BENCH(BitmapUniteDense) {
+  auto& b = bitmaps();
+  auto r = b.dense2->unite(b.dense3);
+  BenchUse(r->cardinality());
+  return SIZE * 2;
+}
+
+BENCH(VectorUnite) {
+  auto& b = bitmaps();
+  std::vector<uint32> r;
+  std::set_union(b.v2.begin(), b.v2.end(), b.v3.begin(), b.v3.end(),
+                 std::back_inserter(r));
+  BenchUse(r.size());
+  return SIZE * 2;
+}
+
+BENCH(BitmapSubtractDense) {
+  auto& b = bitmaps();
+  auto r = b.dense2->subtract(b.dense3);
+  BenchUse(r->cardinality());
+  return SIZE * 2;
+}
+
+BENCH(BitmapIntersectCardinality) {
+  auto& b = bitmaps();
+  BenchUse(b.dense2->intersectCardinality(b.dense3));
+  return SIZE * 2;
+}
+
+
+BENCH(BitmapIterate) {
+  auto& b = bitmaps();
+  uint64_t sum = 0;
+  for (auto v : *b.dense3) {
+    sum += v;
+  }
+  BenchUse(sum);
+  return SIZE;
+}
@@ -0,0 +1,76 @@
+#include "bench.h"
+#include <immutable/deque.h>
+
+using namespace immutable;
+
+static constexpr uint32 COUNT = 1000000;
+static constexpr uint32 WINDOW = 1000;
+
+// Sliding window: values are added at the end and removed from the start
+BENCH(DequeSlidingWindow) {
+  auto d = Deque<int64_t>::empty();
+  for (uint32 i = 0; i < COUNT; ++i) {
+    d = d->push(int64_t(i));
+    if (d->size() > WINDOW) {
+      d = d->rest();
+    }
+  }
+  BenchUse(d->size());
+  return COUNT;
+}
+
+// Same as DequeSlidingWindow but with an Array, for comparison
+BENCH(ArraySlidingWindow) {
+  auto a = Array<int64_t>::empty();
+  for (uint32 i = 0; i < COUNT; ++i) {
+    a = a->push(int64_t(i));
+    if (a->size() > WINDOW) {
+      a = a->rest();
+    }
+  }
+  BenchUse(a->size());
+  return COUNT;
+}
+
+// Values are added at the start and removed from the end
+BENCH(DequeConsPop) {
+  auto d = Deque<int64_t>::empty();
+  for (uint32 i = 0; i < COUNT; ++i) {
+    d = d->cons(int64_t(i));
+    if (d->size() > WINDOW) {
+      d = d->pop();
+    }
+  }
+  BenchUse(d->size());
+  return COUNT;
+}
+
+BENCH(ArrayConsPop) {
+  auto a = Array<int64_t>::empty();
+  for (uint32 i = 0; i < COUNT; ++i) {
+    a = a->cons(int64_t(i));
+    if (a->size() > WINDOW) {
+      a = a->pop();
+    }
+  }
+  BenchUse(a->size());
+  return COUNT;
+}
+
+// Iterating a deque whose values were all added with cons, so they are in the front
+// buffer (compare with ArrayIterateUnboxed)
+BENCH(DequeIterate) {
+  static auto d = [] {
+    auto d = Deque<int64_t>::empty();
+    for (uint32 i = 0; i < COUNT; ++i) {
+      d = d->cons(int64_t(i));
+    }
+    return d;
+  }();
+  int64_t sum = 0;
+  for (auto v : *d) {
+    sum += v;
+  }
+  BenchUse(sum);
+  return COUNT;
+}
@@ -0,0 +1,138 @@
+#include "bench.h"
+#include <immutable/map.h>
+#include <memory>
+#include <unordered_map>
+
+using namespace immutable;
+
+// Copy-on-write std::unordered_map: each version is an immutable map shared by
+// reference, and changing it means copying the whole map. This is what persistence
+// costs without a persistent data structure.
+using CowMap = std::shared_ptr<const std::unordered_map<int64_t,int64_t>>;
+
+static CowMap cowSet(const CowMap& m, int64_t k, int64_t v) {
+  auto m2 = std::make_shared<std::unordered_map<int64_t,int64_t>>(*m);
+  (*m2)[k] = v;
+  return m2;
+}
+
+static ref<Map<int64_t,int64_t>> mapOfSize(uint32 size) {
+  return Map<int64_t,int64_t>::empty()->modify([&](ref<TransientMap<int64_t,int64_t>> t) {
+    for (uint32 i = 0; i < size; ++i) {
+      t->set(int64_t(i), int64_t(i));
+    }
+  });
+}
+
+static CowMap cowMapOfSize(uint32 size) {
+  auto m = std::make_shared<std::unordered_map<int64_t,int64_t>>();
+  for (uint32 i = 0; i < size; ++i) {
+    (*m)[int64_t(i)] = int64_t(i);
+  }
+  return m;
+}
+
+// Keys of successive updates, scattered across the map
+static int64_t keyAt(uint32 i, uint32 size) {
+  return int64_t((uint64_t(i) * 2654435761u) % size);
+}
+
+
+// Updates to a map of `size` entries, each making a new version of the map
+template <uint32 size, uint32 count>
+static uint64_t benchMapUpdate() {
+  auto m = mapOfSize(size);
+  for (uint32 i = 0; i < count; ++i) {
+    m = m->set(keyAt(i, size * 2), int64_t(i));
+  }
+  BenchUse(m->size());
+  return count;
+}
+
+template <uint32 size, uint32 count>
+static uint64_t benchCowMapUpdate() {
+  auto m = cowMapOfSize(size);
+  for (uint32 i = 0; i < count; ++i) {
+    m = cowSet(m, keyAt(i, size * 2), int64_t(i));
+  }
+  BenchUse(m->size());
+  return count;
+}
+
+BENCH(MapUpdate1K) { return benchMapUpdate<1000, 100000>(); }
+BENCH(CowUnorderedMapUpdate1K) { return benchCowMapUpdate<1000, 10000>(); }
+BENCH(MapUpdate100K) { return benchMapUpdate<100000, 100000>(); }
+BENCH(CowUnorderedMapUpdate100K) { return benchCowMapUpdate<100000, 100>(); }
+
+
+static constexpr uint32 COUNT = 1000000;
+
+// Building a map of COUNT entries one entry at a time
+BENCH(MapBuildTransient) {
+  auto m = mapOfSize(COUNT);
+  BenchUse(m->size());
+  return COUNT;
+}
+
+BENCH(MapBuildPersistent) {
+  auto m = Map<int64_t,int64_t>::empty();
+  for (uint32 i = 0; i < COUNT; ++i) {
+    m = m->set(int64_t(i), int64_t(i));
+  }
+  BenchUse(m->size());
+  return COUNT;
+}
+
+BENCH(UnorderedMapBuild) {
+  std::unordered_map<int64_t,int64_t> m;
+  for (uint32 i = 0; i < COUNT; ++i) {
+    m[int64_t(i)] = int64_t(i);
+  }
+  BenchUse(m.size());
+  return COUNT;
+}
+
+
+// Lookups of present and missing keys
+BENCH(MapFind) {
+  static auto m = mapOfSize(COUNT);
+  int64_t sum = 0;
+  for (uint32 i = 0; i < COUNT; ++i) {
+    auto v = m->find(keyAt(i, COUNT * 2));
+    sum += v ? *v : 0;
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+BENCH(UnorderedMapFind) {
+  static auto m = cowMapOfSize(COUNT);
+  int64_t sum = 0;
+  for (uint32 i = 0; i < COUNT; ++i) {
+    auto I = m->find(keyAt(i, COUNT * 2));
+    sum += I != m->end() ? I->second : 0;
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+
+BENCH(MapIterate) {
+  static auto m = mapOfSize(COUNT);
+  int64_t sum = 0;
+  for (auto& e : *m) {
+    sum += e.second;
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+BENCH(UnorderedMapIterate) {
+  static auto m = cowMapOfSize(COUNT);
+  int64_t sum = 0;
+  for (auto& e : *m) {
+    sum += e.second;
+  }
+  BenchUse(sum);
+  return COUNT;
+}
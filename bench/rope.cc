@@ -0,0 +1,109 @@
+#include "bench.h"
+#include <immutable/array.h>
+#include <immutable/rope.h>
+#include <string>
+
+using namespace immutable;
+
+static constexpr uint32 SIZE = 1000000; // bytes of text
+static constexpr uint32 EDITS = 10000;
+
+// Positions of successive edits, scattered across [0, n)
+static uint32 posAt(uint32 i, uint32 n) {
+  return uint32((uint64_t(i) * 2654435761u) % n);
+}
+
+static const std::string& text() {
+  static std::string s;
+  if (s.empty()) {
+    s.resize(SIZE);
+    for (uint32 i = 0; i < SIZE; ++i) {
+      s[i] = (i % 64 == 63) ? '\n' : char('a' + i % 26);
+    }
+  }
+  return s;
+}
+
+
+// Inserting a word at scattered positions, making a new version each time
+BENCH(RopeInsert) {
+  auto r = Rope::create(text());
+  for (uint32 i = 0; i < EDITS; ++i) {
+    r = r->insert(posAt(i, r->size()), "hello", 5);
+  }
+  BenchUse(r->size());
+  return EDITS;
+}
+
+BENCH(RopeInsertTransient) {
+  auto t = Rope::create(text())->asTransient();
+  for (uint32 i = 0; i < EDITS; ++i) {
+    t->insert(posAt(i, t->size()), "hello", 5);
+  }
+  BenchUse(t->size());
+  return EDITS;
+}
+
+BENCH(ArrayCharInsert) {
+  auto& s = text();
+  auto a = Array<char>::create(s.begin(), s.end());
+  const char* word = "hello";
+  for (uint32 i = 0; i < EDITS / 10; ++i) {
+    uint32 pos = posAt(i, a->size());
+    a = a->splice(pos, pos, word + 0, word + 5);
+  }
+  BenchUse(a->size());
+  return EDITS / 10;
+}
+
+BENCH(StringInsert) {
+  std::string s = text();
+  for (uint32 i = 0; i < EDITS; ++i) {
+    s.insert(posAt(i, uint32(s.size())), "hello", 5);
+  }
+  BenchUse(s.size());
+  return EDITS;
+}
+
+
+BENCH(RopeErase) {
+  auto r = Rope::create(text());
+  for (uint32 i = 0; i < EDITS; ++i) {
+    r = r->erase(posAt(i, r->size()), 5);
+  }
+  BenchUse(r->size());
+  return EDITS;
+}
+
+
+// Cutting a range of 10 kB and pasting it elsewhere
+BENCH(RopeCutPaste) {
+  auto r = Rope::create(text());
+  for (uint32 i = 0; i < EDITS; ++i) {
+    uint32 pos = posAt(i, r->size() - 10000);
+    auto part = r->substr(pos, 10000);
+    r = r->erase(pos, 10000);
+    r = r->insert(posAt(i + 1, r->size()), part);
+  }
+  BenchUse(r->size());
+  return EDITS;
+}
+
+
+// Building a rope from a string, and writing the text out in chunks. Report time
+// per byte.
+BENCH(RopeCreate) {
+  auto r = Rope::create(text());
+  BenchUse(r->size());
+  return SIZE;
+}
+
+BENCH(RopeChunks) {
+  static auto r = Rope::create(text());
+  uint64_t sum = 0;
+  for (auto& c : r->chunks()) {
+    sum += uint8(c.data()[c.size() - 1]) + c.size();
+  }
+  BenchUse(sum);
+  return SIZE;
+}
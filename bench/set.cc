@@ -0,0 +1,137 @@
+#include "bench.h"
+#include <immutable/set.h>
+#include <unordered_set>
+
+using namespace immutable;
+
+static constexpr uint32 SIZE = 100000;
+static constexpr uint32 CHANGES = 100;
+
+static ref<Set<int64_t>> setOfSize(uint32 size) {
+  return Set<int64_t>::empty()->modify([&](ref<TransientSet<int64_t>> t) {
+    for (uint32 i = 0; i < size; ++i) {
+      t->add(int64_t(i));
+    }
+  });
+}
+
+// Two versions of a set of SIZE values, each with CHANGES values added and removed
+struct SetVersions {
+  ref<Set<int64_t>> a, b;
+  std::unordered_set<int64_t> sa, sb;
+  SetVersions() {
+    auto base = setOfSize(SIZE);
+    a = base;
+    b = base;
+    for (uint32 i = 0; i < CHANGES; ++i) {
+      a = a->add(int64_t(SIZE + i))->remove(int64_t(i * 997 % SIZE));
+      b = b->add(int64_t(SIZE * 2 + i))->remove(int64_t(i * 991 % SIZE));
+    }
+    sa.insert(a->begin(), a->end());
+    sb.insert(b->begin(), b->end());
+  }
+};
+
+static const SetVersions& versions() {
+  static SetVersions v;
+  return v;
+}
+
+
+BENCH(SetAdd) {
+  auto s = Set<int64_t>::empty();
+  for (uint32 i = 0; i < SIZE; ++i) {
+    s = s->add(int64_t(i));
+  }
+  BenchUse(s->size());
+  return SIZE;
+}
+
+BENCH(SetAddTransient) {
+  auto s = setOfSize(SIZE);
+  BenchUse(s->size());
+  return SIZE;
+}
+
+BENCH(SetContains) {
+  auto& v = versions();
+  uint32 n = 0;
+  for (uint32 i = 0; i < SIZE; ++i) {
+    n += v.a->contains(int64_t(i * 2));
+  }
+  BenchUse(n);
+  return SIZE;
+}
+
+
+// Set operations on two versions of a set, which share most of their nodes.
+// Reports time per operation.
+BENCH(SetUniteShared) {
+  auto& v = versions();
+  uint32 n = 0;
+  for (uint32 i = 0; i < 100; ++i) {
+    n += v.a->unite(v.b)->size();
+  }
+  BenchUse(n);
+  return 100;
+}
+
+BENCH(SetIntersectShared) {
+  auto& v = versions();
+  uint32 n = 0;
+  for (uint32 i = 0; i < 100; ++i) {
+    n += v.a->intersect(v.b)->size();
+  }
+  BenchUse(n);
+  return 100;
+}
+
+BENCH(SetSubtractShared) {
+  auto& v = versions();
+  uint32 n = 0;
+  for (uint32 i = 0; i < 100; ++i) {
+    n += v.a->subtract(v.b)->size();
+  }
+  BenchUse(n);
+  return 100;
+}
+
+// Set operations on sets with the same values as above but no shared nodes
+BENCH(SetUniteUnshared) {
+  auto& v = versions();
+  auto b = Set<int64_t>::create(v.sb.begin(), v.sb.end());
+  uint32 n = 0;
+  for (uint32 i = 0; i < 10; ++i) {
+    n += v.a->unite(b)->size();
+  }
+  BenchUse(n);
+  return 10;
+}
+
+BENCH(UnorderedSetUnite) {
+  auto& v = versions();
+  uint32 n = 0;
+  for (uint32 i = 0; i < 10; ++i) {
+    std::unordered_set<int64_t> u = v.sa;
+    u.insert(v.sb.begin(), v.sb.end());
+    n += uint32(u.size());
+  }
+  BenchUse(n);
+  return 10;
+}
+
+BENCH(UnorderedSetIntersect) {
+  auto& v = versions();
+  uint32 n = 0;
+  for (uint32 i = 0; i < 10; ++i) {
+    std::unordered_set<int64_t> r;
+    for (auto x : v.sa) {
+      if (v.sb.count(x)) {
+        r.insert(x);
+      }
+    }
+    n += uint32(r.size());
+  }
+  BenchUse(n);
+  return 10;
+}
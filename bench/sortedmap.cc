@@ -0,0 +1,126 @@
+#include "bench.h"
+#include <immutable/sortedmap.h>
+#include <map>
+
+using namespace immutable;
+
+static constexpr uint32 COUNT = 1000000;
+
+// Keys of successive operations, scattered across [0, n)
+static int64_t keyAt(uint32 i, uint32 n) {
+  return int64_t((uint64_t(i) * 2654435761u) % n);
+}
+
+static ref<SortedMap<int64_t,int64_t>> sortedMapOfSize(uint32 size) {
+  return SortedMap<int64_t,int64_t>::empty()->modify(
+    [&](ref<TransientSortedMap<int64_t,int64_t>> t) {
+      for (uint32 i = 0; i < size; ++i) {
+        t->set(int64_t(i) * 2, int64_t(i));
+      }
+    });
+}
+
+static const std::map<int64_t,int64_t>& stdMapOfSize(uint32 size) {
+  static std::map<int64_t,int64_t> m;
+  if (m.size() != size) {
+    m.clear();
+    for (uint32 i = 0; i < size; ++i) {
+      m[int64_t(i) * 2] = int64_t(i);
+    }
+  }
+  return m;
+}
+
+
+BENCH(SortedMapBuildTransient) {
+  auto m = SortedMap<int64_t,int64_t>::empty()->modify(
+    [&](ref<TransientSortedMap<int64_t,int64_t>> t) {
+      for (uint32 i = 0; i < COUNT; ++i) {
+        t->set(keyAt(i, COUNT), int64_t(i));
+      }
+    });
+  BenchUse(m->size());
+  return COUNT;
+}
+
+BENCH(SortedMapBuildPersistent) {
+  auto m = SortedMap<int64_t,int64_t>::empty();
+  for (uint32 i = 0; i < COUNT; ++i) {
+    m = m->set(keyAt(i, COUNT), int64_t(i));
+  }
+  BenchUse(m->size());
+  return COUNT;
+}
+
+BENCH(StdMapBuild) {
+  std::map<int64_t,int64_t> m;
+  for (uint32 i = 0; i < COUNT; ++i) {
+    m[keyAt(i, COUNT)] = int64_t(i);
+  }
+  BenchUse(m.size());
+  return COUNT;
+}
+
+
+// Updates and removals making a new version of a map of COUNT entries each time
+BENCH(SortedMapUpdate) {
+  static auto base = sortedMapOfSize(COUNT);
+  auto m = base;
+  for (uint32 i = 0; i < 100000; ++i) {
+    int64_t k = keyAt(i, COUNT * 2);
+    m = (i & 1) ? m->remove(k) : m->set(k, int64_t(i));
+  }
+  BenchUse(m->size());
+  return 100000;
+}
+
+
+BENCH(SortedMapFind) {
+  static auto m = sortedMapOfSize(COUNT);
+  int64_t sum = 0;
+  for (uint32 i = 0; i < COUNT; ++i) {
+    auto v = m->find(keyAt(i, COUNT * 2));
+    sum += v ? *v : 0;
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+BENCH(StdMapFind) {
+  auto& m = stdMapOfSize(COUNT);
+  int64_t sum = 0;
+  for (uint32 i = 0; i < COUNT; ++i) {
+    auto I = m.find(keyAt(i, COUNT * 2));
+    sum += I != m.end() ? I->second : 0;
+  }
+  BenchUse(sum);
+  return COUNT;
+}
+
+
+// Scans of 100 entries starting at scattered keys. Reports time per entry.
+BENCH(SortedMapRangeScan) {
+  static auto m = sortedMapOfSize(COUNT);
+  int64_t sum = 0;
+  for (uint32 i = 0; i < 10000; ++i) {
+    int64_t lo = keyAt(i, COUNT * 2 - 200);
+    for (auto& e : m->range(lo, lo + 200)) {
+      sum += e.second;
+    }
+  }
+  BenchUse(sum);
+  return 10000 * 100;
+}
+
+BENCH(StdMapRangeScan) {
+  auto& m = stdMapOfSize(COUNT);
+  int64_t sum = 0;
+  for (uint32 i = 0; i < 10000; ++i) {
+    int64_t lo = keyAt(i, COUNT * 2 - 200);
+    for (auto I = m.lower_bound(lo), end = m.lower_bound(lo + 200); I != end; ++I) {
+      sum += I->second;
+    }
+  }
+  BenchUse(sum);
+  return 10000 * 100;
+}
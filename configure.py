@@ -4,7 +4,12 @@ from __future__ import print_function
 
 # source files
 lib_src  = [
+  'alloc',
+  'base',
   'array',
+  'rope',
+  'bitmap',
+  'bitarray',
 ]
 
 from optparse import OptionParser
@@ -29,6 +34,10 @@ parser.add_option('--host',
                   choices=platform_helper.platforms())
 parser.add_option('--debug', action='store_true',
                   help='enable debugging extras',)
+parser.add_option('--single-threaded', action='store_true',
+                  help='use non-atomic reference counting for all objects',)
+parser.add_option('--biased-refcount', action='store_true',
+                  help='use biased reference counting for all objects',)
 (options, args) = parser.parse_args()
 if args:
     print('ERROR: extra unparsed command-line arguments:', args)
@@ -196,6 +205,13 @@ def shell_escape(str):
         return "'%s'" % str.replace("'", "\\'")
     return str
 
+if options.single_threaded:
+    cflags.append('-DIMMUTABLE_SINGLE_THREADED=1')
+    test_cflags.append('-DIMMUTABLE_SINGLE_THREADED=1')
+if options.biased_refcount:
+    cflags.append('-DIMMUTABLE_BIASED_REFCOUNT=1')
+    test_cflags.append('-DIMMUTABLE_BIASED_REFCOUNT=1')
+
 if 'CFLAGS' in configure_env:
     cflags.append(configure_env['CFLAGS'])
     test_cflags.append(configure_env['CFLAGS'])
@@ -295,6 +311,28 @@ n.newline()
 all_targets += test_exe
 
 
+n.comment('Benchmarks')
+
+bench_src = [os.path.splitext(path)[0] for path in glob('bench/*.cc')]
+
+bench_cflags = cflags[:]
+objs = []
+
+if not platform.is_msvc():
+  bench_cflags.append('-I.')
+
+n.variable('bench_cflags', bench_cflags)
+for name in bench_src:
+    objs += cxx(name, variables=[('cflags', '$bench_cflags')])
+
+bench_exe = n.build(binary('bench'), 'link', objs, implicit=immutable_lib,
+                    variables=[('ldflags', test_ldflags),
+                               ('libs', test_libs)])
+n.build('bench', 'phony', bench_exe)
+n.newline()
+all_targets += bench_exe
+
+
 if not host.is_mingw():
     n.comment('Regenerate build files if build script changes.')
     n.rule('configure',
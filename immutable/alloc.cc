@@ -0,0 +1,143 @@
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Blocks recycled through free lists are invisible to AddressSanitizer, so caching is
+// off by default in ASan builds to keep use-after-free of nodes detectable.
+#if defined(__SANITIZE_ADDRESS__)
+  #define IMMUTABLE_NODEALLOC_CACHE_DEFAULT false
+#elif defined(__has_feature)
+  #if __has_feature(address_sanitizer)
+    #define IMMUTABLE_NODEALLOC_CACHE_DEFAULT false
+  #endif
+#endif
+#ifndef IMMUTABLE_NODEALLOC_CACHE_DEFAULT
+  #define IMMUTABLE_NODEALLOC_CACHE_DEFAULT true
+#endif
+
+namespace immutable {
+
+  static constexpr size_t NUM_CLASSES = NodeAlloc::MAX_SIZE / NodeAlloc::GRANULE;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct FreeList {
+    FreeBlock* head;
+    uint32     count;
+  };
+
+  struct ThreadCache {
+    FreeList         lists[NUM_CLASSES];
+    NodeAlloc::Stats stats;
+    bool             enabled;
+
+    ThreadCache() : lists(), stats(), enabled(IMMUTABLE_NODEALLOC_CACHE_DEFAULT) {}
+    ~ThreadCache();
+
+    void drain() {
+      for (auto& list : lists) {
+        while (list.head) {
+          auto b = list.head;
+          list.head = b->next;
+          ::free(b);
+        }
+        list.count = 0;
+      }
+    }
+  };
+
+  static thread_local ThreadCache tcache;
+
+  // Set when tcache has been destroyed at thread exit. Nodes released after that point
+  // (e.g. by other thread-local destructors) go straight to free.
+  static thread_local bool tcacheDead = false;
+
+  ThreadCache::~ThreadCache() {
+    drain();
+    tcacheDead = true;
+  }
+
+
+  // Size class index for a block of `size` bytes. Class c holds blocks of
+  // (c + 1) * GRANULE bytes.
+  static inline size_t sizeClass(size_t size) {
+    return (size - 1) / NodeAlloc::GRANULE;
+  }
+
+
+  void* NodeAlloc::alloc(size_t size) {
+    if (size > MAX_SIZE || size == 0 || tcacheDead) {
+      return ::malloc(size);
+    }
+    auto c = sizeClass(size);
+    auto& tc = tcache;
+    auto& list = tc.lists[c];
+    if (list.head) {
+      auto b = list.head;
+      list.head = b->next;
+      --list.count;
+      ++tc.stats.hits;
+      return b;
+    }
+    ++tc.stats.misses;
+    return ::malloc((c + 1) * GRANULE);
+  }
+
+
+  void* NodeAlloc::calloc(size_t size) {
+    void* p = alloc(size);
+    if (p) {
+      memset(p, 0, size);
+    }
+    return p;
+  }
+
+
+  void NodeAlloc::free(void* p, size_t size) {
+    if (size > MAX_SIZE || size == 0 || tcacheDead) {
+      ::free(p);
+      return;
+    }
+    auto& tc = tcache;
+    auto& list = tc.lists[sizeClass(size)];
+    if (list.count == MAX_FREE || !tc.enabled) {
+      ++tc.stats.released;
+      ::free(p);
+      return;
+    }
+    auto b = (FreeBlock*)p;
+    b->next = list.head;
+    list.head = b;
+    ++list.count;
+    ++tc.stats.cached;
+  }
+
+
+  bool NodeAlloc::setCaching(bool enable) {
+    if (tcacheDead) {
+      return false;
+    }
+    auto& tc = tcache;
+    bool prev = tc.enabled;
+    tc.enabled = enable;
+    if (!enable) {
+      tc.drain();
+    }
+    return prev;
+  }
+
+
+  NodeAlloc::Stats NodeAlloc::stats() {
+    return tcacheDead ? Stats{} : tcache.stats;
+  }
+
+
+  void NodeAlloc::resetStats() {
+    if (!tcacheDead) {
+      tcache.stats = Stats{};
+    }
+  }
+
+} // namespace
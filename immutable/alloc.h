@@ -0,0 +1,49 @@
+#pragma once
+#include "base.h"
+#include <stddef.h>
+
+namespace immutable {
+
+  // Allocator for the small, short-lived memory blocks that make up the nodes of
+  // persistent data structures.
+  //
+  // Block sizes are rounded up to a multiple of GRANULE bytes, forming size classes.
+  // Freed blocks are kept in per-thread free lists, one per size class, and handed out
+  // again by later allocations of the same class without going through malloc.
+  // Blocks larger than MAX_SIZE are passed straight to malloc and free.
+  //
+  // Any thread may free a block, not just the one that allocated it; the block then
+  // ends up in the freeing thread's free list. The size passed to free must be the
+  // same as the size passed to alloc.
+  struct NodeAlloc {
+    static constexpr size_t GRANULE  = 16;
+    static constexpr size_t MAX_SIZE = 1024;
+    static constexpr uint32 MAX_FREE = 256; // max blocks cached per size class & thread
+
+    // Allocate a block of at least `size` bytes. Contents are undefined.
+    static void* alloc(size_t size);
+
+    // Allocate a block of at least `size` bytes with all `size` bytes set to zero.
+    static void* calloc(size_t size);
+
+    // Free a block previously returned by alloc or calloc.
+    static void free(void* p, size_t size);
+
+    // Enables or disables free-list caching for the calling thread. When disabled,
+    // every alloc and free goes to malloc and free and cached blocks are released.
+    // Returns the previous setting. Caching is enabled by default, except in
+    // AddressSanitizer builds where it would hide use-after-free bugs.
+    static bool setCaching(bool enable);
+
+    // Counters for the calling thread
+    struct Stats {
+      uint64 hits;     // allocations served from a free list
+      uint64 misses;   // allocations served by malloc
+      uint64 cached;   // frees that put the block on a free list
+      uint64 released; // frees that passed the block to free
+    };
+    static Stats stats();
+    static void resetStats();
+  };
+
+} // namespace
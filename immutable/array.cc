@@ -1,5 +1,14 @@
 #include "array.h"
+#include "alloc.h"
+#include <stdlib.h>
+#include <string.h>
 #include <thread>
+#include <vector>
+#if IMMUTABLE_TARGET_ARCH_X64
+  #include <immintrin.h>
+#elif IMMUTABLE_TARGET_ARCH_ARM64
+  #include <arm_neon.h>
+#endif
 
 // Uncomment to enable pedantic runtime checks for debug builds
 //#define DCHECK(expr) assert(expr)
@@ -24,67 +33,120 @@ namespace immutable {
   static auto constexpr BRANCHES = ArrayImp::BRANCHES;
 //  static auto constexpr MASK     = ArrayImp::MASK;
   
-  using EditID = std::thread::id;
-  static EditID NO_EDIT;
-  
   struct empty_initializer {};
   
 
+  // A value to be stored in a leaf node. When esize is zero, p is an Object* which
+  // the leaf references, otherwise p points to esize bytes to be copied into the leaf.
+  struct LeafValue {
+    const void* p;
+    uint32      esize;
+  };
+  
+
   struct ArrayImp::N : Object {
     static constexpr TypeTag TYPE_TAG = 'N';
-    IMMUTABLE_REFCOUNTED_IMPL(N)
-    public:
     EditID      edit;
-    uint32      length;
+    uint64      hash;    // hash of the values of the subtree, or 0 if not yet computed
+    uint32      length;  // number of slots, or for relaxed branches, number of children
+    uint16      esize;   // size of unboxed values, or 0 for branches and boxed leaves
+    bool        relaxed; // branch with a size table (see sizes())
     ref<Object> _v[0];
     
-    N(EditID ed, uint32 len) : Object(TYPE_TAG), edit(ed), length(len) {}
+    // Note: nodes are shared by arrays of all value types and so use the default kind
+    // of reference count.
+    N(EditID ed, uint32 len, uint32 esz)
+      : Object(TYPE_TAG, kind(), false), edit(ed), hash(0), length(len), esize(esz), relaxed(false)
+    {}
     
     // Constructor used by EMPTY_ROOT and EMPTY_TAIL
     explicit N(empty_initializer, uint32 len)
-      : Object(TYPE_TAG), _refcount(1), edit(NO_EDIT), length(len)
+      : Object(TYPE_TAG, kind(), false), edit(NO_EDIT), hash(0), length(len), esize(0)
+      , relaxed(false)
     {
+      retain();
       uint32 i = 0;
       while (i < length) {
         construct(&_v[i++]);
       }
     }
 
+    // Number of bytes needed for a node with len slots of values of size esize.
+    // Nodes are allocated with room for exactly `length` slots, so a node can never
+    // grow; a node that needs to is copied instead.
+    // Relaxed branches always have room for BRANCHES children and their size table.
+    static IMMUTABLE_ALWAYS_INLINE size_t allocSize(uint32 len, uint32 esize, bool relaxed) {
+      return relaxed ? sizeof(N) + BRANCHES * (sizeof(ref<Object>) + sizeof(uint32)) :
+                       sizeof(N) + len * (esize ? esize : sizeof(ref<Object>));
+    }
+
     // Note: returns a node with zero refcount, so it should be put in a ref immediately.
-    static N* create(uint32 len, EditID edit) {
+    static N* create(uint32 len, EditID edit, uint32 esize=0) {
       DCHECK(len <= BRANCHES);
-      N* n = (N*)calloc(sizeof(N) + (sizeof(ref<Object>) * BRANCHES), 1);
-      construct(n, edit, len);
+      N* n = (N*)NodeAlloc::calloc(allocSize(len, esize, false));
+      construct(n, edit, len, esize);
       // the following is needed if we use malloc instead of calloc:
       //while (len--) {
       //  construct(&n->_v[len]);
       //}
       return n;
     }
+
+    // Creates a relaxed branch with room for `count` children. The caller is
+    // responsible for filling in the size table.
+    static N* createRelaxed(uint32 count, EditID edit) {
+      DCHECK(count <= BRANCHES);
+      N* n = (N*)NodeAlloc::calloc(allocSize(count, 0, true));
+      construct(n, edit, count, 0);
+      n->relaxed = true;
+      return n;
+    }
     
+    // Object kind of nodes
+    static uint16 kind() {
+      static const uint16 k = registerKind([] (Object* obj) {
+        static_cast<N*>(obj)->dealloc();
+      });
+      return k;
+    }
+
     void dealloc() {
-      uint32 i = 0;
-      while (i < length) {
-        auto& v = _v[i++];
-        if (v) {
-          v->release();
+      if (esize == 0) {
+        uint32 i = 0;
+        while (i < length) {
+          auto& v = _v[i++];
+          if (v) {
+            v->release();
+          }
         }
       }
-      ::free(this);
+      NodeAlloc::free(this, allocSize(length, esize, relaxed));
     }
     
-    // Returns a shallow copy of this node
-    N* copy(uint32 len, EditID edit_) const {
-      auto n = create(len, edit_);
+    // Returns a shallow copy of this node. esize is only meaningful when this node
+    // is an empty leaf, which then adopts the storage of the values to be added.
+    N* copy(uint32 len, EditID edit_, uint32 esize_) const {
+      DCHECK(length == 0 || esize == esize_);
+      auto n = relaxed ? createRelaxed(len, edit_) : create(len, edit_, esize_);
 
       uint32 i = min(n->length, length);
-      while (i--) {
-        n->_v[i] = _v[i];
+      if (relaxed) {
+        memcpy(n->sizes(), sizes(), i * sizeof(uint32));
+      }
+      if (esize_) {
+        memcpy(n->bytes(), bytes(), i * esize_);
+      } else {
+        while (i--) {
+          n->_v[i] = _v[i];
+        }
       }
       return n;
     }
+    inline N* copy(uint32 len, EditID edit_) const {
+      return copy(len, edit_, esize);
+    }
     inline N* copy(uint32 len) const {
-      return copy(len, edit);
+      return copy(len, edit, esize);
     }
     
     // Optimized version of copy that avoids increment and decrement of reference for
@@ -94,7 +156,11 @@ namespace immutable {
     // 2.  n2->slot(1) = obj;
     // but it avoids retaining and releasing of object copied at line 1.
     N* copyAssign(uint32 index, Object* obj, EditID edit_) const {
-      auto n = create(length, edit_);
+      DCHECK(esize == 0);
+      auto n = relaxed ? createRelaxed(length, edit_) : create(length, edit_);
+      if (relaxed) {
+        memcpy(n->sizes(), sizes(), length * sizeof(uint32));
+      }
 
       uint32 i = length;
       while (i--) {
@@ -106,9 +172,47 @@ namespace immutable {
     inline N* copyAssign(uint32 index, Object* obj) const {
       return copyAssign(index, obj, edit);
     }
+    
+    // Leaf version of copyAssign
+    N* copyAssign(uint32 index, LeafValue v) const {
+      if (v.esize == 0) {
+        return copyAssign(index, (Object*)v.p, edit);
+      }
+      DCHECK(esize == v.esize);
+      auto n = create(length, edit, esize);
+      memcpy(n->bytes(), bytes(), length * esize);
+      memcpy(n->bytes() + (index * esize), v.p, esize);
+      return n;
+    }
 
     ref<Object>& slot(uint32 i) { return _v[i]; }
     const ref<Object>& slot(uint32 i) const { return _v[i]; }
+
+    N* child(uint32 i) const {
+      ImmutableAssertTypeTag(_v[i], TYPE_TAG);
+      return static_cast<N*>(_v[i].ptr());
+    }
+
+    // Cumulative sizes of the subtrees of a relaxed branch: sizes()[i] is the number
+    // of values in children [0,i]. Stored after the BRANCHES child slots.
+    uint32* sizes() { return (uint32*)&_v[BRANCHES]; }
+    const uint32* sizes() const { return (const uint32*)&_v[BRANCHES]; }
+
+    // Leaf value access
+    LeafValue value(uint32 i) const {
+      return esize ? LeafValue{bytes() + (i * esize), esize} : LeafValue{_v[i].ptr(), 0};
+    }
+    void store(uint32 i, LeafValue v) {
+      DCHECK(esize == v.esize);
+      if (v.esize) {
+        memcpy(bytes() + (i * v.esize), v.p, v.esize);
+      } else {
+        _v[i] = (Object*)v.p;
+      }
+    }
+
+    uint8* bytes() { return (uint8*)_v; }
+    const uint8* bytes() const { return (const uint8*)_v; }
   };
   
   
@@ -116,6 +220,10 @@ namespace immutable {
     
     template <typename A>
     static IMMUTABLE_ALWAYS_INLINE uint32 tailoff(A* a) {
+      if (root(a).relaxed) {
+        // the size of a relaxed tree is the last entry of its root's size table
+        return root(a).sizes()[root(a).length - 1];
+      }
       if (a->_end < BRANCHES) {
         // tail at root
         return 0;
@@ -135,25 +243,129 @@ namespace immutable {
       ImmutableAssertTypeTag(a->_tail, N::TYPE_TAG);
       return *static_cast<N*>(a->_tail.ptr());
     }
-    
-    
-    template <typename A>
-    static IMMUTABLE_ALWAYS_INLINE Object* firstValue(A* a) {
-      // assumes a->_end > 0
-      N* n = uncheckedSlotsFor(a, 0);
-      Object* val = n->slot(0);
-      ImmutableAssertTypeTag(val, A::ValueT::TYPE_TAG);
-      return val;
+
+
+    // A branch node is either strict or relaxed.
+    //
+    // In a strict branch all children but the last are full and all leaves below it
+    // hold BRANCHES values, so the child holding some index is found from the bits of
+    // the index alone. Strict branches only have strict children.
+    //
+    // A relaxed branch has children of any size and a size table which is searched to
+    // find the child holding some index. Relaxed branches are created by concat and
+    // slice, and make those operations O(log n). A branch at `level` has children
+    // holding at most 1 << level values each.
+
+    // Index of the child of relaxed branch `node` holding the value at i, where i is
+    // relative to node. Updates i to be relative to the child.
+    static IMMUTABLE_ALWAYS_INLINE uint32 relaxedIndex(const N& node, uint32 level, uint32& i) {
+      auto sizes = node.sizes();
+      uint32 subidx = i >> level; // never past the right child, as children are <= 1 << level
+      while (sizes[subidx] <= i) {
+        ++subidx;
+      }
+      if (subidx) {
+        i -= sizes[subidx - 1];
+      }
+      return subidx;
     }
+
+    // Index of the child of `node` holding the value at i. Only the low bits of i are
+    // meaningful below strict branches, so i is only updated for relaxed branches.
+    static IMMUTABLE_ALWAYS_INLINE uint32 childIndex(const N& node, uint32 level, uint32& i) {
+      return node.relaxed ? relaxedIndex(node, level, i) : (i >> level) & MASK;
+    }
+
+    // End of the values of child i of `node`, relative to node, or limit if that is
+    // less. Computed in 64 bits, as (i + 1) << level wraps for strict branches at
+    // level 30.
+    static uint32 childEnd(const N& node, uint32 level, uint32 i, uint32 limit) {
+      uint64 end = node.relaxed ? node.sizes()[i] : uint64(i + 1) << level;
+      return uint32(min(end, uint64(limit)));
+    }
+
+    static uint32 childCount(const N& node) {
+      if (node.relaxed) {
+        return node.length;
+      }
+      uint32 n = node.length;
+      while (n && !node.slot(n - 1)) {
+        --n;
+      }
+      return n;
+    }
+
+    // Number of values in the tree at node
+    static uint32 treeSize(const N& node, uint32 level) {
+      if (level == 0) {
+        return node.length;
+      }
+      if (node.relaxed) {
+        return node.sizes()[node.length - 1];
+      }
+      uint32 n = childCount(node);
+      return n ? ((n - 1) << level) + treeSize(*node.child(n - 1), level - BITS) : 0;
+    }
+
+    // Offset and number of values of child idx of `node`, which holds `size` values
+    static void childRange(
+      const N& node, uint32 level, uint32 size, uint32 idx, uint32& start, uint32& count)
+    {
+      if (node.relaxed) {
+        start = idx ? node.sizes()[idx - 1] : 0;
+        count = node.sizes()[idx] - start;
+      } else {
+        start = idx << level;
+        count = min(size - start, uint32(1) << level);
+      }
+    }
+
+    // Creates a branch at level with the provided children. The branch is strict if
+    // the children allow it, and relaxed otherwise.
+    static N* branch(N* const* children, uint32 count, uint32 level, EditID edit) {
+      DCHECK(count > 0 && count <= BRANCHES);
+      uint32 sizes[BRANCHES];
+      uint32 total = 0;
+      bool strict = true;
+      for (uint32 i = 0; i < count; ++i) {
+        const N* c = children[i];
+        uint32 n = treeSize(*c, level - BITS);
+        total += n;
+        sizes[i] = total;
+        strict = strict &&
+                 (level == BITS ? c->length == BRANCHES : !c->relaxed) &&
+                 (i == count - 1 || n == (uint32(1) << level));
+      }
+      N* node;
+      if (strict) {
+        node = N::create(BRANCHES, edit);
+      } else {
+        node = N::createRelaxed(count, edit);
+        memcpy(node->sizes(), sizes, count * sizeof(uint32));
+      }
+      for (uint32 i = 0; i < count; ++i) {
+        node->slot(i) = children[i];
+      }
+      return node;
+    }
+
+    // Removes single-child branches from the top of a tree
+    static void collapse(ref<N>& root, uint32& shift) {
+      while (shift > BITS && childCount(*root) == 1) {
+        root = root->child(0);
+        shift -= BITS;
+      }
+    }
+
     
-    
-    static IMMUTABLE_ALWAYS_INLINE A* push(A* a, Object* obj) {
+    static IMMUTABLE_ALWAYS_INLINE A* push(A* a, LeafValue v) {
+      auto to = tailoff(a);
       
       // room in tail?
-      if (a->_end - tailoff(a) < BRANCHES) {
-        auto newTail = tail(a).copy(tail(a).length + 1);
-        newTail->slot(tail(a).length) = obj;
-        return new A(0, a->_end + 1, a->_shift, a->_root, newTail);
+      if (a->_end - to < BRANCHES) {
+        auto newTail = tail(a).copy(tail(a).length + 1, tail(a).edit, v.esize);
+        newTail->store(tail(a).length, v);
+        return new A(a->_start, a->_end + 1, a->_shift, a->_root, newTail);
       }
       
       // full tail, push into tree
@@ -164,28 +376,36 @@ namespace immutable {
       
       auto newShift = a->_shift;
       
-      // overflow root?
-      if ((a->_end >> BITS) > (1 << a->_shift)) {
+      if (root(a).relaxed) {
+        newRoot = pushTailRelaxed(root(a).edit, a->_shift, root(a), tailNode);
+        if (!newRoot) {
+          N* children[2] = {&root(a), newPath(root(a).edit, a->_shift, tailNode)};
+          newRoot = branch(children, 2, a->_shift + BITS, root(a).edit);
+          newShift += BITS;
+        }
+      } else if ((a->_end >> BITS) > (1u << a->_shift)) { // overflow root?
         newRoot = N::create(BRANCHES, root(a).edit);
         newRoot->slot(0) = a->_root;
         newRoot->slot(1) = newPath(root(a).edit, a->_shift, tailNode);
         newShift += BITS;
       } else {
-        newRoot = pushTail(a, a->_shift, root(a), tailNode);
+        newRoot = pushTail(root(a).edit, a->_shift, root(a), to, tailNode);
       }
 
-      auto newTail = N::create(1, tail(a).edit);
-      newTail->slot(0) = obj;
-      return new A(0, a->_end + 1, newShift, newRoot, newTail);
+      auto newTail = N::create(1, tail(a).edit, v.esize);
+      newTail->store(0, v);
+      return new A(a->_start, a->_end + 1, newShift, newRoot, newTail);
     }
     
 
-    static N* pushTail(A* a, uint32 level, const N& parentNode, N* tailNode) {
+    // size is the number of values in the strict tree at parentNode, which must not be
+    // full and must be a multiple of BRANCHES.
+    static N* pushTail(EditID edit, uint32 level, const N& parentNode, uint32 size, N* tailNode) {
       //if parent is leaf, insert node,
       // else does it map to an existing child? -> nodeToInsert = pushNode one more level
       // else alloc new path
       //return  nodeToInsert placed in copy of parentNode
-      uint32 subidx = ((a->_end - 1) >> level) & MASK;
+      uint32 subidx = (size >> level) & MASK;
       
       N* nodeToInsert;
       if (level == BITS) {
@@ -194,9 +414,9 @@ namespace immutable {
         auto& child = parentNode.slot(subidx);
         if (child) {
           ImmutableAssertTypeTag(child, N::TYPE_TAG);
-          nodeToInsert = pushTail(a, level - BITS, *((N*)child.ptr()), tailNode);
+          nodeToInsert = pushTail(edit, level - BITS, *((N*)child.ptr()), size, tailNode);
         } else {
-          nodeToInsert = newPath(root(a).edit, level - BITS, tailNode);
+          nodeToInsert = newPath(edit, level - BITS, tailNode);
         }
       }
 
@@ -204,15 +424,48 @@ namespace immutable {
     }
 
 
-    static IMMUTABLE_ALWAYS_INLINE TA* tpush(TA* a, Object* val) {
+    // Returns a copy of relaxed node with full leaf tailNode added to its end, or
+    // null if there's no room for it.
+    static N* pushTailRelaxed(EditID edit, uint32 level, const N& node, N* tailNode) {
+      uint32 last = node.length - 1;
+      if (level > BITS) {
+        N* child = node.child(last);
+        N* newChild = nullptr;
+        if (child->relaxed) {
+          newChild = pushTailRelaxed(edit, level - BITS, *child, tailNode);
+        } else {
+          uint32 start, size;
+          childRange(node, level, 0, last, start, size);
+          if (size < (uint32(1) << level)) {
+            newChild = pushTail(edit, level - BITS, *child, size, tailNode);
+          }
+        }
+        if (newChild) {
+          N* n = node.copyAssign(last, newChild, edit);
+          n->sizes()[last] += tailNode->length;
+          return n;
+        }
+      }
+      if (node.length == BRANCHES) {
+        return nullptr;
+      }
+      N* n = node.copy(node.length + 1, edit);
+      n->slot(node.length) = newPath(edit, level - BITS, tailNode);
+      n->sizes()[node.length] = node.sizes()[last] + tailNode->length;
+      return n;
+    }
+
+
+    static IMMUTABLE_ALWAYS_INLINE TA* tpush(TA* a, LeafValue v) {
       if (!isEditable(a)) {
         return nullptr;
       }
       auto i = a->_end;
+      auto to = tailoff(a);
       
       // room in tail?
-      if (i - tailoff(a) < BRANCHES) {
-        tail(a).slot(i & MASK) = val;
+      if (i - to < BRANCHES) {
+        tail(a).store(i - to, v);
         ++a->_end;
         return a;
       }
@@ -221,20 +474,26 @@ namespace immutable {
       N* newRoot;
       ref<N> tailNode = &tail(a);
 
-      N* newTail = N::create(BRANCHES, root(a).edit);
-      newTail->slot(0) = val;
+      N* newTail = N::create(BRANCHES, root(a).edit, v.esize);
+      newTail->store(0, v);
       a->_tail = newTail;
 
       auto newShift = a->_shift;
 
-      // overflow root?
-      if ((a->_end >> BITS) > (1 << a->_shift)) {
+      if (root(a).relaxed) {
+        newRoot = tpushTailRelaxed(a, a->_shift, &root(a), tailNode);
+        if (!newRoot) {
+          N* children[2] = {&root(a), newPath(root(a).edit, a->_shift, tailNode)};
+          newRoot = branch(children, 2, a->_shift + BITS, root(a).edit);
+          newShift += BITS;
+        }
+      } else if ((a->_end >> BITS) > (1u << a->_shift)) { // overflow root?
         newRoot = N::create(BRANCHES, root(a).edit);
         newRoot->slot(0) = a->_root;
         newRoot->slot(1) = newPath(root(a).edit, a->_shift, tailNode);
         newShift += BITS;
       } else {
-        newRoot = tpushTail(a, a->_shift, &root(a), tailNode);
+        newRoot = tpushTail(a, a->_shift, &root(a), to, tailNode);
       }
       a->_root = newRoot;
       a->_shift = newShift;
@@ -243,13 +502,13 @@ namespace immutable {
     }
     
     
-    static N* tpushTail(TA* a, uint32 level, N* parentNode, N* tailNode) {
+    static N* tpushTail(TA* a, uint32 level, N* parentNode, uint32 size, N* tailNode) {
       //if parent is leaf, insert node,
       // else does it map to an existing child? -> nodeToInsert = pushNode one more level
       // else alloc new path
       //return  nodeToInsert placed in parent
       parentNode = ensureEditable(a, parentNode);
-      uint32 subidx = ((a->_end - 1) >> level) & MASK;
+      uint32 subidx = (size >> level) & MASK;
 
       N* nodeToInsert;
       if (level == BITS) {
@@ -258,7 +517,7 @@ namespace immutable {
         N* child = static_cast<N*>(parentNode->slot(subidx).ptr());
         if (child) {
           ImmutableAssertTypeTag(child, N::TYPE_TAG);
-          nodeToInsert = tpushTail(a, level - BITS, child, tailNode);
+          nodeToInsert = tpushTail(a, level - BITS, child, size, tailNode);
         } else {
           nodeToInsert = newPath(root(a).edit, level - BITS, tailNode);
         }
@@ -267,6 +526,39 @@ namespace immutable {
       parentNode->slot(subidx) = nodeToInsert;
       return parentNode;
     }
+
+
+    // Transient version of pushTailRelaxed. Modifies node only if there's room.
+    static N* tpushTailRelaxed(TA* a, uint32 level, N* node, N* tailNode) {
+      uint32 last = node->length - 1;
+      if (level > BITS) {
+        N* child = node->child(last);
+        N* newChild = nullptr;
+        if (child->relaxed) {
+          newChild = tpushTailRelaxed(a, level - BITS, child, tailNode);
+        } else {
+          uint32 start, size;
+          childRange(*node, level, 0, last, start, size);
+          if (size < (uint32(1) << level)) {
+            newChild = tpushTail(a, level - BITS, child, size, tailNode);
+          }
+        }
+        if (newChild) {
+          node = ensureEditable(a, node);
+          node->slot(last) = newChild;
+          node->sizes()[last] += tailNode->length;
+          return node;
+        }
+      }
+      if (node->length == BRANCHES) {
+        return nullptr;
+      }
+      node = ensureEditable(a, node);
+      node->slot(node->length) = newPath(root(a).edit, level - BITS, tailNode);
+      node->sizes()[node->length] = node->sizes()[last] + tailNode->length;
+      ++node->length;
+      return node;
+    }
     
     
     static N* newPath(EditID edit, uint32 level, N* node) {
@@ -279,105 +571,82 @@ namespace immutable {
     }
     
 
-    static IMMUTABLE_ALWAYS_INLINE A* set(A* a, uint32 i, Object* obj) {
+    static IMMUTABLE_ALWAYS_INLINE A* set(A* a, uint32 i, LeafValue v) {
       // Note: i is assumed to be less than a->_end
-      if (i >= tailoff(a)) {
+      auto to = tailoff(a);
+      if (i >= to) {
         // Common case: i is inside tail — copy tail and replace tail slot
-        return new A(0, a->_end, a->_shift, &root(a), tail(a).copyAssign(i & MASK, obj));
+        return new A(
+          a->_start, a->_end, a->_shift, &root(a), tail(a).copyAssign(i - to, v));
       }
       // build tree
-      return new A(0, a->_end, a->_shift, doAssoc(a, a->_shift, root(a), i, obj), &tail(a));
+      return new A(
+        a->_start, a->_end, a->_shift, doAssoc(a->_shift, root(a), i, v), &tail(a));
     }
     
     
-    static N* doAssoc(A* a, uint32 level, const N& node, uint32 i, Object* obj) {
+    static N* doAssoc(uint32 level, const N& node, uint32 i, LeafValue v) {
       if (level == 0) {
-        return node.copyAssign(i & MASK, obj);
+        return node.copyAssign(i & MASK, v);
       }
       
-      uint32 subidx = (i >> level) & MASK;
-      N* subNode = static_cast<N*>(node.slot(subidx).ptr());
-      ImmutableAssertTypeTag(subNode, N::TYPE_TAG);
+      uint32 subidx = childIndex(node, level, i);
+      N* subNode = node.child(subidx);
 
-      return node.copyAssign(subidx, doAssoc(a, level - BITS, *subNode, i, obj));
+      return node.copyAssign(subidx, doAssoc(level - BITS, *subNode, i, v));
     }
     
     
-    static IMMUTABLE_ALWAYS_INLINE TA* tset(TA* a, uint32 i, Object* val) {
+    static IMMUTABLE_ALWAYS_INLINE TA* tset(TA* a, uint32 i, LeafValue v) {
       // Note: i is assumed to be less than a->_end
       if (!isEditable(a)) {
         return nullptr;
       }
       
-      if (i >= tailoff(a)) {
-        tail(a).slot(i & MASK) = val;
+      auto to = tailoff(a);
+      if (i >= to) {
+        tail(a).store(i - to, v);
         return a;
       }
       
-      a->_root = tdoAssoc(a, a->_shift, &root(a), i, val);
+      a->_root = tdoAssoc(a, a->_shift, &root(a), i, v);
       return a;
     }
     
     
-    static N* tdoAssoc(TA* a, uint32 level, N* node, uint32 i, Object* val) {
+    static N* tdoAssoc(TA* a, uint32 level, N* node, uint32 i, LeafValue v) {
       node = ensureEditable(a, node);
       if (level == 0) {
-        node->slot(i & MASK) = val;
+        node->store(i & MASK, v);
       } else {
-        uint32 subidx = (i >> level) & MASK;
-        N* subNode = static_cast<N*>(node->slot(subidx).ptr());
-        ImmutableAssertTypeTag(subNode, N::TYPE_TAG);
-        node->slot(subidx) = tdoAssoc(a, level - BITS, subNode, i, val);
+        uint32 subidx = childIndex(*node, level, i);
+        N* subNode = node->child(subidx);
+        node->slot(subidx) = tdoAssoc(a, level - BITS, subNode, i, v);
       }
       return node;
     }
     
     
+    // Returns the leaf (or tail) holding the value at i, and sets base to the index of
+    // the first value in that leaf. Unchecked.
     template <typename A>
-    static inline N* checkedSlotsFor(A* a, uint32 i) {
+    static inline N* leafFor(A* a, uint32 i, uint32& base) {
       DCHECK(i < a->_end);
-
-      if (i >= tailoff(a)) {
+      auto to = tailoff(a);
+      if (i >= to) {
+        base = to;
         return &tail(a);
       }
       
       N* node = &root(a);
+      uint32 j = i; // relative to the last relaxed branch
       
       for (uint32 level = a->_shift; level > 0; level -= BITS) {
+        node = node->child(childIndex(*node, level, j));
         DCHECK(node);
-        auto k = (i >> level) & MASK;
-        if (k < node->length) {
-          Object* obj = node->slot((i >> level) & MASK);
-          if (!obj) {
-            return nullptr;
-          }
-          ImmutableAssertTypeTag(obj, N::TYPE_TAG);
-          node = static_cast<N*>(obj);
-        } else {
-          return nullptr;
-        }
-      }
-      
-      return node;
-    }
-    
-    
-    template <typename A>
-    static inline N* uncheckedSlotsFor(A* a, uint32 i) {
-      DCHECK(i < a->_end);
-      if (i >= tailoff(a)) {
-        return &tail(a);
-      }
-      
-      N* node = &root(a);
-      
-      for (uint32 level = a->_shift; level > 0; level -= BITS) {
-        DCHECK(((i >> level) & MASK) < node->length);
-        node = static_cast<N*>(node->slot((i >> level) & MASK).ptr());
-        DCHECK(node);
-        ImmutableAssertTypeTag(node, N::TYPE_TAG);
       }
       
+      base = i - (j & MASK);
       return node;
     }
     
@@ -392,10 +661,8 @@ namespace immutable {
       N* node = &root(a);
       
       for (uint32 level = a->_shift; level > 0; level -= BITS) {
-        DCHECK(((i >> level) & MASK) < node->length);
-        node = ensureEditable(a, static_cast<N*>(node->slot((i >> level) & MASK).ptr()));
+        node = ensureEditable(a, node->child(childIndex(*node, level, i)));
         DCHECK(node);
-        ImmutableAssertTypeTag(node, N::TYPE_TAG);
       }
 
       return node;
@@ -404,82 +671,135 @@ namespace immutable {
     
     static IMMUTABLE_ALWAYS_INLINE A* pop(A* a) {
       // assumes a is not empty
-      if (a->_end == 1) {
+      if (a->_end - a->_start == 1) {
         return &ArrayImp::EMPTY;
       }
 
-      if (a->_end - tailoff(a) > 1) {
+      auto to = tailoff(a);
+      if (a->_end - to > 1) {
         // inside tail and there's at least one more item in tail
         N* newTail = tail(a).copy(tail(a).length - 1);
-        return new A(0, a->_end - 1, a->_shift, &root(a), newTail);
+        return new A(a->_start, a->_end - 1, a->_shift, &root(a), newTail);
       }
       
       DCHECK(a->_end >= 2);
       
-      N* newTail = uncheckedSlotsFor(a, a->_end - 2);
-      N* newRoot = popTail(a, a->_shift, root(a));
+      uint32 base;
+      N* newTail = leafFor(a, a->_end - 2, base);
+      if (base <= a->_start) {
+        // no values left in the tree, except for ones before the start offset
+        return new A(a->_start - base, a->_end - 1 - base, BITS, EMPTY._root, newTail);
+      }
+      ref<N> newRoot = root(a).relaxed ?
+        popTailRelaxed(root(a).edit, a->_shift, root(a), newTail->length) :
+        popTail(root(a).edit, a->_shift, root(a), to);
       
-      int newShift = a->_shift;
+      uint32 newShift = a->_shift;
       if (!newRoot) {
-        newRoot = &EMPTY_NODE;
-      }
-
-      if (a->_shift > BITS && !newRoot->slot(1)) {
-        newRoot = static_cast<N*>(newRoot->slot(0).ptr());
-        ImmutableAssertTypeTag(newRoot, N::TYPE_TAG);
+        // Note: The root must have BRANCHES slots as we might push into it
+        newRoot = N::create(BRANCHES, root(a).edit);
+        newShift = BITS;
+      } else if (a->_shift > BITS && childCount(*newRoot) == 1) {
+        newRoot = newRoot->child(0);
         newShift -= BITS;
       }
 
-      return new A(0, a->_end - 1, newShift, newRoot, newTail);
+      return new A(a->_start, a->_end - 1, newShift, newRoot, newTail);
     }
     
     
-    static N* popTail(A* a, uint32 level, const N& node) {
-      uint32 subidx = ((a->_end - 2) >> level) & MASK;
+    // size is the number of values in the strict tree at node
+    static N* popTail(EditID edit, uint32 level, const N& node, uint32 size) {
+      uint32 subidx = ((size - 1) >> level) & MASK;
       if (level > BITS) {
         DCHECK(node.slot(subidx));
-        ImmutableAssertTypeTag(node.slot(subidx), N::TYPE_TAG);
-        N* newChild = popTail(a, level - BITS, *static_cast<N*>(node.slot(subidx).ptr()));
+        N* newChild = popTail(edit, level - BITS, *node.child(subidx), size);
         if (newChild != nullptr || subidx != 0) {
-          return node.copyAssign(subidx, newChild, root(a).edit);
+          return node.copyAssign(subidx, newChild, edit);
         }
       } else if (subidx != 0) {
-        return node.copyAssign(subidx, nullptr, root(a).edit);
+        return node.copyAssign(subidx, nullptr, edit);
       }
       return nullptr;
     }
+
+
+    // Returns a copy of relaxed node without its last leaf, which holds leafLen values,
+    // or null if that was the only leaf.
+    static N* popTailRelaxed(EditID edit, uint32 level, const N& node, uint32 leafLen) {
+      uint32 last = node.length - 1;
+      N* newChild = nullptr;
+      if (level > BITS) {
+        N* child = node.child(last);
+        if (child->relaxed) {
+          newChild = popTailRelaxed(edit, level - BITS, *child, leafLen);
+        } else {
+          uint32 start, size;
+          childRange(node, level, 0, last, start, size);
+          newChild = popTail(edit, level - BITS, *child, size);
+        }
+      }
+      if (newChild) {
+        N* n = node.copyAssign(last, newChild, edit);
+        n->sizes()[last] -= leafLen;
+        return n;
+      }
+      return last ? node.copy(last, edit) : nullptr;
+    }
     
     
     static IMMUTABLE_ALWAYS_INLINE TA* tpop(TA* a) {
       // assumes a is not empty
-      if (a->_end == 1) {
+      if (a->_end - a->_start == 1) {
+        if (a->_start) {
+          a->_root = N::create(BRANCHES, root(a).edit);
+          a->_shift = BITS;
+          a->_start = 0;
+        }
         a->_end = 0;
         return a;
       }
       
-      auto i = a->_end - 1;
+      auto to = tailoff(a);
 
       // pop in tail?
-      if ((i & MASK) > 0) {
+      if (a->_end - to > 1) {
         --a->_end;
         return a;
       }
       
       DCHECK(a->_end >= 2);
 
+      uint32 base;
+      N* leaf = leafFor(a, a->_end - 2, base);
+      if (base <= a->_start) {
+        // no values left in the tree, except for ones before the start offset
+        a->_tail = leaf->copy(BRANCHES, root(a).edit);
+        a->_root = N::create(BRANCHES, root(a).edit);
+        a->_shift = BITS;
+        a->_start -= base;
+        a->_end -= 1 + base;
+        return a;
+      }
+
       ref<N> newTail = editableSlotsFor(a, a->_end - 2);
-      N* newRoot = tpopTail(a, a->_shift, &root(a));
+      uint32 leafLen = newTail->length;
+      ref<N> newRoot = root(a).relaxed ?
+        tpopTailRelaxed(a, a->_shift, &root(a), leafLen) :
+        tpopTail(a, a->_shift, &root(a), to);
 
       auto newShift = a->_shift;
       if (!newRoot) {
         newRoot = N::create(BRANCHES, root(a).edit);
+        newShift = BITS;
+      } else if (a->_shift > BITS && childCount(*newRoot) == 1) {
+        newRoot = ensureEditable(a, newRoot->child(0));
+        newShift -= BITS;
       }
 
-      if (a->_shift > BITS && !newRoot->slot(1)) {
-        newRoot = static_cast<N*>(newRoot->slot(0).ptr());
-        ImmutableAssertTypeTag(newRoot, N::TYPE_TAG);
-        newRoot = ensureEditable(a, newRoot);
-        newShift -= BITS;
+      if (leafLen < BRANCHES) {
+        // the tail of a transient always has room for BRANCHES values
+        newTail = newTail->copy(BRANCHES, root(a).edit);
       }
 
       a->_root = newRoot;
@@ -491,13 +811,12 @@ namespace immutable {
     }
     
     
-    static N* tpopTail(TA* a, uint32 level, N* node) {
+    static N* tpopTail(TA* a, uint32 level, N* node, uint32 size) {
       node = ensureEditable(a, node);
-      uint32 subidx = ((a->_end - 2) >> level) & MASK;
+      uint32 subidx = ((size - 1) >> level) & MASK;
       if (level > BITS) {
         DCHECK(node->slot(subidx));
-        ImmutableAssertTypeTag(node->slot(subidx), N::TYPE_TAG);
-        N* newChild = tpopTail(a, level - BITS, static_cast<N*>(node->slot(subidx).ptr()));
+        N* newChild = tpopTail(a, level - BITS, node->child(subidx), size);
         if (newChild != nullptr || subidx != 0) {
           node->slot(subidx) = newChild;
           return node;
@@ -508,6 +827,34 @@ namespace immutable {
       }
       return nullptr;
     }
+
+
+    static N* tpopTailRelaxed(TA* a, uint32 level, N* node, uint32 leafLen) {
+      node = ensureEditable(a, node);
+      uint32 last = node->length - 1;
+      N* newChild = nullptr;
+      if (level > BITS) {
+        N* child = node->child(last);
+        if (child->relaxed) {
+          newChild = tpopTailRelaxed(a, level - BITS, child, leafLen);
+        } else {
+          uint32 start, size;
+          childRange(*node, level, 0, last, start, size);
+          newChild = tpopTail(a, level - BITS, child, size);
+        }
+      }
+      if (newChild) {
+        node->slot(last) = newChild;
+        node->sizes()[last] -= leafLen;
+        return node;
+      }
+      if (last == 0) {
+        return nullptr;
+      }
+      node->slot(last) = nullptr;
+      --node->length;
+      return node;
+    }
     
     
     static inline bool isEditable(TA* a) {
@@ -527,30 +874,33 @@ namespace immutable {
       DCHECK(start >= a->_start);
       return end <= a->_end && start <= end;
     }
+
+    // A new array sharing the data of a
+    static inline A* copy(A* a) {
+      return new A(a->_start, a->_end, a->_shift, a->_root, a->_tail);
+    }
     
 
-    static A* pushAllFn(A* a, const ItFunc& next) {
-      A::ValueT* vptr = next();
-      if (vptr) {
-        auto t = createTransient(a);
-        do {
-          tpush(t, vptr);
-        } while ((vptr = next()));
-        a = createPersistent(t);
-        t->release();
+    // Returns a new array with values produced by next added to a
+    static A* pushAllFn(A* a, const ItFunc& next, uint32 esize) {
+      const void* vptr = next();
+      if (!vptr) {
+        return copy(a);
       }
-      return a;
+      ref<TA> t = createTransient(a, esize);
+      do {
+        tpush(t, LeafValue{vptr, esize});
+      } while ((vptr = next()));
+      return createPersistent(t);
     }
     
+    // Returns a new array with the remaining values of it added to a
     static A* pushAllIt(A* a, A::Iterator& it) {
-      if (it != END_ITERATOR) {
-        auto t = createTransient(a);
-        do {
-          tpush(t, it.value());
-        } while (++it != END_ITERATOR);
-        a = createPersistent(t);
-        t->release();
+      if (it == END_ITERATOR) {
+        return copy(a);
       }
+      a = concat(a, it._a, it._i, it._end);
+      it = END_ITERATOR;
       return a;
     }
     
@@ -558,77 +908,352 @@ namespace immutable {
     // copies items in the range [start,end) of src to dst
     // Assumes start and end are absolute.
     static void tpushAll(TA* dst, A* src, uint32 start, uint32 end) {
-      A::Iterator I(src, start, end);
-      for (; I != END_ITERATOR; ++I) {
-        DCHECK(I.value());
-        tpush(dst, I.value());
+      while (start < end) {
+        uint32 base;
+        N* leaf = leafFor(src, start, base);
+        uint32 i = start - base;
+        uint32 iend = min(end - base, leaf->length);
+        start = base + iend;
+        for (; i < iend; ++i) {
+          tpush(dst, leaf->value(i));
+        }
+      }
+    }
+
+    // Storage size of values in non-empty array a
+    static inline uint32 esize(A* a) {
+      DCHECK(a->_end > a->_start);
+      return tail(a).esize;
+    }
+
+
+    // —— Concatenation and slicing ——
+
+    // Returns a copy of the tree at node in which all children that only hold values
+    // before index i are replaced with null. i must be inside the tree.
+    // The child holding i (and so the last child) is kept, so that the right edge of
+    // the tree, where push and pop operate, is never affected.
+    static N* trimPrefix(const N& node, uint32 level, uint32 i) {
+      uint32 idx = childIndex(node, level, i);
+      N* child = node.child(idx);
+      ref<N> newChild = level > BITS ? trimPrefix(*child, level - BITS, i) : child;
+      N* n = node.copyAssign(idx, newChild, NO_EDIT);
+      for (uint32 k = 0; k < idx; ++k) {
+        n->slot(k) = nullptr;
+      }
+      return n;
+    }
+
+    // Leaf with values [from,to) of leaf
+    static N* copyRange(const N& leaf, uint32 from, uint32 to) {
+      N* n = N::create(to - from, NO_EDIT, leaf.esize);
+      for (uint32 i = from; i < to; ++i) {
+        n->store(i - from, leaf.value(i));
+      }
+      return n;
+    }
+
+    // Path of single-child branches from level down to leaf
+    static N* leafPath(uint32 level, N* leaf) {
+      if (level == 0) {
+        return leaf;
+      }
+      ref<N> child = leafPath(level - BITS, leaf);
+      N* children[1] = {child};
+      return branch(children, 1, level, NO_EDIT);
+    }
+
+    // Returns a copy of the tree at node with leaf added after its last leaf, or null if
+    // the tree is full. Unlike pushTail, leaf need not be full.
+    static N* appendLeaf(const N& node, uint32 level, N* leaf) {
+      N* children[BRANCHES];
+      uint32 count = childCount(node);
+      for (uint32 i = 0; i < count; ++i) {
+        children[i] = node.child(i);
+      }
+      if (level > BITS && count) {
+        ref<N> last = appendLeaf(*children[count - 1], level - BITS, leaf);
+        if (last) {
+          children[count - 1] = last;
+          return branch(children, count, level, NO_EDIT);
+        }
+      }
+      if (count == BRANCHES) {
+        return nullptr;
+      }
+      ref<N> path = leafPath(level - BITS, leaf);
+      children[count] = path;
+      return branch(children, count + 1, level, NO_EDIT);
+    }
+
+    // Returns the tree at node, which holds `size` values, restricted to values in the
+    // range [from,to). Shares all nodes fully inside the range.
+    static N* sliceNode(N& node, uint32 level, uint32 size, uint32 from, uint32 to) {
+      if (from == 0 && to == size) {
+        return &node;
+      }
+      if (level == 0) {
+        return copyRange(node, from, to);
+      }
+      uint32 i = from, j = to - 1;
+      uint32 first = node.relaxed ? relaxedIndex(node, level, i) : from >> level;
+      uint32 last = node.relaxed ? relaxedIndex(node, level, j) : (to - 1) >> level;
+      ref<N> slices[BRANCHES];
+      N* children[BRANCHES];
+      uint32 n = 0;
+      for (uint32 idx = first; idx <= last; ++idx, ++n) {
+        uint32 start, count;
+        childRange(node, level, size, idx, start, count);
+        slices[n] = sliceNode(*node.child(idx), level - BITS, count,
+                              max(from, start) - start, min(to, start + count) - start);
+        children[n] = slices[n];
+      }
+      return branch(children, n, level, NO_EDIT);
+    }
+
+    // Returns a new array with the values [start,_end) of a, sharing the root and tail
+    // of a but with a start offset. Subtrees of a that only hold values before start
+    // are dropped once start moves past a leaf, so that values which are no longer
+    // reachable are released. Amortized O(1) for a series of rest() calls.
+    static A* sliceSuffix(A* a, uint32 start) {
+      auto to = tailoff(a);
+      if (start >= to) {
+        // only values in the tail remain
+        return new A(start - to, a->_end - to, BITS, EMPTY._root, a->_tail);
+      }
+      uint32 base;
+      N* leaf = leafFor(a, a->_start, base);
+      if (start < base + leaf->length) {
+        // start is in the same leaf as the current start
+        return new A(start, a->_end, a->_shift, a->_root, a->_tail);
+      }
+      return new A(start, a->_end, a->_shift, trimPrefix(root(a), a->_shift, start), a->_tail);
+    }
+
+    // Returns a new array with the values [start,end) of a and no start offset.
+    // Assumes start < end and that both are absolute.
+    static A* sliceTree(A* a, uint32 start, uint32 end) {
+      DCHECK(start < end);
+      // the leaf holding the last value becomes the tail
+      uint32 base;
+      N* leaf = leafFor(a, end - 1, base);
+      uint32 from = max(start, base);
+      ref<N> newTail = (from == base && end - base == leaf->length) ?
+        leaf : copyRange(*leaf, from - base, end - base);
+      if (start >= base) {
+        return new A(0, end - start, BITS, EMPTY._root, newTail);
+      }
+      uint32 shift = a->_shift;
+      ref<N> newRoot = sliceNode(root(a), shift, tailoff(a), start, base);
+      collapse(newRoot, shift);
+      return new A(0, end - start, shift, newRoot, newTail);
+    }
+
+    // Allowed number of nodes per level above the minimum when rebalancing
+    static constexpr uint32 CONCAT_EXTRA = 2;
+
+    // Computes how to redistribute the items (values or children) of n nodes with item
+    // counts `counts`, so that the result has at most CONCAT_EXTRA more nodes than the
+    // minimum needed. Updates counts with the new item counts and returns the new
+    // number of nodes.
+    static uint32 concatPlan(uint32* counts, uint32 n) {
+      uint32 total = 0;
+      for (uint32 i = 0; i < n; ++i) {
+        total += counts[i];
+      }
+      uint32 optimal = (total + BRANCHES - 1) / BRANCHES;
+      uint32 i = 0;
+      while (n > optimal + CONCAT_EXTRA) {
+        // skip nodes that are (almost) full
+        while (counts[i] > BRANCHES - CONCAT_EXTRA / 2) {
+          ++i;
+        }
+        // distribute the items of node i over the nodes that follow it
+        uint32 r = counts[i];
+        while (r > 0) {
+          uint32 c = min(r + counts[i + 1], uint32(BRANCHES));
+          counts[i] = c;
+          r = r + counts[i + 1] - c;
+          ++i;
+        }
+        for (uint32 j = i; j < n - 1; ++j) {
+          counts[j] = counts[j + 1];
+        }
+        --n;
+        --i;
+      }
+      return n;
+    }
+
+    // Up to two nodes of the same level
+    struct NodePair {
+      ref<N> n[2];
+      uint32 count = 0;
+    };
+
+    // Redistributes the children of l but its last, the nodes of center, and the
+    // children of r but its first, according to concatPlan. Returns the result as one
+    // or two branches at level. l and r may be null.
+    static NodePair rebalance(const N* l, const NodePair& center, const N* r, uint32 level) {
+      const N* all[2 * BRANCHES];
+      uint32 n = 0;
+      if (l) {
+        for (uint32 i = 0, c = childCount(*l); i < c - 1; ++i) {
+          all[n++] = l->child(i);
+        }
+      }
+      for (uint32 i = 0; i < center.count; ++i) {
+        all[n++] = center.n[i];
+      }
+      if (r) {
+        for (uint32 i = 1, c = childCount(*r); i < c; ++i) {
+          all[n++] = r->child(i);
+        }
+      }
+
+      uint32 sublevel = level - BITS;
+      uint32 counts[2 * BRANCHES]; // item counts of nodes in all
+      uint32 plan[2 * BRANCHES];   // item counts of the new nodes
+      for (uint32 i = 0; i < n; ++i) {
+        counts[i] = plan[i] = sublevel ? childCount(*all[i]) : all[i]->length;
+      }
+      uint32 m = concatPlan(plan, n);
+
+      ref<N> nodes[2 * BRANCHES];
+      N* children[2 * BRANCHES];
+      N* subchildren[BRANCHES];
+      uint32 src = 0, srci = 0; // next item to move is item srci of all[src]
+      for (uint32 j = 0; j < m; ++j) {
+        if (srci == 0 && counts[src] == plan[j]) {
+          // node is unaffected
+          nodes[j] = const_cast<N*>(all[src++]);
+        } else if (sublevel == 0) {
+          N* leaf = N::create(plan[j], NO_EDIT, all[src]->esize);
+          nodes[j] = leaf;
+          for (uint32 k = 0; k < plan[j]; ++k) {
+            leaf->store(k, all[src]->value(srci));
+            if (++srci == counts[src]) {
+              ++src;
+              srci = 0;
+            }
+          }
+        } else {
+          for (uint32 k = 0; k < plan[j]; ++k) {
+            subchildren[k] = all[src]->child(srci);
+            if (++srci == counts[src]) {
+              ++src;
+              srci = 0;
+            }
+          }
+          nodes[j] = branch(subchildren, plan[j], sublevel, NO_EDIT);
+        }
+        children[j] = nodes[j];
+      }
+
+      NodePair res;
+      if (m <= BRANCHES) {
+        res.n[0] = branch(children, m, level, NO_EDIT);
+        res.count = 1;
+      } else {
+        res.n[0] = branch(children, BRANCHES, level, NO_EDIT);
+        res.n[1] = branch(children + BRANCHES, m - BRANCHES, level, NO_EDIT);
+        res.count = 2;
+      }
+      return res;
+    }
+
+    // Concatenates the trees at l and r, at levels ll and rl. Returns the result as one
+    // or two nodes at level max(ll, rl).
+    static NodePair concatSub(const N* l, uint32 ll, const N* r, uint32 rl) {
+      if (ll > rl) {
+        auto center = concatSub(l->child(childCount(*l) - 1), ll - BITS, r, rl);
+        return rebalance(l, center, nullptr, ll);
+      }
+      if (ll < rl) {
+        auto center = concatSub(l, ll, r->child(0), rl - BITS);
+        return rebalance(nullptr, center, r, rl);
+      }
+      if (ll == 0) {
+        NodePair leaves;
+        leaves.n[0] = const_cast<N*>(l);
+        leaves.n[1] = const_cast<N*>(r);
+        leaves.count = 2;
+        return leaves;
+      }
+      auto center = concatSub(l->child(childCount(*l) - 1), ll - BITS, r->child(0), rl - BITS);
+      return rebalance(l, center, r, ll);
+    }
+
+    // Concatenates non-empty arrays l and r, neither with a start offset and r with a
+    // non-empty tree.
+    static A* concatTrees(A* l, A* r) {
+      // move l's tail into its tree
+      uint32 lshift = l->_shift;
+      ref<N> lroot = appendLeaf(root(l), lshift, &tail(l));
+      if (!lroot) {
+        ref<N> path = leafPath(lshift, &tail(l));
+        N* children[2] = {&root(l), path};
+        lroot = branch(children, 2, lshift + BITS, NO_EDIT);
+        lshift += BITS;
+      }
+
+      auto p = concatSub(lroot, lshift, &root(r), r->_shift);
+      uint32 shift = max(lshift, r->_shift);
+      ref<N> newRoot;
+      if (p.count == 1) {
+        newRoot = p.n[0];
+      } else {
+        N* children[2] = {p.n[0], p.n[1]};
+        newRoot = branch(children, 2, shift + BITS, NO_EDIT);
+        shift += BITS;
       }
+      collapse(newRoot, shift);
+      return new A(0, l->_end + r->_end, shift, newRoot, &tail(r));
     }
 
+    // Returns a new array with the values of a followed by values [start,end) of b.
+    // Assumes start and end are absolute.
+    static A* concat(A* a, A* b, uint32 start, uint32 end) {
+      if (start == end) {
+        return copy(a);
+      }
+      if (a->_start == a->_end) {
+        return sliceTree(b, start, end);
+      }
+      if (end - start <= BRANCHES || start >= tailoff(b)) {
+        // few enough values to just push them
+        ref<TA> t = createTransient(a, esize(b));
+        tpushAll(t, b, start, end);
+        return createPersistent(t);
+      }
+      ref<A> l = a->_start ? sliceTree(a, a->_start, a->_end) : a;
+      ref<A> r = (start || end != b->_end) ? sliceTree(b, start, end) : b;
+      return concatTrees(l, r);
+    }
   
   }; // detail
   
   
-  ref<Object>* ArrayImp::slotsFor(A* a, uint32 i, uint32& length) {
-    N* n = detail::uncheckedSlotsFor(a, i);
+  ref<Object>* ArrayImp::slotsFor(A* a, uint32 i, uint32& base, uint32& length) {
+    N* n = detail::leafFor(a, i, base);
     length = n->length;
     return n->_v;
   }
   
-  ref<Object>* ArrayImp::slotsFor(TA* a, uint32 i, uint32& length) {
-    N* n = detail::uncheckedSlotsFor(a, i);
-    length = n->length;
+  ref<Object>* ArrayImp::slotsFor(TA* a, uint32 i, uint32& base, uint32& length) {
+    N* n = detail::leafFor(a, i, base);
+    // the tail of a transient has room for more values than it holds
+    length = (n == &detail::tail(a)) ? a->_end - base : n->length;
     return n->_v;
   }
 
   
-  Object* ArrayImp::findValue(A* a, uint32 i) {
-    N* n = detail::checkedSlotsFor(a, i);
-    const auto k = i & MASK;
-    if (n && k < n->length) {
-      return n->slot(k);
-    }
-    return nullptr; // empty branch or index out-of bounds
-  }
-  
-  Object* ArrayImp::findValue(TA* a, uint32 i) {
-    N* n = detail::checkedSlotsFor(a, i);
-    const auto k = i & MASK;
-    if (n && k < n->length) {
-      return n->slot(k);
-    }
-    return nullptr; // empty branch or index out-of bounds
-  }
-  
-  
-  Object* ArrayImp::getValue(A* a, uint32 i) {
-    Object* val = detail::uncheckedSlotsFor(a, i)->slot(i & MASK);
-    ImmutableAssertTypeTag(val, A::ValueT::TYPE_TAG);
-    return val;
-  }
-  
-  Object* ArrayImp::getValue(TA* a, uint32 i) {
-    Object* val = detail::uncheckedSlotsFor(a, i)->slot(i & MASK);
-    ImmutableAssertTypeTag(val, A::ValueT::TYPE_TAG);
-    return val;
-  }
-  
-  
-  Object* ArrayImp::firstValue(A* a) {
-    return detail::firstValue(a);
+  ArrayImp::A* ArrayImp::set(A* a, uint32 i, const void* v, uint32 esize) {
+    return detail::set(a, i, LeafValue{v, esize});
   }
   
-  Object* ArrayImp::firstValue(TA* a) {
-    return detail::firstValue(a);
-  }
-  
-  
-  ArrayImp::A* ArrayImp::set(A* a, uint32 i, Object* obj) {
-    return detail::set(a, i, obj);
-  }
-  
-  ArrayImp::A* ArrayImp::push(A* a, Object* obj) {
-    return detail::push(a, obj);
+  ArrayImp::A* ArrayImp::push(A* a, const void* v, uint32 esize) {
+    return detail::push(a, LeafValue{v, esize});
   }
   
   ArrayImp::A* ArrayImp::pop(A* a) {
@@ -638,6 +1263,18 @@ namespace immutable {
   ArrayImp::TA* ArrayImp::pop(TA* a) {
     return detail::tpop(a);
   }
+
+
+  ArrayImp::A* ArrayImp::concat(A* a, A* b) {
+    // [1 2 3] concat([4 5]) => [1 2 3 4 5]
+    if (b->_start == b->_end) {
+      return a;
+    }
+    if (a->_start == a->_end) {
+      return b;
+    }
+    return detail::concat(a, b, b->_start, b->_end);
+  }
   
   
   ArrayImp::A* ArrayImp::slice(A* a, uint32 start, uint32 end) {
@@ -656,23 +1293,28 @@ namespace immutable {
     if (end == a->_end && end - start >= a->size()/2) {
       // [1 2 3 4 5] slice(2,END) => [3 4 5]
       // optimization where we return a with just a start offset, referencing
-      // the same underlying data; root and tail are simply retained.
-      // TODO: find a way to release inaccessible values. We can't simply release them
-      //       here, because they are owned by root and tail, which are shared.
-      return new A(start, end, a->_shift, a->_root, a->_tail);
+      // the same underlying data.
+      return detail::sliceSuffix(a, start);
     }
     // [1 2 3 4 5] slice(1,4) => [2 3 4]
     // because we rely on _end to be the true end of the underlying data (for push'ing),
-    // we need to build a new array when the slice ends before _end.
-    // We effectively create a new array with items in range [start,end) of a.
-    auto t = createTransient(&EMPTY);
-    detail::tpushAll(t, a, start, end); // add [start,end) from a onto b
-    a = createPersistent(t);
-    t->release();
-    return a;
+    // we need to build a new array when the slice ends before _end. The new array
+    // shares all nodes of a that are fully inside [start,end), so this is O(log n).
+    return detail::sliceTree(a, start, end);
   }
   
   
+  ArrayImp::A* ArrayImp::compact(A* a) {
+    if (a->_start == 0) {
+      return a;
+    }
+    if (a->_start == a->_end) {
+      return &EMPTY;
+    }
+    return detail::sliceTree(a, a->_start, a->_end);
+  }
+
+
   ArrayImp::A* ArrayImp::without(A* a, uint32 start, uint32 end) {
     // Note: assumed start and end are absolute
     if (!detail::isOutOfBounds(a, start, end)) {
@@ -695,29 +1337,22 @@ namespace immutable {
       return slice(a, a->_start, start);
     }
     // [1 2 3 4 5] without(2,4) => [1 2 5]
-    // TODO: something more efficient
     ref<A> left = slice(a, a->_start, start); // [1 2]
-    auto t = createTransient(left);
-    detail::tpushAll(t, a, end, a->_end);
-    a = createPersistent(t);
-    t->release();
-    return a;
+    return detail::concat(left, a, end, a->_end);
   }
 
 
-  ArrayImp::A* ArrayImp::cons(A* a, Object* val) {
+  ArrayImp::A* ArrayImp::cons(A* a, const void* v, uint32 esize) {
     // [1 2 3] cons(0) => [0 1 2 3]
-    // TODO: something more efficient
-    auto t = createTransient(&EMPTY);
-    detail::tpush(t, val);
-    detail::tpushAll(t, a, a->_start, a->_end);
-    a = createPersistent(t);
-    t->release();
-    return a;
+    N* leaf = N::create(1, NO_EDIT, esize);
+    leaf->store(0, LeafValue{v, esize});
+    ref<A> head = new A(0, 1, BITS, EMPTY._root, leaf);
+    return detail::concat(head, a, a->_start, a->_end);
   }
   
   
-  ArrayImp::A* ArrayImp::splice(A* a, uint32 start, uint32 end, A::Iterator& it) {
+  ArrayImp::A* ArrayImp::splice(A* a, uint32 start, uint32 end, A::Iterator& it)
+  {
     // Note: assumed start and end are absolute
     if (!detail::isOutOfBounds(a, start, end)) {
       return nullptr;
@@ -743,23 +1378,18 @@ namespace immutable {
     // case: start > 0 && end < size
     // [1 2 3 4 5] splice(2,4, [6 7]) => [1 2 6 7 5]
     
-    auto t = createTransient(&EMPTY);
-    // add head, e.g. [1 2]
-    detail::tpushAll(t, a, a->_start, start);
+    // head, e.g. [1 2]
+    ref<A> b = slice(a, a->_start, start);
     // add new items, e.g. [1 2 6 7]
-    while (it != END_ITERATOR) {
-      detail::tpush(t, it.value());
-      ++it;
-    }
+    b = detail::pushAllIt(b, it);
     // add tail, e.g. [1 2 6 7 5]
-    detail::tpushAll(t, a, end, a->_end);
-    a = createPersistent(t);
-    t->release();
-    return a;
+    return detail::concat(b, a, end, a->_end);
   }
   
   
-  ArrayImp::A* ArrayImp::splicefn(A* a, uint32 start, uint32 end, const ItFunc& next) {
+  ArrayImp::A* ArrayImp::splicefn(
+    A* a, uint32 start, uint32 end, const ItFunc& next, uint32 esize)
+  {
     // Note: assumed start and end are absolute
     if (!detail::isOutOfBounds(a, start, end)) {
       return nullptr;
@@ -767,54 +1397,706 @@ namespace immutable {
     if (start == a->_start) {
       if (end == a->_end) {
         // [1 2 3 4 5] splice(0,5, [6 7]) => [6 7]
-        return detail::pushAllFn(&ArrayImp::EMPTY, next);
+        return detail::pushAllFn(&ArrayImp::EMPTY, next, esize);
       }
       // [1 2 3 4 5] splice(0,3, [6 7]) => [4 5 6 7]
       ref<A> b = slice(a, end, a->_end);
-      return detail::pushAllFn(b, next);
+      return detail::pushAllFn(b, next, esize);
     }
     if (end == a->_end) { // start != 0 && start != end
       if (start == end) {
         // [1 2 3 4 5] splice(5,5, [6 7]) => [1 2 3 4 5 6 7]
-        return detail::pushAllFn(a, next);
+        return detail::pushAllFn(a, next, esize);
       }
       // [1 2 3 4 5] splice(2,5, [6 7]) => [1 2 6 7]
       ref<A> b = slice(a, a->_start, start);
-      return detail::pushAllFn(b, next);
+      return detail::pushAllFn(b, next, esize);
     }
     // case: start > 0 && end < size
     // [1 2 3 4 5] splice(2,4, [6 7]) => [1 2 6 7 5]
 
-    auto t = createTransient(&EMPTY);
-    // add head, e.g. [1 2]
-    detail::tpushAll(t, a, a->_start, start);
+    // head, e.g. [1 2]
+    ref<A> b = slice(a, a->_start, start);
     // add new items, e.g. [1 2 6 7]
-    A::ValueT* vptr;
-    while ((vptr = next())) {
-      detail::tpush(t, vptr);
-    }
+    b = detail::pushAllFn(b, next, esize);
     // add tail, e.g. [1 2 6 7 5]
-    detail::tpushAll(t, a, end, a->_end);
-    a = createPersistent(t);
-    t->release();
-    return a;
+    return detail::concat(b, a, end, a->_end);
   }
   
   
-  ArrayImp::TA* ArrayImp::createTransient(A* a) {
+  // Leaves processed per thread by parallel operations must be at least this many,
+  // as starting a thread costs about as much as filling this many leaves.
+  static constexpr uint32 PARALLEL_MIN_LEAVES_PER_THREAD = 1024;
+
+  // Number of threads to use for processing nleaves leaves, when the caller asked for
+  // `threads` threads, or one per CPU when threads is 0.
+  static uint32 threadsFor(uint32 threads, uint32 nleaves) {
+#ifdef IMMUTABLE_SINGLE_THREADED
+    // reference counts are not thread-safe
+    (void)threads; (void)nleaves;
+    return 1;
+#else
+    if (threads == 0) {
+      threads = max(1u, std::thread::hardware_concurrency());
+    }
+    return min(threads, max(1u, nleaves / PARALLEL_MIN_LEAVES_PER_THREAD));
+#endif
+  }
+
+  // Calls f(begin, end) for `threads` contiguous ranges which together cover [0,n),
+  // each on its own thread. The calling thread handles the first range.
+  template <typename F>
+  static void parallelFor(uint32 n, uint32 threads, const F& f) {
+    if (threads <= 1) {
+      f(0, n);
+      return;
+    }
+    std::vector<std::thread> workers;
+    uint32 chunk = n / threads;
+    for (uint32 t = 1; t < threads; ++t) {
+      uint32 end = t + 1 == threads ? n : (t + 1) * chunk;
+      workers.emplace_back(f, t * chunk, end);
+    }
+    f(0, chunk);
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+
+  // Assembles the branches above n full leaves level by level, until there's a single
+  // root, which is returned along with its shift. Like the ones made by push, branches
+  // have BRANCHES slots, with unused ones being null. nodes is used as scratch space.
+  static N* buildBranches(N** nodes, uint32 n, uint32& shift) {
+    // Note: nodes[p] is only written after nodes[p * BRANCHES] has been read.
+    shift = ArrayImp::BITS;
+    while (true) {
+      uint32 nparents = (n + ArrayImp::MASK) >> ArrayImp::BITS;
+      for (uint32 p = 0; p < nparents; ++p) {
+        N* branch = N::create(BRANCHES, NO_EDIT);
+        uint32 end = min(n, (p + 1) << ArrayImp::BITS);
+        for (uint32 i = p << ArrayImp::BITS; i < end; ++i) {
+          branch->slot(i & ArrayImp::MASK) = nodes[i];
+        }
+        nodes[p] = branch;
+      }
+      if (nparents == 1) {
+        return nodes[0];
+      }
+      n = nparents;
+      shift += ArrayImp::BITS;
+    }
+  }
+
+  ArrayImp::A* ArrayImp::build(uint32 count, const FillFunc& fill, uint32 esize, uint32 threads) {
+    if (count == 0) {
+      return &EMPTY;
+    }
+    // Like with push, the tail holds the last 1-32 values and the tree holds the rest
+    // in full leaves.
+    uint32 tailoff = ((count - 1) >> BITS) << BITS;
+    N* tail = N::create(count - tailoff, NO_EDIT, esize);
+    fill(&tail->slot(0), tailoff, count - tailoff);
+    uint32 nleaves = tailoff >> BITS;
+    if (nleaves == 0) {
+      return new A(0, count, BITS, EMPTY._root, tail);
+    }
+
+    // Note: nodes have a zero refcount until referenced by their parent
+    std::vector<N*> nodes(nleaves);
+    auto fillLeaves = [&] (uint32 begin, uint32 end) {
+      for (uint32 i = begin; i < end; ++i) {
+        N* leaf = N::create(BRANCHES, NO_EDIT, esize);
+        fill(&leaf->slot(0), i << BITS, BRANCHES);
+        nodes[i] = leaf;
+      }
+    };
+    parallelFor(nleaves, threadsFor(threads, nleaves), fillLeaves);
+
+    uint32 shift;
+    N* root = buildBranches(nodes.data(), nleaves, shift);
+    return new A(0, count, shift, root, tail);
+  }
+
+
+  // Maps the values of a subtree into a new subtree with the same structure. When
+  // `mapped` is set, the subtrees at splitLevel have already been mapped and are taken
+  // from it in order instead.
+  struct TrieMapper {
+    const ArrayImp::MapFunc& f;
+    uint32 esize;
+    N**    mapped;
+    uint32 splitLevel;
+
+    N* map(const N* node, uint32 level) {
+      if (mapped && level == splitLevel) {
+        return *mapped++;
+      }
+      if (level == 0) {
+        N* leaf = N::create(node->length, NO_EDIT, esize);
+        f(&leaf->slot(0), const_cast<ref<Object>*>(&node->slot(0)), node->length);
+        return leaf;
+      }
+      N* n;
+      if (node->relaxed) {
+        n = N::createRelaxed(node->length, NO_EDIT);
+        memcpy(n->sizes(), node->sizes(), node->length * sizeof(uint32));
+      } else {
+        n = N::create(node->length, NO_EDIT);
+      }
+      for (uint32 i = 0; i < node->length; ++i) {
+        if (node->slot(i)) {
+          n->slot(i) = map(node->child(i), level - ArrayImp::BITS);
+        }
+      }
+      return n;
+    }
+  };
+
+  ArrayImp::A* ArrayImp::map(A* a, const MapFunc& f, uint32 esize, uint32 threads) {
+    ref<A> src = compact(a);
+    if (src->_end == 0) {
+      return &EMPTY;
+    }
+    const N* root = (const N*)src->_root.ptr();
+    TrieMapper mapper{f, esize, nullptr, 0};
+    N* tail = mapper.map((const N*)src->_tail.ptr(), 0);
+    threads = threadsFor(threads, src->_end >> BITS);
+    if (threads == 1) {
+      return new A(0, src->_end, src->_shift, mapper.map(root, src->_shift), tail);
+    }
+
+    // Split the tree at the highest level with at least one subtree per thread, map
+    // those subtrees in parallel, and then the branches above them.
+    std::vector<const N*> subtrees{root};
+    uint32 level = src->_shift;
+    while (subtrees.size() < threads && level > 0) {
+      std::vector<const N*> children;
+      for (const N* n : subtrees) {
+        for (uint32 i = 0; i < n->length; ++i) {
+          if (n->slot(i)) {
+            children.push_back(n->child(i));
+          }
+        }
+      }
+      subtrees.swap(children);
+      level -= BITS;
+    }
+    std::vector<N*> mapped(subtrees.size());
+    threads = min(threads, uint32(subtrees.size()));
+    parallelFor(uint32(subtrees.size()), threads, [&] (uint32 begin, uint32 end) {
+      TrieMapper m{f, esize, nullptr, 0};
+      for (uint32 i = begin; i < end; ++i) {
+        mapped[i] = m.map(subtrees[i], level);
+      }
+    });
+    mapper.mapped = mapped.data();
+    mapper.splitLevel = level;
+    return new A(0, src->_end, src->_shift, mapper.map(root, src->_shift), tail);
+  }
+
+
+  // Walks the leaves of a subtree which hold values in [start, end), in order.
+  // Indexes are relative to the first value of the subtree.
+  struct LeafWalker {
+    const ArrayImp::PartFunc& f;
+    uint32 part;
+
+    void walk(const N* node, uint32 level, uint32 start, uint32 end) {
+      if (level == 0) {
+        f(part, const_cast<ref<Object>*>(&node->slot(0)), start, min(end, node->length));
+        return;
+      }
+      uint32 childStart = 0;
+      for (uint32 i = 0; i < node->length && childStart < end; ++i) {
+        uint32 childEnd = ArrayImp::detail::childEnd(*node, level, i, end);
+        if (start < childEnd && node->slot(i)) {
+          walk(node->child(i), level - ArrayImp::BITS,
+               start > childStart ? start - childStart : 0, childEnd - childStart);
+        }
+        childStart = childEnd;
+      }
+    }
+  };
+
+  uint32 ArrayImp::parallelThreads(A* a, uint32 threads) {
+    return threadsFor(threads, a->size() >> BITS);
+  }
+
+  void ArrayImp::forEachLeaf(A* a, uint32 start, uint32 end, uint32 parts, const PartFunc& f) {
+    if (start >= end) {
+      return;
+    }
+    uint32 to = detail::tailoff(a);
+    const N* root = &detail::root(a);
+    if (parts <= 1 || start >= to) {
+      if (start < to) {
+        LeafWalker{f, 0}.walk(root, a->_shift, start, min(end, to));
+      }
+      if (end > to) {
+        f(0, &detail::tail(a).slot(0), start > to ? start - to : 0, end - to);
+      }
+      return;
+    }
+
+    // Find the start of the subtrees which hold values in [start, end) at the highest
+    // level with at least one subtree per part. Each part is then made up of a
+    // contiguous run of those subtrees.
+    std::vector<std::pair<const N*,uint32>> subtrees{{root, 0}}; // (node, first index)
+    std::vector<uint32> bounds;
+    uint32 level = a->_shift;
+    while (subtrees.size() < parts && level > 0) {
+      std::vector<std::pair<const N*,uint32>> children;
+      for (auto& st : subtrees) {
+        const N* n = st.first;
+        uint32 childStart = st.second;
+        for (uint32 i = 0; i < n->length && childStart < end; ++i) {
+          uint32 childEnd = st.second + detail::childEnd(*n, level, i, end - st.second);
+          if (start < childEnd && n->slot(i)) {
+            children.emplace_back(n->child(i), childStart);
+          }
+          childStart = childEnd;
+        }
+      }
+      subtrees.swap(children);
+      level -= BITS;
+    }
+    parts = min(parts, uint32(subtrees.size()));
+    uint32 chunk = uint32(subtrees.size()) / parts;
+    for (uint32 p = 0; p < parts; ++p) {
+      bounds.push_back(p == 0 ? start : subtrees[p * chunk].second);
+    }
+    bounds.push_back(end);
+
+    // the tail goes with the last part
+    parallelFor(parts, parts, [&] (uint32 begin, uint32 endp) {
+      for (uint32 p = begin; p < endp; ++p) {
+        uint32 pstart = bounds[p];
+        uint32 pend = bounds[p + 1];
+        if (pstart < to) {
+          LeafWalker{f, p}.walk(root, a->_shift, pstart, min(pend, to));
+        }
+        if (pend > to) {
+          f(p, &detail::tail(a).slot(0), pstart > to ? pstart - to : 0, pend - to);
+        }
+      }
+    });
+  }
+
+
+  // Finds the values which differ between two arrays, skipping leaves and subtrees
+  // which the arrays share. With an emit function, each range of differing values is
+  // passed to it, otherwise the search stops at the first difference.
+  struct DiffFinder {
+    A*     a;
+    A*     b;
+    uint32 astart, ashift; // a->_start, a->_shift
+    uint32 bstart, bshift; // b->_start, b->_shift
+    const ArrayImp::MismatchFunc& f;
+    const ArrayImp::RangeFunc*    emit;
+    uint32 first = 0;                 // first difference when emit is null
+    uint32 runStart = 0, runEnd = 0;  // differing values not yet emitted
+
+    // Compares n values at ak and bk in the slots as and bs, which hold the values
+    // from index i. Returns true to stop the search.
+    bool compare(ref<Object>* as, uint32 ak, ref<Object>* bs, uint32 bk, uint32 i, uint32 n) {
+      uint32 k = 0;
+      while ((k += f(as, ak + k, bs, bk + k, n - k)) < n) {
+        if (!emit) {
+          first = i + k;
+          return true;
+        }
+        uint32 e = k + 1;
+        while (e < n && f(as, ak + e, bs, bk + e, 1) == 0) {
+          ++e;
+        }
+        if (runStart == runEnd || runEnd != i + k) {
+          flush();
+          runStart = i + k;
+        }
+        runEnd = i + e;
+        k = e;
+      }
+      return false;
+    }
+
+    void flush() {
+      if (runStart < runEnd) {
+        (*emit)(runStart, runEnd);
+      }
+      runStart = runEnd;
+    }
+
+    // Compares the values [start, end) leaf by leaf, where a leaf which holds the
+    // same values at the same offset in both arrays is skipped.
+    // Indexes are relative to the start of the arrays.
+    bool leaves(uint32 start, uint32 end) {
+      uint32 i = start;
+      while (i < end) {
+        uint32 abase, alen, bbase, blen;
+        ref<Object>* as = ArrayImp::slotsFor(a, astart + i, abase, alen);
+        ref<Object>* bs = ArrayImp::slotsFor(b, bstart + i, bbase, blen);
+        uint32 ak = astart + i - abase;
+        uint32 bk = bstart + i - bbase;
+        uint32 n = min(min(alen - ak, blen - bk), end - i);
+        if ((as != bs || ak != bk) && compare(as, ak, bs, bk, i, n)) {
+          return true;
+        }
+        i += n;
+      }
+      return false;
+    }
+
+    // Compares the values [start, end) of subtrees x and y, which both hold values
+    // from the absolute index base. Children which hold the same indexes are compared
+    // in turn, and once the children of x and y are split differently, the remaining
+    // values are compared leaf by leaf.
+    bool walk(const N* x, const N* y, uint32 level, uint32 base, uint32 start, uint32 end) {
+      if (x == y) {
+        return false;
+      }
+      if (level == 0) {
+        return compare(const_cast<ref<Object>*>(&x->slot(0)), start,
+                       const_cast<ref<Object>*>(&y->slot(0)), start,
+                       base + start - astart, end - start);
+      }
+      uint32 childStart = 0;
+      for (uint32 i = 0; childStart < end; ++i) {
+        if (i >= x->length || i >= y->length || !x->slot(i) || !y->slot(i)) {
+          break;
+        }
+        uint32 xend = ArrayImp::detail::childEnd(*x, level, i, end);
+        uint32 yend = ArrayImp::detail::childEnd(*y, level, i, end);
+        uint32 childEnd = min(xend, yend);
+        if (start < childEnd && walk(x->child(i), y->child(i), level - ArrayImp::BITS,
+                                     base + childStart,
+                                     start > childStart ? start - childStart : 0,
+                                     childEnd - childStart))
+        {
+          return true;
+        }
+        if (xend != yend) {
+          childStart = childEnd;
+          break;
+        }
+        childStart = xend;
+      }
+      if (childStart < end) {
+        uint32 from = base + max(start, childStart) - astart;
+        return leaves(from, base + end - astart);
+      }
+      return false;
+    }
+
+    // Compares the values [0, n)
+    void run(uint32 n) {
+      uint32 end = astart; // end of the values compared by walk
+      if (astart == bstart) {
+        // Nodes at the same position of the tries hold the same indexes. The root of
+        // the taller trie holds the other trie's indexes in its first subtree.
+        const N* x = &ArrayImp::detail::root(a);
+        const N* y = &ArrayImp::detail::root(b);
+        uint32 xlevel = ashift;
+        uint32 ylevel = bshift;
+        end = min(min(ArrayImp::detail::tailoff(a), ArrayImp::detail::tailoff(b)), astart + n);
+        while (astart < end && xlevel > ylevel) {
+          end = min(end, x->relaxed ? x->sizes()[0] : 1u << xlevel);
+          x = x->child(0);
+          xlevel -= ArrayImp::BITS;
+        }
+        while (astart < end && ylevel > xlevel) {
+          end = min(end, y->relaxed ? y->sizes()[0] : 1u << ylevel);
+          y = y->child(0);
+          ylevel -= ArrayImp::BITS;
+        }
+        if (astart < end && walk(x, y, xlevel, 0, astart, end)) {
+          return;
+        }
+        end = max(end, astart);
+      }
+      if (leaves(end - astart, n)) {
+        return;
+      }
+      first = n;
+    }
+  };
+
+  uint32 ArrayImp::mismatch(A* a, A* b, uint32 n, const MismatchFunc& f) {
+    DiffFinder d{a, b, a->_start, a->_shift, b->_start, b->_shift, f, nullptr};
+    d.run(n);
+    return d.first;
+  }
+
+  void ArrayImp::diff(A* a, A* b, uint32 n, const MismatchFunc& f, const RangeFunc& emit) {
+    DiffFinder d{a, b, a->_start, a->_shift, b->_start, b->_shift, f, &emit};
+    d.run(n);
+    d.flush();
+  }
+
+
+  // Returns HASH_P to the power of n
+  static uint64 hashPow(uint32 n) {
+    uint64 p = 1;
+    uint64 b = ArrayImp::HASH_P;
+    for (; n; n >>= 1) {
+      if (n & 1) {
+        p *= b;
+      }
+      b *= b;
+    }
+    return p;
+  }
+
+  // Computes the hash of a range of values from the hashes of the leaves and subtrees
+  // which hold them. As the hash of a sequence is a polynomial of the hashes of its
+  // values (see ArrayImp::hash), the hash of values [start, end) of a subtree is
+  // hash([start, mid)) * HASH_P^(end - mid) + hash([mid, end)), for any mid.
+  struct Hasher {
+    const ArrayImp::HashFunc& f;
+
+    // Hash of the values [start, end) of a subtree which holds count values
+    uint64 range(const N* node, uint32 level, uint32 start, uint32 end, uint32 count) {
+      if (start == 0 && end == count) {
+        return full(node, level, count);
+      }
+      if (level == 0) {
+        return f(const_cast<ref<Object>*>(&node->slot(0)), start, end - start);
+      }
+      uint64 h = 0;
+      uint32 childStart = 0;
+      for (uint32 i = 0; i < node->length && childStart < end; ++i) {
+        uint32 childEnd = ArrayImp::detail::childEnd(*node, level, i, count);
+        if (start < childEnd) {
+          uint32 s = max(start, childStart);
+          uint32 e = min(end, childEnd);
+          h = h * hashPow(e - s) + range(node->child(i), level - ArrayImp::BITS,
+                                         s - childStart, e - childStart, childEnd - childStart);
+        }
+        childStart = childEnd;
+      }
+      return h;
+    }
+
+    // Hash of all values of a subtree which holds count values. Cached in the node.
+    // Note: nodes are never modified once they are part of a persistent array, and
+    // concurrent callers compute and store the same hash.
+    uint64 full(const N* node, uint32 level, uint32 count) {
+      N* n = const_cast<N*>(node);
+      uint64 h = __atomic_load_n(&n->hash, __ATOMIC_RELAXED);
+      if (h != 0 || count == 0) {
+        return h;
+      }
+      if (level == 0) {
+        h = f(&n->slot(0), 0, count);
+        if (count != n->length) {
+          return h; // the node holds other values too
+        }
+      } else {
+        uint64 fullPow = hashPow(1u << level); // of strict children
+        uint32 childStart = 0;
+        for (uint32 i = 0; i < n->length && childStart < count; ++i) {
+          uint32 childEnd = ArrayImp::detail::childEnd(*n, level, i, count);
+          uint32 len = childEnd - childStart;
+          h = h * (!n->relaxed && len == (1u << level) ? fullPow : hashPow(len)) +
+              full(n->child(i), level - ArrayImp::BITS, len);
+          childStart = childEnd;
+        }
+      }
+      __atomic_store_n(&n->hash, h, __ATOMIC_RELAXED);
+      return h;
+    }
+  };
+
+  uint64 ArrayImp::hash(A* a, const HashFunc& f) {
+    Hasher hasher{f};
+    uint32 to = detail::tailoff(a);
+    uint64 h = 0;
+    if (a->_start < to) {
+      h = hasher.range(&detail::root(a), a->_shift, a->_start, min(a->_end, to), to);
+    }
+    if (a->_end > to) {
+      uint32 start = a->_start > to ? a->_start - to : 0;
+      N& tail = detail::tail(a);
+      h = h * hashPow(a->_end - to - start) +
+          hasher.range(&tail, 0, start, a->_end - to, tail.length);
+    }
+    return h;
+  }
+
+
+  static uint32 equalBytesScalar(const uint8* a, const uint8* b, uint32 i, uint32 n) {
+    for (; i + 8 <= n; i += 8) {
+      uint64 x, y;
+      memcpy(&x, a + i, 8);
+      memcpy(&y, b + i, 8);
+      if (x != y) {
+        break;
+      }
+    }
+    while (i < n && a[i] == b[i]) {
+      ++i;
+    }
+    return i;
+  }
+
+#if IMMUTABLE_TARGET_ARCH_X64
+
+  static uint32 equalBytesSSE2(const uint8* a, const uint8* b, uint32 i, uint32 n) {
+    for (; i + 16 <= n; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+      uint32 ne = ~uint32(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) & 0xffff;
+      if (ne) {
+        return i + __builtin_ctz(ne);
+      }
+    }
+    return equalBytesScalar(a, b, i, n);
+  }
+
+  __attribute__((target("avx2")))
+  static uint32 equalBytesAVX2(const uint8* a, const uint8* b, uint32 n) {
+    uint32 i = 0;
+    for (; i + 32 <= n; i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+      __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+      uint32 ne = ~uint32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+      if (ne) {
+        return i + __builtin_ctz(ne);
+      }
+    }
+    return equalBytesSSE2(a, b, i, n);
+  }
+
+  uint32 ArrayImp::equalBytes(const void* a, const void* b, uint32 n) {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? equalBytesAVX2((const uint8*)a, (const uint8*)b, n) :
+                  equalBytesSSE2((const uint8*)a, (const uint8*)b, 0, n);
+  }
+
+#elif IMMUTABLE_TARGET_ARCH_ARM64
+
+  uint32 ArrayImp::equalBytes(const void* a, const void* b, uint32 n) {
+    auto pa = (const uint8*)a;
+    auto pb = (const uint8*)b;
+    uint32 i = 0;
+    for (; i + 16 <= n; i += 16) {
+      // the difference is located by equalBytesScalar
+      if (vminvq_u8(vceqq_u8(vld1q_u8(pa + i), vld1q_u8(pb + i))) != 0xff) {
+        break;
+      }
+    }
+    return equalBytesScalar(pa, pb, i, n);
+  }
+
+#else
+
+  uint32 ArrayImp::equalBytes(const void* a, const void* b, uint32 n) {
+    return equalBytesScalar((const uint8*)a, (const uint8*)b, 0, n);
+  }
+
+#endif
+
+
+  void ArrayImp::reserve(Builder& b, uint32 n) {
+    b.reserved = n;
+    uint32 nleaves = n ? (n - 1) >> BITS : 0; // the last leaf becomes the tail
+    if (nleaves > b.cap) {
+      b.leaves = (N**)realloc(b.leaves, nleaves * sizeof(N*));
+      b.cap = nleaves;
+    }
+  }
+
+
+  void ArrayImp::nextLeaf(Builder& b) {
+    uint32 count = b.nleaves << BITS; // number of values in full leaves
+    if (b.leaf) {
+      if (b.len < BRANCHES) {
+        // More values than reserved are being added, so the leaf meant to be the tail
+        // is too short. Replace it with a full-size copy.
+        N* leaf = b.leaf->copy(BRANCHES, NO_EDIT);
+        b.leaf->dealloc();
+        b.leaf = leaf;
+        b.len = BRANCHES;
+        b.slots = &leaf->slot(0);
+        return;
+      }
+      if (b.nleaves == b.cap) {
+        b.cap = max(uint32(8), b.cap * 2);
+        b.leaves = (N**)realloc(b.leaves, b.cap * sizeof(N*));
+      }
+      b.leaves[b.nleaves++] = b.leaf;
+      count += BRANCHES;
+    }
+    // The last leaf of a reserved number of values gets exactly as many slots as
+    // needed, so that it can be used as the tail without being copied.
+    uint32 len = BRANCHES;
+    if (b.reserved > count && b.reserved - count < BRANCHES) {
+      len = b.reserved - count;
+    }
+    b.leaf = N::create(len, NO_EDIT, b.esize);
+    b.len = len;
+    b.n = 0;
+    b.slots = &b.leaf->slot(0);
+  }
+
+
+  ArrayImp::A* ArrayImp::build(Builder& b) {
+    if (!b.leaf) {
+      return &EMPTY;
+    }
+    // Like with push, the tail holds the last 1-32 values and the tree holds the rest
+    uint32 count = (b.nleaves << BITS) + b.n;
+    N* tail = b.leaf;
+    if (b.n < b.len) {
+      tail = b.leaf->copy(b.n, NO_EDIT);
+      b.leaf->dealloc();
+    }
+    N* root = (N*)EMPTY._root.ptr();
+    uint32 shift = BITS;
+    if (b.nleaves) {
+      root = buildBranches(b.leaves, b.nleaves, shift);
+    }
+    b.leaf = nullptr;
+    b.slots = nullptr;
+    b.n = b.len = b.reserved = b.nleaves = 0;
+    return new A(0, count, shift, root, tail);
+  }
+
+
+  void ArrayImp::clear(Builder& b) {
+    for (uint32 i = 0; i < b.nleaves; ++i) {
+      b.leaves[i]->dealloc();
+    }
+    if (b.leaf) {
+      b.leaf->dealloc();
+    }
+    b.leaf = nullptr;
+    b.slots = nullptr;
+    b.n = b.len = b.reserved = b.nleaves = 0;
+  }
+
+
+  void ArrayImp::destroy(Builder& b) {
+    clear(b);
+    free(b.leaves);
+    b.leaves = nullptr;
+    b.cap = 0;
+  }
+
+
+  ArrayImp::TA* ArrayImp::createTransient(A* a, uint32 esize) {
     N* root = (N*)a->_root.ptr();
-    N* editableRoot = root->copy(root->length, std::this_thread::get_id());
-    N* editableTail = ((N*)a->_tail.ptr())->copy(BRANCHES, editableRoot->edit);
+    N* editableRoot = root->copy(root->length, newEditID());
+    N* editableTail = ((N*)a->_tail.ptr())->copy(BRANCHES, editableRoot->edit, esize);
     return new TA(a->_start, a->_end, a->_shift, editableRoot, editableTail);
   }
 
   
-  ArrayImp::TA* ArrayImp::set(TA* a, uint32 i, Object* obj) {
-    return detail::tset(a, i, obj);
+  ArrayImp::TA* ArrayImp::set(TA* a, uint32 i, const void* v, uint32 esize) {
+    return detail::tset(a, i, LeafValue{v, esize});
   }
   
-  ArrayImp::TA* ArrayImp::push(TA* a, Object* obj) {
-    return detail::tpush(a, obj);
+  ArrayImp::TA* ArrayImp::push(TA* a, const void* v, uint32 esize) {
+    return detail::tpush(a, LeafValue{v, esize});
   }
   
   
@@ -865,6 +2147,7 @@ namespace immutable {
   ArrayImp::N ArrayImp::EMPTY_NODE(empty_initializer(), 0);
 
   ArrayImp::A ArrayImp::EMPTY(EMPTY_ROOT, &EMPTY_NODE);
+  ArrayImp::A* const ArrayImp::EMPTY_PTR = &EMPTY;
   
   A::Iterator ArrayImp::END_ITERATOR(nullptr);
   
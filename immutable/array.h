@@ -1,12 +1,45 @@
 #pragma once
 #include "base.h"
 #include <iterator>
+#include <type_traits>
+#include <vector>
 
 namespace immutable {
   struct ArrayImp;
   template <typename T> struct TransientArray;
-  static constexpr uint32 END = 0xffffffff;
-  
+  template <typename T> struct ArrayBuilder;
+  template <typename T> struct ArrayChunk;
+  template <typename T, bool Unboxed> struct ArrayStorage;
+
+
+  // Decides if values of type T are stored "unboxed", directly inside leaf nodes,
+  // or "boxed" in individually-allocated Value<T> objects referenced by leaf nodes.
+  // Small trivially-copyable types are unboxed by default. Specialize to override, e.g.
+  //   template <> struct ArrayUnboxed<MyPOD> : std::false_type {};
+  template <typename T> struct ArrayUnboxed : std::integral_constant<bool,
+    std::is_trivially_copyable<T>::value &&
+    sizeof(T) <= sizeof(void*) * 2 &&
+    alignof(T) <= alignof(void*)
+  > {};
+
+  // Type of values produced by a function F called with values of type T, e.g. by map
+  template <typename T, typename F>
+  using ArrayMapResult = typename std::decay<
+    decltype(std::declval<F&>()(std::declval<const T&>()))>::type;
+
+  // A range of indexes [start, end) at which two arrays differ (see Array::diff).
+  // CHANGED ranges hold different values in both arrays, ADDED ranges only exist in
+  // the other array and REMOVED ranges only exist in the first array.
+  struct ArrayDiff {
+    enum Kind : uint8 { CHANGED, ADDED, REMOVED };
+    Kind   kind;
+    uint32 start;
+    uint32 end;
+    bool operator==(const ArrayDiff& rhs) const {
+      return kind == rhs.kind && start == rhs.start && end == rhs.end;
+    }
+  };
+
 
   // Persistent array (aka vector aka random-access list)
   template <typename T>
@@ -14,6 +47,10 @@ namespace immutable {
     using ValueT = Value<T>;
     using TransientArrayT = TransientArray<T>;
     struct Iterator;
+    struct ReverseIterator;
+
+    // True if values are stored inline in leaf nodes (see ArrayUnboxed)
+    static constexpr bool UNBOXED = ArrayUnboxed<T>::value;
 
     // The empty array
     static ref<Array> empty();
@@ -29,6 +66,13 @@ namespace immutable {
     template <typename It> static ref<Array> create(It& begin, const It& end);
     template <typename It> static ref<Array> create(It&& begin, const It& end);
 
+    // Create an array with values from a random-access iterable, like std::vector,
+    // filling leaves on up to `threads` threads in parallel. When threads is 0, one
+    // thread per CPU is used. Small iterables, and all iterables in builds with
+    // IMMUTABLE_SINGLE_THREADED, are filled on the calling thread.
+    template <typename Iterable>
+    static ref<Array> createParallel(const Iterable&, uint32 threads=0);
+
     // Number of values in this array
     uint32 size() const { return _end - _start; }
     
@@ -60,9 +104,11 @@ namespace immutable {
     Iterator find(uint32 i) const;
 
     // Find value at index. Returns nullptr if index is out-of bounds.
+    // For unboxed arrays, the returned Value is a copy.
     const ref<ValueT> findValue(uint32 i) const;
     
     // Access value at index. If i >= size() the behavior is undefined.
+    // For unboxed arrays, the returned Value is a copy.
     const ref<ValueT> getValue(uint32 i) const;
     
     // Access first and last value
@@ -84,6 +130,34 @@ namespace immutable {
     // Returns a slice of this array, from start up until (but not including) end.
     // Returns null if start and/or end is out-of bounds.
     ref<Array> slice(uint32 start, uint32 end=END) const;
+
+    // Returns an array with the same values as this array which does not reference
+    // any values that are outside of it, like the ones before the start of a slice.
+    // O(log n), or O(1) if there are no such values.
+    ref<Array> compact() const;
+    
+    // Returns an array with the result of fn(value) for each value of this array.
+    // The new array has the same trie structure as this array (or as compact() for
+    // slices), and its leaves are filled directly rather than by pushing values.
+    template <typename F, typename U = ArrayMapResult<T,F>>
+    ref<Array<U>> map(F&& fn) const;
+
+    // Like map, but subtrees are mapped by up to `threads` threads in parallel, or one
+    // thread per CPU when threads is 0. fn must be safe to call concurrently.
+    template <typename F, typename U = ArrayMapResult<T,F>>
+    ref<Array<U>> parallelMap(F&& fn, uint32 threads=0) const;
+    
+    // Folds the values of this array from first to last, by acc = op(acc, value)
+    // starting with acc = init, and returns the final acc.
+    template <typename U, typename Op> U reduce(U init, Op&& op) const;
+
+    // Like reduce, but the array is split at subtree boundaries into contiguous parts
+    // which are folded on up to `threads` threads in parallel, or one thread per CPU
+    // when threads is 0. Each part is folded starting with identity, and the results
+    // are then combined in order by acc = combine(acc, result), starting with identity.
+    // op must be safe to call concurrently.
+    template <typename U, typename Op, typename Combine>
+    U parallelReduce(U identity, Op&& op, Combine&& combine, uint32 threads=0) const;
     
     // Replaces values within the range [start, end) with values from iterator it.
     template <typename It>
@@ -97,7 +171,9 @@ namespace immutable {
     // Removes values within the range [start, end). Returns null if i is out-of bounds.
     ref<Array> without(uint32 start, uint32 end=END) const;
     
-    // return a new TransientArray contaning the same values as this array
+    // return a new TransientArray contaning the same values as this array.
+    // The transient is not tied to the calling thread and may be handed off to
+    // another thread, as long as only one thread uses it at a time.
     ref<TransientArrayT> asTransient() const;
     
     // apply modification with a transient.
@@ -113,6 +189,32 @@ namespace immutable {
     // True if this array has the same values as the other array.
     // Compares values using std::less<T>.
     int compare(const ref<Array>& other) const;
+
+    // Hash of the values of this array, which is the same for all arrays with equal
+    // values regardless of how they were created. Values are hashed with std::hash<T>.
+    // Hashes of subtrees are computed the first time they are needed and cached in the
+    // nodes, so hashing a new version of a hashed array only visits the nodes which
+    // the versions don't share, i.e. O(log n) for a version made by set or push.
+    uint64 hash() const;
+
+    // True if this array has the same values as the other array, like compare()==0.
+    // Returns false right away when the hashes of both arrays are already known and
+    // differ, and skips nodes which the arrays share (see mismatch).
+    bool equals(const ref<Array>& other) const;
+
+    // Returns the index of the first value which differs between this array and the
+    // other array, or END if both arrays have the same values. If one array holds
+    // the first values of the other, the size of the shorter array is returned.
+    // Compares values like compare() does.
+    uint32 mismatch(const ref<Array>& other) const;
+
+    // Calls fn(const ArrayDiff&) for each range of indexes at which the other array
+    // differs from this array, in order: ranges of changed values followed by the
+    // values added to or removed from the end. Subtrees which the arrays share are
+    // skipped, so for arrays derived from one another with set and push, the time
+    // taken is proportional to the number of changed leaves. Form 2 returns the ranges.
+    template <typename F> void diff(const ref<Array>& other, F&& fn) const; // 1
+    std::vector<ArrayDiff> diff(const ref<Array>& other) const; // 2
     
     // True if the other array refers to the same underlying data.
     bool operator==(const ref<Array>& rhs) const;
@@ -121,11 +223,64 @@ namespace immutable {
     // Iteration
     Iterator begin(uint32 start=0, uint32 end=END) const;
     const Iterator& end() const;
+
+    // Reverse iteration over the values in the range [start, end), from end-1 down
+    // to start. rend() returns the end iterator, which can be compared with but not
+    // moved.
+    ReverseIterator rbegin(uint32 start=0, uint32 end=END) const;
+    ReverseIterator rend() const { return ReverseIterator(); }
+
+    // Iteration in chunks of values which are stored in the same leaf, i.e. up to
+    // BRANCHES values at a time (see ArrayChunk). Both cover the values in the range
+    // [start, end). forEachChunk calls fn(const ArrayChunk<T>&) for each chunk, while
+    // chunks returns a range for use with range-based for loops.
+    struct ChunkRange;
+    template <typename F> void forEachChunk(F&& fn, uint32 start=0, uint32 end=END) const;
+    ChunkRange chunks(uint32 start=0, uint32 end=END) const;
+
+    // range of chunks
+    struct ChunkRange {
+      struct iterator {
+        typedef std::forward_iterator_tag iterator_category;
+        typedef int64                     difference_type;
+        typedef ArrayChunk<T>             value_type;
+        typedef const ArrayChunk<T>*      pointer;
+        typedef const ArrayChunk<T>&      reference;
+
+        const ArrayChunk<T>& operator*() const { return _chunk; }
+        const ArrayChunk<T>* operator->() const { return &_chunk; }
+        iterator& operator++(); // ++i
+        bool operator==(const iterator& rhs) const { return _i == rhs._i; }
+        bool operator!=(const iterator& rhs) const { return _i != rhs._i; }
+
+      private:
+        friend struct ChunkRange;
+        iterator(const Array* a, uint32 i, uint32 end); // absolute indexes
+        const Array*  _a;
+        uint32        _i;
+        uint32        _end;
+        ArrayChunk<T> _chunk;
+      };
+
+      iterator begin() const { return iterator(_a.ptr(), _start, _end); }
+      iterator end() const { return iterator(_a.ptr(), _end, _end); }
+
+    private:
+      friend struct Array;
+      ChunkRange(const Array* a, uint32 start, uint32 end)
+        : _a(const_cast<Array*>(a)), _start(start), _end(end) {}
+      ref<Array> _a;
+      uint32     _start; // absolute
+      uint32     _end;   // absolute
+    };
     
-    // forward iterator
+    // random-access iterator. Moving an iterator by n is a single trie lookup, or
+    // O(1) when the new position is within the leaf the iterator is already at.
+    // Note: the end() sentinel can be compared with and subtracted from other
+    // iterators but not moved; use begin() + size() for a movable end iterator.
     struct Iterator {
-      typedef std::forward_iterator_tag iterator_category;
-      typedef uint32 difference_type;
+      typedef std::random_access_iterator_tag iterator_category;
+      typedef int64  difference_type;
       typedef T      value_type;
       typedef T*     pointer;
       typedef T&     reference;
@@ -136,26 +291,44 @@ namespace immutable {
       
       Iterator& operator++(); // ++i
       Iterator operator++(int); // i++
+      Iterator& operator--(); // --i
+      Iterator operator--(int); // i--
+      Iterator& operator+=(difference_type n);
+      Iterator& operator-=(difference_type n) { return *this += -n; }
+      Iterator operator+(difference_type n) const { return Iterator(*this) += n; }
+      Iterator operator-(difference_type n) const { return Iterator(*this) += -n; }
+      friend Iterator operator+(difference_type n, const Iterator& it) { return it + n; }
+      difference_type operator-(const Iterator& rhs) const;
       Iterator& operator=(const Iterator& rhs) = default;
       Iterator& operator=(Iterator&& rhs) = default;
       
-      // O(1) distance calculation
-      difference_type distanceTo(const Iterator& rhs) const;
+      // O(1) absolute distance calculation
+      uint32 distanceTo(const Iterator& rhs) const;
 
-      T& operator*();
-      ValueT* value();
+      T& operator*() const;
+      T& operator[](difference_type n) const;
+      ValueT* value(); // only available for boxed arrays
       const ValueT* value() const;
       bool valid() const;
 
       bool operator==(const Iterator& rhs) const;
       bool operator!=(const Iterator& rhs) const { return !(*this == rhs); }
+      bool operator<(const Iterator& rhs) const { return *this - rhs < 0; }
+      bool operator>(const Iterator& rhs) const { return *this - rhs > 0; }
+      bool operator<=(const Iterator& rhs) const { return *this - rhs <= 0; }
+      bool operator>=(const Iterator& rhs) const { return *this - rhs >= 0; }
       
     protected:
       friend struct Array;
       friend struct ArrayImp;
 
       Iterator(const Array* a, uint32 absstart, uint32 absend);
-      explicit Iterator(const void*) : _a(nullptr) {} // used by ArrayImp::END_ITERATOR
+      explicit Iterator(const void*) : _a(nullptr), _end(0) {} // used by ArrayImp::END_ITERATOR
+
+      const void* elem() const; // current value in the form accepted by ArrayImp
+
+      // Absolute position, where the end() sentinel is at the end of other
+      uint32 pos(const Iterator& other) const { return _a ? _i : other._end; }
       
       ref<Array>   _a;
       uint32       _i = 0;
@@ -165,8 +338,47 @@ namespace immutable {
       uint32       _slotlen;
     };
     
-    // lower-case name for STL compatibility
+    // bidirectional iterator which visits values in reverse order. Like Iterator, it
+    // references the leaf of the current value, so that stepping only descends the
+    // trie when moving into another leaf.
+    struct ReverseIterator {
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef int64  difference_type;
+      typedef T      value_type;
+      typedef T*     pointer;
+      typedef T&     reference;
+
+      ReverseIterator() {}
+      ReverseIterator& operator++(); // ++i, moves towards the start
+      ReverseIterator operator++(int); // i++
+      ReverseIterator& operator--(); // --i, moves towards the end
+      ReverseIterator operator--(int); // i--
+
+      T& operator*() const;
+      ValueT* value() const; // only available for boxed arrays
+      bool valid() const { return _slots != nullptr; }
+
+      // Index of the current value, relative to the start of the array
+      uint32 index() const { return _i - 1 - _a->_start; }
+
+      bool operator==(const ReverseIterator& rhs) const;
+      bool operator!=(const ReverseIterator& rhs) const { return !(*this == rhs); }
+
+    protected:
+      friend struct Array;
+      ReverseIterator(const Array* a, uint32 absstart, uint32 absend);
+
+      ref<Array>   _a;
+      uint32       _i = 0; // absolute index of the current value plus one
+      uint32       _start;
+      uint32       _base;
+      ref<Object>* _slots = nullptr;
+      uint32       _slotlen;
+    };
+    
+    // lower-case names for STL compatibility
     typedef Iterator iterator;
+    typedef ReverseIterator reverse_iterator;
     
     // copyable and movable
     Array(const Array&) = default;
@@ -176,17 +388,31 @@ namespace immutable {
 
   protected:
     friend struct ArrayImp;
+    using Storage = ArrayStorage<T, UNBOXED>;
     
     uint32      _start; // index offset used when this array is a slice of another array
     uint32      _end;   // _end - _offs = number of values in the list
     uint32      _shift; // BITS times (the depth of this trie minus one)
     ref<Object> _root;  // trie root
     ref<Object> _tail;  // holds the last few entries for efficieny reasons
+    mutable uint64 _hash = 0; // cached hash(), or 0 if not yet computed
 
     Array() = delete; // use Array::empty() instead
     Array(uint32 start, uint32 end, uint32 shift, ref<Object> root, ref<Object> tail);
     Array(ref<Object> root, ref<Object> tail);
 
+    // Values of random-access ranges are stored directly into leaves (see
+    // ArrayImp::build), while other ranges are pushed one value at a time.
+    template <typename It> static ref<Array> createRange(It& I, const It& E);
+    template <typename It>
+    static ref<Array> createRange(It& I, const It& E, std::true_type /*random-access*/);
+    template <typename It>
+    static ref<Array> createRange(It& I, const It& E, std::false_type);
+    template <typename It> // moves values
+    static ref<Array> createRangeMove(It& I, const It& E, std::true_type);
+    template <typename It> // moves values
+    static ref<Array> createRangeMove(It& I, const It& E, std::false_type);
+
     void dealloc() { delete this; }
 
     IMMUTABLE_REFCOUNTED_IMPL(Array)
@@ -200,6 +426,7 @@ namespace immutable {
   // for a transient.
   template <typename T> struct TransientArray : RefCounted {
     using ValueT = Value<T>;
+    static constexpr bool UNBOXED = Array<T>::UNBOXED;
     
     // Number of items in this array
     uint32 size() const { return _end - _start; }
@@ -239,6 +466,7 @@ namespace immutable {
   private:
     friend struct ArrayImp;
     friend struct Array<T>;
+    using Storage = ArrayStorage<T, UNBOXED>;
     
     uint32      _start;
     uint32      _end;
@@ -254,8 +482,8 @@ namespace immutable {
     
     IMMUTABLE_REFCOUNTED_IMPL(TransientArray)
   };
-  
-  
+
+
   struct ArrayImp {
     static constexpr uint32  BITS     = 5;            // 5, 4, 3, 2 ...
     static constexpr uint32  BRANCHES = 1 << BITS;    // 2^5=32, 2^4=16, 2^3=8, 2^2=4 ...
@@ -264,38 +492,118 @@ namespace immutable {
     struct N;
     using  A = Array<void*>;
     using  TA = TransientArray<void*>;
-    using  ItFunc = std::function<A::ValueT*()>;
+    using  ItFunc = std::function<const void*()>;
+    using  FillFunc = std::function<void(ref<Object>* slots, uint32 start, uint32 n)>;
+    using  MapFunc = std::function<void(ref<Object>* dst, ref<Object>* src, uint32 n)>;
+    using  PartFunc = std::function<
+      void(uint32 part, ref<Object>* slots, uint32 begin, uint32 end)>;
+    using  MismatchFunc = std::function<
+      uint32(ref<Object>* a, uint32 ai, ref<Object>* b, uint32 bi, uint32 n)>;
+    using  RangeFunc = std::function<void(uint32 start, uint32 end)>;
+    using  HashFunc = std::function<uint64(ref<Object>* slots, uint32 start, uint32 n)>;
 
     static A EMPTY;
+    static A* const EMPTY_PTR; // &EMPTY
     static N EMPTY_NODE;
     static A::Iterator END_ITERATOR;
     
     // Note: The below functions all expect normalized, absolute indexes.
+    //
+    // Values are passed as a pointer `v` along with `esize`, the size in bytes of
+    // unboxed values. When esize is zero, the array is boxed and v is an Object* which
+    // is referenced by the array. Otherwise v points to esize bytes which are copied
+    // into a leaf node.
 
     // Array
-    static ref<Object>* slotsFor(A*, uint32 i, uint32& length); // unchecked
-    static Object* findValue(A*, uint32 i); // checked
-    static Object* getValue(A*, uint32 i);  // unchecked
-    static Object* firstValue(A*); // unchecked
-    static A*      set(A*, uint32 i, Object*);
-    static A*      push(A*, Object*);
-    static A*      cons(A*, Object*);
+    // slotsFor returns the slots of the leaf holding the value at i, along with base,
+    // the index of the leaf's first value, and length, the number of values in the leaf.
+    static ref<Object>* slotsFor(A*, uint32 i, uint32& base, uint32& length); // unchecked
+    static A*      set(A*, uint32 i, const void* v, uint32 esize);
+    static A*      push(A*, const void* v, uint32 esize);
+    static A*      cons(A*, const void* v, uint32 esize);
+    static A*      concat(A*, A*);
+    static A*      compact(A*);
     static A*      pop(A*);
     static A*      slice(A*, uint32 start, uint32 end);
     static A*      without(A*, uint32 start, uint32 end);
     static A*      splice(A*, uint32 start, uint32 end, A::Iterator& it);
-    static A*      splicefn(A*, uint32 start, uint32 end, const ItFunc& next);
+    static A*      splicefn(A*, uint32 start, uint32 end, const ItFunc& next, uint32 esize);
+
+    // Creates an array of count values by filling full leaves directly and assembling
+    // the branches above them bottom-up, which gives the same trie as pushing the
+    // values one at a time. fill(slots, start, n) must store values [start, start+n)
+    // into the slots of a new leaf. Leaves are filled by up to `threads` threads in
+    // parallel, or one thread per CPU when threads is 0, in which case fill must be
+    // safe to call concurrently.
+    static A*      build(uint32 count, const FillFunc& fill, uint32 esize, uint32 threads);
+
+    // Returns an array with the same trie structure as a (or for slices, as compact(a))
+    // whose leaves hold values of size esize, which f(dst, src, n) produces from the
+    // n values in src. Subtrees are mapped by up to `threads` threads in parallel, or
+    // one thread per CPU when threads is 0, in which case f must be safe to call
+    // concurrently.
+    static A*      map(A*, const MapFunc& f, uint32 esize, uint32 threads);
+
+    // Calls f(part, slots, begin, end) for the values [begin, end) in the slots of each
+    // leaf holding values in [start, end), in order. The range is split at subtree
+    // boundaries into up to `parts` contiguous parts which are visited on separate
+    // threads, where the values of part p come before those of part p+1.
+    static void    forEachLeaf(A*, uint32 start, uint32 end, uint32 parts, const PartFunc& f);
+
+    // Returns the first index in [0, n) at which a and b hold different values, or n.
+    // f(aslots, ai, bslots, bi, count) compares count values starting at ai and bi
+    // and returns the offset of the first difference, or count. Leaves and subtrees
+    // which the arrays share at the same position are skipped without calling f.
+    static uint32  mismatch(A*, A*, uint32 n, const MismatchFunc& f);
+
+    // Calls emit(start, end) for each range of indexes in [0, n) at which a and b hold
+    // different values, in order. Values are compared and shared nodes skipped like
+    // for mismatch.
+    static void    diff(A*, A*, uint32 n, const MismatchFunc& f, const RangeFunc& emit);
+
+    // Returns the hash of the values of a, where the hash of values v[0..n) is the sum
+    // of hash(v[i]) * HASH_P^(n-1-i), modulo 2^64. f(slots, start, n) returns the hash
+    // of n values of a leaf, starting at start. The hashes of full subtrees are cached
+    // in their nodes.
+    static constexpr uint64 HASH_P = 0x100000001b3;
+    static uint64  hash(A*, const HashFunc& f);
+
+    // Returns the number of leading bytes which are equal in a and b, up to n. Uses
+    // SSE2/AVX2 or NEON instructions when available.
+    static uint32  equalBytes(const void* a, const void* b, uint32 n);
+
+    // Number of threads to use for a parallel operation over all values of an array
+    // when asked for `threads` threads, or one per CPU when threads is 0.
+    static uint32  parallelThreads(A*, uint32 threads);
+
+    // ArrayBuilder
+    // Values are added to a leaf until it's full, at which point it's added to
+    // `leaves` and nextLeaf creates a new leaf. build assembles the leaves into a trie.
+    // All nodes have a zero refcount until then and are owned by the builder.
+    struct Builder {
+      ref<Object>* slots = nullptr;   // slots of the current leaf
+      uint32       n = 0;             // number of values in the current leaf
+      uint32       len = 0;           // number of slots in the current leaf
+      uint32       reserved = 0;      // expected number of values, or 0
+      uint32       nleaves = 0;       // number of full leaves
+      uint32       cap = 0;           // capacity of leaves
+      uint32       esize = 0;
+      N*           leaf = nullptr;    // current leaf
+      N**          leaves = nullptr;  // full leaves
+    };
+    static void    reserve(Builder&, uint32 n);
+    static void    nextLeaf(Builder&);
+    static A*      build(Builder&); // resets the builder
+    static void    clear(Builder&); // releases all nodes
+    static void    destroy(Builder&);
     
     // Array -> TransientArray
-    static TA*     createTransient(A*);
+    static TA*     createTransient(A*, uint32 esize);
 
     // TransientArray
-    static ref<Object>* slotsFor(TA*, uint32 i, uint32& length); // unchecked
-    static Object* findValue(TA*, uint32 i); // checked
-    static Object* getValue(TA*, uint32 i);  // unchecked
-    static Object* firstValue(TA*); // unchecked
-    static TA*     set(TA*, uint32 i, Object*);
-    static TA*     push(TA*, Object*);
+    static ref<Object>* slotsFor(TA*, uint32 i, uint32& base, uint32& length); // unchecked
+    static TA*     set(TA*, uint32 i, const void* v, uint32 esize);
+    static TA*     push(TA*, const void* v, uint32 esize);
     static TA*     pop(TA*);
     
     // TransientArray -> Array
@@ -305,6 +613,291 @@ namespace immutable {
   };
 
 
+  // Builds an array by appending values, which are constructed directly in leaf
+  // nodes. Unlike TransientArray, a builder is not reference counted and is meant to
+  // live on the stack, e.g.
+  //   ArrayBuilder<int> b(3);
+  //   b.emplace_back(1); b.emplace_back(2); b.emplace_back(3);
+  //   auto a = b.build();
+  // When the number of values is reserved up front, build uses all nodes as-is.
+  template <typename T> struct ArrayBuilder {
+    ArrayBuilder() { _b.esize = Storage::ESIZE; }
+    explicit ArrayBuilder(uint32 n) : ArrayBuilder() { reserve(n); }
+    ArrayBuilder(const ArrayBuilder&) = delete;
+    ArrayBuilder& operator=(const ArrayBuilder&) = delete;
+    ~ArrayBuilder();
+
+    // Number of values added since the builder was created, built or cleared
+    uint32 size() const;
+
+    // Prepare for a total of n values. More or fewer values may still be added.
+    void reserve(uint32 n);
+
+    // Append a value. Form 1 constructs a value T in-place.
+    template <typename... Args> T& emplace_back(Args&&...); // 1
+    void push_back(const T& v) { emplace_back(v); } // 2
+    void push_back(T&& v) { emplace_back(std::move(v)); } // 3
+
+    // Returns an array with the values added and resets this builder, which keeps
+    // its memory for building another array.
+    ref<Array<T>> build();
+
+    // Removes all values added
+    void clear();
+
+  private:
+    using Storage = ArrayStorage<T, Array<T>::UNBOXED>;
+    ArrayImp::Builder _b;
+  };
+
+
+  // Values of an array which are stored in the same leaf, as visited by
+  // Array::forEachChunk and Array::chunks. The values of unboxed arrays are stored
+  // contiguously, so loops over data() can be vectorized by the compiler.
+  template <typename T> struct ArrayChunk {
+    using iterator = typename ArrayStorage<T, ArrayUnboxed<T>::value>::ChunkIterator;
+
+    // Number of values
+    uint32 size() const { return _end - _begin; }
+
+    // Access value at index. If i >= size() the behavior is undefined.
+    const T& operator[](uint32 i) const { return Storage::at(_slots, _begin + i); }
+
+    // Pointer to the values. Only available for unboxed arrays.
+    const T* data() const;
+
+    iterator begin() const { return Storage::chunkIterator(_slots, _begin); }
+    iterator end() const { return Storage::chunkIterator(_slots, _end); }
+
+    ArrayChunk() {}
+    ArrayChunk(ref<Object>* slots, uint32 begin, uint32 end)
+      : _slots(slots), _begin(begin), _end(end) {}
+
+  private:
+    using Storage = ArrayStorage<T, ArrayUnboxed<T>::value>;
+    ref<Object>* _slots = nullptr; // slots of the leaf
+    uint32       _begin = 0;       // index of the first value in the leaf
+    uint32       _end = 0;
+  };
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // ArrayStorage
+
+  // Values are equal when neither is less or greater than the other, the same way
+  // Array::compare compares values
+  template <typename T>
+  inline bool ArrayEqual(const T& a, const T& b) {
+    return !std::less<T>()(a, b) && !std::greater<T>()(a, b);
+  }
+
+  // Hash of a value, for Array::hash. Mixes the bits of std::hash<T>, which for
+  // integers is often the value itself.
+  template <typename T>
+  inline uint64 ArrayHashValue(const T& v) {
+    uint64 h = uint64(std::hash<T>()(v));
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return h ^ (h >> 31);
+  }
+  
+  // Boxed storage: leaf slots reference Value<T> objects
+  template <typename T> struct ArrayStorage<T, false> {
+    using ValueT = Value<T>;
+    static constexpr uint32 ESIZE = 0;
+
+    // Holds a value while it's being passed to ArrayImp
+    struct Elem {
+      Object* obj;
+      Elem(ValueT* v) : obj(v) {}
+      template <typename Arg> Elem(Arg&& arg) : obj(new ValueT(fwd<Arg>(arg))) {}
+      operator const void*() const { return obj; }
+    };
+
+    static T& at(ref<Object>* slots, uint32 k) {
+      Object* obj = slots[k];
+      ImmutableAssertTypeTag(obj, ValueT::TYPE_TAG);
+      return static_cast<ValueT*>(obj)->value;
+    }
+
+    static ref<ValueT> valueAt(ref<Object>* slots, uint32 k) {
+      Object* obj = slots[k];
+      ImmutableAssertTypeTag(obj, ValueT::TYPE_TAG);
+      return static_cast<ValueT*>(obj);
+    }
+
+    static const void* elemAt(ref<Object>* slots, uint32 k) {
+      return slots[k].ptr();
+    }
+
+    // Iterator over the values of an ArrayChunk
+    struct ChunkIterator {
+      typedef std::forward_iterator_tag iterator_category;
+      typedef int64    difference_type;
+      typedef T        value_type;
+      typedef const T* pointer;
+      typedef const T& reference;
+
+      ref<Object>* p;
+      const T& operator*() const { return at(p, 0); }
+      ChunkIterator& operator++() { ++p; return *this; } // ++i
+      bool operator==(const ChunkIterator& rhs) const { return p == rhs.p; }
+      bool operator!=(const ChunkIterator& rhs) const { return p != rhs.p; }
+    };
+
+    static ChunkIterator chunkIterator(ref<Object>* slots, uint32 k) {
+      return ChunkIterator{slots + k};
+    }
+
+    // Constructs a value in slot k, which must be empty
+    template <typename... Args>
+    static T& emplace(ref<Object>* slots, uint32 k, Args&&... args) {
+      ValueT* v = new ValueT(fwd<Args>(args)...);
+      slots[k] = v;
+      return v->value;
+    }
+
+    // Wraps a random-access iterator in a function that stores values into leaf slots
+    template <typename It>
+    static ArrayImp::FillFunc fillFunc(const It& it) {
+      return [it] (ref<Object>* slots, uint32 start, uint32 n) {
+        for (uint32 k = 0; k < n; ++k) {
+          slots[k] = Elem(it[start + k]).obj;
+        }
+      };
+    }
+
+    // Hash of n values of a leaf (see ArrayImp::hash)
+    static uint64 hash(ref<Object>* slots, uint32 start, uint32 n) {
+      uint64 h = 0;
+      for (uint32 k = start; k < start + n; ++k) {
+        h = h * ArrayImp::HASH_P + ArrayHashValue(static_cast<ValueT*>(slots[k].ptr())->value);
+      }
+      return h;
+    }
+
+    // Compares the values of two leaves (see ArrayImp::mismatch)
+    static uint32 mismatch(ref<Object>* a, uint32 ai, ref<Object>* b, uint32 bi, uint32 n) {
+      for (uint32 k = 0; k < n; ++k) {
+        Object* x = a[ai + k];
+        Object* y = b[bi + k];
+        if (x != y && !ArrayEqual(static_cast<ValueT*>(x)->value,
+                                  static_cast<ValueT*>(y)->value)) {
+          return k;
+        }
+      }
+      return n;
+    }
+
+    // Wraps a type-sensitive iterator in a function that produces type-insensitive values
+    template <typename It>
+    static ArrayImp::ItFunc iterFunc(It&& it, const It& endit) {
+      return [it=std::move(it), endit] () mutable -> const void* {
+        if (it == endit) { return nullptr; }
+        Object* v = new ValueT(std::move(*it));
+        ++it;
+        return v;
+      };
+    }
+  };
+
+
+  // Unboxed storage: values are stored directly in leaf nodes
+  template <typename T> struct ArrayStorage<T, true> {
+    using ValueT = Value<T>;
+    static constexpr uint32 ESIZE = sizeof(T);
+
+    // Holds a value while it's being passed to ArrayImp
+    struct Elem {
+      T value;
+      Elem(ValueT* v) : value(ref<ValueT>(v)->value) {}
+      template <typename Arg> Elem(Arg&& arg) : value(fwd<Arg>(arg)) {}
+      operator const void*() const { return &value; }
+    };
+
+    static T& at(ref<Object>* slots, uint32 k) {
+      return reinterpret_cast<T*>(slots)[k];
+    }
+
+    static ref<ValueT> valueAt(ref<Object>* slots, uint32 k) {
+      return new ValueT(at(slots, k));
+    }
+
+    static const void* elemAt(ref<Object>* slots, uint32 k) {
+      return &at(slots, k);
+    }
+
+    // Iterator over the values of an ArrayChunk
+    using ChunkIterator = const T*;
+
+    static ChunkIterator chunkIterator(ref<Object>* slots, uint32 k) {
+      return &at(slots, k);
+    }
+
+    // Constructs a value in slot k, which must be empty
+    template <typename... Args>
+    static T& emplace(ref<Object>* slots, uint32 k, Args&&... args) {
+      return *::new((void*)&at(slots, k)) T(fwd<Args>(args)...);
+    }
+
+    // Wraps a random-access iterator in a function that stores values into leaf slots
+    template <typename It>
+    static ArrayImp::FillFunc fillFunc(const It& it) {
+      return [it] (ref<Object>* slots, uint32 start, uint32 n) {
+        for (uint32 k = 0; k < n; ++k) {
+          ::new((void*)&at(slots, k)) T(Elem(it[start + k]).value);
+        }
+      };
+    }
+
+    // Hash of n values of a leaf (see ArrayImp::hash)
+    static uint64 hash(ref<Object>* slots, uint32 start, uint32 n) {
+      uint64 h = 0;
+      for (uint32 k = start; k < start + n; ++k) {
+        h = h * ArrayImp::HASH_P + ArrayHashValue(at(slots, k));
+      }
+      return h;
+    }
+
+    // Compares the values of two leaves (see ArrayImp::mismatch). Values of arithmetic
+    // types are compared as bytes first, which finds all differences as only values
+    // with different bytes can differ (while e.g. -0.0 and 0.0 are equal.)
+    static uint32 mismatch(ref<Object>* a, uint32 ai, ref<Object>* b, uint32 bi, uint32 n) {
+      return mismatchValues(&at(a, ai), &at(b, bi), n, std::is_arithmetic<T>());
+    }
+    static uint32 mismatchValues(const T* a, const T* b, uint32 n, std::true_type) {
+      uint32 k = 0;
+      while (k < n) {
+        k += ArrayImp::equalBytes(a + k, b + k, (n - k) * sizeof(T)) / sizeof(T);
+        if (k == n || !ArrayEqual(a[k], b[k])) {
+          break;
+        }
+        ++k;
+      }
+      return k;
+    }
+    static uint32 mismatchValues(const T* a, const T* b, uint32 n, std::false_type) {
+      uint32 k = 0;
+      while (k < n && ArrayEqual(a[k], b[k])) {
+        ++k;
+      }
+      return k;
+    }
+
+    // Wraps a type-sensitive iterator in a function that produces type-insensitive values
+    template <typename It>
+    static ArrayImp::ItFunc iterFunc(It&& it, const It& endit) {
+      using Buf = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+      return [it=std::move(it), endit, buf=Buf()] () mutable -> const void* {
+        if (it == endit) { return nullptr; }
+        T* v = ::new((void*)&buf) T(std::move(*it));
+        ++it;
+        return v;
+      };
+    }
+  };
+
+
   // —————————————————————————————————————————————————————————————————————
   // TransientArray
   
@@ -318,13 +911,15 @@ namespace immutable {
   inline ref<TransientArray<T>>
   TransientArray<T>::push(typename TransientArray<T>::ValueT* v) {
     assert(v != nullptr);
-    return (TransientArray<T>*)ArrayImp::push((ArrayImp::TA*)this, v);
+    return (TransientArray<T>*)ArrayImp::push(
+      (ArrayImp::TA*)this, typename Storage::Elem(v), Storage::ESIZE);
   }
   
   template <typename T>
   template <typename Arg>
   inline ref<TransientArray<T>> TransientArray<T>::push(Arg&& arg) {
-    return push(new ValueT(fwd<Arg>(arg)));
+    return (TransientArray<T>*)ArrayImp::push(
+      (ArrayImp::TA*)this, typename Storage::Elem(fwd<Arg>(arg)), Storage::ESIZE);
   }
   
   
@@ -335,68 +930,66 @@ namespace immutable {
     if (i >= _end) {
       return nullptr; // index out-of bounds
     }
-    return (TransientArray<T>*)ArrayImp::set((ArrayImp::TA*)this, i, v);
+    return (TransientArray<T>*)ArrayImp::set(
+      (ArrayImp::TA*)this, i, typename Storage::Elem(v), Storage::ESIZE);
   }
   
   template <typename T>
   template <typename Arg>
   inline ref<TransientArray<T>> TransientArray<T>::set(uint32 i, Arg&& arg) {
-    return set(i, new ValueT(fwd<Arg>(arg)));
+    i += _start;
+    if (i >= _end) {
+      return nullptr; // index out-of bounds
+    }
+    return (TransientArray<T>*)ArrayImp::set(
+      (ArrayImp::TA*)this, i, typename Storage::Elem(fwd<Arg>(arg)), Storage::ESIZE);
   }
   
   
   template <typename T>
   inline const ref<Value<T>> TransientArray<T>::findValue(uint32 i) const {
-    i += _start;
-    if (i >= _end) {
+    if (i >= size()) {
       return nullptr;
     }
-    Object* obj = ArrayImp::findValue((ArrayImp::TA*)this, i);
-    if (obj) {
-      ImmutableAssertTypeTag(obj, ValueT::TYPE_TAG);
-    }
-    return static_cast<ValueT*>(obj);
+    return getValue(i);
   }
   
   
   template <typename T>
   inline const ref<Value<T>> TransientArray<T>::getValue(uint32 i) const {
-    return static_cast<ValueT*>(ArrayImp::getValue((ArrayImp::TA*)this, i + _start));
+    i += _start;
+    uint32 base, len;
+    auto slots = ArrayImp::slotsFor((ArrayImp::TA*)this, i, base, len);
+    return Storage::valueAt(slots, i - base);
   }
   
   template <typename T>
   inline const T& TransientArray<T>::get(uint32 i) const {
-    return getValue(i)->value;
+    i += _start;
+    uint32 base, len;
+    auto slots = ArrayImp::slotsFor((ArrayImp::TA*)this, i, base, len);
+    return Storage::at(slots, i - base);
   }
   
   
   template <typename T>
   inline const ref<typename TransientArray<T>::ValueT> TransientArray<T>::firstValue() const {
-    if (!size()) {
-      return nullptr;
-    }
-    if (_start == 0) {
-      return static_cast<ValueT*>(ArrayImp::firstValue((ArrayImp::TA*)this));
-    }
-    return static_cast<ValueT*>(ArrayImp::getValue((ArrayImp::TA*)this, _start));
+    return size() ? getValue(0) : nullptr;
   }
   
   template <typename T>
   inline const ref<typename TransientArray<T>::ValueT> TransientArray<T>::lastValue() const {
-    if (size()) {
-      return static_cast<ValueT*>(ArrayImp::getValue((ArrayImp::TA*)this, _end - 1));
-    }
-    return nullptr;
+    return size() ? getValue(size() - 1) : nullptr;
   }
   
   template <typename T>
   inline const T& TransientArray<T>::first() const {
-    return firstValue()->value;
+    return get(0);
   }
   
   template <typename T>
   inline const T& TransientArray<T>::last() const {
-    return lastValue()->value;
+    return get(size() - 1);
   }
   
   template <typename T>
@@ -405,12 +998,56 @@ namespace immutable {
   }
   
   
+  // —————————————————————————————————————————————————————————————————————
+  // ArrayBuilder
+
+  template <typename T>
+  inline ArrayBuilder<T>::~ArrayBuilder() {
+    if (_b.leaf || _b.leaves) {
+      ArrayImp::destroy(_b);
+    }
+  }
+
+  template <typename T>
+  inline uint32 ArrayBuilder<T>::size() const {
+    return (_b.nleaves << ArrayImp::BITS) + _b.n;
+  }
+
+  template <typename T>
+  inline void ArrayBuilder<T>::reserve(uint32 n) {
+    ArrayImp::reserve(_b, n);
+  }
+
+  template <typename T>
+  template <typename... Args>
+  inline T& ArrayBuilder<T>::emplace_back(Args&&... args) {
+    if (_b.n == _b.len) {
+      ArrayImp::nextLeaf(_b);
+    }
+    T& v = Storage::emplace(_b.slots, _b.n, fwd<Args>(args)...);
+    ++_b.n;
+    return v;
+  }
+
+  template <typename T>
+  inline ref<Array<T>> ArrayBuilder<T>::build() {
+    return (Array<T>*)ArrayImp::build(_b);
+  }
+
+  template <typename T>
+  inline void ArrayBuilder<T>::clear() {
+    ArrayImp::clear(_b);
+  }
+
+
   // —————————————————————————————————————————————————————————————————————
   // Array
   
   template <typename T>
   inline ref<Array<T>> Array<T>::empty() {
-    return (Array<T>*)&ArrayImp::EMPTY;
+    // Note: EMPTY is never deallocated, but GCC warns about the delete in dealloc
+    // when it can see that a ref refers to it.
+    return (Array<T>*)ArrayImp::EMPTY_PTR;
   }
   
   //template <typename T>
@@ -421,77 +1058,109 @@ namespace immutable {
   //  // a copy of the empty array.
   //}
 
+  // True for iterators which support it[n] and it1 - it2 in constant time
+  template <typename It, typename = void>
+  struct ArrayRandomAccess : std::false_type {};
+  template <typename It>
+  struct ArrayRandomAccess<It, typename std::enable_if<std::is_base_of<
+    std::random_access_iterator_tag,
+    typename std::iterator_traits<It>::iterator_category
+  >::value>::type> : std::true_type {};
+
   template <typename T>
   template <typename It>
-  inline ref<Array<T>> Array<T>::create(It& I, const It& E) {
+  inline ref<Array<T>> Array<T>::createRange(It& I, const It& E) {
+    return createRange(I, E, ArrayRandomAccess<It>());
+  }
+
+  template <typename T>
+  template <typename It>
+  inline ref<Array<T>> Array<T>::createRange(It& I, const It& E, std::true_type) {
+    uint32 count = uint32(E - I);
+    auto a = (Array<T>*)ArrayImp::build(count, Storage::fillFunc(I), Storage::ESIZE, 1);
+    I = E;
+    return a;
+  }
+
+  template <typename T>
+  template <typename It>
+  inline ref<Array<T>> Array<T>::createRange(It& I, const It& E, std::false_type) {
     auto t = empty()->asTransient();
     for (; I != E; ++I) {
       t = t->push(*I);
     }
     return t->makePersistent();
   }
-  
+
   template <typename T>
   template <typename It>
-  inline ref<Array<T>> Array<T>::create(It&& I, const It& E) {
+  inline ref<Array<T>> Array<T>::createRangeMove(It& I, const It& E, std::true_type) {
+    auto MI = std::make_move_iterator(I);
+    return createRange(MI, std::make_move_iterator(E), std::true_type());
+  }
+
+  template <typename T>
+  template <typename It>
+  inline ref<Array<T>> Array<T>::createRangeMove(It& I, const It& E, std::false_type) {
     auto t = empty()->asTransient();
     for (; I != E; ++I) {
-      t = t->push(*I);
+      t = t->push(std::move(*I));
     }
     return t->makePersistent();
   }
+
+  template <typename T>
+  template <typename It>
+  inline ref<Array<T>> Array<T>::create(It& I, const It& E) {
+    return createRange(I, E);
+  }
+  
+  template <typename T>
+  template <typename It>
+  inline ref<Array<T>> Array<T>::create(It&& I, const It& E) {
+    return createRange(I, E);
+  }
   
   // specialization for Array<T>::Iterator
   template <typename T>
   inline ref<Array<T>> Array<T>::create(Iterator&& I, const Iterator& E) {
-    auto t = empty()->asTransient();
-    for (; I != E; ++I) {
-      t = t->push(I.value());
-    }
-    return t->makePersistent();
+    return empty()->push(I, E);
   }
 
   template <typename T>
   inline ref<Array<T>> Array<T>::create(Iterator& I, const Iterator& E) {
-    auto t = empty()->asTransient();
-    for (; I != E; ++I) {
-      t = t->push(I.value());
-    }
-    return t->makePersistent();
+    return empty()->push(I, E);
   }
   
   template <typename T>
   template <typename Iterable>
   inline ref<Array<T>> Array<T>::create(Iterable&& vals) {
-    auto t = empty()->asTransient();
     auto I = vals.begin();
-    auto E = vals.end();
-    for (; I != E; ++I) {
-      t = t->push(std::move(*I));
-    }
-    return t->makePersistent();
+    return createRangeMove(I, vals.end(), ArrayRandomAccess<decltype(I)>());
   }
   
   template <typename T>
   template <typename Iterable>
   inline ref<Array<T>> Array<T>::create(const Iterable& vals) {
-    auto t = empty()->asTransient();
-    for (auto& v : vals) {
-      t = t->push(v);
-    }
-    return t->makePersistent();
+    auto I = vals.begin();
+    return createRange(I, vals.end());
   }
   
   template <typename T>
   template <typename Y>
   inline ref<Array<T>> Array<T>::create(std::initializer_list<Y>&& vals) {
-    auto t = empty()->asTransient();
     auto I = vals.begin();
-    auto E = vals.end();
-    for (; I != E; ++I) {
-      t = t->push(std::move(*I));
-    }
-    return t->makePersistent();
+    return createRange(I, vals.end());
+  }
+
+  template <typename T>
+  template <typename Iterable>
+  inline ref<Array<T>> Array<T>::createParallel(const Iterable& vals, uint32 threads) {
+    auto I = vals.begin();
+    static_assert(ArrayRandomAccess<decltype(I)>::value,
+      "createParallel requires an iterable with random-access iterators");
+    return (Array<T>*)ArrayImp::build(
+      uint32(vals.end() - I), Storage::fillFunc(I), Storage::ESIZE, threads);
   }
   
   // Constructor only used for initialization of ArrayImp::EMPTY
@@ -511,12 +1180,15 @@ namespace immutable {
   
   template <typename T>
   inline ref<Array<T>> Array<T>::push(ValueT* v) const {
-    return (Array<T>*)ArrayImp::push((ArrayImp::A*)this, v);
+    assert(v != nullptr);
+    return (Array<T>*)ArrayImp::push(
+      (ArrayImp::A*)this, typename Storage::Elem(v), Storage::ESIZE);
   }
   
   template <typename T>
   template <typename Arg> ref<Array<T>> Array<T>::push(Arg&& arg) const {
-    return push(new ValueT(fwd<Arg>(arg)));
+    return (Array<T>*)ArrayImp::push(
+      (ArrayImp::A*)this, typename Storage::Elem(fwd<Arg>(arg)), Storage::ESIZE);
   }
   
   template <typename T>
@@ -541,18 +1213,15 @@ namespace immutable {
   
   template <typename T>
   inline ref<Array<T>> Array<T>::push(Iterator&& I, const Iterator& E) const {
-    return modify([&](ref<TransientArray<T>> t) {
-      for (; I != E; ++I) {
-        t->push(I.value());
-      }
-    });
+    return push(I, E);
   }
   
   template <typename T>
   inline ref<Array<T>> Array<T>::push(Iterator& I, const Iterator& E) const {
+    // references values rather than constructing new ones
     return modify([&](ref<TransientArray<T>> t) {
       for (; I != E; ++I) {
-        t->push(I.value());
+        ArrayImp::push((ArrayImp::TA*)t.ptr(), I.elem(), Storage::ESIZE);
       }
     });
   }
@@ -560,12 +1229,15 @@ namespace immutable {
   
   template <typename T>
   inline ref<Array<T>> Array<T>::cons(ValueT* v) const {
-    return (Array<T>*)ArrayImp::cons((ArrayImp::A*)this, v);
+    assert(v != nullptr);
+    return (Array<T>*)ArrayImp::cons(
+      (ArrayImp::A*)this, typename Storage::Elem(v), Storage::ESIZE);
   }
   
   template <typename T>
   template <typename Arg> ref<Array<T>> Array<T>::cons(Arg&& arg) const {
-    return cons(new ValueT(fwd<Arg>(arg)));
+    return (Array<T>*)ArrayImp::cons(
+      (ArrayImp::A*)this, typename Storage::Elem(fwd<Arg>(arg)), Storage::ESIZE);
   }
   
   
@@ -576,13 +1248,19 @@ namespace immutable {
     if (i >= _end) {
       return nullptr; // index out-of bounds
     }
-    return (Array<T>*)ArrayImp::set((ArrayImp::A*)this, i, v);
+    return (Array<T>*)ArrayImp::set(
+      (ArrayImp::A*)this, i, typename Storage::Elem(v), Storage::ESIZE);
   }
   
   template <typename T>
   template <typename Arg>
   inline ref<Array<T>> Array<T>::set(uint32 i, Arg&& arg) const {
-    return set(i, new ValueT(fwd<Arg>(arg)));
+    i += _start;
+    if (i >= _end) {
+      return nullptr; // index out-of bounds
+    }
+    return (Array<T>*)ArrayImp::set(
+      (ArrayImp::A*)this, i, typename Storage::Elem(fwd<Arg>(arg)), Storage::ESIZE);
   }
 
 
@@ -594,57 +1272,106 @@ namespace immutable {
 
   template <typename T>
   inline const ref<Value<T>> Array<T>::findValue(uint32 i) const {
-    i += _start;
-    if (i >= _end) {
+    if (i >= size()) {
       return nullptr;
     }
-    Object* obj = ArrayImp::findValue((ArrayImp::A*)this, i);
-    if (obj) {
-      ImmutableAssertTypeTag(obj, ValueT::TYPE_TAG);
-    }
-    return static_cast<ValueT*>(obj);
+    return getValue(i);
   }
   
 
   template <typename T>
   inline const ref<Value<T>> Array<T>::getValue(uint32 i) const {
-    return static_cast<ValueT*>(ArrayImp::getValue((ArrayImp::A*)this, i + _start));
+    i += _start;
+    uint32 base, len;
+    auto slots = ArrayImp::slotsFor((ArrayImp::A*)this, i, base, len);
+    return Storage::valueAt(slots, i - base);
   }
   
   template <typename T>
   inline const T& Array<T>::get(uint32 i) const {
-    return getValue(i)->value;
+    i += _start;
+    uint32 base, len;
+    auto slots = ArrayImp::slotsFor((ArrayImp::A*)this, i, base, len);
+    return Storage::at(slots, i - base);
   }
   
   template <typename T>
   inline const ref<typename Array<T>::ValueT> Array<T>::firstValue() const {
-    if (!size()) {
-      return nullptr;
-    }
-    if (_start == 0) {
-      return static_cast<ValueT*>(ArrayImp::firstValue((ArrayImp::A*)this));
-    }
-    return static_cast<ValueT*>(ArrayImp::getValue((ArrayImp::A*)this, _start));
+    return size() ? getValue(0) : nullptr;
   }
   
   template <typename T>
   inline const ref<typename Array<T>::ValueT> Array<T>::lastValue() const {
-    if (size()) {
-      return static_cast<ValueT*>(ArrayImp::getValue((ArrayImp::A*)this, _end - 1));
-    }
-    return nullptr;
+    return size() ? getValue(size() - 1) : nullptr;
   }
   
   template <typename T>
   inline const T& Array<T>::first() const {
-    return firstValue()->value;
+    return get(0);
   }
   
   template <typename T>
   inline const T& Array<T>::last() const {
-    return lastValue()->value;
+    return get(size() - 1);
   }
   
+  template <typename T>
+  template <typename F, typename U>
+  inline ref<Array<U>> Array<T>::map(F&& fn) const {
+    return parallelMap(fwd<F>(fn), 1);
+  }
+
+  template <typename T>
+  template <typename F, typename U>
+  inline ref<Array<U>> Array<T>::parallelMap(F&& fn, uint32 threads) const {
+    using UStorage = ArrayStorage<U, Array<U>::UNBOXED>;
+    return (Array<U>*)ArrayImp::map(
+      (ArrayImp::A*)this,
+      [&fn] (ref<Object>* dst, ref<Object>* src, uint32 n) {
+        for (uint32 k = 0; k < n; ++k) {
+          UStorage::emplace(dst, k, fn((const T&)Storage::at(src, k)));
+        }
+      },
+      UStorage::ESIZE,
+      threads);
+  }
+
+
+  template <typename T>
+  template <typename U, typename Op>
+  inline U Array<T>::reduce(U init, Op&& op) const {
+    ArrayImp::forEachLeaf((ArrayImp::A*)this, _start, _end, 1,
+      [&] (uint32, ref<Object>* slots, uint32 begin, uint32 end) {
+        for (uint32 k = begin; k < end; ++k) {
+          init = op(std::move(init), (const T&)Storage::at(slots, k));
+        }
+      });
+    return init;
+  }
+
+  template <typename T>
+  template <typename U, typename Op, typename Combine>
+  inline U Array<T>::parallelReduce(
+    U identity, Op&& op, Combine&& combine, uint32 threads) const
+  {
+    uint32 parts = ArrayImp::parallelThreads((ArrayImp::A*)this, threads);
+    std::vector<U> results(parts, identity);
+    ArrayImp::forEachLeaf((ArrayImp::A*)this, _start, _end, parts,
+      [&] (uint32 part, ref<Object>* slots, uint32 begin, uint32 end) {
+        // Note: accumulates in a local to avoid contending for results' cache lines
+        U acc = std::move(results[part]);
+        for (uint32 k = begin; k < end; ++k) {
+          acc = op(std::move(acc), (const T&)Storage::at(slots, k));
+        }
+        results[part] = std::move(acc);
+      });
+    for (auto& r : results) {
+      identity = combine(std::move(identity), std::move(r));
+    }
+    return identity;
+  }
+
+
   template <typename T>
   inline ref<Array<T>> Array<T>::pop() const {
     return size() ? (Array<T>*)ArrayImp::pop((ArrayImp::A*)this)
@@ -658,7 +1385,7 @@ namespace immutable {
   
   template <typename T>
   inline ref<Array<T>> Array<T>::concat(ref<Array> other) const {
-    return push(other->begin(), other->end());
+    return (Array<T>*)ArrayImp::concat((ArrayImp::A*)this, (ArrayImp::A*)other.ptr());
   }
   
   template <typename T>
@@ -670,6 +1397,11 @@ namespace immutable {
     );
   }
   
+  template <typename T>
+  inline ref<Array<T>> Array<T>::compact() const {
+    return (Array<T>*)ArrayImp::compact((ArrayImp::A*)this);
+  }
+  
   template <typename T>
   inline ref<Array<T>> Array<T>::without(uint32 start, uint32 end) const {
     return (Array<T>*)ArrayImp::without(
@@ -714,20 +1446,14 @@ namespace immutable {
       (ArrayImp::A*)this,
       start + _start,
       end == END ? _end : end + _start,
-      [it=std::move(it), endit] () mutable -> ArrayImp::A::ValueT* {
-        // iterator function wrapping type-sensitive iterator to produce
-        // type-insensitive values
-        if (it == endit) { return nullptr; }
-        auto v = (ArrayImp::A::ValueT*)new ValueT(std::move(*it));
-        ++it;
-        return v;
-      }
+      Storage::iterFunc(std::move(it), endit),
+      Storage::ESIZE
     );
   }
   
   template <typename T>
   inline ref<TransientArray<T>> Array<T>::asTransient() const {
-    return (TransientArrayT*)ArrayImp::createTransient((ArrayImp::A*)this);
+    return (TransientArrayT*)ArrayImp::createTransient((ArrayImp::A*)this, Storage::ESIZE);
   }
   
   
@@ -759,27 +1485,119 @@ namespace immutable {
     if (size() > other->size()) {
       return 1;
     }
-    auto E = end();
-    auto ai = begin();
-    auto bi = other->begin();
-    while (ai != E) {
-      // Note: Value implements comparison operators for T
-      auto a = ai.value();
-      auto b = bi.value();
-      if (a != b) { // not same values
-        if (*a < *b) {
-          return -1;
-        }
-        if (*a > *b) {
-          return 1;
-        }
-      }
-      ++ai;
-      ++bi;
+    uint32 i = mismatch(other);
+    if (i == END) {
+      return 0;
+    }
+    return std::less<T>()(get(i), other->get(i)) ? -1 : 1;
+  }
+
+  template <typename T>
+  inline uint64 Array<T>::hash() const {
+    uint64 h = __atomic_load_n(&_hash, __ATOMIC_RELAXED);
+    if (h == 0) {
+      h = ArrayImp::hash((ArrayImp::A*)this, &Storage::hash);
+      __atomic_store_n(&_hash, h, __ATOMIC_RELAXED);
     }
-    return 0;
+    return h;
+  }
+
+  template <typename T>
+  inline bool Array<T>::equals(const ref<Array>& other) const {
+    if (operator==(other)) {
+      return true;
+    }
+    if (size() != other->size()) {
+      return false;
+    }
+    uint64 h1 = __atomic_load_n(&_hash, __ATOMIC_RELAXED);
+    uint64 h2 = __atomic_load_n(&other->_hash, __ATOMIC_RELAXED);
+    if (h1 != 0 && h2 != 0 && h1 != h2) {
+      return false;
+    }
+    return mismatch(other) == END;
+  }
+
+  template <typename T>
+  template <typename F>
+  inline void Array<T>::diff(const ref<Array>& other, F&& fn) const {
+    if (operator==(other)) {
+      return;
+    }
+    uint32 n = min(size(), other->size());
+    ArrayImp::diff(
+      (ArrayImp::A*)this, (ArrayImp::A*)other.ptr(), n, &Storage::mismatch,
+      [&] (uint32 start, uint32 end) { fn(ArrayDiff{ArrayDiff::CHANGED, start, end}); });
+    if (n < other->size()) {
+      fn(ArrayDiff{ArrayDiff::ADDED, n, other->size()});
+    } else if (n < size()) {
+      fn(ArrayDiff{ArrayDiff::REMOVED, n, size()});
+    }
+  }
+
+  template <typename T>
+  inline std::vector<ArrayDiff> Array<T>::diff(const ref<Array>& other) const {
+    std::vector<ArrayDiff> ranges;
+    diff(other, [&] (const ArrayDiff& d) { ranges.push_back(d); });
+    return ranges;
+  }
+
+  template <typename T>
+  inline uint32 Array<T>::mismatch(const ref<Array>& other) const {
+    if (operator==(other)) {
+      return END;
+    }
+    uint32 n = min(size(), other->size());
+    uint32 i = ArrayImp::mismatch(
+      (ArrayImp::A*)this, (ArrayImp::A*)other.ptr(), n, &Storage::mismatch);
+    return (i == n && size() == other->size()) ? END : i;
   }
   
+  // —————————————————————————————————————————————————————————————————————
+  // Array chunks
+
+  template <typename T>
+  inline const T* ArrayChunk<T>::data() const {
+    static_assert(ArrayUnboxed<T>::value, "data() is only available for unboxed arrays");
+    return &Storage::at(_slots, _begin);
+  }
+
+  template <typename T>
+  template <typename F>
+  inline void Array<T>::forEachChunk(F&& fn, uint32 start, uint32 end) const {
+    end = end == END ? _end : min(_start + end, _end);
+    start = min(_start + start, end);
+    ArrayImp::forEachLeaf((ArrayImp::A*)this, start, end, 1,
+      [&] (uint32, ref<Object>* slots, uint32 from, uint32 to) {
+        fn((const ArrayChunk<T>&)ArrayChunk<T>(slots, from, to));
+      });
+  }
+
+  template <typename T>
+  inline typename Array<T>::ChunkRange Array<T>::chunks(uint32 start, uint32 end) const {
+    end = end == END ? _end : min(_start + end, _end);
+    return ChunkRange(this, min(_start + start, end), end);
+  }
+
+  template <typename T>
+  inline Array<T>::ChunkRange::iterator::iterator(const Array* a, uint32 i, uint32 end)
+    : _a(a), _i(i), _end(end)
+  {
+    if (_i < _end) {
+      uint32 base, length;
+      auto slots = ArrayImp::slotsFor((ArrayImp::A*)a, _i, base, length);
+      _chunk = ArrayChunk<T>(slots, _i - base, min(_end - base, length));
+    }
+  }
+
+  template <typename T>
+  inline typename Array<T>::ChunkRange::iterator&
+  Array<T>::ChunkRange::iterator::operator++() {
+    *this = iterator(_a, _i + _chunk.size(), _end);
+    return *this;
+  }
+
+
   // —————————————————————————————————————————————————————————————————————
   // Array::Iterator
   
@@ -804,10 +1622,9 @@ namespace immutable {
     : _a(const_cast<Array*>(a))
     , _i(start)
     , _end(end)
-    , _base(_i - (_i % ArrayImp::BRANCHES))
   {
     if (_i < _end) {
-      _slots = ArrayImp::slotsFor((ArrayImp::A*)a, _i, _slotlen);
+      _slots = ArrayImp::slotsFor((ArrayImp::A*)a, _i, _base, _slotlen);
     } else {
       _slots = nullptr;
     }
@@ -815,35 +1632,52 @@ namespace immutable {
   
   template <typename T>
   inline Value<T>* Array<T>::Iterator::value() {
-    Object* obj = _slots[_i & ArrayImp::MASK];
+    static_assert(!UNBOXED, "value() is not available for unboxed arrays");
+    Object* obj = _slots[_i - _base];
     ImmutableAssertTypeTag(obj, ValueT::TYPE_TAG);
     return static_cast<ValueT*>(obj);
   }
 
   template <typename T>
   inline const Value<T>* Array<T>::Iterator::value() const {
-    Object* obj = _slots[_i & ArrayImp::MASK];
+    static_assert(!UNBOXED, "value() is not available for unboxed arrays");
+    Object* obj = _slots[_i - _base];
     ImmutableAssertTypeTag(obj, ValueT::TYPE_TAG);
     return static_cast<const ValueT*>(obj);
   }
 
+  template <typename T>
+  inline const void* Array<T>::Iterator::elem() const {
+    return Storage::elemAt(_slots, _i - _base);
+  }
+
   template <typename T>
   inline bool Array<T>::Iterator::valid() const {
     return _slots && _i < _end;
   }
   
   template <typename T>
-  inline T& Array<T>::Iterator::operator*() {
-    return value()->value;
+  inline T& Array<T>::Iterator::operator*() const {
+    return Storage::at(_slots, _i - _base);
+  }
+
+  template <typename T>
+  inline T& Array<T>::Iterator::operator[](difference_type n) const {
+    uint32 i = _i + n;
+    if (_slots && i - _base < _slotlen) {
+      return Storage::at(_slots, i - _base);
+    }
+    uint32 base, len;
+    auto slots = ArrayImp::slotsFor((ArrayImp::A*)_a.ptr(), i, base, len);
+    return Storage::at(slots, i - base);
   }
   
   template <typename T>
   inline typename Array<T>::Iterator& Array<T>::Iterator::operator++() { // ++i
     ++_i;
     if (_i < _end) {
-      if (_i - _base == ArrayImp::BRANCHES) {
-        _slots = ArrayImp::slotsFor((ArrayImp::A*)_a.ptr(), _i, _slotlen);
-        _base += ArrayImp::BRANCHES;
+      if (_i - _base == _slotlen) {
+        _slots = ArrayImp::slotsFor((ArrayImp::A*)_a.ptr(), _i, _base, _slotlen);
       }
     } else {
       // reached end
@@ -858,6 +1692,44 @@ namespace immutable {
     operator++();
     return copy;
   }
+
+  template <typename T>
+  inline typename Array<T>::Iterator& Array<T>::Iterator::operator--() { // --i
+    --_i;
+    // Note: _slots is null when moving back from the end
+    if (!_slots || _i - _base >= _slotlen) {
+      _slots = ArrayImp::slotsFor((ArrayImp::A*)_a.ptr(), _i, _base, _slotlen);
+    }
+    return *this;
+  }
+
+  template <typename T>
+  inline typename Array<T>::Iterator Array<T>::Iterator::operator--(int) { // i--
+    Iterator copy(*this);
+    operator--();
+    return copy;
+  }
+
+  template <typename T>
+  inline typename Array<T>::Iterator& Array<T>::Iterator::operator+=(difference_type n) {
+    _i += n;
+    if (_i < _end) {
+      // Note: unsigned wrap-around makes _i - _base large when _i < _base
+      if (!_slots || _i - _base >= _slotlen) {
+        _slots = ArrayImp::slotsFor((ArrayImp::A*)_a.ptr(), _i, _base, _slotlen);
+      }
+    } else {
+      // reached end
+      _slots = nullptr;
+    }
+    return *this;
+  }
+
+  template <typename T>
+  inline typename Array<T>::Iterator::difference_type
+  Array<T>::Iterator::operator-(const Iterator& rhs) const {
+    return difference_type(pos(rhs)) - difference_type(rhs.pos(*this));
+  }
   
   template <typename T>
   inline bool Array<T>::Iterator::operator==(const Array<T>::Iterator& rhs) const {
@@ -871,8 +1743,7 @@ namespace immutable {
   
   
   template <typename T>
-  inline typename Array<T>::Iterator::difference_type
-  Array<T>::Iterator::distanceTo(const Array<T>::Iterator& other) const {
+  inline uint32 Array<T>::Iterator::distanceTo(const Array<T>::Iterator& other) const {
     if (!_slots) { // E - I
       return other._end - other._i;
     }
@@ -883,4 +1754,110 @@ namespace immutable {
   }
 
 
+  // —————————————————————————————————————————————————————————————————————
+  // Array::ReverseIterator
+
+  template <typename T>
+  inline typename Array<T>::ReverseIterator Array<T>::rbegin(uint32 start, uint32 end) const {
+    uint32 absend = end == END ? _end : min(_start + end, _end);
+    return ReverseIterator(this, min(_start + start, absend), absend);
+  }
+
+  template <typename T>
+  inline Array<T>::ReverseIterator::ReverseIterator(const Array* a, uint32 start, uint32 end)
+    // Note: start and end are absolute
+    : _a(const_cast<Array*>(a))
+    , _i(end)
+    , _start(start)
+  {
+    if (_i > _start) {
+      _slots = ArrayImp::slotsFor((ArrayImp::A*)a, _i - 1, _base, _slotlen);
+    }
+  }
+
+  template <typename T>
+  inline T& Array<T>::ReverseIterator::operator*() const {
+    return Storage::at(_slots, _i - 1 - _base);
+  }
+
+  template <typename T>
+  inline Value<T>* Array<T>::ReverseIterator::value() const {
+    static_assert(!UNBOXED, "value() is not available for unboxed arrays");
+    Object* obj = _slots[_i - 1 - _base];
+    ImmutableAssertTypeTag(obj, ValueT::TYPE_TAG);
+    return static_cast<ValueT*>(obj);
+  }
+
+  template <typename T>
+  inline typename Array<T>::ReverseIterator& Array<T>::ReverseIterator::operator++() { // ++i
+    --_i;
+    if (_i > _start) {
+      if (_i - 1 < _base) {
+        _slots = ArrayImp::slotsFor((ArrayImp::A*)_a.ptr(), _i - 1, _base, _slotlen);
+      }
+    } else {
+      // reached end
+      _slots = nullptr;
+    }
+    return *this;
+  }
+
+  template <typename T>
+  inline typename Array<T>::ReverseIterator Array<T>::ReverseIterator::operator++(int) { // i++
+    ReverseIterator copy(*this);
+    operator++();
+    return copy;
+  }
+
+  template <typename T>
+  inline typename Array<T>::ReverseIterator& Array<T>::ReverseIterator::operator--() { // --i
+    ++_i;
+    // Note: _slots is null when moving back from the end
+    if (!_slots || _i - 1 - _base == _slotlen) {
+      _slots = ArrayImp::slotsFor((ArrayImp::A*)_a.ptr(), _i - 1, _base, _slotlen);
+    }
+    return *this;
+  }
+
+  template <typename T>
+  inline typename Array<T>::ReverseIterator Array<T>::ReverseIterator::operator--(int) { // i--
+    ReverseIterator copy(*this);
+    operator--();
+    return copy;
+  }
+
+  template <typename T>
+  inline bool Array<T>::ReverseIterator::operator==(const ReverseIterator& rhs) const {
+    if (_slots != rhs._slots) { return false; }
+    if (!_slots) { // both slots are null
+      // == rend
+      return true;
+    }
+    return _i == rhs._i;
+  }
+
+
+
+  // Compares arrays by value (see Array::equals and BitArray::equals), e.g. for the
+  // keys of unordered containers which are hashed by value with std::hash:
+  //   std::unordered_set<ref<Array<int>>, std::hash<ref<Array<int>>>, ArrayEqualTo>
+  struct ArrayEqualTo {
+    template <typename A>
+    bool operator()(const ref<A>& a, const ref<A>& b) const {
+      return a->equals(b);
+    }
+  };
+
+
 } // namespace
+
+
+namespace std {
+  // Hashes arrays by value (see Array::hash)
+  template <typename T>
+  struct hash<immutable::ref<immutable::Array<T>>> {
+    size_t operator()(const immutable::ref<immutable::Array<T>>& a) const {
+      return size_t(a->hash());
+    }
+  };
+}
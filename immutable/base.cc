@@ -0,0 +1,198 @@
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "base.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace immutable {
+
+  // Note: both are constant-initialized, so kinds can be registered during static
+  // initialization of other translation units.
+  ObjectDeallocFunc Object::_deallocFuncs[Object::MAX_KINDS];
+  static std::atomic<uint32> nextKind{0};
+
+  static EditID nextEditID = 1;
+
+  EditID newEditID() {
+    return __atomic_fetch_add(&nextEditID, 1, __ATOMIC_RELAXED);
+  }
+
+  uint16 Object::registerKind(ObjectDeallocFunc f) {
+    uint32 kind = nextKind.fetch_add(1, std::memory_order_relaxed);
+    if (kind >= MAX_KINDS) {
+      fprintf(stderr, "immutable: too many object kinds (max %u)\n", MAX_KINDS);
+      abort();
+    }
+    _deallocFuncs[kind] = f;
+    return uint16(kind);
+  }
+
+
+#ifdef IMMUTABLE_BIASED_REFCOUNT
+
+  // An object queued for merging by its owner thread
+  struct QueuedRef {
+    const BiasedRefCount* rc;
+    const void*           obj;
+    RefCountedDeallocFunc dealloc;
+  };
+
+  // Merge queues of live threads, by thread id. Threads are removed when they exit;
+  // objects owned by a thread which has exited are merged by the releasing thread.
+  struct BiasedThreads {
+    struct Entry {
+      uint32*                pending; // the thread's ThreadState::pending
+      std::vector<QueuedRef> queue;
+    };
+    std::mutex                        mu;
+    std::unordered_map<uint32,Entry>  threads;
+    std::atomic<uint32>               nextID{1};
+  };
+
+  // Note: allocated and never freed, as objects may be released during and after
+  // static destruction.
+  static BiasedThreads& biasedThreads() {
+    static BiasedThreads* t = new BiasedThreads;
+    return *t;
+  }
+
+  // Thread ids are never reused. Threads which have exited get DEAD_THREAD, so that
+  // objects they release from then on are always counted as shared.
+  static constexpr uint32 DEAD_THREAD = 0xffffffff;
+
+  // Unregisters the calling thread when it exits, after merging its queue
+  struct BiasedThreadExit {
+    uint32* id;
+    ~BiasedThreadExit();
+  };
+
+  BiasedThreadExit::~BiasedThreadExit() {
+    BiasedRefCount::mergeQueued();
+    auto& bt = biasedThreads();
+    std::vector<QueuedRef> queue;
+    {
+      std::lock_guard<std::mutex> lock(bt.mu);
+      auto I = bt.threads.find(*id);
+      queue.swap(I->second.queue);
+      bt.threads.erase(I);
+      *id = DEAD_THREAD;
+    }
+    for (auto& q : queue) {
+      q.rc->merge(q.obj, q.dealloc);
+    }
+  }
+
+
+  uint32 BiasedRefCount::registerThread() {
+    static thread_local BiasedThreadExit exit;
+    auto& t = threadState();
+    auto& bt = biasedThreads();
+    std::lock_guard<std::mutex> lock(bt.mu);
+    t.id = bt.nextID.fetch_add(1, std::memory_order_relaxed);
+    bt.threads[t.id].pending = &t.pending;
+    exit.id = &t.id;
+    return t.id;
+  }
+
+
+  void BiasedRefCount::mergeQueued() {
+    auto& t = threadState();
+    if (t.id == 0 || t.id == DEAD_THREAD) {
+      return;
+    }
+    auto& bt = biasedThreads();
+    std::vector<QueuedRef> queue;
+    {
+      std::lock_guard<std::mutex> lock(bt.mu);
+      queue.swap(bt.threads[t.id].queue);
+      __atomic_store_n(&t.pending, 0, __ATOMIC_RELAXED);
+    }
+    // Note: merging may deallocate objects which release other objects and so
+    // re-enter mergeQueued, which then finds an empty queue.
+    for (auto& q : queue) {
+      q.rc->merge(q.obj, q.dealloc);
+    }
+  }
+
+
+  // Called by the owner thread when its count drops to zero
+  bool BiasedRefCount::releaseOwned(const void* obj, RefCountedDeallocFunc dealloc) const {
+    int32 prev = __atomic_fetch_or(&_shared, MERGED, __ATOMIC_ACQ_REL);
+    if ((prev & QUEUED) == 0 && (prev >> 2) == 0) {
+      dealloc(obj);
+      return true;
+    }
+    // Other threads hold references, or obj is in our queue and is deallocated when
+    // the queue is merged. Note: releaseShared relies on MERGED being set before the
+    // owner is cleared.
+    __atomic_store_n(&_owner, 0, __ATOMIC_RELEASE);
+    return false;
+  }
+
+
+  // Called by threads other than the owner
+  bool BiasedRefCount::releaseShared(const void* obj, RefCountedDeallocFunc dealloc) const {
+    int32 prev = __atomic_load_n(&_shared, __ATOMIC_RELAXED);
+    int32 next;
+    do {
+      next = prev - ONE;
+      if ((prev & (MERGED | QUEUED)) == 0 && (next >> 2) <= 0) {
+        // We have released at least as many references as this thread and others
+        // have retained, so the owner may hold none and it must merge the counts.
+        next |= QUEUED;
+      }
+    } while (!__atomic_compare_exchange_n(
+      &_shared, &prev, next, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if (prev & MERGED) {
+      if (next == MERGED) {
+        dealloc(obj);
+        return true;
+      }
+      return false;
+    }
+    if ((next & QUEUED) == 0 || (prev & QUEUED)) {
+      return false;
+    }
+
+    // Queue obj with its owner. If the owner has already merged (after our update
+    // above), or has exited, merge here.
+    uint32 owner = __atomic_load_n(&_owner, __ATOMIC_ACQUIRE);
+    if (owner != 0) {
+      auto& bt = biasedThreads();
+      std::lock_guard<std::mutex> lock(bt.mu);
+      auto I = bt.threads.find(owner);
+      if (I != bt.threads.end()) {
+        I->second.queue.push_back(QueuedRef{this, obj, dealloc});
+        __atomic_store_n(I->second.pending, 1, __ATOMIC_RELAXED);
+        return false;
+      }
+    }
+    return merge(obj, dealloc);
+  }
+
+
+  // Merges the counts of a queued object. Called by the owner thread, or by any thread
+  // when the owner has exited or has already merged.
+  bool BiasedRefCount::merge(const void* obj, RefCountedDeallocFunc dealloc) const {
+    int32 prev = __atomic_load_n(&_shared, __ATOMIC_ACQUIRE);
+    int32 biased = (prev & MERGED) ? 0 : int32(_biased);
+    _biased = 0;
+    __atomic_store_n(&_owner, 0, __ATOMIC_RELAXED);
+    int32 next;
+    do {
+      next = ((prev & ~QUEUED) + biased * ONE) | MERGED;
+    } while (!__atomic_compare_exchange_n(
+      &_shared, &prev, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if (next == MERGED) {
+      dealloc(obj);
+      return true;
+    }
+    return false;
+  }
+
+#endif // IMMUTABLE_BIASED_REFCOUNT
+
+} // namespace
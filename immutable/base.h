@@ -2,6 +2,8 @@
 #include <assert.h>
 #include <stdint.h>
 #include <functional>
+#include <type_traits>
+#include <utility>
 
 namespace immutable {
 
@@ -42,8 +44,12 @@ using intz   = intptr_t;
 using uintz  = uintptr_t;
 using int32  = int32_t;
 using uint32 = uint32_t;
+using int64  = int64_t;
+using uint64 = uint64_t;
 using int8   = int8_t;
 using uint8  = uint8_t;
+using int16  = int16_t;
+using uint16 = uint16_t;
 
 // does the compiler and libc provide C11 stdatomic.h?
 #if !defined(__STDC_NO_ATOMICS__) && \
@@ -103,9 +109,9 @@ atomic_incr32(volatile atomicu32* ptr, uint32 delta) {
      )
   // all x86 archs but i386
   asm __volatile__ (
-    "lock xaddl %1, %0\n" // add delta to operand
-    : // no output
-    : "m" (*ptr), "r" (delta)
+    "lock addl %1, %0\n" // add delta to operand
+    : "+m" (*ptr)
+    : "ir" (delta)
   );
 #elif defined(IMMUTABLE_HAS_STDATOMIC)
   atomic_fetch_add_explicit(ptr, delta, memory_order_acq_rel);
@@ -165,6 +171,31 @@ inline static uint32 atomic_acq_load32(volatile atomicu32* ptr) {
 #endif
 }
 
+// non-atomic versions of atomic_incr32 and atomic_fetch_decr32, for counts which are
+// only ever accessed by one thread
+inline static void IMMUTABLE_UNUSED
+local_incr32(volatile atomicu32* ptr, uint32 delta) {
+#ifdef IMMUTABLE_HAS_STDATOMIC
+  __c11_atomic_store(ptr, __c11_atomic_load(ptr, memory_order_relaxed) + delta,
+                     memory_order_relaxed);
+#else
+  *ptr += delta;
+#endif
+}
+
+inline static uint32 IMMUTABLE_UNUSED
+local_fetch_decr32(volatile atomicu32* ptr, uint32 delta) {
+#ifdef IMMUTABLE_HAS_STDATOMIC
+  uint32 v = __c11_atomic_load(ptr, memory_order_relaxed);
+  __c11_atomic_store(ptr, v - delta, memory_order_relaxed);
+  return v;
+#else
+  uint32 v = *ptr;
+  *ptr = v - delta;
+  return v;
+#endif
+}
+
 // ————————————————————————————————————————————————————————————————————————————————————
 // language utils
 
@@ -189,18 +220,28 @@ min(const T& a, const T& b) {
   return a < b ? a : b;
 }
 
+template <typename T> inline T
+max(const T& a, const T& b) {
+  return a < b ? b : a;
+}
+
 
 // ————————————————————————————————————————————————————————————————————————————————————
 // Reference counting
 
-// Interface defining the reference count implementation methods
-struct RefCounted {
-  virtual void retain() const =0;
-  virtual bool release() const =0; // true if count is zero and obj was deleted
-  virtual bool hasSingleRef() const =0;
- protected:
-  virtual ~RefCounted() {}
-};
+// Base of reference-counted types, which implement the following methods, usually
+// with IMMUTABLE_REFCOUNTED_IMPL:
+//   void retain() const;
+//   bool release() const; // true if count is zero and obj was deleted
+//   bool hasSingleRef() const;
+// The methods are not virtual, so that ref<T> can inline them. Objects must therefore
+// be referenced by their actual type, with the exception of Object which dispatches
+// deallocation on the object's kind.
+struct RefCounted {};
+
+
+// Function which deallocates a reference-counted object
+using RefCountedDeallocFunc = void(*)(const void* obj);
 
 
 // Class that implements atomic reference counting.
@@ -226,25 +267,177 @@ struct RefCount {
 
   mutable atomicu32 _refcount;
 };
+
+
+// Class that implements non-atomic reference counting, for objects that are only
+// referenced by one thread at a time. Avoids the cost of locked instructions.
+struct LocalRefCount {
+  LocalRefCount(uint32 initialCount) : _refcount(initialCount) {}
+  LocalRefCount() : LocalRefCount(0) {}
+
+  void retain() const {
+    ++_refcount;
+  }
+
+  bool release() const {
+    return --_refcount == 0;
+  }
+
+  bool hasSingleRef() const {
+    return _refcount == 1;
+  }
+
+ private:
+  LocalRefCount(const LocalRefCount&) = delete;
+  void operator=(const LocalRefCount&) = delete;
+
+  mutable uint32 _refcount;
+};
+
+
+#ifdef IMMUTABLE_BIASED_REFCOUNT
+// Class that implements biased reference counting (Choi et al., "Biased Reference
+// Counting", PACT 2018). The thread which creates an object owns it and counts its
+// references without atomic instructions, while other threads use a separate, atomic
+// count. The counts are merged when the owner's count drops to zero, or, when other
+// threads release more references than they retained (e.g. when an object is passed to
+// another thread), by the owner thread once it notices, the next time it releases one
+// of its own references, or when it exits.
+struct BiasedRefCount {
+  BiasedRefCount() : _owner(currentThread()), _biased(0), _shared(0) {}
+
+  void retain() const {
+    if (__atomic_load_n(&_owner, __ATOMIC_RELAXED) == currentThread()) {
+      ++_biased;
+    } else {
+      __atomic_fetch_add(&_shared, ONE, __ATOMIC_RELAXED);
+    }
+  }
+
+  // Returns true if the count reached zero and dealloc(obj) was called. dealloc may
+  // also be called later, by another thread, in which case false is returned.
+  bool release(const void* obj, RefCountedDeallocFunc dealloc) const {
+    if (__atomic_load_n(&_owner, __ATOMIC_RELAXED) == currentThread()) {
+      bool freed = --_biased == 0 && releaseOwned(obj, dealloc);
+      if (__atomic_load_n(&threadState().pending, __ATOMIC_RELAXED)) {
+        mergeQueued();
+      }
+      return freed;
+    }
+    return releaseShared(obj, dealloc);
+  }
+
+  // Note: may return false for a single reference held by a thread other than the
+  // owner, before the counts have been merged.
+  bool hasSingleRef() const {
+    int32 shared = __atomic_load_n(&_shared, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&_owner, __ATOMIC_RELAXED) == currentThread()) {
+      return _biased + (shared >> 2) == 1;
+    }
+    return (shared & MERGED) && (shared >> 2) == 1;
+  }
+
+  // Merges the counts of objects owned by the calling thread which other threads have
+  // released. This happens automatically, but a thread which owns objects that other
+  // threads release, yet rarely releases anything itself, can call this periodically
+  // to have those objects freed sooner.
+  static void mergeQueued();
+
+ private:
+  BiasedRefCount(const BiasedRefCount&) = delete;
+  void operator=(const BiasedRefCount&) = delete;
+
+  // _shared holds the shared count times ONE, plus flags
+  static constexpr int32 ONE    = 4;
+  static constexpr int32 MERGED = 1; // counts have been merged; _biased is unused
+  static constexpr int32 QUEUED = 2; // queued for merging by the owner thread
+
+  struct ThreadState {
+    uint32 id;      // zero until first use
+    uint32 pending; // set by other threads when objects are queued for merging
+  };
+
+  static ThreadState& threadState() {
+    static thread_local ThreadState t; // zero-initialized, so no guard is needed
+    return t;
+  }
+
+  static IMMUTABLE_ALWAYS_INLINE uint32 currentThread() {
+    uint32 id = threadState().id;
+    return id ? id : registerThread();
+  }
+
+  friend struct BiasedThreadExit;
+  static uint32 registerThread();
+  bool releaseOwned(const void* obj, RefCountedDeallocFunc) const;
+  bool releaseShared(const void* obj, RefCountedDeallocFunc) const;
+  bool merge(const void* obj, RefCountedDeallocFunc) const;
+
+  mutable uint32 _owner;  // id of owning thread, or 0 once merged
+  mutable uint32 _biased; // count of references held by the owner thread
+  mutable int32  _shared;
+};
+#endif
+
+
+// Decides the kind of reference count used by objects of type T (that use
+// IMMUTABLE_REFCOUNTED_IMPL). Defaults to RefCount, or to LocalRefCount when
+// IMMUTABLE_SINGLE_THREADED is defined, or to BiasedRefCount when
+// IMMUTABLE_BIASED_REFCOUNT is defined. Specialize to change it for a single type, e.g.
+//   template <> struct RefCountPolicy<Value<Foo>> { using type = LocalRefCount; };
+//
+// Note: Array nodes and Array objects are shared by arrays of all value types and so
+// always use the default. With IMMUTABLE_BIASED_REFCOUNT, all Objects (Values and
+// nodes) are biased, regardless of their policy.
+#if defined(IMMUTABLE_SINGLE_THREADED) && defined(IMMUTABLE_BIASED_REFCOUNT)
+  #error "IMMUTABLE_SINGLE_THREADED and IMMUTABLE_BIASED_REFCOUNT are mutually exclusive"
+#elif defined(IMMUTABLE_SINGLE_THREADED)
+  using DefaultRefCount = LocalRefCount;
+#elif defined(IMMUTABLE_BIASED_REFCOUNT)
+  using DefaultRefCount = BiasedRefCount;
+#else
+  using DefaultRefCount = RefCount;
+#endif
+template <typename T> struct RefCountPolicy {
+  using type = DefaultRefCount;
+};
+
+
   
-  
+// Releases a reference counted by rc, which belongs to obj, and calls dealloc(obj)
+// when the count reaches zero. Returns true if obj was deallocated.
+template <typename RC>
+inline bool releaseRef(const RC& rc, const void* obj, RefCountedDeallocFunc dealloc) {
+  if (rc.release()) {
+    dealloc(obj);
+    return true;
+  }
+  return false;
+}
+#ifdef IMMUTABLE_BIASED_REFCOUNT
+inline bool releaseRef(
+  const BiasedRefCount& rc, const void* obj, RefCountedDeallocFunc dealloc)
+{
+  return rc.release(obj, dealloc);
+}
+#endif
+
 #define IMMUTABLE_REFCOUNTED_IMPL(T)        \
   public:                                   \
-    void retain() const override {          \
+    void retain() const {                   \
       _refcount.retain();                   \
     }                                       \
-    bool release() const override {         \
-      if (_refcount.release()) {            \
-        const_cast<T*>(this)->dealloc();    \
-        return true;                        \
-      }                                     \
-      return false;                         \
+    bool release() const {                  \
+      return ::immutable::releaseRef(_refcount, this, &T::deallocRefCounted); \
     }                                       \
-    bool hasSingleRef() const override {    \
+    bool hasSingleRef() const {             \
       return _refcount.hasSingleRef();      \
     }                                       \
   private:                                  \
-    ::immutable::RefCount _refcount;
+    static void deallocRefCounted(const void* p) { \
+      const_cast<T*>(static_cast<const T*>(p))->dealloc(); \
+    }                                       \
+    typename ::immutable::RefCountPolicy<T>::type _refcount;
 
 
 // Ref manages a reference to a RefCounted object
@@ -302,12 +495,13 @@ public:
   }
 
   ref<T>& operator=(ref<T>&& r) {
-    if (r._ptr != _ptr) {
+    if (&r != this) {
+      // Note: when both refer to the same object, r's reference must still be released
       T* old_ptr = _ptr;
       _ptr = r._ptr;
+      r._ptr = nullptr;
       if (old_ptr) { old_ptr->release(); }
     }
-    r._ptr = nullptr;
     return *this;
   }
   
@@ -353,14 +547,108 @@ using TypeTag = char;
 #endif
 
 
-// Optionally type-tagged object
+// Nodes created by a transient are stamped with the transient's edit token and may be
+// modified in-place by it until it's made persistent. Tokens are drawn from a global
+// counter, one per transient, and never reused, so a transient is not tied to the
+// thread that created it and no other transient can ever modify its nodes.
+using EditID = uint64;
+static constexpr EditID NO_EDIT = 0;
+EditID newEditID();
+
+
+// Index meaning "to the end", e.g. of an array or rope
+static constexpr uint32 END = 0xffffffff;
+
+
+struct Object;
+
+// Function which destroys an object when its last reference is released
+using ObjectDeallocFunc = void(*)(Object*);
+
+
+// Reference-counted, optionally type-tagged object. Objects of different types are
+// referenced through ref<Object>, e.g. in the nodes of an array, yet Object has no
+// virtual methods: the reference count lives in the object header and deallocation
+// is dispatched on the object's kind, a small integer which indexes a table of
+// dealloc functions. Each concrete type registers a kind with registerKind.
 struct Object : RefCounted {
+  // Registers a dealloc function for a kind of object and returns the kind.
+  // Aborts if more than MAX_KINDS kinds are registered.
+  static constexpr uint32 MAX_KINDS = 4096;
+  static uint16 registerKind(ObjectDeallocFunc);
+
+#ifdef IMMUTABLE_BIASED_REFCOUNT
+  void retain() const { _refcount.retain(); }
+  bool release() const { return _refcount.release(this, &dealloc); }
+  bool hasSingleRef() const { return _refcount.hasSingleRef(); }
+#else
+  void retain() const {
+    if (isLocal()) {
+      local_incr32(&_refcount, 1);
+    } else {
+      atomic_incr32(&_refcount, 1);
+    }
+  }
+
+  bool release() const {
+    if ((isLocal() ? local_fetch_decr32(&_refcount, 1) :
+                     atomic_fetch_decr32(&_refcount, 1)) == 1) {
+      dealloc(this);
+      return true;
+    }
+    return false;
+  }
+
+  bool hasSingleRef() const {
+    return atomic_acq_load32(&_refcount) == 1;
+  }
+#endif
+
+ protected:
+  // local selects non-atomic reference counting (see RefCountPolicy)
   #ifdef IMMUTABLE_WITH_TYPE_TAGS
-  ImmutableTypeTagHead
-  Object(TypeTag t) : typeTag(t) {}
+  Object(TypeTag t, uint16 kind, bool local)
+    : _refcount(), _kind(kind), _local(local)
+  {
+    typeTag = t;
+  }
   #else
-  Object(TypeTag) {}
+  Object(TypeTag, uint16 kind, bool local)
+    : _refcount(), _kind(kind), _local(local) {}
   #endif
+
+ private:
+  Object(const Object&) = delete;
+  void operator=(const Object&) = delete;
+
+  bool isLocal() const {
+    #ifdef IMMUTABLE_SINGLE_THREADED
+    return true;
+    #else
+    return _local;
+    #endif
+  }
+
+  static void dealloc(const void* p) {
+    auto obj = static_cast<const Object*>(p);
+    _deallocFuncs[obj->_kind](const_cast<Object*>(obj));
+  }
+
+  #ifdef IMMUTABLE_BIASED_REFCOUNT
+  BiasedRefCount    _refcount; // local is ignored
+  #else
+  mutable atomicu32 _refcount;
+  #endif
+  uint16            _kind;
+  bool              _local;
+
+ public:
+  #ifdef IMMUTABLE_WITH_TYPE_TAGS
+  ImmutableTypeTagHead
+  #endif
+
+ private:
+  static ObjectDeallocFunc _deallocFuncs[MAX_KINDS];
 };
 
 
@@ -372,7 +660,7 @@ struct Value : Object {
   // Forwarding constructor
   template <class... Args>
   Value(Args&&... args)
-    : Object(TYPE_TAG), value(fwd<Args>(args)...)
+    : Object(TYPE_TAG, kind(), LOCAL), value(fwd<Args>(args)...)
   {}
 
   // allow implicit cast to T
@@ -387,17 +675,26 @@ struct Value : Object {
   bool operator==(const Value& rhs) const { return std::equal_to<T>()(value, rhs.value); }
   bool operator!=(const Value& rhs) const { return std::not_equal_to<T>()(value, rhs.value); }
 
-  // copyable and movable
-  Value(const Value&) = default;
-  Value(Value&&) = default;
-  Value& operator=(const Value&) = default;
-  Value& operator=(Value&&) = default;
+  // copyable and movable. Only the value is copied; a copy has its own reference count.
+  Value(const Value& v) : Object(TYPE_TAG, kind(), LOCAL), value(v.value) {}
+  Value(Value&& v) : Object(TYPE_TAG, kind(), LOCAL), value(std::move(v.value)) {}
+  Value& operator=(const Value& v) { value = v.value; return *this; }
+  Value& operator=(Value&& v) { value = std::move(v.value); return *this; }
 
-  void dealloc() { delete this; }
   static constexpr TypeTag TYPE_TAG = 'V';
-  IMMUTABLE_REFCOUNTED_IMPL(Value)
+
+  // Object kind of Value<T>
+  static uint16 kind() {
+    static const uint16 k = registerKind([] (Object* obj) {
+      delete static_cast<Value*>(obj);
+    });
+    return k;
+  }
+
+ private:
+  static constexpr bool LOCAL =
+    std::is_same<typename RefCountPolicy<Value>::type, LocalRefCount>::value;
 };
 
 
 } // namespace
-
@@ -0,0 +1,364 @@
+#include "bitarray.h"
+
+namespace immutable {
+
+  static uint32 popcountScalar(const uint64* w, uint32 n) {
+    uint32 count = 0;
+    for (uint32 i = 0; i < n; ++i) {
+      count += __builtin_popcountll(w[i]);
+    }
+    return count;
+  }
+
+#if IMMUTABLE_TARGET_ARCH_X64
+
+  // Same as popcountScalar, with popcount compiled to the POPCNT instruction
+  __attribute__((target("popcnt")))
+  static uint32 popcountPOPCNT(const uint64* w, uint32 n) {
+    uint32 count = 0;
+    for (uint32 i = 0; i < n; ++i) {
+      count += __builtin_popcountll(w[i]);
+    }
+    return count;
+  }
+
+  static uint32 popcountWords(const uint64* w, uint32 n) {
+    static const bool popcnt = __builtin_cpu_supports("popcnt");
+    return popcnt ? popcountPOPCNT(w, n) : popcountScalar(w, n);
+  }
+
+#else
+
+  static uint32 popcountWords(const uint64* w, uint32 n) {
+    return popcountScalar(w, n);
+  }
+
+#endif
+
+  // Reads the values of an BitArray 64 at a time, from words starting at bit shift
+  struct PackedWordReader {
+    Array<uint64>::Iterator it;
+    uint32 shift;
+    uint64 word; // *it
+
+    PackedWordReader(const Array<uint64>* words, uint32 shift)
+      : it(words->begin()), shift(shift), word(it.valid() ? *it : 0) {}
+
+    uint64 next() {
+      uint64 w = word >> shift;
+      ++it;
+      word = it.valid() ? *it : 0;
+      return shift ? w | (word << (64 - shift)) : w;
+    }
+  };
+
+  ref<BitArray> BitArray::empty() {
+    static ref<BitArray> e = new BitArray(Words::empty(), 0, 0);
+    return e;
+  }
+
+  ref<BitArray> BitArray::create(uint32 n, bool value) {
+    if (n == 0) {
+      return empty();
+    }
+    uint32 nwords = ((n - 1) >> 6) + 1;
+    ArrayBuilder<uint64> b(nwords);
+    for (uint32 k = 0; k < nwords; ++k) {
+      b.push_back(value ? ~uint64(0) : 0);
+    }
+    return new BitArray(b.build(), 0, n);
+  }
+
+  // Note: bits after _end in the last word may have any value, so they are written
+  // by push and masked out when words are read as a whole.
+
+  ref<BitArray> BitArray::push(bool v) const {
+    if ((_end & 63) == 0) {
+      return new BitArray(_words->push(uint64(v)), _start, _end + 1);
+    }
+    uint32 k = _end >> 6;
+    uint64 bit = uint64(1) << (_end & 63);
+    uint64 w = _words->get(k);
+    if (bool(w & bit) == v) {
+      return new BitArray(_words, _start, _end + 1);
+    }
+    return new BitArray(_words->set(k, w ^ bit), _start, _end + 1);
+  }
+
+  ref<BitArray> BitArray::cons(bool v) const {
+    if (_start > 0) {
+      uint32 i = _start - 1;
+      uint64 bit = uint64(1) << i;
+      uint64 w = _words->get(0);
+      return new BitArray(bool(w & bit) == v ? _words : _words->set(0, w ^ bit), i, _end);
+    }
+    // prepends a word which holds v in its last bit
+    return new BitArray(_words->cons(uint64(v) << 63), 63, _end + 64);
+  }
+
+  ref<BitArray> BitArray::set(uint32 i, bool v) const {
+    if (i >= size()) {
+      return nullptr; // index out-of bounds
+    }
+    i += _start;
+    uint64 bit = uint64(1) << (i & 63);
+    uint64 w = _words->get(i >> 6);
+    if (bool(w & bit) == v) {
+      return const_cast<BitArray*>(this);
+    }
+    return new BitArray(_words->set(i >> 6, w ^ bit), _start, _end);
+  }
+
+  ref<BitArray> BitArray::pop() const {
+    if (size() <= 1) {
+      return size() ? empty() : ref<BitArray>(const_cast<BitArray*>(this));
+    }
+    uint32 end = _end - 1;
+    return new BitArray((end & 63) ? _words : _words->pop(), _start, end);
+  }
+
+  ref<BitArray> BitArray::slice(uint32 start, uint32 end) const {
+    if (end == END) {
+      end = size();
+    }
+    if (start > end || end > size()) {
+      return nullptr;
+    }
+    if (start == end) {
+      return empty();
+    }
+    if (start == 0 && end == size()) {
+      return const_cast<BitArray*>(this);
+    }
+    start += _start;
+    end += _start;
+    auto words = _words->slice(start >> 6, ((end - 1) >> 6) + 1);
+    return new BitArray(words, start & 63, (start & 63) + end - start);
+  }
+
+  void BitArray::pushWords(TransientArray<uint64>* words, uint32& end, const BitArray* b) {
+    PackedWordReader r(b->_words, b->_start);
+    uint32 shift = end & 63;
+    for (uint32 n = b->size(); n > 0; ) {
+      uint64 w = r.next();
+      uint32 m = min(n, uint32(64));
+      if (shift == 0) {
+        words->push(w);
+      } else {
+        // w is split between the last word and a new word
+        uint32 k = end >> 6;
+        words->set(k, (words->get(k) & ~(~uint64(0) << shift)) | (w << shift));
+        if (m > 64 - shift) {
+          words->push(w >> (64 - shift));
+        }
+      }
+      end += m;
+      n -= m;
+    }
+  }
+
+  ref<BitArray> BitArray::concat(ref<BitArray> other) const {
+    if (other->size() == 0) {
+      return const_cast<BitArray*>(this);
+    }
+    if (size() == 0) {
+      return other;
+    }
+    uint32 shift = _end & 63;
+    if (shift == other->_start) {
+      // The values of other are at the bit offsets they have in the result, so its
+      // words are shared apart from the one where the arrays meet
+      uint32 end = _end + other->size();
+      if (shift == 0) {
+        return new BitArray(_words->concat(other->_words), _start, end);
+      }
+      uint32 k = _end >> 6;
+      uint64 mask = ~uint64(0) << shift;
+      uint64 w = (_words->get(k) & ~mask) | (other->_words->first() & mask);
+      return new BitArray(_words->set(k, w)->concat(other->_words->rest()), _start, end);
+    }
+    auto t = _words->asTransient();
+    uint32 end = _end;
+    pushWords(t.ptr(), end, other.ptr());
+    return new BitArray(t->makePersistent(), _start, end);
+  }
+
+  ref<BitArray> BitArray::splice(uint32 start, uint32 end, ref<BitArray> a) const {
+    if (start > end || end > size()) {
+      return nullptr;
+    }
+    if (start == 0 && end < size()) {
+      // Like Array<T>::splice, values are pushed after the remaining ones, e.g.
+      // [1 1 1 0 0] splice(0,3, [0 1]) => [0 0 0 1]
+      return slice(end)->concat(a);
+    }
+    return slice(0, start)->concat(a)->concat(slice(end));
+  }
+
+  ref<BitArray> BitArray::without(uint32 start, uint32 end) const {
+    if (end == END) {
+      end = size();
+    }
+    if (start > end || end > size()) {
+      return nullptr;
+    }
+    if (start == end) {
+      return const_cast<BitArray*>(this);
+    }
+    return slice(0, start)->concat(slice(end));
+  }
+
+  uint32 BitArray::popcount(uint32 start, uint32 end) const {
+    end = end == END ? _end : min(_start + end, _end);
+    start = min(_start + start, end);
+    if (start == end) {
+      return 0;
+    }
+    uint32 n = 0;
+    _words->forEachChunk([&](const ArrayChunk<uint64>& c) {
+      n += popcountWords(c.data(), c.size());
+    }, start >> 6, ((end - 1) >> 6) + 1);
+    // minus the bits before start and after end in the first and last words
+    n -= __builtin_popcountll(_words->get(start >> 6) & ~(~uint64(0) << (start & 63)));
+    if (end & 63) {
+      n -= __builtin_popcountll(_words->get(end >> 6) & (~uint64(0) << (end & 63)));
+    }
+    return n;
+  }
+
+  uint32 BitArray::findFirstSet(uint32 start) const {
+    if (start >= size()) {
+      return END;
+    }
+    start += _start;
+    uint32 k = start >> 6;
+    uint64 mask = ~uint64(0) << (start & 63);
+    for (auto& c : _words->chunks(k)) {
+      const uint64* w = c.data();
+      for (uint32 j = 0; j < c.size(); ++j, ++k) {
+        if (w[j] & mask) {
+          uint32 i = (k << 6) + __builtin_ctzll(w[j] & mask);
+          return i < _end ? i - _start : END;
+        }
+        mask = ~uint64(0);
+      }
+    }
+    return END;
+  }
+
+  ref<TransientBitArray> BitArray::asTransient() const {
+    return new TransientBitArray(_words->asTransient(), _start, _end);
+  }
+
+  int BitArray::compare(const ref<BitArray>& other) const {
+    if (size() != other->size()) {
+      return size() < other->size() ? -1 : 1;
+    }
+    uint32 i = mismatch(other);
+    return i == END ? 0 : get(i) ? 1 : -1;
+  }
+
+  uint64 BitArray::hash() const {
+    uint64 h = __atomic_load_n(&_hash, __ATOMIC_RELAXED);
+    if (h == 0) {
+      // Note: starts with the size, as trailing false values are zero bits
+      h = size();
+      PackedWordReader r(_words, _start);
+      for (uint32 n = size(); n > 0; n -= min(n, uint32(64))) {
+        uint64 mask = n >= 64 ? ~uint64(0) : ~(~uint64(0) << n);
+        h = h * ArrayImp::HASH_P + ArrayHashValue(r.next() & mask);
+      }
+      __atomic_store_n(&_hash, h, __ATOMIC_RELAXED);
+    }
+    return h;
+  }
+
+  bool BitArray::equals(const ref<BitArray>& other) const {
+    if (size() != other->size()) {
+      return false;
+    }
+    uint64 h1 = __atomic_load_n(&_hash, __ATOMIC_RELAXED);
+    uint64 h2 = __atomic_load_n(&other->_hash, __ATOMIC_RELAXED);
+    if (h1 != 0 && h2 != 0 && h1 != h2) {
+      return false;
+    }
+    return mismatch(other) == END;
+  }
+
+  uint32 BitArray::mismatch(const ref<BitArray>& other) const {
+    if (operator==(other)) {
+      return END;
+    }
+    uint32 n = min(size(), other->size());
+    PackedWordReader a(_words, _start), b(other->_words, other->_start);
+    for (uint32 i = 0; i < n; i += 64) {
+      uint64 d = a.next() ^ b.next();
+      if (n - i < 64) {
+        d &= ~(~uint64(0) << (n - i));
+      }
+      if (d) {
+        return i + __builtin_ctzll(d);
+      }
+    }
+    return size() == other->size() ? END : n;
+  }
+
+
+  ref<BitArray> TransientBitArray::makePersistent() {
+    if (_sealed) {
+      return nullptr;
+    }
+    _sealed = true;
+    auto words = _words->makePersistent();
+    if (_end == _start) {
+      return BitArray::empty();
+    }
+    return new BitArray(words, _start, _end);
+  }
+
+  ref<TransientBitArray> TransientBitArray::push(bool v) {
+    if (_sealed) {
+      return nullptr;
+    }
+    if ((_end & 63) == 0) {
+      _words->push(uint64(v));
+    } else {
+      uint32 k = _end >> 6;
+      uint64 bit = uint64(1) << (_end & 63);
+      uint64 w = _words->get(k);
+      if (bool(w & bit) != v) {
+        _words->set(k, w ^ bit);
+      }
+    }
+    ++_end;
+    return this;
+  }
+
+  ref<TransientBitArray> TransientBitArray::set(uint32 i, bool v) {
+    if (_sealed || i >= size()) {
+      return nullptr;
+    }
+    i += _start;
+    uint64 bit = uint64(1) << (i & 63);
+    uint64 w = _words->get(i >> 6);
+    if (bool(w & bit) != v) {
+      _words->set(i >> 6, w ^ bit);
+    }
+    return this;
+  }
+
+  ref<TransientBitArray> TransientBitArray::pop() {
+    if (_sealed) {
+      return nullptr;
+    }
+    if (_end > _start) {
+      --_end;
+      if ((_end & 63) == 0) {
+        _words->pop();
+      }
+    }
+    return this;
+  }
+
+
+} // namespace
@@ -0,0 +1,424 @@
+#pragma once
+#include "array.h"
+
+namespace immutable {
+  struct TransientBitArray;
+
+  // Persistent array of bools, packed 64 values to a word.
+  //
+  // Values are stored as the bits of an Array<uint64>, so each leaf holds 2048 values
+  // and changing a value copies a 256-byte leaf and the branches above it, where
+  // Array<bool> uses a byte per value. A slice shares the words of the array it was
+  // made from and starts at a bit offset within its first word.
+  //
+  // Operations have the same persistent semantics as those of Array<bool>. Like
+  // std::vector<bool>, values are returned by value rather than by reference.
+  struct BitArray : RefCounted {
+    using Words = Array<uint64>;
+    using TransientArrayT = TransientBitArray;
+    struct Iterator;
+    struct ReverseIterator;
+
+    // The empty array
+    static ref<BitArray> empty();
+
+    // Create an array with values from initializer list, iterable or iterator range,
+    // or an array of n copies of value
+    template <typename Y> static ref<BitArray> create(std::initializer_list<Y>&&);
+    template <typename Iterable> static ref<BitArray> create(const Iterable&);
+    template <typename It> static ref<BitArray> create(It&& begin, const It& end);
+    static ref<BitArray> create(uint32 n, bool value);
+
+    // Number of values in this array
+    uint32 size() const { return _end - _start; }
+
+    // Access value at index. If i >= size() the behavior is undefined.
+    bool get(uint32 i) const;
+    bool first() const { return get(0); }
+    bool last() const { return get(size() - 1); }
+
+    // Find value at index. Returns the end iterator if index is out-of bounds.
+    Iterator find(uint32 i) const { return i < size() ? begin(i) : end(); }
+
+    // Append value, or values from an iterator range, to the end
+    ref<BitArray> push(bool) const;
+    template <typename It> ref<BitArray> push(It&& begin, const It& end) const;
+
+    // Prepend value to the beginning
+    ref<BitArray> cons(bool) const;
+
+    // Set value at index i. Returns nullptr if i is out-of bounds, and this array if
+    // the value at i is already v.
+    ref<BitArray> set(uint32 i, bool v) const;
+
+    // Remove the last value
+    ref<BitArray> pop() const;
+
+    // Returns a slice of this array, from start up until (but not including) end.
+    // Returns null if start and/or end is out-of bounds.
+    ref<BitArray> slice(uint32 start, uint32 end=END) const;
+    ref<BitArray> rest() const { return slice(1); }
+
+    // Returns a version of this array with other array added to the end. The words
+    // of the other array are shared when its values have the same bit offset within
+    // a word as they have in the result, and shifted a word at a time otherwise.
+    ref<BitArray> concat(ref<BitArray>) const;
+
+    // Replaces values within the range [start, end) with values from an iterator
+    // range or another array. Returns null if start and/or end is out-of bounds.
+    template <typename It>
+    ref<BitArray> splice(uint32 start, uint32 end, It&& it, const It& endit) const;
+    ref<BitArray> splice(uint32 start, uint32 end, ref<BitArray>) const;
+
+    // Removes values within the range [start, end). Returns null if start and/or end
+    // is out-of bounds.
+    ref<BitArray> without(uint32 start, uint32 end=END) const;
+
+    // Folds the values of this array from first to last, by acc = op(acc, value)
+    // starting with acc = init, and returns the final acc.
+    template <typename U, typename Op> U reduce(U init, Op&& op) const;
+
+    // Number of true values in the range [start, end), counted a word at a time
+    uint32 popcount(uint32 start=0, uint32 end=END) const;
+
+    // Index of the first true value at or after start, or END if there is none.
+    // Skips false values a word at a time.
+    uint32 findFirstSet(uint32 start=0) const;
+
+    // return a new TransientBitArray contaning the same values as this array.
+    ref<TransientArrayT> asTransient() const;
+
+    // apply modification with a transient. F is called with a ref<TransientBitArray>.
+    template <typename F> ref<BitArray> modify(F&& fn) const;
+
+    // Compares arrays by size and then by their first differing value, where false
+    // is less than true. Values are compared a word at a time.
+    int compare(const ref<BitArray>& other) const;
+
+    // Hash of the values of this array, which is the same for all arrays with equal
+    // values. Values are hashed a word at a time and the result is cached.
+    uint64 hash() const;
+
+    // True if this array has the same values as the other array
+    bool equals(const ref<BitArray>& other) const;
+
+    // Returns the index of the first value which differs between this array and the
+    // other array, or END if both arrays have the same values. If one array holds
+    // the first values of the other, the size of the shorter array is returned.
+    uint32 mismatch(const ref<BitArray>& other) const;
+
+    // True if the other array refers to the same underlying data.
+    bool operator==(const ref<BitArray>& rhs) const { return this == rhs.ptr(); }
+    bool operator!=(const ref<BitArray>& rhs) const { return !(*this == rhs); }
+
+    // Iteration over the values in the range [start, end)
+    Iterator begin(uint32 start=0, uint32 end=END) const;
+    Iterator end() const { return Iterator(); }
+
+    // Reverse iteration over the values in the range [start, end), from end-1 down
+    // to start
+    ReverseIterator rbegin(uint32 start=0, uint32 end=END) const;
+    ReverseIterator rend() const { return ReverseIterator(); }
+
+    // random-access iterator which reads a word at a time. Moving it within a word
+    // is O(1), and into another word moves an Array<uint64>::Iterator.
+    // Note: the end() sentinel can be compared with and subtracted from other
+    // iterators but not moved; use begin() + size() for a movable end iterator.
+    struct Iterator {
+      typedef std::random_access_iterator_tag iterator_category;
+      typedef int64 difference_type;
+      typedef bool  value_type;
+      typedef void  pointer;
+      typedef bool  reference;
+
+      Iterator() {}
+      Iterator& operator++(); // ++i
+      Iterator operator++(int); // i++
+      Iterator& operator--() { --_i; load(); return *this; } // --i
+      Iterator operator--(int); // i--
+      Iterator& operator+=(difference_type n) { _i += n; load(); return *this; }
+      Iterator& operator-=(difference_type n) { return *this += -n; }
+      Iterator operator+(difference_type n) const { return Iterator(*this) += n; }
+      Iterator operator-(difference_type n) const { return Iterator(*this) += -n; }
+      friend Iterator operator+(difference_type n, const Iterator& it) { return it + n; }
+      difference_type operator-(const Iterator& rhs) const {
+        return difference_type(pos(rhs)) - difference_type(rhs.pos(*this));
+      }
+
+      bool operator*() const { return (_word >> (_i & 63)) & 1; }
+      bool operator[](difference_type n) const { return *(*this + n); }
+      bool valid() const { return _i < _end; }
+
+      // Index of the current value, relative to the start of the array
+      uint32 index() const { return _i - _start; }
+
+      bool operator==(const Iterator& rhs) const {
+        bool atEnd = _i >= _end;
+        return atEnd == (rhs._i >= rhs._end) && (atEnd || _i == rhs._i);
+      }
+      bool operator!=(const Iterator& rhs) const { return !(*this == rhs); }
+      bool operator<(const Iterator& rhs) const { return *this - rhs < 0; }
+      bool operator>(const Iterator& rhs) const { return *this - rhs > 0; }
+      bool operator<=(const Iterator& rhs) const { return *this - rhs <= 0; }
+      bool operator>=(const Iterator& rhs) const { return *this - rhs >= 0; }
+
+    protected:
+      friend struct BitArray;
+      friend struct ReverseIterator;
+      Iterator(const BitArray* a, uint32 start, uint32 end); // absolute bit indexes
+
+      // Moves _w to the word holding the current value, if it's not there already
+      void load();
+
+      // Absolute position, where the end() sentinel is at the end of other
+      uint32 pos(const Iterator& other) const { return _sentinel ? other._end : _i; }
+
+      Words::Iterator _w;         // word _k
+      uint64          _word = 0;  // *_w
+      uint32          _k = 0;
+      uint32          _i = 0;     // absolute bit index of the current value
+      uint32          _end = 0;
+      uint32          _start = 0; // absolute bit index of the array's first value
+      bool            _sentinel = true;
+    };
+
+    // bidirectional iterator which visits values in reverse order
+    struct ReverseIterator {
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef int64 difference_type;
+      typedef bool  value_type;
+      typedef void  pointer;
+      typedef bool  reference;
+
+      ReverseIterator() {}
+      ReverseIterator& operator++() { if (--_n) { --_it; } return *this; } // ++i
+      ReverseIterator operator++(int); // i++
+      ReverseIterator& operator--() { if (_n++) { ++_it; } return *this; } // --i
+      ReverseIterator operator--(int); // i--
+
+      bool operator*() const { return *_it; }
+      bool valid() const { return _n != 0; }
+
+      // Index of the current value, relative to the start of the array
+      uint32 index() const { return _it.index(); }
+
+      bool operator==(const ReverseIterator& rhs) const {
+        return _n == rhs._n && (_n == 0 || _it._i == rhs._it._i);
+      }
+      bool operator!=(const ReverseIterator& rhs) const { return !(*this == rhs); }
+
+    protected:
+      friend struct BitArray;
+      ReverseIterator(const BitArray* a, uint32 start, uint32 end); // absolute
+
+      Iterator _it; // at the current value, or at start once past it
+      uint32   _n = 0; // number of values left, including the current value
+    };
+
+    // lower-case names for STL compatibility
+    typedef Iterator iterator;
+    typedef ReverseIterator reverse_iterator;
+
+  protected:
+    friend struct TransientBitArray;
+
+    BitArray(ref<Words> words, uint32 start, uint32 end)
+      : _words(std::move(words)), _start(start), _end(end) {}
+
+    // Appends the values of b to words which hold values [0, end), and advances end
+    static void pushWords(TransientArray<uint64>* words, uint32& end, const BitArray* b);
+
+    // The words hold values [0, _end), of which [_start, _end) are in this array, and
+    // there are no words past the one holding the last value.
+    ref<Words> _words;
+    uint32     _start; // < 64
+    uint32     _end;
+    mutable uint64 _hash = 0; // cached hash(), or 0 if not yet computed
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(BitArray)
+  };
+
+
+  struct TransientBitArray : RefCounted {
+    // Number of values in this array
+    uint32 size() const { return _end - _start; }
+
+    // "seal" the transient array and return a persistent array that refers to the
+    // same words. Returns null if this transient array is not editable (e.g.
+    // makePersistent() has already been called.)
+    ref<BitArray> makePersistent();
+
+    // Append value, set value at index i or remove the last value. Returns null if
+    // this transient array is not editable or if i is out-of bounds.
+    ref<TransientBitArray> push(bool v);
+    ref<TransientBitArray> set(uint32 i, bool v);
+    ref<TransientBitArray> pop();
+
+    // Access value at index. If i >= size() the behavior is undefined.
+    bool get(uint32 i) const;
+
+  private:
+    friend struct BitArray;
+
+    TransientBitArray(ref<TransientArray<uint64>> words, uint32 start, uint32 end)
+      : _words(std::move(words)), _start(start), _end(end) {}
+
+    ref<TransientArray<uint64>> _words;
+    uint32                      _start;
+    uint32                      _end;
+    bool                        _sealed = false;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(TransientBitArray)
+  };
+
+
+  template <typename Y>
+  inline ref<BitArray> BitArray::create(std::initializer_list<Y>&& vals) {
+    return create(vals.begin(), vals.end());
+  }
+
+  template <typename Iterable>
+  inline ref<BitArray> BitArray::create(const Iterable& vals) {
+    return create(vals.begin(), vals.end());
+  }
+
+  template <typename It>
+  inline ref<BitArray> BitArray::create(It&& I, const It& E) {
+    // values are packed into a word which is pushed when it's full
+    auto t = Words::empty()->asTransient();
+    uint64 word = 0;
+    uint32 n = 0;
+    for (auto it = I; it != E; ++it) {
+      word |= uint64(bool(*it)) << (n & 63);
+      if ((++n & 63) == 0) {
+        t->push(word);
+        word = 0;
+      }
+    }
+    if (n & 63) {
+      t->push(word);
+    }
+    return n ? ref<BitArray>(new BitArray(t->makePersistent(), 0, n)) : empty();
+  }
+
+  inline bool BitArray::get(uint32 i) const {
+    i += _start;
+    return (_words->get(i >> 6) >> (i & 63)) & 1;
+  }
+
+  template <typename It>
+  inline ref<BitArray> BitArray::push(It&& I, const It& E) const {
+    return concat(create(std::forward<It>(I), E));
+  }
+
+  template <typename It>
+  inline ref<BitArray> BitArray::splice(
+    uint32 start, uint32 end, It&& it, const It& endit) const
+  {
+    return splice(start, end, create(std::forward<It>(it), endit));
+  }
+
+  template <typename U, typename Op>
+  inline U BitArray::reduce(U init, Op&& op) const {
+    for (auto it = begin(); it.valid(); ++it) {
+      init = op(std::move(init), *it);
+    }
+    return init;
+  }
+
+  template <typename F>
+  inline ref<BitArray> BitArray::modify(F&& fn) const {
+    auto t = asTransient();
+    fn(t);
+    return t->makePersistent();
+  }
+
+  inline BitArray::Iterator BitArray::begin(uint32 start, uint32 end) const {
+    end = end == END ? _end : min(_start + end, _end);
+    return Iterator(this, min(_start + start, end), end);
+  }
+
+  inline BitArray::Iterator::Iterator(const BitArray* a, uint32 start, uint32 end)
+    : _i(start), _end(end), _start(a->_start), _sentinel(false)
+  {
+    // Note: _w is kept at a word of the array, so that it can always be moved
+    if (end > a->_start) {
+      _k = min(_i, end - 1) >> 6;
+      _w = a->_words->begin(_k);
+      _word = *_w;
+    }
+  }
+
+  inline void BitArray::Iterator::load() {
+    uint32 k = _i >> 6;
+    if (k != _k && _i < _end) {
+      _w += difference_type(k) - difference_type(_k);
+      _k = k;
+      _word = *_w;
+    }
+  }
+
+  inline BitArray::Iterator& BitArray::Iterator::operator++() { // ++i
+    ++_i;
+    if ((_i & 63) == 0 && _i < _end) {
+      ++_w;
+      ++_k;
+      _word = *_w;
+    }
+    return *this;
+  }
+
+  inline BitArray::Iterator BitArray::Iterator::operator++(int) { // i++
+    Iterator copy(*this);
+    operator++();
+    return copy;
+  }
+
+  inline BitArray::Iterator BitArray::Iterator::operator--(int) { // i--
+    Iterator copy(*this);
+    operator--();
+    return copy;
+  }
+
+  inline BitArray::ReverseIterator BitArray::rbegin(uint32 start, uint32 end) const {
+    end = end == END ? _end : min(_start + end, _end);
+    return ReverseIterator(this, min(_start + start, end), end);
+  }
+
+  inline BitArray::ReverseIterator::ReverseIterator(
+    const BitArray* a, uint32 start, uint32 end)
+    : _it(a, end > start ? end - 1 : start, end), _n(end - start) {}
+
+  inline BitArray::ReverseIterator BitArray::ReverseIterator::operator++(int) {
+    ReverseIterator copy(*this);
+    operator++();
+    return copy;
+  }
+
+  inline BitArray::ReverseIterator BitArray::ReverseIterator::operator--(int) {
+    ReverseIterator copy(*this);
+    operator--();
+    return copy;
+  }
+
+  inline bool TransientBitArray::get(uint32 i) const {
+    i += _start;
+    return (_words->get(i >> 6) >> (i & 63)) & 1;
+  }
+
+} // namespace
+
+
+namespace std {
+  // Hashes bit arrays by value (see BitArray::hash)
+  template <>
+  struct hash<immutable::ref<immutable::BitArray>> {
+    size_t operator()(const immutable::ref<immutable::BitArray>& a) const {
+      return size_t(a->hash());
+    }
+  };
+}
@@ -0,0 +1,939 @@
+#include "bitmap.h"
+#include "alloc.h"
+#include <algorithm>
+#include <string.h>
+#if IMMUTABLE_TARGET_ARCH_X64
+  #include <immintrin.h>
+#elif IMMUTABLE_TARGET_ARCH_ARM64
+  #include <arm_neon.h>
+#endif
+
+namespace immutable {
+  using C = BitmapContainer;
+  using Run = C::Run;
+
+  static constexpr uint32 ARRAY_MAX = C::ARRAY_MAX;
+  static constexpr uint32 WORDS = C::WORDS;
+  static constexpr uint32 RUNS_MAX = WORDS * 8 / sizeof(Run); // runs in 8 kB
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // Word kernels, which combine two bitsets word by word into dst and return the
+  // number of bits set in the result. When dst is null the result is only counted.
+
+  enum WordOp { AND, OR, ANDNOT };
+
+  template <WordOp op>
+  static inline uint64 combineWord(uint64 a, uint64 b) {
+    return op == AND ? a & b : op == OR ? a | b : a & ~b;
+  }
+
+  template <WordOp op>
+  static uint32 combineScalar(uint64* dst, const uint64* a, const uint64* b) {
+    uint32 n = 0;
+    for (uint32 i = 0; i < WORDS; ++i) {
+      uint64 w = combineWord<op>(a[i], b[i]);
+      if (dst) {
+        dst[i] = w;
+      }
+      n += __builtin_popcountll(w);
+    }
+    return n;
+  }
+
+  using CombineFunc = uint32(*)(uint64* dst, const uint64* a, const uint64* b);
+
+#if IMMUTABLE_TARGET_ARCH_X64
+
+  // Same as combineScalar, with popcount compiled to the POPCNT instruction
+  template <WordOp op>
+  __attribute__((target("popcnt")))
+  static uint32 combinePOPCNT(uint64* dst, const uint64* a, const uint64* b) {
+    uint32 n = 0;
+    for (uint32 i = 0; i < WORDS; ++i) {
+      uint64 w = combineWord<op>(a[i], b[i]);
+      if (dst) {
+        dst[i] = w;
+      }
+      n += __builtin_popcountll(w);
+    }
+    return n;
+  }
+
+  // Counts bits by looking up the count of each 4-bit nibble with a byte shuffle, and
+  // sums the counts of each 8 bytes into four 64-bit lanes.
+  __attribute__((target("avx2")))
+  static inline __m256i popcount256(__m256i v) {
+    const __m256i lut = _mm256_setr_epi8(
+      0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+      0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low4));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+  }
+
+  template <WordOp op>
+  __attribute__((target("avx2")))
+  static uint32 combineAVX2(uint64* dst, const uint64* a, const uint64* b) {
+    __m256i total = _mm256_setzero_si256();
+    for (uint32 i = 0; i < WORDS; i += 4) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+      __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+      __m256i w = op == AND ? _mm256_and_si256(x, y)
+                : op == OR  ? _mm256_or_si256(x, y)
+                :             _mm256_andnot_si256(y, x);
+      if (dst) {
+        _mm256_storeu_si256((__m256i*)(dst + i), w);
+      }
+      total = _mm256_add_epi64(total, popcount256(w));
+    }
+    return uint32(_mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                  _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3));
+  }
+
+  template <WordOp op>
+  static CombineFunc selectCombine() {
+    if (__builtin_cpu_supports("avx2")) {
+      return combineAVX2<op>;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+      return combinePOPCNT<op>;
+    }
+    return combineScalar<op>;
+  }
+
+#elif IMMUTABLE_TARGET_ARCH_ARM64
+
+  template <WordOp op>
+  static uint32 combineNEON(uint64* dst, const uint64* a, const uint64* b) {
+    uint32 n = 0;
+    for (uint32 i = 0; i < WORDS; i += 2) {
+      uint64x2_t x = vld1q_u64(a + i);
+      uint64x2_t y = vld1q_u64(b + i);
+      uint64x2_t w = op == AND ? vandq_u64(x, y)
+                   : op == OR  ? vorrq_u64(x, y)
+                   :             vbicq_u64(x, y);
+      if (dst) {
+        vst1q_u64(dst + i, w);
+      }
+      n += vaddvq_u8(vcntq_u8(vreinterpretq_u8_u64(w)));
+    }
+    return n;
+  }
+
+  template <WordOp op>
+  static CombineFunc selectCombine() {
+    return combineNEON<op>;
+  }
+
+#else
+
+  template <WordOp op>
+  static CombineFunc selectCombine() {
+    return combineScalar<op>;
+  }
+
+#endif
+
+  template <WordOp op>
+  static uint32 combineWords(uint64* dst, const uint64* a, const uint64* b) {
+    static const CombineFunc f = selectCombine<op>();
+    return f(dst, a, b);
+  }
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // Containers
+
+  static size_t allocSize(C::Type type, uint32 capacity) {
+    return sizeof(C) + (type == C::BITSET ? WORDS * sizeof(uint64) :
+                        type == C::ARRAY  ? capacity * sizeof(uint16) :
+                                            capacity * sizeof(Run));
+  }
+
+  void BitmapContainer::dealloc() {
+    size_t size = allocSize(type, capacity);
+    this->~BitmapContainer();
+    NodeAlloc::free(this, size);
+  }
+
+  static C* newContainer(EditID edit, C::Type type, uint32 capacity) {
+    auto c = new (NodeAlloc::alloc(allocSize(type, capacity))) C(edit, type, capacity);
+    if (type == C::BITSET) {
+      memset(c->words(), 0, WORDS * sizeof(uint64));
+    }
+    return c;
+  }
+
+  static bool isEditable(const C* c, EditID edit) {
+    return edit != NO_EDIT && c->edit == edit;
+  }
+
+  // Capacity of an array container for n values. Transients leave room to grow.
+  static uint32 arrayCapacity(EditID edit, uint32 n) {
+    if (edit == NO_EDIT) {
+      return n;
+    }
+    uint32 cap = 4;
+    while (cap < n) {
+      cap *= 2;
+    }
+    return std::min(cap, ARRAY_MAX);
+  }
+
+  static bool testBit(const uint64* w, uint32 v) {
+    return (w[v >> 6] >> (v & 63)) & 1;
+  }
+
+  static void setBit(uint64* w, uint32 v) {
+    w[v >> 6] |= uint64(1) << (v & 63);
+  }
+
+  static void clearBit(uint64* w, uint32 v) {
+    w[v >> 6] &= ~(uint64(1) << (v & 63));
+  }
+
+  // Sets bits [start, end]
+  static void setBits(uint64* w, uint32 start, uint32 end) {
+    uint32 i = start >> 6, j = end >> 6;
+    uint64 first = ~uint64(0) << (start & 63);
+    uint64 last = ~uint64(0) >> (63 - (end & 63));
+    if (i == j) {
+      w[i] |= first & last;
+      return;
+    }
+    w[i] |= first;
+    for (++i; i < j; ++i) {
+      w[i] = ~uint64(0);
+    }
+    w[j] |= last;
+  }
+
+  // Index of the first run with a start greater than v
+  static uint32 runAfter(const C* c, uint32 v) {
+    auto r = c->runs();
+    return uint32(std::upper_bound(r, r + c->count, v, [](uint32 v, const Run& r) {
+      return v < r.start;
+    }) - r);
+  }
+
+  static uint32 runEnd(const Run& r) {
+    return uint32(r.start) + r.length;
+  }
+
+  static bool containerContains(const C* c, uint32 v) {
+    switch (c->type) {
+      case C::ARRAY:
+        return std::binary_search(c->values(), c->values() + c->count, uint16(v));
+      case C::BITSET:
+        return testBit(c->words(), v);
+      case C::RUNS: {
+        uint32 i = runAfter(c, v);
+        return i > 0 && v <= runEnd(c->runs()[i - 1]);
+      }
+    }
+    return false;
+  }
+
+  static bool isFull(const C* c) {
+    return c->cardinality == 0x10000;
+  }
+
+
+  // Conversions
+
+  static C* toBitset(EditID edit, const C* c) {
+    auto m = newContainer(edit, C::BITSET, WORDS);
+    auto w = m->words();
+    if (c->type == C::ARRAY) {
+      for (uint32 i = 0; i < c->count; ++i) {
+        setBit(w, c->values()[i]);
+      }
+    } else if (c->type == C::RUNS) {
+      for (uint32 i = 0; i < c->count; ++i) {
+        setBits(w, c->runs()[i].start, runEnd(c->runs()[i]));
+      }
+    } else {
+      memcpy(w, c->words(), WORDS * sizeof(uint64));
+    }
+    m->cardinality = c->cardinality;
+    return m;
+  }
+
+  static C* toArray(EditID edit, const C* c) {
+    auto m = newContainer(edit, C::ARRAY, arrayCapacity(edit, c->cardinality));
+    auto v = m->values();
+    if (c->type == C::BITSET) {
+      auto w = c->words();
+      for (uint32 i = 0; i < WORDS; ++i) {
+        for (uint64 bits = w[i]; bits; bits &= bits - 1) {
+          v[m->count++] = uint16(i * 64 + __builtin_ctzll(bits));
+        }
+      }
+    } else {
+      for (uint32 i = 0; i < c->count; ++i) {
+        for (uint32 x = c->runs()[i].start; x <= runEnd(c->runs()[i]); ++x) {
+          v[m->count++] = uint16(x);
+        }
+      }
+    }
+    m->cardinality = m->count;
+    return m;
+  }
+
+  // Array or bitset with the values of runs container c
+  static ref<C> fromRuns(EditID edit, const C* c) {
+    return c->cardinality <= ARRAY_MAX ? toArray(edit, c) : toBitset(edit, c);
+  }
+
+  // Runs container with runs r[0..n), or an array or bitset if that's smaller
+  static ref<C> newRuns(EditID edit, const Run* r, uint32 n, uint32 cardinality) {
+    ref<C> m = newContainer(edit, C::RUNS, n);
+    memcpy(m->runs(), r, n * sizeof(Run));
+    m->count = n;
+    m->cardinality = cardinality;
+    return n > RUNS_MAX ? fromRuns(edit, m) : m;
+  }
+
+  // Bitset c with its cardinality reduced by a removal, as an array if it's small
+  static ref<C> shrunkBitset(EditID edit, const ref<C>& c) {
+    return c->cardinality <= ARRAY_MAX ? toArray(edit, c) : c.ptr();
+  }
+
+
+  // Add and remove
+
+  static ref<C> containerAdd(C* c, EditID edit, uint32 v, bool& added) {
+    if (containerContains(c, v)) {
+      return c;
+    }
+    added = true;
+    switch (c->type) {
+      case C::ARRAY: {
+        if (c->count == ARRAY_MAX) {
+          auto m = toBitset(edit, c);
+          setBit(m->words(), v);
+          m->cardinality++;
+          return m;
+        }
+        auto vals = c->values();
+        uint32 i = uint32(std::lower_bound(vals, vals + c->count, uint16(v)) - vals);
+        C* m = c;
+        if (!isEditable(c, edit) || c->count == c->capacity) {
+          m = newContainer(edit, C::ARRAY, arrayCapacity(edit, c->count + 1));
+          memcpy(m->values(), vals, i * sizeof(uint16));
+          memcpy(m->values() + i + 1, vals + i, (c->count - i) * sizeof(uint16));
+        } else {
+          memmove(vals + i + 1, vals + i, (c->count - i) * sizeof(uint16));
+        }
+        m->values()[i] = uint16(v);
+        m->count = m->cardinality = c->count + 1;
+        return m;
+      }
+      case C::BITSET: {
+        C* m = isEditable(c, edit) ? c : toBitset(edit, c);
+        setBit(m->words(), v);
+        m->cardinality++;
+        return m;
+      }
+      case C::RUNS: {
+        // extend the runs before and/or after v, or insert a new run
+        auto r = c->runs();
+        uint32 i = runAfter(c, v);
+        bool joinPrev = i > 0 && runEnd(r[i - 1]) + 1 == v;
+        bool joinNext = i < c->count && v + 1 == r[i].start;
+        Run tmp[RUNS_MAX + 1];
+        uint32 n = 0;
+        for (uint32 k = 0; k < i; ++k) {
+          tmp[n++] = r[k];
+        }
+        if (joinPrev && joinNext) {
+          tmp[n - 1].length = uint16(runEnd(r[i]) - r[i - 1].start);
+          ++i;
+        } else if (joinPrev) {
+          tmp[n - 1].length++;
+        } else if (joinNext) {
+          tmp[n++] = Run{uint16(v), uint16(r[i].length + 1)};
+          ++i;
+        } else {
+          tmp[n++] = Run{uint16(v), 0};
+        }
+        for (uint32 k = i; k < c->count; ++k) {
+          tmp[n++] = r[k];
+        }
+        return newRuns(edit, tmp, n, c->cardinality + 1);
+      }
+    }
+    return c;
+  }
+
+  // Returns null when the last value of c is removed
+  static ref<C> containerRemove(C* c, EditID edit, uint32 v, bool& removed) {
+    if (!containerContains(c, v)) {
+      return c;
+    }
+    removed = true;
+    if (c->cardinality == 1) {
+      return nullptr;
+    }
+    switch (c->type) {
+      case C::ARRAY: {
+        auto vals = c->values();
+        uint32 i = uint32(std::lower_bound(vals, vals + c->count, uint16(v)) - vals);
+        C* m = c;
+        if (isEditable(c, edit)) {
+          memmove(vals + i, vals + i + 1, (c->count - i - 1) * sizeof(uint16));
+        } else {
+          m = newContainer(edit, C::ARRAY, arrayCapacity(edit, c->count - 1));
+          memcpy(m->values(), vals, i * sizeof(uint16));
+          memcpy(m->values() + i, vals + i + 1, (c->count - i - 1) * sizeof(uint16));
+        }
+        m->count = m->cardinality = c->count - 1;
+        return m;
+      }
+      case C::BITSET: {
+        ref<C> m = isEditable(c, edit) ? c : toBitset(edit, c);
+        clearBit(m->words(), v);
+        m->cardinality--;
+        return shrunkBitset(edit, m);
+      }
+      case C::RUNS: {
+        // shorten or split the run holding v
+        auto r = c->runs();
+        uint32 i = runAfter(c, v) - 1;
+        Run tmp[RUNS_MAX + 1];
+        uint32 n = 0;
+        for (uint32 k = 0; k < i; ++k) {
+          tmp[n++] = r[k];
+        }
+        if (v > r[i].start) {
+          tmp[n++] = Run{r[i].start, uint16(v - 1 - r[i].start)};
+        }
+        if (v < runEnd(r[i])) {
+          tmp[n++] = Run{uint16(v + 1), uint16(runEnd(r[i]) - v - 1)};
+        }
+        for (uint32 k = i + 1; k < c->count; ++k) {
+          tmp[n++] = r[k];
+        }
+        return newRuns(edit, tmp, n, c->cardinality - 1);
+      }
+    }
+    return c;
+  }
+
+
+  // Set operations on containers. The results are null when empty, and one of the
+  // containers when it has the same values as the result. Runs are combined as arrays
+  // or bitsets, except for full runs containers.
+
+  enum SetOp { UNITE, INTERSECT, SUBTRACT };
+
+  // Merges sorted arrays a and b into dst, which must have room for na+nb values.
+  // Returns the number of values in dst.
+  template <SetOp op>
+  static uint32 mergeArrays(uint16* dst, const uint16* a, uint32 na, const uint16* b, uint32 nb) {
+    uint32 i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+      if (a[i] < b[j]) {
+        if (op != INTERSECT) {
+          dst[n++] = a[i];
+        }
+        ++i;
+      } else if (b[j] < a[i]) {
+        if (op == UNITE) {
+          dst[n++] = b[j];
+        }
+        ++j;
+      } else {
+        if (op != SUBTRACT) {
+          dst[n++] = a[i];
+        }
+        ++i;
+        ++j;
+      }
+    }
+    if (op != INTERSECT) {
+      memcpy(dst + n, a + i, (na - i) * sizeof(uint16));
+      n += na - i;
+    }
+    if (op == UNITE) {
+      memcpy(dst + n, b + j, (nb - j) * sizeof(uint16));
+      n += nb - j;
+    }
+    return n;
+  }
+
+  static ref<C> newArray(const uint16* values, uint32 n) {
+    if (n == 0) {
+      return nullptr;
+    }
+    auto m = newContainer(NO_EDIT, C::ARRAY, n);
+    memcpy(m->values(), values, n * sizeof(uint16));
+    m->count = m->cardinality = n;
+    return m;
+  }
+
+  // Values of array a for which the bit in w is set (keep=true) or not set (keep=false)
+  static ref<C> filterArray(const C* a, const uint64* w, bool keep) {
+    uint16 tmp[ARRAY_MAX];
+    uint32 n = 0;
+    for (uint32 i = 0; i < a->count; ++i) {
+      tmp[n] = a->values()[i];
+      n += testBit(w, tmp[n]) == keep;
+    }
+    return newArray(tmp, n);
+  }
+
+  template <SetOp op>
+  static ref<C> combineContainers(C* a, C* b) {
+    if (a == b) {
+      return op == SUBTRACT ? nullptr : a;
+    }
+    if (isFull(b)) {
+      return op == UNITE ? b : op == INTERSECT ? a : nullptr;
+    }
+    if (isFull(a) && op != SUBTRACT) {
+      return op == UNITE ? a : b;
+    }
+    if (a->type == C::RUNS || b->type == C::RUNS) {
+      ref<C> ra = a->type == C::RUNS ? fromRuns(NO_EDIT, a) : ref<C>(a);
+      ref<C> rb = b->type == C::RUNS ? fromRuns(NO_EDIT, b) : ref<C>(b);
+      ref<C> m = combineContainers<op>(ra.ptr(), rb.ptr());
+      // keep the runs containers themselves where they are the result
+      if (m == ra) {
+        return a;
+      }
+      return m == rb ? ref<C>(b) : m;
+    }
+
+    ref<C> m;
+    if (a->type == C::ARRAY && b->type == C::ARRAY) {
+      uint16 tmp[2 * ARRAY_MAX];
+      uint32 n = mergeArrays<op>(tmp, a->values(), a->count, b->values(), b->count);
+      if (n <= ARRAY_MAX) {
+        m = newArray(tmp, n);
+      } else {
+        m = newContainer(NO_EDIT, C::BITSET, WORDS);
+        for (uint32 i = 0; i < n; ++i) {
+          setBit(m->words(), tmp[i]);
+        }
+        m->cardinality = n;
+      }
+    } else if (a->type == C::BITSET && b->type == C::BITSET) {
+      m = newContainer(NO_EDIT, C::BITSET, WORDS);
+      m->cardinality = op == UNITE     ? combineWords<OR>(m->words(), a->words(), b->words())
+                     : op == INTERSECT ? combineWords<AND>(m->words(), a->words(), b->words())
+                     :                   combineWords<ANDNOT>(m->words(), a->words(), b->words());
+      m = m->cardinality == 0 ? nullptr : shrunkBitset(NO_EDIT, m);
+    } else if (op == INTERSECT || (op == SUBTRACT && a->type == C::ARRAY)) {
+      // the values of the array which are (or are not) in the bitset
+      C* arr = a->type == C::ARRAY ? a : b;
+      C* bits = arr == a ? b : a;
+      m = filterArray(arr, bits->words(), op == INTERSECT);
+    } else {
+      // a bitset with the values of an array added or removed
+      C* arr = a->type == C::ARRAY ? a : b;
+      C* bits = arr == a ? b : a;
+      m = toBitset(NO_EDIT, bits);
+      auto w = m->words();
+      for (uint32 i = 0; i < arr->count; ++i) {
+        uint16 v = arr->values()[i];
+        if (testBit(w, v) != (op == UNITE)) {
+          w[v >> 6] ^= uint64(1) << (v & 63);
+          m->cardinality += op == UNITE ? 1 : -1;
+        }
+      }
+      m = shrunkBitset(NO_EDIT, m);
+    }
+
+    if (m && m->cardinality == a->cardinality && op != UNITE) {
+      return a; // intersection or difference which is a subset of a, with all of a
+    }
+    if (m && op == UNITE && m->cardinality == std::max(a->cardinality, b->cardinality)) {
+      return a->cardinality >= b->cardinality ? a : b;
+    }
+    return m;
+  }
+
+  static uint32 intersectCount(C* a, C* b) {
+    if (a == b) {
+      return a->cardinality;
+    }
+    if (a->type == C::BITSET && b->type == C::BITSET) {
+      return combineWords<AND>(nullptr, a->words(), b->words());
+    }
+    if (a->type == C::ARRAY && b->type != C::ARRAY) {
+      std::swap(a, b);
+    }
+    if (b->type == C::ARRAY) {
+      uint32 n = 0;
+      for (uint32 i = 0; i < b->count; ++i) {
+        n += containerContains(a, b->values()[i]);
+      }
+      return n;
+    }
+    ref<C> m = combineContainers<INTERSECT>(a, b);
+    return m ? m->cardinality : 0;
+  }
+
+
+  // Number of runs of consecutive values in container c
+  static uint32 countRuns(const C* c) {
+    uint32 n = 0;
+    if (c->type == C::ARRAY) {
+      for (uint32 i = 0; i < c->count; ++i) {
+        n += i == 0 || c->values()[i] != c->values()[i - 1] + 1;
+      }
+    } else if (c->type == C::BITSET) {
+      uint64 carry = 0;
+      for (uint32 i = 0; i < WORDS; ++i) {
+        uint64 w = c->words()[i];
+        n += __builtin_popcountll(w & ~((w << 1) | carry));
+        carry = w >> 63;
+      }
+    } else {
+      n = c->count;
+    }
+    return n;
+  }
+
+  static ref<C> toRuns(const C* c, uint32 nruns) {
+    auto m = newContainer(NO_EDIT, C::RUNS, nruns);
+    auto r = m->runs();
+    auto add = [&](uint32 v) {
+      if (m->count > 0 && runEnd(r[m->count - 1]) + 1 == v) {
+        r[m->count - 1].length++;
+      } else {
+        r[m->count++] = Run{uint16(v), 0};
+      }
+    };
+    if (c->type == C::ARRAY) {
+      for (uint32 i = 0; i < c->count; ++i) {
+        add(c->values()[i]);
+      }
+    } else {
+      for (uint32 i = 0; i < WORDS; ++i) {
+        for (uint64 bits = c->words()[i]; bits; bits &= bits - 1) {
+          add(i * 64 + __builtin_ctzll(bits));
+        }
+      }
+    }
+    m->cardinality = c->cardinality;
+    return m;
+  }
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // Bitmap
+
+  ref<Bitmap> Bitmap::empty() {
+    static ref<Bitmap> e = new Bitmap(Map::empty(), 0);
+    return e;
+  }
+
+  bool Bitmap::contains(uint32 v) const {
+    auto c = _map->find(uint16(v >> 16));
+    return c && containerContains(c->ptr(), v & 0xffff);
+  }
+
+  ref<Bitmap> Bitmap::add(uint32 v) const {
+    uint16 key = uint16(v >> 16);
+    auto c = _map->find(key);
+    if (!c) {
+      auto m = newContainer(NO_EDIT, C::ARRAY, 1);
+      m->values()[0] = uint16(v);
+      m->count = m->cardinality = 1;
+      return new Bitmap(_map->set(key, ref<C>(m)), _cardinality + 1);
+    }
+    bool added = false;
+    ref<C> m = containerAdd(c->ptr(), NO_EDIT, v & 0xffff, added);
+    if (!added) {
+      return const_cast<Bitmap*>(this);
+    }
+    return new Bitmap(_map->set(key, std::move(m)), _cardinality + 1);
+  }
+
+  ref<Bitmap> Bitmap::remove(uint32 v) const {
+    uint16 key = uint16(v >> 16);
+    auto c = _map->find(key);
+    if (!c) {
+      return const_cast<Bitmap*>(this);
+    }
+    bool removed = false;
+    ref<C> m = containerRemove(c->ptr(), NO_EDIT, v & 0xffff, removed);
+    if (!removed) {
+      return const_cast<Bitmap*>(this);
+    }
+    return new Bitmap(m ? _map->set(key, std::move(m)) : _map->remove(key), _cardinality - 1);
+  }
+
+  ref<Bitmap> Bitmap::addRange(uint64 start, uint64 end) const {
+    end = std::min(end, uint64(0x100000000));
+    if (start >= end) {
+      return const_cast<Bitmap*>(this);
+    }
+    // a bitmap of the range, with one run per container
+    auto range = Map::empty()->modify([&](ref<TransientSortedMap<uint16,ref<C>>> t) {
+      for (uint64 key = start >> 16; key <= (end - 1) >> 16; ++key) {
+        uint64 lo = std::max(start, key << 16);
+        uint64 hi = std::min(end, (key + 1) << 16) - 1;
+        Run run = {uint16(lo), uint16(hi - lo)};
+        t->set(uint16(key), newRuns(NO_EDIT, &run, 1, uint32(hi - lo + 1)));
+      }
+    });
+    return unite(new Bitmap(range, end - start));
+  }
+
+  ref<Bitmap> Bitmap::unite(const ref<Bitmap>& other) const {
+    if (other->_map == _map || other->_cardinality == 0) {
+      return const_cast<Bitmap*>(this);
+    }
+    if (_cardinality == 0) {
+      return other;
+    }
+    uint64 card = _cardinality;
+    auto t = _map->asTransient();
+    for (auto& e : *other->_map) {
+      auto c = _map->find(e.first);
+      if (!c) {
+        t->set(e.first, e.second);
+        card += e.second->cardinality;
+      } else if (*c != e.second) {
+        ref<C> m = combineContainers<UNITE>(c->ptr(), e.second.ptr());
+        if (m != *c) {
+          card += m->cardinality - (*c)->cardinality;
+          t->set(e.first, std::move(m));
+        }
+      }
+    }
+    if (card == _cardinality) {
+      return const_cast<Bitmap*>(this);
+    }
+    if (card == other->_cardinality) {
+      return other;
+    }
+    return new Bitmap(t->makePersistent(), card);
+  }
+
+  ref<Bitmap> Bitmap::intersect(const ref<Bitmap>& other) const {
+    if (other->_map == _map) {
+      return const_cast<Bitmap*>(this);
+    }
+    // look up the containers of the bitmap with fewer containers in the other one
+    bool small = _map->size() <= other->_map->size();
+    const Bitmap* a = small ? this : other.ptr();
+    const Bitmap* b = small ? other.ptr() : this;
+    uint64 card = 0;
+    auto t = Map::empty()->asTransient();
+    for (auto& e : *a->_map) {
+      auto c = b->_map->find(e.first);
+      if (c) {
+        ref<C> m = combineContainers<INTERSECT>(e.second.ptr(), c->ptr());
+        if (m) {
+          card += m->cardinality;
+          t->set(e.first, std::move(m));
+        }
+      }
+    }
+    if (card == _cardinality) {
+      return const_cast<Bitmap*>(this);
+    }
+    if (card == other->_cardinality) {
+      return other;
+    }
+    return card == 0 ? empty() : ref<Bitmap>(new Bitmap(t->makePersistent(), card));
+  }
+
+  ref<Bitmap> Bitmap::subtract(const ref<Bitmap>& other) const {
+    if (other->_map == _map) {
+      return empty();
+    }
+    uint64 card = _cardinality;
+    auto t = _map->asTransient();
+    for (auto& e : *other->_map) {
+      auto c = _map->find(e.first);
+      if (c) {
+        ref<C> m = combineContainers<SUBTRACT>(c->ptr(), e.second.ptr());
+        if (m != *c) {
+          card -= (*c)->cardinality - (m ? m->cardinality : 0);
+          if (m) {
+            t->set(e.first, std::move(m));
+          } else {
+            t->remove(e.first);
+          }
+        }
+      }
+    }
+    if (card == _cardinality) {
+      return const_cast<Bitmap*>(this);
+    }
+    return card == 0 ? empty() : ref<Bitmap>(new Bitmap(t->makePersistent(), card));
+  }
+
+  uint64 Bitmap::intersectCardinality(const ref<Bitmap>& other) const {
+    bool small = _map->size() <= other->_map->size();
+    const Bitmap* a = small ? this : other.ptr();
+    const Bitmap* b = small ? other.ptr() : this;
+    uint64 n = 0;
+    for (auto& e : *a->_map) {
+      auto c = b->_map->find(e.first);
+      if (c) {
+        n += intersectCount(e.second.ptr(), c->ptr());
+      }
+    }
+    return n;
+  }
+
+  ref<Bitmap> Bitmap::runOptimize() const {
+    ref<TransientSortedMap<uint16,ref<C>>> t;
+    for (auto& e : *_map) {
+      C* c = e.second.ptr();
+      if (c->type == C::RUNS) {
+        continue;
+      }
+      uint32 nruns = countRuns(c);
+      size_t size = c->type == C::ARRAY ? c->count * sizeof(uint16) : WORDS * sizeof(uint64);
+      if (nruns * sizeof(Run) < size) {
+        if (!t) {
+          t = _map->asTransient();
+        }
+        t->set(e.first, toRuns(c, nruns));
+      }
+    }
+    return t ? ref<Bitmap>(new Bitmap(t->makePersistent(), _cardinality))
+             : ref<Bitmap>(const_cast<Bitmap*>(this));
+  }
+
+  ref<TransientBitmap> Bitmap::asTransient() const {
+    return new TransientBitmap(newEditID(), _map->asTransient(), _cardinality);
+  }
+
+
+  Bitmap::Iterator::Iterator(const Bitmap* b)
+    : _b(const_cast<Bitmap*>(b)), _m(b->_map->begin())
+  {
+    enter();
+  }
+
+  void Bitmap::Iterator::enter() {
+    if (_m == MapIterator()) {
+      _c = nullptr;
+      _v = 0;
+      return;
+    }
+    _c = _m->second.ptr();
+    _i = 0;
+    uint32 hi = uint32(_m->first) << 16;
+    switch (_c->type) {
+      case C::ARRAY:
+        _v = hi | _c->values()[0];
+        break;
+      case C::BITSET:
+        while ((_word = _c->words()[_i]) == 0) {
+          ++_i;
+        }
+        _v = hi | (_i * 64 + __builtin_ctzll(_word));
+        break;
+      case C::RUNS:
+        _v = hi | _c->runs()[0].start;
+        break;
+    }
+  }
+
+  Bitmap::Iterator& Bitmap::Iterator::operator++() { // ++i
+    uint32 hi = _v & 0xffff0000;
+    switch (_c->type) {
+      case C::ARRAY:
+        if (++_i < _c->count) {
+          _v = hi | _c->values()[_i];
+          return *this;
+        }
+        break;
+      case C::BITSET:
+        _word &= _word - 1;
+        while (_word == 0 && ++_i < WORDS) {
+          _word = _c->words()[_i];
+        }
+        if (_word) {
+          _v = hi | (_i * 64 + __builtin_ctzll(_word));
+          return *this;
+        }
+        break;
+      case C::RUNS:
+        if ((_v & 0xffff) < runEnd(_c->runs()[_i])) {
+          ++_v;
+          return *this;
+        }
+        if (++_i < _c->count) {
+          _v = hi | _c->runs()[_i].start;
+          return *this;
+        }
+        break;
+    }
+    ++_m;
+    enter();
+    return *this;
+  }
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // TransientBitmap
+
+  ref<Bitmap> TransientBitmap::makePersistent() {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    _edit = NO_EDIT;
+    return new Bitmap(_map->makePersistent(), _cardinality);
+  }
+
+  ref<TransientBitmap> TransientBitmap::add(uint32 v) {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    uint16 key = uint16(v >> 16);
+    auto c = _map->find(key);
+    if (!c) {
+      auto m = newContainer(_edit, C::ARRAY, arrayCapacity(_edit, 1));
+      m->values()[0] = uint16(v);
+      m->count = m->cardinality = 1;
+      _map->set(key, ref<C>(m));
+      _cardinality++;
+      return this;
+    }
+    bool added = false;
+    ref<C> m = containerAdd(c->ptr(), _edit, v & 0xffff, added);
+    if (m != *c) {
+      _map->set(key, std::move(m));
+    }
+    _cardinality += added;
+    return this;
+  }
+
+  ref<TransientBitmap> TransientBitmap::remove(uint32 v) {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    uint16 key = uint16(v >> 16);
+    auto c = _map->find(key);
+    if (!c) {
+      return this;
+    }
+    bool removed = false;
+    ref<C> m = containerRemove(c->ptr(), _edit, v & 0xffff, removed);
+    if (!m) {
+      _map->remove(key);
+    } else if (m != *c) {
+      _map->set(key, std::move(m));
+    }
+    _cardinality -= removed;
+    return this;
+  }
+
+  bool TransientBitmap::contains(uint32 v) const {
+    auto c = _map->find(uint16(v >> 16));
+    return c && containerContains(c->ptr(), v & 0xffff);
+  }
+
+} // namespace
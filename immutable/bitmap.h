@@ -0,0 +1,225 @@
+#pragma once
+#include "base.h"
+#include "sortedmap.h"
+#include <initializer_list>
+#include <iterator>
+
+namespace immutable {
+  struct TransientBitmap;
+
+  // Container of the values of a Bitmap which have the same high 16 bits, holding the
+  // low 16 bits of each value in one of three forms:
+  //
+  //   ARRAY   a sorted array of up to ARRAY_MAX values
+  //   BITSET  a set of 65536 bits in WORDS 64-bit words
+  //   RUNS    a sorted array of runs of consecutive values
+  //
+  // Containers with more than ARRAY_MAX values are bitsets (or runs), containers with
+  // fewer are arrays (or runs), and empty containers are removed, so each container is
+  // at most 8 kB. Runs are made by Bitmap::addRange and Bitmap::runOptimize.
+  //
+  // Like other nodes, containers stamped with a transient's edit token are modified
+  // in-place by that transient, while other containers are copied with the change.
+  struct BitmapContainer : RefCounted {
+    enum Type : uint8 { ARRAY, BITSET, RUNS };
+
+    // Values start, start+1, ... start+length
+    struct Run {
+      uint16 start;
+      uint16 length;
+    };
+
+    static constexpr uint32 ARRAY_MAX = 4096;
+    static constexpr uint32 WORDS = 1024;
+
+    EditID edit;
+    uint32 cardinality; // number of values, 1 to 65536
+    uint32 count;       // number of values (ARRAY) or runs (RUNS)
+    uint32 capacity;    // number of values or runs there's space for
+    Type   type;
+
+    BitmapContainer(EditID edit, Type type, uint32 capacity)
+      : edit(edit), cardinality(0), count(0), capacity(capacity), type(type) {}
+
+    uint16* values() const { return (uint16*)(this + 1); }
+    uint64* words() const { return (uint64*)(this + 1); }
+    Run*    runs() const { return (Run*)(this + 1); }
+
+    void dealloc();
+
+    IMMUTABLE_REFCOUNTED_IMPL(BitmapContainer)
+  };
+
+
+  // Persistent set of uint32 values, compressed like a Roaring bitmap.
+  //
+  // Values are grouped by their high 16 bits into containers (see BitmapContainer),
+  // which are kept in a SortedMap by those bits. A new version of a bitmap shares all
+  // containers with the version it was made from except the one which changed, and
+  // all but O(log n) nodes of the map. add, remove and contains are O(log n) plus, for
+  // add and remove, a copy of the container of up to 8 kB.
+  //
+  // unite, intersect and subtract combine containers pairwise. Containers which are
+  // the same in both bitmaps are skipped, and pairs of bitsets are combined 64 bits at
+  // a time with SIMD instructions (AVX2 or NEON, chosen at runtime on x86) which also
+  // count the bits of the result.
+  struct Bitmap : RefCounted {
+    struct Iterator;
+
+    // The empty bitmap
+    static ref<Bitmap> empty();
+
+    // Create a bitmap with the values of initializer list or of range [begin, end)
+    static ref<Bitmap> create(std::initializer_list<uint32>&&);
+    template <typename It> static ref<Bitmap> create(It&& begin, const It& end);
+
+    // Number of values in this bitmap
+    uint64 cardinality() const { return _cardinality; }
+
+    // True if v is in this bitmap
+    bool contains(uint32 v) const;
+
+    // Add or remove value. Returns this bitmap if nothing changed.
+    ref<Bitmap> add(uint32 v) const;
+    ref<Bitmap> remove(uint32 v) const;
+
+    // Add values [start, end), stored as runs where they fill whole containers
+    ref<Bitmap> addRange(uint64 start, uint64 end) const;
+
+    // Values which are in this bitmap or other (OR), in both this bitmap and other
+    // (AND), and in this bitmap but not in other (AND NOT). Returns this bitmap or
+    // other when the result has the same values.
+    ref<Bitmap> unite(const ref<Bitmap>& other) const;
+    ref<Bitmap> intersect(const ref<Bitmap>& other) const;
+    ref<Bitmap> subtract(const ref<Bitmap>& other) const;
+
+    // Number of values in both this bitmap and other, without creating a bitmap
+    uint64 intersectCardinality(const ref<Bitmap>& other) const;
+
+    // Returns a bitmap with the same values where containers which take up less space
+    // as runs are converted to runs
+    ref<Bitmap> runOptimize() const;
+
+    // return a new TransientBitmap contaning the same values as this bitmap.
+    ref<TransientBitmap> asTransient() const;
+
+    // apply modification with a transient. F is called with a ref<TransientBitmap>.
+    template <typename F> ref<Bitmap> modify(F&& fn) const;
+
+    // Iteration in ascending order
+    Iterator begin() const { return Iterator(this); }
+    Iterator end() const { return Iterator(); }
+
+    // forward iterator
+    struct Iterator {
+      typedef std::forward_iterator_tag iterator_category;
+      typedef int64  difference_type;
+      typedef uint32 value_type;
+      typedef void   pointer;
+      typedef uint32 reference;
+
+      Iterator() {}
+      Iterator& operator++(); // ++i
+      Iterator operator++(int); // i++
+      uint32 operator*() const { return _v; }
+
+      bool operator==(const Iterator& rhs) const { return _c == rhs._c && _v == rhs._v; }
+      bool operator!=(const Iterator& rhs) const { return !(*this == rhs); }
+
+    protected:
+      friend struct Bitmap;
+      using MapIterator = SortedMap<uint16,ref<BitmapContainer>>::Iterator;
+      Iterator(const Bitmap*);
+      void enter(); // move to the first value of the container at _m
+
+      ref<Bitmap>            _b;
+      MapIterator            _m;
+      const BitmapContainer* _c = nullptr; // current container
+      uint32                 _i = 0;       // index of value, word or run in _c
+      uint64                 _word = 0;    // bits of word _i not yet visited (BITSET)
+      uint32                 _v = 0;       // current value
+    };
+
+  protected:
+    friend struct TransientBitmap;
+    using Map = SortedMap<uint16,ref<BitmapContainer>>;
+
+    Bitmap(ref<Map> map, uint64 cardinality)
+      : _map(std::move(map)), _cardinality(cardinality) {}
+
+    ref<Map> _map;
+    uint64   _cardinality;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(Bitmap)
+  };
+
+
+  // Non-persistent version of Bitmap, for bulk loading. Works like TransientArray:
+  // containers created by the transient are modified in-place, and array containers
+  // grow by doubling their capacity.
+  struct TransientBitmap : RefCounted {
+    // Number of values in this bitmap
+    uint64 cardinality() const { return _cardinality; }
+
+    // "seal" the transient bitmap and return a persistent bitmap that refers to the
+    // same containers. Returns null if this transient bitmap is not editable (e.g.
+    // makePersistent() has already been called.)
+    ref<Bitmap> makePersistent();
+
+    // Add or remove value. Returns null if this transient bitmap is not editable.
+    ref<TransientBitmap> add(uint32 v);
+    ref<TransientBitmap> remove(uint32 v);
+
+    // True if v is in this bitmap
+    bool contains(uint32 v) const;
+
+  protected:
+    friend struct Bitmap;
+    using Map = SortedMap<uint16,ref<BitmapContainer>>;
+
+    TransientBitmap(EditID edit, ref<TransientSortedMap<uint16,ref<BitmapContainer>>> map,
+                    uint64 cardinality)
+      : _edit(edit), _map(std::move(map)), _cardinality(cardinality) {}
+
+    EditID                                                _edit;
+    ref<TransientSortedMap<uint16,ref<BitmapContainer>>> _map;
+    uint64                                                _cardinality;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(TransientBitmap)
+  };
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // implementation
+
+  inline ref<Bitmap> Bitmap::create(std::initializer_list<uint32>&& v) {
+    return create(v.begin(), v.end());
+  }
+
+  template <typename It>
+  inline ref<Bitmap> Bitmap::create(It&& begin, const It& end) {
+    auto t = empty()->asTransient();
+    for (auto it = begin; it != end; ++it) {
+      t->add(uint32(*it));
+    }
+    return t->makePersistent();
+  }
+
+  template <typename F>
+  inline ref<Bitmap> Bitmap::modify(F&& fn) const {
+    auto t = asTransient();
+    fn(t);
+    return t->makePersistent();
+  }
+
+  inline Bitmap::Iterator Bitmap::Iterator::operator++(int) { // i++
+    Iterator copy(*this);
+    operator++();
+    return copy;
+  }
+
+} // namespace
@@ -0,0 +1,272 @@
+#pragma once
+#include "array.h"
+
+namespace immutable {
+
+  // Persistent double-ended queue. Like Array, but values can be added and removed at
+  // both ends in amortized O(1) time, while random access remains O(log32 n).
+  //
+  // A deque is made up of two arrays: the front buffer, which holds the first values
+  // in reverse order, and the back array which holds the remaining values. cons and
+  // rest push and pop at the end of the front buffer, the same way push and pop work
+  // at the end of the back array. When the front buffer is empty, rest removes the
+  // first value of the back array instead, which is an O(1) slice (and vice versa for
+  // pop), so no values ever need to be moved between the two.
+  template <typename T>
+  struct Deque : RefCounted {
+    using ValueT = Value<T>;
+    using ArrayT = Array<T>;
+    struct Iterator;
+
+    // The empty deque
+    static ref<Deque> empty();
+
+    // Create a deque with values from initializer list
+    template <typename Y> static ref<Deque> create(std::initializer_list<Y>&&);
+
+    // Create a deque with the values of an array. O(1)
+    static ref<Deque> create(ref<ArrayT>);
+
+    // Number of values in this deque
+    uint32 size() const { return _front->size() + _back->size(); }
+
+    // Append value to the end. Form 2 constructs a value T in-place.
+    ref<Deque> push(ValueT*) const; // 1
+    template <typename Arg> ref<Deque> push(Arg&&) const; // 2
+
+    // Prepend value to the beginning. Form 2 constructs a value T in-place.
+    ref<Deque> cons(ValueT*) const; // 1
+    template <typename Arg> ref<Deque> cons(Arg&&) const; // 2
+
+    // Remove the last value
+    ref<Deque> pop() const;
+
+    // Remove the first value
+    ref<Deque> rest() const;
+
+    // Set value at index i, where i must be less than size().
+    // Returns nullptr if i is out-of bounds. Form 1 constructs a value T in-place.
+    template <typename Arg> ref<Deque> set(uint32 i, Arg&&) const; // 1
+    ref<Deque> set(uint32 i, ValueT*) const; // 2
+
+    // Access value at index. If i >= size() the behavior is undefined.
+    const T& get(uint32 i) const;
+
+    // Access value at index. If i >= size() the behavior is undefined.
+    // For unboxed values, the returned Value is a copy.
+    const ref<ValueT> getValue(uint32 i) const;
+
+    // Access first and last value. If the deque is empty the behavior is undefined.
+    const T& first() const { return get(0); }
+    const T& last() const { return get(size() - 1); }
+
+    // Returns an array with the same values as this deque. O(log n) plus the size of
+    // the front buffer, which is at most the number of values added with cons.
+    ref<ArrayT> toArray() const;
+
+    // Iteration
+    Iterator begin() const { return Iterator(this, 0); }
+    Iterator end() const { return Iterator(this, size()); }
+
+    // forward iterator
+    struct Iterator {
+      typedef std::forward_iterator_tag iterator_category;
+      typedef int64    difference_type;
+      typedef T        value_type;
+      typedef const T* pointer;
+      typedef const T& reference;
+
+      Iterator() {}
+      Iterator& operator++(); // ++i
+      Iterator operator++(int); // i++
+      const T& operator*() const;
+
+      bool operator==(const Iterator& rhs) const { return _i == rhs._i; }
+      bool operator!=(const Iterator& rhs) const { return _i != rhs._i; }
+
+    protected:
+      friend struct Deque;
+      Iterator(const Deque* d, uint32 i);
+
+      ref<Deque>                       _d;
+      uint32                           _i = 0;
+      typename ArrayT::ReverseIterator _rit; // position in _d->_front
+      typename ArrayT::Iterator        _it;  // position in _d->_back
+    };
+
+  protected:
+    Deque(ref<ArrayT> front, ref<ArrayT> back) : _front(front), _back(back) {}
+
+    // Returns a new array with the values of src in reverse order
+    static ref<ArrayT> reversed(const ArrayT* src);
+
+    ref<ArrayT> _front; // first values of the deque, in reverse order
+    ref<ArrayT> _back;  // remaining values of the deque
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(Deque)
+  };
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // implementation
+
+  template <typename T>
+  inline ref<Deque<T>> Deque<T>::empty() {
+    static ref<Deque> e = new Deque(ArrayT::empty(), ArrayT::empty());
+    return e;
+  }
+
+  template <typename T>
+  template <typename Y>
+  inline ref<Deque<T>> Deque<T>::create(std::initializer_list<Y>&& v) {
+    return create(ArrayT::create(std::move(v)));
+  }
+
+  template <typename T>
+  inline ref<Deque<T>> Deque<T>::create(ref<ArrayT> a) {
+    return new Deque(ArrayT::empty(), a);
+  }
+
+
+  template <typename T>
+  inline ref<Array<T>> Deque<T>::reversed(const ArrayT* src) {
+    return ArrayT::empty()->modify([&](ref<TransientArray<T>> t) {
+      for (uint32 end = src->size(); end > 0; ) {
+        // Note: getValue references boxed values rather than copying them
+        --end;
+        ArrayT::UNBOXED ? t->push(src->get(end)) : t->push(src->getValue(end).ptr());
+      }
+    });
+  }
+
+
+  template <typename T>
+  inline ref<Deque<T>> Deque<T>::push(ValueT* v) const {
+    return new Deque(_front, _back->push(v));
+  }
+
+  template <typename T>
+  template <typename Arg>
+  inline ref<Deque<T>> Deque<T>::push(Arg&& arg) const {
+    return new Deque(_front, _back->push(fwd<Arg>(arg)));
+  }
+
+  template <typename T>
+  inline ref<Deque<T>> Deque<T>::cons(ValueT* v) const {
+    return new Deque(_front->push(v), _back);
+  }
+
+  template <typename T>
+  template <typename Arg>
+  inline ref<Deque<T>> Deque<T>::cons(Arg&& arg) const {
+    return new Deque(_front->push(fwd<Arg>(arg)), _back);
+  }
+
+
+  template <typename T>
+  inline ref<Deque<T>> Deque<T>::pop() const {
+    if (_back->size()) {
+      return new Deque(_front, _back->pop());
+    }
+    if (_front->size() == 0) {
+      return const_cast<Deque*>(this);
+    }
+    // _front[0] is the last value of the deque
+    return new Deque(_front->rest(), _back);
+  }
+
+  template <typename T>
+  inline ref<Deque<T>> Deque<T>::rest() const {
+    if (_front->size()) {
+      return new Deque(_front->pop(), _back);
+    }
+    if (_back->size() == 0) {
+      return const_cast<Deque*>(this);
+    }
+    return new Deque(_front, _back->rest());
+  }
+
+
+  template <typename T>
+  template <typename Arg>
+  inline ref<Deque<T>> Deque<T>::set(uint32 i, Arg&& arg) const {
+    uint32 n = _front->size();
+    if (i < n) {
+      return new Deque(_front->set(n - 1 - i, fwd<Arg>(arg)), _back);
+    }
+    auto b = _back->set(i - n, fwd<Arg>(arg));
+    return b ? new Deque(_front, b) : nullptr;
+  }
+
+  template <typename T>
+  inline ref<Deque<T>> Deque<T>::set(uint32 i, ValueT* v) const {
+    uint32 n = _front->size();
+    if (i < n) {
+      return new Deque(_front->set(n - 1 - i, v), _back);
+    }
+    auto b = _back->set(i - n, v);
+    return b ? new Deque(_front, b) : nullptr;
+  }
+
+
+  template <typename T>
+  inline const T& Deque<T>::get(uint32 i) const {
+    uint32 n = _front->size();
+    return i < n ? _front->get(n - 1 - i) : _back->get(i - n);
+  }
+
+  template <typename T>
+  inline const ref<Value<T>> Deque<T>::getValue(uint32 i) const {
+    uint32 n = _front->size();
+    return i < n ? _front->getValue(n - 1 - i) : _back->getValue(i - n);
+  }
+
+
+  template <typename T>
+  inline ref<Array<T>> Deque<T>::toArray() const {
+    if (_front->size() == 0) {
+      return _back;
+    }
+    return reversed(_front.ptr())->concat(_back);
+  }
+
+
+  // Values of the front buffer are visited with a ReverseIterator, which references
+  // the current leaf like _it does, so that both parts are iterated leaf by leaf.
+  template <typename T>
+  inline Deque<T>::Iterator::Iterator(const Deque* d, uint32 i)
+    : _d(const_cast<Deque*>(d))
+    , _i(i)
+    , _it(d->_back->begin(i > d->_front->size() ? i - d->_front->size() : 0))
+  {
+    uint32 n = d->_front->size();
+    if (i < n) {
+      _rit = d->_front->rbegin(0, n - i);
+    }
+  }
+
+  template <typename T>
+  inline typename Deque<T>::Iterator& Deque<T>::Iterator::operator++() { // ++i
+    if (_i++ >= _d->_front->size()) {
+      ++_it;
+    } else {
+      ++_rit;
+    }
+    return *this;
+  }
+
+  template <typename T>
+  inline typename Deque<T>::Iterator Deque<T>::Iterator::operator++(int) { // i++
+    Iterator copy(*this);
+    operator++();
+    return copy;
+  }
+
+  template <typename T>
+  inline const T& Deque<T>::Iterator::operator*() const {
+    return _i < _d->_front->size() ? *_rit : *const_cast<typename ArrayT::Iterator&>(_it);
+  }
+
+} // namespace
@@ -0,0 +1,714 @@
+#pragma once
+#include "base.h"
+#include "alloc.h"
+#include <functional>
+#include <type_traits>
+
+namespace immutable {
+
+  // Hash of a key in a hash trie. std::hash of integers is often the identity
+  // function, so its result is mixed (splitmix64 finalizer) to make every bit of the
+  // hash depend on every bit of the key.
+  template <typename K>
+  inline uint32 HashTrieHash(const K& k) {
+    uint64 h = uint64(std::hash<K>()(k));
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return uint32(h ^ (h >> 31));
+  }
+
+
+  // Node of a compressed hash-array mapped prefix trie (CHAMP), the structure behind
+  // Map and Set. Traits defines the type of entries stored in the trie and how to get the key
+  // of an entry:
+  //   struct Traits {
+  //     using Key = ...;
+  //     using Entry = ...;
+  //     static const Key& key(const Entry&);
+  //   };
+  //
+  // A node has 32 positions, one for each value of the BITS bits of a key's hash at
+  // the node's level. A position holds either an entry or a subnode (for two or more
+  // keys with the same hash bits), and is marked by a bit in datamap or nodemap
+  // respectively. Entries and subnode references are stored compactly, in order of
+  // their positions, in the same allocation as the node, so that a lookup visits
+  // one memory block per level.
+  //
+  // Tries are kept in canonical form: a subnode always holds at least two entries
+  // (in total, at any depth). When removing leaves a subnode with a single entry, the
+  // entry moves up into the parent. Nodes below the last level, where all bits of the
+  // hash are used, are collision nodes which hold any number of entries in any order.
+  // Every node records the number of entries in its subtree, so that the size of the
+  // result of a set operation (unite etc.) is known without visiting shared subtrees.
+  //
+  // Operations take an edit token: nodes stamped with the token (other than NO_EDIT)
+  // belong to the transient which is making the change and are modified in-place,
+  // while other nodes are copied with the change and stamped with the token.
+  // Operations which change a node return the new node with no references, or the
+  // node itself when it was modified in-place or not changed.
+  template <typename Traits>
+  struct HashTrieNode : RefCounted {
+    using Node = HashTrieNode;
+    using Key = typename Traits::Key;
+    using Entry = typename Traits::Entry;
+
+    static constexpr uint32 BITS = 5;
+    static constexpr uint32 HASH_BITS = 32; // nodes at this shift are collision nodes
+    static constexpr uint32 MAX_DEPTH = HASH_BITS / BITS + 2; // incl. collision nodes
+
+    static_assert(alignof(Entry) <= NodeAlloc::GRANULE, "Entry is over-aligned");
+
+    EditID edit;
+    uint32 datamap;  // positions holding entries
+    uint32 nodemap;  // positions holding subnodes
+    uint32 nentries; // == popcount(datamap), except for collision nodes
+    uint32 nnodes;   // == popcount(nodemap)
+    uint32 size;     // number of entries in this subtree
+
+    ref<Node>* nodes() const { return (ref<Node>*)(this + 1); }
+    Entry* entries() const { return (Entry*)((char*)this + entriesOffset(nnodes)); }
+
+    // Returns a node without entries and subnodes, to be filled in by the caller.
+    // size is set to nentries.
+    static Node* alloc(EditID, uint32 datamap, uint32 nodemap, uint32 nentries, uint32 nnodes);
+
+    // Entry with key k, or nullptr if there's no such entry
+    static const Entry* find(const Node*, const Key& k, uint32 hash, uint32 shift=0);
+
+    // Adds entry e. If there's an entry with the same key, it's replaced by e when
+    // `replace` is true, or else left alone. `added` is set if e was added.
+    static Node* set(
+      Node*, EditID, uint32 shift, Entry&& e, uint32 hash, bool replace, bool& added);
+
+    // Removes the entry with key k. `removed` is set if there was such an entry.
+    static Node* remove(
+      Node*, EditID, uint32 shift, const Key& k, uint32 hash, bool& removed);
+
+    // Set operations, which return new persistent nodes. Subtrees which are the same
+    // node in a and b are not visited, and a or b itself is returned when the result
+    // has the same entries, so the cost depends on how much the tries differ rather
+    // than on their size. Where both have an entry with the same key, the result
+    // has either one of them. intersect and subtract return nullptr when the result
+    // is empty.
+    static Node* unite(Node* a, Node* b, uint32 shift);     // entries of a or b
+    static Node* intersect(Node* a, Node* b, uint32 shift); // entries of a in b
+    static Node* subtract(Node* a, Node* b, uint32 shift);  // entries of a not in b
+
+  protected:
+    HashTrieNode(EditID edit, uint32 datamap, uint32 nodemap, uint32 nentries, uint32 nnodes)
+      : edit(edit)
+      , datamap(datamap)
+      , nodemap(nodemap)
+      , nentries(nentries)
+      , nnodes(nnodes)
+      , size(nentries)
+    {}
+
+    struct Builder;
+
+    static size_t entriesOffset(uint32 nnodes) {
+      size_t off = sizeof(Node) + nnodes * sizeof(ref<Node>);
+      return (off + alignof(Entry) - 1) & ~(alignof(Entry) - 1);
+    }
+    static size_t allocSize(uint32 nentries, uint32 nnodes) {
+      return entriesOffset(nnodes) + nentries * sizeof(Entry);
+    }
+
+    static uint32 bitpos(uint32 hash, uint32 shift) {
+      return 1u << ((hash >> shift) & ((1u << BITS) - 1));
+    }
+    static uint32 index(uint32 map, uint32 bit) {
+      return uint32(__builtin_popcount(map & (bit - 1)));
+    }
+    static bool isEditable(const Node* n, EditID edit) {
+      return edit != NO_EDIT && n->edit == edit;
+    }
+
+    // Moves (if n is editable, and so about to be replaced) or copies the entries or
+    // subnodes [start, end) of n to dst
+    static void copyEntries(Node* n, EditID, uint32 start, uint32 end, Entry* dst);
+    static void copyNodes(Node* n, EditID, uint32 start, uint32 end, ref<Node>* dst);
+
+    static Node* setIn(Node*, EditID, uint32 shift, Entry&&, uint32 hash, bool replace, bool& added);
+    static Node* removeIn(Node*, EditID, uint32 shift, const Key&, uint32 hash, bool& removed);
+    static Node* merge(EditID, uint32 shift, Entry&& e1, uint32 h1, Entry&& e2, uint32 h2);
+    static Node* replaceEntry(Node*, EditID, uint32 i, Entry&&);
+    static Node* insertEntry(Node*, EditID, uint32 bit, Entry&&);
+    static Node* removeEntry(Node*, EditID, uint32 bit, uint32 i);
+    static Node* replaceNode(Node*, EditID, uint32 j, Node*);
+    static Node* entryToNode(Node*, EditID, uint32 bit, uint32 i, Node*);
+    static Node* nodeToEntry(Node*, EditID, uint32 bit, uint32 j, Entry&&);
+
+    void dealloc();
+
+    IMMUTABLE_REFCOUNTED_IMPL(HashTrieNode)
+  };
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // implementation
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::alloc(
+    EditID edit, uint32 datamap, uint32 nodemap, uint32 nentries, uint32 nnodes)
+  {
+    void* p = NodeAlloc::alloc(allocSize(nentries, nnodes));
+    return new (p) Node(edit, datamap, nodemap, nentries, nnodes);
+  }
+
+  template <typename Traits>
+  inline void HashTrieNode<Traits>::dealloc() {
+    size_t bytes = allocSize(nentries, nnodes);
+    auto e = entries();
+    for (uint32 i = 0; i < nentries; ++i) {
+      e[i].~Entry();
+    }
+    auto c = nodes();
+    for (uint32 i = 0; i < nnodes; ++i) {
+      c[i].~ref<Node>();
+    }
+    this->~HashTrieNode();
+    NodeAlloc::free(this, bytes);
+  }
+
+
+  template <typename Traits>
+  inline const typename Traits::Entry* HashTrieNode<Traits>::find(
+    const Node* n, const Key& k, uint32 hash, uint32 shift)
+  {
+    for (; shift < HASH_BITS; shift += BITS) {
+      uint32 bit = bitpos(hash, shift);
+      if (n->datamap & bit) {
+        auto e = &n->entries()[index(n->datamap, bit)];
+        return Traits::key(*e) == k ? e : nullptr;
+      }
+      if ((n->nodemap & bit) == 0) {
+        return nullptr;
+      }
+      n = n->nodes()[index(n->nodemap, bit)].ptr();
+    }
+    auto e = n->entries();
+    for (uint32 i = 0; i < n->nentries; ++i) {
+      if (Traits::key(e[i]) == k) {
+        return &e[i];
+      }
+    }
+    return nullptr;
+  }
+
+
+  template <typename Traits>
+  inline void HashTrieNode<Traits>::copyEntries(
+    Node* n, EditID edit, uint32 start, uint32 end, Entry* dst)
+  {
+    auto src = n->entries();
+    if (isEditable(n, edit)) {
+      for (uint32 i = start; i < end; ++i) {
+        new (dst++) Entry(std::move(src[i]));
+      }
+    } else {
+      for (uint32 i = start; i < end; ++i) {
+        new (dst++) Entry(src[i]);
+      }
+    }
+  }
+
+  template <typename Traits>
+  inline void HashTrieNode<Traits>::copyNodes(
+    Node* n, EditID edit, uint32 start, uint32 end, ref<Node>* dst)
+  {
+    auto src = n->nodes();
+    if (isEditable(n, edit)) {
+      for (uint32 i = start; i < end; ++i) {
+        new (dst++) ref<Node>(std::move(src[i]));
+      }
+    } else {
+      for (uint32 i = start; i < end; ++i) {
+        new (dst++) ref<Node>(src[i]);
+      }
+    }
+  }
+
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::set(
+    Node* n, EditID edit, uint32 shift, Entry&& e, uint32 hash, bool replace, bool& added)
+  {
+    Node* m = setIn(n, edit, shift, std::move(e), hash, replace, added);
+    // Note: m is only the same as n when n was not changed, or changed in-place
+    if (m != n || added) {
+      m->size = n->size + added;
+    }
+    return m;
+  }
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::remove(
+    Node* n, EditID edit, uint32 shift, const Key& k, uint32 hash, bool& removed)
+  {
+    Node* m = removeIn(n, edit, shift, k, hash, removed);
+    if (m != n || removed) {
+      m->size = n->size - removed;
+    }
+    return m;
+  }
+
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::setIn(
+    Node* n, EditID edit, uint32 shift, Entry&& e, uint32 hash, bool replace, bool& added)
+  {
+    if (shift >= HASH_BITS) {
+      auto entries = n->entries();
+      for (uint32 i = 0; i < n->nentries; ++i) {
+        if (Traits::key(entries[i]) == Traits::key(e)) {
+          return replace ? replaceEntry(n, edit, i, std::move(e)) : n;
+        }
+      }
+      added = true;
+      auto m = alloc(edit, 0, 0, n->nentries + 1, 0);
+      copyEntries(n, edit, 0, n->nentries, m->entries());
+      new (&m->entries()[n->nentries]) Entry(std::move(e));
+      return m;
+    }
+
+    uint32 bit = bitpos(hash, shift);
+    if (n->datamap & bit) {
+      uint32 i = index(n->datamap, bit);
+      auto& cur = n->entries()[i];
+      if (Traits::key(cur) == Traits::key(e)) {
+        return replace ? replaceEntry(n, edit, i, std::move(e)) : n;
+      }
+      // Two keys at the same position; both move down into a new subnode
+      added = true;
+      uint32 curhash = HashTrieHash(Traits::key(cur));
+      Entry e1 = isEditable(n, edit) ? Entry(std::move(cur)) : Entry(cur);
+      auto sub = merge(edit, shift + BITS, std::move(e1), curhash, std::move(e), hash);
+      return entryToNode(n, edit, bit, i, sub);
+    }
+
+    if (n->nodemap & bit) {
+      uint32 j = index(n->nodemap, bit);
+      Node* child = n->nodes()[j].ptr();
+      Node* c = set(child, edit, shift + BITS, std::move(e), hash, replace, added);
+      return c == child ? n : replaceNode(n, edit, j, c);
+    }
+
+    added = true;
+    return insertEntry(n, edit, bit, std::move(e));
+  }
+
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::removeIn(
+    Node* n, EditID edit, uint32 shift, const Key& k, uint32 hash, bool& removed)
+  {
+    if (shift >= HASH_BITS) {
+      auto entries = n->entries();
+      for (uint32 i = 0; i < n->nentries; ++i) {
+        if (Traits::key(entries[i]) == k) {
+          removed = true;
+          auto m = alloc(edit, 0, 0, n->nentries - 1, 0);
+          copyEntries(n, edit, 0, i, m->entries());
+          copyEntries(n, edit, i + 1, n->nentries, m->entries() + i);
+          return m;
+        }
+      }
+      return n;
+    }
+
+    uint32 bit = bitpos(hash, shift);
+    if (n->datamap & bit) {
+      uint32 i = index(n->datamap, bit);
+      if (!(Traits::key(n->entries()[i]) == k)) {
+        return n;
+      }
+      removed = true;
+      return removeEntry(n, edit, bit, i);
+    }
+
+    if (n->nodemap & bit) {
+      uint32 j = index(n->nodemap, bit);
+      Node* child = n->nodes()[j].ptr();
+      Node* c = remove(child, edit, shift + BITS, k, hash, removed);
+      if (c == child) {
+        return n;
+      }
+      if (c->nnodes == 0 && c->nentries == 1) {
+        // Keep the trie canonical by moving the subnode's last entry up here. If this
+        // node is then left with a single entry, our parent does the same.
+        ref<Node> hold = c;
+        Entry e = isEditable(c, edit) ? Entry(std::move(c->entries()[0]))
+                                      : Entry(c->entries()[0]);
+        return nodeToEntry(n, edit, bit, j, std::move(e));
+      }
+      return replaceNode(n, edit, j, c);
+    }
+
+    return n;
+  }
+
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::merge(
+    EditID edit, uint32 shift, Entry&& e1, uint32 h1, Entry&& e2, uint32 h2)
+  {
+    if (shift >= HASH_BITS) {
+      auto m = alloc(edit, 0, 0, 2, 0);
+      new (&m->entries()[0]) Entry(std::move(e1));
+      new (&m->entries()[1]) Entry(std::move(e2));
+      return m;
+    }
+    uint32 b1 = bitpos(h1, shift);
+    uint32 b2 = bitpos(h2, shift);
+    if (b1 == b2) {
+      auto m = alloc(edit, 0, b1, 0, 1);
+      new (&m->nodes()[0]) ref<Node>(
+        merge(edit, shift + BITS, std::move(e1), h1, std::move(e2), h2));
+      m->size = 2;
+      return m;
+    }
+    auto m = alloc(edit, b1 | b2, 0, 2, 0);
+    new (&m->entries()[b1 < b2 ? 0 : 1]) Entry(std::move(e1));
+    new (&m->entries()[b1 < b2 ? 1 : 0]) Entry(std::move(e2));
+    return m;
+  }
+
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::replaceEntry(
+    Node* n, EditID edit, uint32 i, Entry&& e)
+  {
+    if (isEditable(n, edit)) {
+      n->entries()[i] = std::move(e);
+      return n;
+    }
+    auto m = alloc(edit, n->datamap, n->nodemap, n->nentries, n->nnodes);
+    copyEntries(n, edit, 0, i, m->entries());
+    new (&m->entries()[i]) Entry(std::move(e));
+    copyEntries(n, edit, i + 1, n->nentries, m->entries() + i + 1);
+    copyNodes(n, edit, 0, n->nnodes, m->nodes());
+    return m;
+  }
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::insertEntry(
+    Node* n, EditID edit, uint32 bit, Entry&& e)
+  {
+    uint32 i = index(n->datamap, bit);
+    auto m = alloc(edit, n->datamap | bit, n->nodemap, n->nentries + 1, n->nnodes);
+    copyEntries(n, edit, 0, i, m->entries());
+    new (&m->entries()[i]) Entry(std::move(e));
+    copyEntries(n, edit, i, n->nentries, m->entries() + i + 1);
+    copyNodes(n, edit, 0, n->nnodes, m->nodes());
+    return m;
+  }
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::removeEntry(
+    Node* n, EditID edit, uint32 bit, uint32 i)
+  {
+    auto m = alloc(edit, n->datamap ^ bit, n->nodemap, n->nentries - 1, n->nnodes);
+    copyEntries(n, edit, 0, i, m->entries());
+    copyEntries(n, edit, i + 1, n->nentries, m->entries() + i);
+    copyNodes(n, edit, 0, n->nnodes, m->nodes());
+    return m;
+  }
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::replaceNode(
+    Node* n, EditID edit, uint32 j, Node* c)
+  {
+    if (isEditable(n, edit)) {
+      n->nodes()[j] = c;
+      return n;
+    }
+    auto m = alloc(edit, n->datamap, n->nodemap, n->nentries, n->nnodes);
+    copyEntries(n, edit, 0, n->nentries, m->entries());
+    copyNodes(n, edit, 0, j, m->nodes());
+    new (&m->nodes()[j]) ref<Node>(c);
+    copyNodes(n, edit, j + 1, n->nnodes, m->nodes() + j + 1);
+    return m;
+  }
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::entryToNode(
+    Node* n, EditID edit, uint32 bit, uint32 i, Node* c)
+  {
+    uint32 j = index(n->nodemap, bit);
+    auto m = alloc(edit, n->datamap ^ bit, n->nodemap | bit, n->nentries - 1, n->nnodes + 1);
+    copyEntries(n, edit, 0, i, m->entries());
+    copyEntries(n, edit, i + 1, n->nentries, m->entries() + i);
+    copyNodes(n, edit, 0, j, m->nodes());
+    new (&m->nodes()[j]) ref<Node>(c);
+    copyNodes(n, edit, j, n->nnodes, m->nodes() + j + 1);
+    return m;
+  }
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::nodeToEntry(
+    Node* n, EditID edit, uint32 bit, uint32 j, Entry&& e)
+  {
+    uint32 i = index(n->datamap, bit);
+    auto m = alloc(edit, n->datamap | bit, n->nodemap ^ bit, n->nentries + 1, n->nnodes - 1);
+    copyEntries(n, edit, 0, i, m->entries());
+    new (&m->entries()[i]) Entry(std::move(e));
+    copyEntries(n, edit, i, n->nentries, m->entries() + i + 1);
+    copyNodes(n, edit, 0, j, m->nodes());
+    copyNodes(n, edit, j + 1, n->nnodes, m->nodes() + j);
+    return m;
+  }
+
+
+  // Collects the entries and subnodes of a node made by a set operation, in order of
+  // their positions. Subnodes with a single entry are replaced by the entry.
+  // sameA and sameB are cleared by the operation when the node differs from a or b.
+  template <typename Traits>
+  struct HashTrieNode<Traits>::Builder {
+    uint32       datamap = 0;
+    uint32       nodemap = 0;
+    uint32       nentries = 0;
+    uint32       nnodes = 0;
+    bool         sameA = true;
+    bool         sameB = true;
+    const Entry* entries[1 << BITS];
+    ref<Node>    nodes[1 << BITS];
+    ref<Node>    keep[1 << BITS]; // single-entry subnodes whose entry is in entries
+
+    void entry(uint32 bit, const Entry* e) {
+      datamap |= bit;
+      entries[nentries++] = e;
+    }
+
+    void node(uint32 bit, Node* n) {
+      if (n->nnodes == 0 && n->nentries == 1) {
+        keep[nentries] = n;
+        entry(bit, &n->entries()[0]);
+      } else {
+        nodemap |= bit;
+        nodes[nnodes++] = n;
+      }
+    }
+
+    // Returns a, b or a new node, or nullptr if the node is empty
+    Node* make(Node* a, Node* b) {
+      if (sameA) {
+        return a;
+      }
+      if (sameB) {
+        return b;
+      }
+      if (nentries + nnodes == 0) {
+        return nullptr;
+      }
+      auto m = alloc(NO_EDIT, datamap, nodemap, nentries, nnodes);
+      for (uint32 i = 0; i < nentries; ++i) {
+        new (&m->entries()[i]) Entry(*entries[i]);
+      }
+      for (uint32 i = 0; i < nnodes; ++i) {
+        m->size += nodes[i]->size;
+        new (&m->nodes()[i]) ref<Node>(std::move(nodes[i]));
+      }
+      return m;
+    }
+  };
+
+
+  // Returns a collision node with the entries of n for which keep(entry) is true, n
+  // itself if that's all of them, or nullptr if none
+  template <typename Traits, typename F>
+  inline HashTrieNode<Traits>* HashTrieFilter(HashTrieNode<Traits>* n, F&& keep) {
+    using Entry = typename Traits::Entry;
+    auto e = n->entries();
+    uint32 count = 0;
+    for (uint32 i = 0; i < n->nentries; ++i) {
+      count += keep(e[i]);
+    }
+    if (count == n->nentries) {
+      return n;
+    }
+    if (count == 0) {
+      return nullptr;
+    }
+    auto m = HashTrieNode<Traits>::alloc(NO_EDIT, 0, 0, count, 0);
+    auto dst = m->entries();
+    for (uint32 i = 0; i < n->nentries; ++i) {
+      if (keep(e[i])) {
+        new (dst++) Entry(e[i]);
+      }
+    }
+    return m;
+  }
+
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::unite(Node* a, Node* b, uint32 shift) {
+    if (a == b || b->size == 0) {
+      return a;
+    }
+    if (a->size == 0) {
+      return b;
+    }
+
+    if (shift >= HASH_BITS) {
+      auto extra = HashTrieFilter<Traits>(b, [&](const Entry& e) {
+        return find(a, Traits::key(e), 0, shift) == nullptr;
+      });
+      if (extra == nullptr) {
+        return a;
+      }
+      ref<Node> hold = extra;
+      if (a->nentries + extra->nentries == b->nentries) {
+        return b; // all of a is in b
+      }
+      auto m = alloc(NO_EDIT, 0, 0, a->nentries + extra->nentries, 0);
+      copyEntries(a, NO_EDIT, 0, a->nentries, m->entries());
+      copyEntries(extra, NO_EDIT, 0, extra->nentries, m->entries() + a->nentries);
+      return m;
+    }
+
+    Builder r;
+    for (uint32 map = a->datamap | a->nodemap | b->datamap | b->nodemap; map; map &= map - 1) {
+      uint32 bit = map & -map;
+      auto ae = (a->datamap & bit) ? &a->entries()[index(a->datamap, bit)] : nullptr;
+      auto be = (b->datamap & bit) ? &b->entries()[index(b->datamap, bit)] : nullptr;
+      auto an = (a->nodemap & bit) ? a->nodes()[index(a->nodemap, bit)].ptr() : nullptr;
+      auto bn = (b->nodemap & bit) ? b->nodes()[index(b->nodemap, bit)].ptr() : nullptr;
+      if (an || bn) {
+        Node* n;
+        if (an && bn) {
+          n = unite(an, bn, shift + BITS);
+        } else {
+          // a subnode, and maybe an entry of the other trie to add to it
+          auto e = an ? be : ae;
+          n = an ? an : bn;
+          if (e) {
+            bool added = false;
+            n = set(n, NO_EDIT, shift + BITS, Entry(*e), HashTrieHash(Traits::key(*e)),
+                    false, added);
+          }
+        }
+        r.sameA &= n == an;
+        r.sameB &= n == bn;
+        r.node(bit, n);
+      } else if (ae && be && !(Traits::key(*ae) == Traits::key(*be))) {
+        r.sameA = r.sameB = false;
+        r.node(bit, merge(NO_EDIT, shift + BITS,
+                          Entry(*ae), HashTrieHash(Traits::key(*ae)),
+                          Entry(*be), HashTrieHash(Traits::key(*be))));
+      } else {
+        r.sameA &= ae != nullptr;
+        r.sameB &= be != nullptr;
+        r.entry(bit, ae ? ae : be);
+      }
+    }
+    return r.make(a, b);
+  }
+
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::intersect(Node* a, Node* b, uint32 shift) {
+    if (a == b) {
+      return a;
+    }
+    if (a->size == 0 || b->size == 0) {
+      return nullptr;
+    }
+
+    if (shift >= HASH_BITS) {
+      return HashTrieFilter<Traits>(a, [&](const Entry& e) {
+        return find(b, Traits::key(e), 0, shift) != nullptr;
+      });
+    }
+
+    Builder r;
+    uint32 amap = a->datamap | a->nodemap;
+    uint32 bmap = b->datamap | b->nodemap;
+    // positions which are only in one of the tries are not in the result
+    r.sameA = (amap & ~bmap) == 0;
+    r.sameB = (bmap & ~amap) == 0;
+    for (uint32 map = amap & bmap; map; map &= map - 1) {
+      uint32 bit = map & -map;
+      auto ae = (a->datamap & bit) ? &a->entries()[index(a->datamap, bit)] : nullptr;
+      auto be = (b->datamap & bit) ? &b->entries()[index(b->datamap, bit)] : nullptr;
+      auto an = (a->nodemap & bit) ? a->nodes()[index(a->nodemap, bit)].ptr() : nullptr;
+      auto bn = (b->nodemap & bit) ? b->nodes()[index(b->nodemap, bit)].ptr() : nullptr;
+      if (an && bn) {
+        auto n = intersect(an, bn, shift + BITS);
+        r.sameA &= n == an;
+        r.sameB &= n == bn;
+        if (n) {
+          r.node(bit, n);
+        }
+        continue;
+      }
+      // An entry of one trie, which is in the result if the other trie has its key
+      auto e = ae ? ae : be;
+      auto& k = Traits::key(*e);
+      const Entry* found;
+      if (ae && be) {
+        found = Traits::key(*be) == k ? ae : nullptr;
+      } else {
+        found = find(an ? an : bn, k, HashTrieHash(k), shift + BITS);
+      }
+      r.sameA &= found && ae;
+      r.sameB &= found && be;
+      if (found) {
+        r.entry(bit, found);
+      }
+    }
+    return r.make(a, b);
+  }
+
+
+  template <typename Traits>
+  inline HashTrieNode<Traits>* HashTrieNode<Traits>::subtract(Node* a, Node* b, uint32 shift) {
+    if (a == b) {
+      return nullptr;
+    }
+    if (a->size == 0 || b->size == 0) {
+      return a;
+    }
+
+    if (shift >= HASH_BITS) {
+      return HashTrieFilter<Traits>(a, [&](const Entry& e) {
+        return find(b, Traits::key(e), 0, shift) == nullptr;
+      });
+    }
+
+    Builder r;
+    r.sameB = false;
+    for (uint32 map = a->datamap | a->nodemap; map; map &= map - 1) {
+      uint32 bit = map & -map;
+      auto ae = (a->datamap & bit) ? &a->entries()[index(a->datamap, bit)] : nullptr;
+      auto be = (b->datamap & bit) ? &b->entries()[index(b->datamap, bit)] : nullptr;
+      auto an = (a->nodemap & bit) ? a->nodes()[index(a->nodemap, bit)].ptr() : nullptr;
+      auto bn = (b->nodemap & bit) ? b->nodes()[index(b->nodemap, bit)].ptr() : nullptr;
+      if (ae) {
+        auto& k = Traits::key(*ae);
+        bool found = be ? Traits::key(*be) == k
+                   : bn ? find(bn, k, HashTrieHash(k), shift + BITS) != nullptr
+                   : false;
+        r.sameA &= !found;
+        if (!found) {
+          r.entry(bit, ae);
+        }
+        continue;
+      }
+      Node* n = an;
+      if (be) {
+        bool removed = false;
+        auto& k = Traits::key(*be);
+        n = remove(an, NO_EDIT, shift + BITS, k, HashTrieHash(k), removed);
+      } else if (bn) {
+        n = subtract(an, bn, shift + BITS);
+      }
+      r.sameA &= n == an;
+      if (n) {
+        r.node(bit, n);
+      }
+    }
+    return r.make(a, b);
+  }
+
+} // namespace
@@ -0,0 +1,333 @@
+#pragma once
+#include "hashtrie.h"
+#include <initializer_list>
+#include <iterator>
+#include <utility>
+
+namespace immutable {
+  template <typename K, typename V> struct TransientMap;
+
+  template <typename K, typename V>
+  struct MapTraits {
+    using Key = K;
+    using Entry = std::pair<K,V>;
+    static const K& key(const Entry& e) { return e.first; }
+  };
+
+
+  // Persistent hash map from keys K to values V. Keys are hashed with std::hash<K>
+  // and compared with ==.
+  //
+  // Entries are stored in a compressed hash trie (see HashTrieNode) of up to 32-way
+  // nodes, so lookups, set and remove are O(log32 n). Like for Array, a new version of
+  // a map shares all nodes with the previous version except the O(log32 n) nodes on
+  // the path to the changed entry.
+  template <typename K, typename V>
+  struct Map : RefCounted {
+    using Entry = std::pair<K,V>;
+    using TransientMapT = TransientMap<K,V>;
+    struct Iterator;
+
+    // The empty map
+    static ref<Map> empty();
+
+    // Create a map with the entries of initializer list. Later entries replace earlier
+    // entries with the same key.
+    static ref<Map> create(std::initializer_list<Entry>&&);
+
+    // Create a map with the entries of the range [begin, end)
+    template <typename It> static ref<Map> create(It&& begin, const It& end);
+
+    // Number of entries in this map
+    uint32 size() const { return _root->size; }
+
+    // Access value for key. find returns nullptr if there's no entry with key k.
+    // If there's no entry with key k the behavior of get is undefined.
+    const V* find(const K& k) const;
+    const V& get(const K& k) const;
+    bool contains(const K& k) const { return find(k) != nullptr; }
+
+    // Set value for key k, replacing the value of an existing entry. The value is
+    // constructed in-place from arg.
+    template <typename Arg> ref<Map> set(const K& k, Arg&& arg) const;
+
+    // Remove the entry with key k. Returns this map if there's no such entry.
+    ref<Map> remove(const K& k) const;
+
+    // return a new TransientMap contaning the same entries as this map.
+    ref<TransientMapT> asTransient() const;
+
+    // apply modification with a transient. F is called with a ref<TransientMap<K,V>>.
+    template <typename F> ref<Map> modify(F&& fn) const;
+
+    // Iteration, in an unspecified order
+    Iterator begin() const { return Iterator(this); }
+    Iterator end() const { return Iterator(); }
+
+    // forward iterator
+    struct Iterator {
+      typedef std::forward_iterator_tag iterator_category;
+      typedef int64        difference_type;
+      typedef Entry        value_type;
+      typedef const Entry* pointer;
+      typedef const Entry& reference;
+
+      Iterator() {}
+      Iterator& operator++(); // ++i
+      Iterator operator++(int); // i++
+      const Entry& operator*() const { return *_e; }
+      const Entry* operator->() const { return _e; }
+
+      bool operator==(const Iterator& rhs) const { return _e == rhs._e; }
+      bool operator!=(const Iterator& rhs) const { return _e != rhs._e; }
+
+    protected:
+      friend struct Map;
+      using Node = HashTrieNode<MapTraits<K,V>>;
+      Iterator(const Map*);
+      void enter(const Node*);
+      void next(); // move to the first entry of the next node with entries
+
+      struct Range {
+        const ref<Node>* next;
+        const ref<Node>* end;
+      };
+      ref<Map>     _m;
+      const Entry* _e = nullptr;    // current entry
+      const Entry* _eend = nullptr; // end of current node's entries
+      Range        _stack[Node::MAX_DEPTH]; // subnodes left to visit, per level
+      uint32       _depth = 0;
+    };
+
+  protected:
+    friend struct TransientMap<K,V>;
+    using Node = HashTrieNode<MapTraits<K,V>>;
+
+    Map(ref<Node> root) : _root(std::move(root)) {}
+
+    ref<Node> _root;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(Map)
+  };
+
+
+  // Non-persistent version of Map, for efficient batch modifications. Like
+  // TransientArray, a transient map is not thread safe but is not tied to the thread
+  // that created it either. Nodes the transient creates are stamped with its edit token
+  // and modified in-place by later changes, while nodes shared with other maps are
+  // never modified.
+  template <typename K, typename V>
+  struct TransientMap : RefCounted {
+    using Entry = std::pair<K,V>;
+
+    // Number of entries in this map
+    uint32 size() const { return _root->size; }
+
+    // "seal" the transient map and return a persistent map that refers to the same
+    // root. Returns null if this transient map is not editable (e.g. makePersistent()
+    // has already been called.)
+    ref<Map<K,V>> makePersistent();
+
+    // Set value for key k. Returns null if this transient map is not editable.
+    template <typename Arg> ref<TransientMap> set(const K& k, Arg&& arg);
+
+    // Remove the entry with key k. Returns null if this transient map is not editable.
+    ref<TransientMap> remove(const K& k);
+
+    // Access value for key, like Map::find and Map::get
+    const V* find(const K& k) const;
+    const V& get(const K& k) const;
+    bool contains(const K& k) const { return find(k) != nullptr; }
+
+  protected:
+    friend struct Map<K,V>;
+    using Node = HashTrieNode<MapTraits<K,V>>;
+
+    TransientMap(EditID edit, ref<Node> root) : _edit(edit), _root(std::move(root)) {}
+
+    EditID    _edit;
+    ref<Node> _root;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(TransientMap)
+  };
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // implementation
+
+  template <typename K, typename V>
+  inline ref<Map<K,V>> Map<K,V>::empty() {
+    static ref<Map> e = new Map(Node::alloc(NO_EDIT, 0, 0, 0, 0));
+    return e;
+  }
+
+  template <typename K, typename V>
+  inline ref<Map<K,V>> Map<K,V>::create(std::initializer_list<Entry>&& v) {
+    return create(v.begin(), v.end());
+  }
+
+  template <typename K, typename V>
+  template <typename It>
+  inline ref<Map<K,V>> Map<K,V>::create(It&& begin, const It& end) {
+    auto t = empty()->asTransient();
+    for (auto it = begin; it != end; ++it) {
+      t->set(it->first, it->second);
+    }
+    return t->makePersistent();
+  }
+
+
+  template <typename K, typename V>
+  inline const V* Map<K,V>::find(const K& k) const {
+    auto e = Node::find(_root.ptr(), k, HashTrieHash(k));
+    return e ? &e->second : nullptr;
+  }
+
+  template <typename K, typename V>
+  inline const V& Map<K,V>::get(const K& k) const {
+    auto v = find(k);
+    assert(v != nullptr);
+    return *v;
+  }
+
+
+  template <typename K, typename V>
+  template <typename Arg>
+  inline ref<Map<K,V>> Map<K,V>::set(const K& k, Arg&& arg) const {
+    bool added = false;
+    auto root = Node::set(
+      _root.ptr(), NO_EDIT, 0, Entry(k, fwd<Arg>(arg)), HashTrieHash(k), true, added);
+    return new Map(root);
+  }
+
+  template <typename K, typename V>
+  inline ref<Map<K,V>> Map<K,V>::remove(const K& k) const {
+    bool removed = false;
+    auto root = Node::remove(_root.ptr(), NO_EDIT, 0, k, HashTrieHash(k), removed);
+    if (!removed) {
+      return const_cast<Map*>(this);
+    }
+    return new Map(root);
+  }
+
+
+  template <typename K, typename V>
+  inline ref<TransientMap<K,V>> Map<K,V>::asTransient() const {
+    return new TransientMapT(newEditID(), _root);
+  }
+
+  template <typename K, typename V>
+  template <typename F>
+  inline ref<Map<K,V>> Map<K,V>::modify(F&& fn) const {
+    auto t = asTransient();
+    fn(t);
+    return t->makePersistent();
+  }
+
+
+  template <typename K, typename V>
+  inline Map<K,V>::Iterator::Iterator(const Map* m) : _m(const_cast<Map*>(m)) {
+    enter(m->_root.ptr());
+    if (_e == _eend) {
+      next();
+    }
+  }
+
+  template <typename K, typename V>
+  inline void Map<K,V>::Iterator::enter(const Node* n) {
+    _stack[_depth++] = Range{n->nodes(), n->nodes() + n->nnodes};
+    _e = n->entries();
+    _eend = _e + n->nentries;
+  }
+
+  template <typename K, typename V>
+  inline void Map<K,V>::Iterator::next() {
+    while (_depth > 0) {
+      auto& r = _stack[_depth - 1];
+      if (r.next == r.end) {
+        --_depth;
+        continue;
+      }
+      enter((r.next++)->ptr());
+      if (_e != _eend) {
+        return;
+      }
+    }
+    _e = nullptr;
+    _m = nullptr;
+  }
+
+  template <typename K, typename V>
+  inline typename Map<K,V>::Iterator& Map<K,V>::Iterator::operator++() { // ++i
+    if (++_e == _eend) {
+      next();
+    }
+    return *this;
+  }
+
+  template <typename K, typename V>
+  inline typename Map<K,V>::Iterator Map<K,V>::Iterator::operator++(int) { // i++
+    Iterator copy(*this);
+    operator++();
+    return copy;
+  }
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // TransientMap
+
+  template <typename K, typename V>
+  inline ref<Map<K,V>> TransientMap<K,V>::makePersistent() {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    _edit = NO_EDIT;
+    return new Map<K,V>(_root);
+  }
+
+  template <typename K, typename V>
+  template <typename Arg>
+  inline ref<TransientMap<K,V>> TransientMap<K,V>::set(const K& k, Arg&& arg) {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    bool added = false;
+    auto root = Node::set(
+      _root.ptr(), _edit, 0, Entry(k, fwd<Arg>(arg)), HashTrieHash(k), true, added);
+    if (root != _root.ptr()) {
+      _root = root;
+    }
+    return this;
+  }
+
+  template <typename K, typename V>
+  inline ref<TransientMap<K,V>> TransientMap<K,V>::remove(const K& k) {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    bool removed = false;
+    auto root = Node::remove(_root.ptr(), _edit, 0, k, HashTrieHash(k), removed);
+    if (root != _root.ptr()) {
+      _root = root;
+    }
+    return this;
+  }
+
+  template <typename K, typename V>
+  inline const V* TransientMap<K,V>::find(const K& k) const {
+    auto e = Node::find(_root.ptr(), k, HashTrieHash(k));
+    return e ? &e->second : nullptr;
+  }
+
+  template <typename K, typename V>
+  inline const V& TransientMap<K,V>::get(const K& k) const {
+    auto v = find(k);
+    assert(v != nullptr);
+    return *v;
+  }
+
+} // namespace
@@ -0,0 +1,564 @@
+#include "rope.h"
+#include "alloc.h"
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+namespace immutable {
+  using N = RopeNode;
+
+  static constexpr uint32 BRANCHES = N::BRANCHES;
+  static constexpr uint32 MIN_BRANCHES = BRANCHES / 2;
+
+  // Leaves are the largest blocks which NodeAlloc keeps in its free lists
+  static constexpr uint32 LEAF_MAX = uint32(NodeAlloc::MAX_SIZE - sizeof(N));
+  static constexpr uint32 MIN_LEAF = LEAF_MAX / 2;
+
+  static_assert(LEAF_MAX >= 256, "RopeNode header is too large");
+
+
+  static size_t allocSize(uint32 height) {
+    return height == 0 ? NodeAlloc::MAX_SIZE
+                       : sizeof(N) + BRANCHES * (sizeof(ref<N>) + sizeof(uint32));
+  }
+
+  static N* newNode(EditID edit, uint32 height) {
+    return new (NodeAlloc::alloc(allocSize(height))) N(edit, height);
+  }
+
+  void RopeNode::dealloc() {
+    uint32 h = height;
+    if (h > 0) {
+      auto c = children();
+      for (uint32 i = 0; i < count; ++i) {
+        c[i].~ref<N>();
+      }
+    }
+    this->~RopeNode();
+    NodeAlloc::free(this, allocSize(h));
+  }
+
+
+  static bool isEditable(const N* n, EditID edit) {
+    return edit != NO_EDIT && n->edit == edit;
+  }
+
+  // True if n holds enough bytes or subtrees to be a subtree of a branch
+  static bool isHalfFull(const N* n) {
+    return n->height == 0 ? n->size >= MIN_LEAF : n->count >= MIN_BRANCHES;
+  }
+
+  // Offset of the start of subtree i within branch n
+  static uint32 childStart(const N* n, uint32 i) {
+    return i == 0 ? 0 : n->ends()[i - 1];
+  }
+
+
+  // Recomputes the size of branch n and the ends of its subtrees from subtree i on
+  static void updateEnds(N* n, uint32 i) {
+    auto c = n->children();
+    auto e = n->ends();
+    uint32 end = childStart(n, i);
+    for (; i < n->count; ++i) {
+      end += c[i]->size;
+      e[i] = end;
+    }
+    n->size = end;
+  }
+
+  // Branch with subtrees c[0..n), where 1 < n <= BRANCHES
+  static N* newBranch(EditID edit, N* const* c, uint32 n) {
+    auto b = newNode(edit, c[0]->height + 1);
+    for (uint32 i = 0; i < n; ++i) {
+      new (&b->children()[i]) ref<N>(c[i]);
+    }
+    b->count = n;
+    updateEnds(b, 0);
+    return b;
+  }
+
+
+  // Bytes of a leaf which is being made from pieces of other leaves and new bytes
+  struct Span {
+    const char* data;
+    uint32      size;
+  };
+
+  // Appends bytes [start, end) of the concatenation of spans to leaf dst
+  static void appendSpans(
+    N* dst, const Span* spans, uint32 nspans, uint32 start, uint32 end)
+  {
+    uint32 offs = 0;
+    for (uint32 i = 0; i < nspans && offs < end; offs += spans[i++].size) {
+      uint32 s = std::max(start, offs);
+      uint32 e = std::min(end, offs + spans[i].size);
+      if (s < e) {
+        memcpy(dst->bytes() + dst->size, spans[i].data + (s - offs), e - s);
+        dst->size += e - s;
+      }
+    }
+  }
+
+  // Leaf with the concatenation of spans, or a branch with two leaves of half of the
+  // bytes each if they don't fit in one leaf. The total size must be <= 2*LEAF_MAX.
+  static N* newLeaves(EditID edit, const Span* spans, uint32 nspans) {
+    uint32 total = 0;
+    for (uint32 i = 0; i < nspans; ++i) {
+      total += spans[i].size;
+    }
+    auto l = newNode(edit, 0);
+    if (total <= LEAF_MAX) {
+      appendSpans(l, spans, nspans, 0, total);
+      return l;
+    }
+    auto r = newNode(edit, 0);
+    appendSpans(l, spans, nspans, 0, total / 2);
+    appendSpans(r, spans, nspans, total / 2, total);
+    N* c[2] = {l, r};
+    return newBranch(edit, c, 2);
+  }
+
+
+  // Branch with subtrees c[0..n), or a branch with two branches holding them if they
+  // don't fit in one, where n <= 2*BRANCHES
+  static N* mergeChildren(EditID edit, N* const* c, uint32 n) {
+    if (n <= BRANCHES) {
+      return newBranch(edit, c, n);
+    }
+    uint32 nleft = std::min(BRANCHES, n - MIN_BRANCHES);
+    N* halves[2] = {newBranch(edit, c, nleft), newBranch(edit, c + nleft, n - nleft)};
+    return newBranch(edit, halves, 2);
+  }
+
+
+  // Tree with the bytes of a followed by the bytes of b. Trees of different heights are
+  // joined by descending the taller tree's left or right edge to the height of the
+  // other tree, so the cost is proportional to the difference in height.
+  static ref<N> concat(EditID edit, N* a, N* b) {
+    if (a->size == 0) {
+      return b;
+    }
+    if (b->size == 0) {
+      return a;
+    }
+    N* c[2 * BRANCHES];
+    uint32 n = 0;
+    auto addChildren = [&](const N* p, uint32 start, uint32 end) {
+      for (uint32 i = start; i < end; ++i) {
+        c[n++] = p->children()[i].ptr();
+      }
+    };
+
+    if (a->height == b->height) {
+      if (isHalfFull(a) && isHalfFull(b)) {
+        c[0] = a;
+        c[1] = b;
+        return newBranch(edit, c, 2);
+      }
+      if (a->height == 0) {
+        Span spans[2] = {{a->bytes(), a->size}, {b->bytes(), b->size}};
+        return newLeaves(edit, spans, 2);
+      }
+      addChildren(a, 0, a->count);
+      addChildren(b, 0, b->count);
+      return mergeChildren(edit, c, n);
+    }
+
+    if (a->height < b->height) {
+      ref<N> m;
+      if (a->height + 1 == b->height && isHalfFull(a)) {
+        c[n++] = a;
+        addChildren(b, 0, b->count);
+      } else {
+        m = concat(edit, a, b->children()[0].ptr());
+        if (m->height < b->height) {
+          c[n++] = m.ptr();
+        } else {
+          addChildren(m, 0, m->count);
+        }
+        addChildren(b, 1, b->count);
+      }
+      return mergeChildren(edit, c, n);
+    }
+
+    ref<N> m;
+    if (b->height + 1 == a->height && isHalfFull(b)) {
+      addChildren(a, 0, a->count);
+      c[n++] = b;
+    } else {
+      addChildren(a, 0, a->count - 1);
+      m = concat(edit, a->children()[a->count - 1].ptr(), b);
+      if (m->height < a->height) {
+        c[n++] = m.ptr();
+      } else {
+        addChildren(m, 0, m->count);
+      }
+    }
+    return mergeChildren(edit, c, n);
+  }
+
+
+  // Tree with bytes [start, end) of subtree n, where start < end
+  static ref<N> slice(EditID edit, N* n, uint32 start, uint32 end) {
+    if (start == 0 && end == n->size) {
+      return n;
+    }
+    if (n->height == 0) {
+      Span span = {n->bytes() + start, end - start};
+      return newLeaves(edit, &span, 1);
+    }
+    auto c = n->children();
+    uint32 i = n->childAt(start);
+    uint32 j = n->childAt(end - 1);
+    uint32 istart = childStart(n, i);
+    uint32 jstart = childStart(n, j);
+    if (i == j) {
+      return slice(edit, c[i].ptr(), start - istart, end - istart);
+    }
+    ref<N> r = slice(edit, c[i].ptr(), start - istart, c[i]->size);
+    if (j == i + 2) {
+      r = concat(edit, r.ptr(), c[i + 1].ptr());
+    } else if (j > i + 2) {
+      N* mid[BRANCHES];
+      for (uint32 k = i + 1; k < j; ++k) {
+        mid[k - i - 1] = c[k].ptr();
+      }
+      ref<N> m = newBranch(edit, mid, j - i - 1);
+      r = concat(edit, r.ptr(), m.ptr());
+    }
+    ref<N> l = slice(edit, c[j].ptr(), 0, end - jstart);
+    return concat(edit, r.ptr(), l.ptr());
+  }
+
+
+  // Tree with the bytes of tree m inserted into tree n at pos
+  static ref<N> insertTree(EditID edit, N* n, uint32 pos, N* m) {
+    if (pos == 0) {
+      return concat(edit, m, n);
+    }
+    ref<N> r = concat(edit, slice(edit, n, 0, pos).ptr(), m);
+    if (pos == n->size) {
+      return r;
+    }
+    return concat(edit, r.ptr(), slice(edit, n, pos, n->size).ptr());
+  }
+
+
+  // Tree with the bytes of data, in leaves and branches which are as full as possible
+  static ref<N> build(EditID edit, const char* data, uint32 size) {
+    uint32 nleaves = std::max(1u, (size + LEAF_MAX - 1) / LEAF_MAX);
+    std::vector<ref<N>> nodes(nleaves);
+    for (uint32 i = 0; i < nleaves; ++i) {
+      uint32 start = uint32(uint64(size) * i / nleaves);
+      uint32 end = uint32(uint64(size) * (i + 1) / nleaves);
+      Span span = {data + start, end - start};
+      nodes[i] = newLeaves(edit, &span, 1);
+    }
+    // group nodes evenly into as few parents as possible, until there's one left
+    while (nodes.size() > 1) {
+      uint32 n = uint32(nodes.size());
+      uint32 nparents = (n + BRANCHES - 1) / BRANCHES;
+      std::vector<ref<N>> parents(nparents);
+      for (uint32 p = 0; p < nparents; ++p) {
+        N* c[BRANCHES];
+        uint32 start = n * p / nparents;
+        uint32 end = n * (p + 1) / nparents;
+        for (uint32 i = start; i < end; ++i) {
+          c[i - start] = nodes[i].ptr();
+        }
+        parents[p] = newBranch(edit, c, end - start);
+      }
+      nodes.swap(parents);
+    }
+    return nodes[0];
+  }
+
+
+  // Branch n with subtree i replaced by c, and its ends updated
+  static ref<N> replaceChild(N* n, EditID edit, uint32 i, N* c) {
+    if (isEditable(n, edit)) {
+      if (n->children()[i] != c) {
+        n->children()[i] = c;
+      }
+      updateEnds(n, i);
+      return n;
+    }
+    N* children[BRANCHES];
+    for (uint32 k = 0; k < n->count; ++k) {
+      children[k] = k == i ? c : n->children()[k].ptr();
+    }
+    return newBranch(edit, children, n->count);
+  }
+
+  // Branch n with subtree i replaced by c and r inserted after it. A full branch is
+  // split in two halves, and the second half is stored in `right`.
+  static ref<N> insertChild(N* n, EditID edit, uint32 i, N* c, N* r, ref<N>& right) {
+    N* children[BRANCHES + 1];
+    uint32 count = 0;
+    for (uint32 k = 0; k < n->count; ++k) {
+      children[count++] = k == i ? c : n->children()[k].ptr();
+      if (k == i) {
+        children[count++] = r;
+      }
+    }
+    if (count <= BRANCHES && isEditable(n, edit)) {
+      auto ch = n->children();
+      new (&ch[n->count]) ref<N>();
+      for (uint32 k = n->count; k > i + 1; --k) {
+        ch[k] = std::move(ch[k - 1]);
+      }
+      ch[i] = c;
+      ch[i + 1] = r;
+      n->count++;
+      updateEnds(n, i);
+      return n;
+    }
+    if (count <= BRANCHES) {
+      return newBranch(edit, children, count);
+    }
+    right = newBranch(edit, children + count / 2, count - count / 2);
+    return newBranch(edit, children, count / 2);
+  }
+
+
+  // Inserts data into subtree n at pos, where size <= LEAF_MAX. If n is split, the new
+  // right sibling is stored in `right`.
+  static ref<N> insertBytes(
+    N* n, EditID edit, uint32 pos, const char* data, uint32 size, ref<N>& right)
+  {
+    if (n->height == 0) {
+      if (n->size + size <= LEAF_MAX && isEditable(n, edit)) {
+        auto b = n->bytes();
+        memmove(b + pos + size, b + pos, n->size - pos);
+        memcpy(b + pos, data, size);
+        n->size += size;
+        return n;
+      }
+      Span spans[3] = {
+        {n->bytes(), pos}, {data, size}, {n->bytes() + pos, n->size - pos},
+      };
+      ref<N> m = newLeaves(edit, spans, 3);
+      if (m->height == 0) {
+        return m;
+      }
+      right = m->children()[1];
+      return m->children()[0];
+    }
+    // insert at the end of a subtree rather than at the start of the next one
+    auto e = n->ends();
+    uint32 i = 0;
+    while (i + 1 < n->count && e[i] < pos) {
+      ++i;
+    }
+    N* child = n->children()[i].ptr();
+    ref<N> r;
+    ref<N> c = insertBytes(child, edit, pos - childStart(n, i), data, size, r);
+    if (r) {
+      return insertChild(n, edit, i, c.ptr(), r.ptr(), right);
+    }
+    return replaceChild(n, edit, i, c.ptr());
+  }
+
+
+  // Removes bytes [start, end) from subtree n if they are all in the same leaf and the
+  // leaf keeps at least MIN_LEAF bytes (any number if the leaf is the root.) Returns
+  // null otherwise.
+  static ref<N> eraseInLeaf(N* n, EditID edit, uint32 start, uint32 end, bool root) {
+    if (n->height == 0) {
+      uint32 size = n->size - (end - start);
+      if (size < MIN_LEAF && !root) {
+        return nullptr;
+      }
+      if (isEditable(n, edit)) {
+        auto b = n->bytes();
+        memmove(b + start, b + end, n->size - end);
+        n->size = size;
+        return n;
+      }
+      Span spans[2] = {{n->bytes(), start}, {n->bytes() + end, n->size - end}};
+      return newLeaves(edit, spans, 2);
+    }
+    uint32 i = n->childAt(start);
+    uint32 offs = childStart(n, i);
+    if (end > n->ends()[i]) {
+      return nullptr;
+    }
+    ref<N> c = eraseInLeaf(n->children()[i].ptr(), edit, start - offs, end - offs, false);
+    if (!c) {
+      return nullptr;
+    }
+    return replaceChild(n, edit, i, c.ptr());
+  }
+
+
+  // Operations shared by Rope and TransientRope. Those which modify return the new root.
+
+  static char getByte(N* n, uint32 i) {
+    while (n->height > 0) {
+      uint32 k = n->childAt(i);
+      i -= childStart(n, k);
+      n = n->children()[k].ptr();
+    }
+    return n->bytes()[i];
+  }
+
+  static ref<N> insertRoot(
+    N* root, EditID edit, uint32 pos, const char* data, uint32 size)
+  {
+    if (size == 0) {
+      return root;
+    }
+    if (size > LEAF_MAX) {
+      return insertTree(edit, root, pos, build(edit, data, size).ptr());
+    }
+    ref<N> right;
+    ref<N> m = insertBytes(root, edit, pos, data, size, right);
+    if (right) {
+      N* c[2] = {m.ptr(), right.ptr()};
+      return newBranch(edit, c, 2);
+    }
+    return m;
+  }
+
+  static ref<N> eraseRoot(N* root, EditID edit, uint32 pos, uint32 len) {
+    uint32 end = len > root->size - pos ? root->size : pos + len;
+    if (pos == end) {
+      return root;
+    }
+    if (pos == 0 && end == root->size) {
+      return newNode(edit, 0);
+    }
+    ref<N> m = eraseInLeaf(root, edit, pos, end, true);
+    if (m) {
+      return m;
+    }
+    if (pos == 0) {
+      return slice(edit, root, end, root->size);
+    }
+    if (end == root->size) {
+      return slice(edit, root, 0, pos);
+    }
+    ref<N> l = slice(edit, root, 0, pos);
+    return concat(edit, l.ptr(), slice(edit, root, end, root->size).ptr());
+  }
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // Rope
+
+  ref<Rope> Rope::empty() {
+    static ref<Rope> e = new Rope(newNode(NO_EDIT, 0));
+    return e;
+  }
+
+  ref<Rope> Rope::create(const char* data, uint32 size) {
+    return size == 0 ? empty() : ref<Rope>(new Rope(build(NO_EDIT, data, size)));
+  }
+
+  ref<Rope> Rope::withRoot(ref<RopeNode> root) const {
+    if (root == _root) {
+      return const_cast<Rope*>(this);
+    }
+    return new Rope(std::move(root));
+  }
+
+  char Rope::get(uint32 i) const {
+    return getByte(_root.ptr(), i);
+  }
+
+  RopeChunk Rope::chunkAt(uint32 i, uint32 end) const {
+    N* n = _root.ptr();
+    uint32 offs = 0;
+    while (n->height > 0) {
+      uint32 k = n->childAt(i - offs);
+      offs += childStart(n, k);
+      n = n->children()[k].ptr();
+    }
+    return RopeChunk(n->bytes() + (i - offs), std::min(end, offs + n->size) - i);
+  }
+
+  ref<Rope> Rope::insert(uint32 pos, const char* data, uint32 size) const {
+    if (pos > this->size()) {
+      return nullptr;
+    }
+    return withRoot(insertRoot(_root.ptr(), NO_EDIT, pos, data, size));
+  }
+
+  ref<Rope> Rope::insert(uint32 pos, const ref<Rope>& r) const {
+    if (pos > size()) {
+      return nullptr;
+    }
+    if (r->size() == 0) {
+      return const_cast<Rope*>(this);
+    }
+    if (size() == 0) {
+      return r;
+    }
+    return new Rope(insertTree(NO_EDIT, _root.ptr(), pos, r->_root.ptr()));
+  }
+
+  ref<Rope> Rope::erase(uint32 pos, uint32 len) const {
+    if (pos > size()) {
+      return nullptr;
+    }
+    return withRoot(eraseRoot(_root.ptr(), NO_EDIT, pos, len));
+  }
+
+  ref<Rope> Rope::substr(uint32 pos, uint32 len) const {
+    if (pos > size()) {
+      return nullptr;
+    }
+    uint32 end = len > size() - pos ? size() : pos + len;
+    if (pos == end) {
+      return empty();
+    }
+    return withRoot(slice(NO_EDIT, _root.ptr(), pos, end));
+  }
+
+  ref<Rope> Rope::concat(const ref<Rope>& r) const {
+    return insert(size(), r);
+  }
+
+  std::string Rope::str(uint32 pos, uint32 len) const {
+    std::string s;
+    forEachChunk([&](const RopeChunk& c) { s.append(c.data(), c.size()); }, pos, len);
+    return s;
+  }
+
+  ref<TransientRope> Rope::asTransient() const {
+    return new TransientRope(newEditID(), _root);
+  }
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // TransientRope
+
+  char TransientRope::get(uint32 i) const {
+    return getByte(_root.ptr(), i);
+  }
+
+  ref<Rope> TransientRope::makePersistent() {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    _edit = NO_EDIT;
+    return new Rope(_root);
+  }
+
+  ref<TransientRope> TransientRope::insert(uint32 pos, const char* data, uint32 size) {
+    if (_edit == NO_EDIT || pos > _root->size) {
+      return nullptr;
+    }
+    _root = insertRoot(_root.ptr(), _edit, pos, data, size);
+    return this;
+  }
+
+  ref<TransientRope> TransientRope::erase(uint32 pos, uint32 len) {
+    if (_edit == NO_EDIT || pos > _root->size) {
+      return nullptr;
+    }
+    _root = eraseRoot(_root.ptr(), _edit, pos, len);
+    return this;
+  }
+
+} // namespace
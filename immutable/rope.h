@@ -0,0 +1,279 @@
+#pragma once
+#include "base.h"
+#include <iterator>
+#include <string>
+#if __cplusplus >= 201703L
+  #include <string_view>
+#endif
+
+namespace immutable {
+  struct TransientRope;
+  struct RopeChunk;
+
+  // Node of a Rope's B+tree. Leaves hold up to about 1 kB of bytes. Branches hold up
+  // to BRANCHES subtrees of the same height, and for each subtree the offset of its
+  // end within the branch, so that a position is found by scanning a small array.
+  // All nodes but the root hold at least half as many bytes or subtrees as they can.
+  //
+  // Like array nodes, nodes stamped with a transient's edit token are modified
+  // in-place by that transient, while other nodes are copied with the change.
+  struct RopeNode : RefCounted {
+    static constexpr uint32 BRANCHES = 16;
+
+    EditID edit;
+    uint32 size;   // number of bytes in this subtree
+    uint8  height; // 0 for leaves
+    uint8  count;  // number of subtrees (branches only)
+
+    RopeNode(EditID edit, uint32 height)
+      : edit(edit), size(0), height(uint8(height)), count(0) {}
+
+    char*          bytes() const { return (char*)(this + 1); }
+    ref<RopeNode>* children() const { return (ref<RopeNode>*)(this + 1); }
+    uint32*        ends() const { return (uint32*)(children() + BRANCHES); }
+
+    // Index of the subtree holding byte i, where i < size
+    uint32 childAt(uint32 i) const {
+      auto e = ends();
+      uint32 k = 0;
+      while (e[k] <= i) {
+        ++k;
+      }
+      return k;
+    }
+
+    void dealloc();
+
+    IMMUTABLE_REFCOUNTED_IMPL(RopeNode)
+  };
+
+
+  // Persistent string of bytes, for large texts which are edited in many places, like
+  // the buffer of a text editor.
+  //
+  // Bytes are stored in a B+tree with leaves of up to about 1 kB (see RopeNode), so
+  // insert, erase, substr and concat are all O(log n), and a new version of a rope
+  // shares all nodes with the version it was made from except the ones along the
+  // edited positions. The bytes of each leaf are contiguous and can be read in place
+  // with forEachChunk or chunks.
+  //
+  // Positions and lengths are in bytes. Like std::string, operations which take a
+  // length clamp it to the end of the rope.
+  struct Rope : RefCounted {
+    struct ChunkRange;
+
+    // The empty rope
+    static ref<Rope> empty();
+
+    // Create a rope with a copy of bytes
+    static ref<Rope> create(const char* data, uint32 size);
+    static ref<Rope> create(const std::string& s) {
+      return create(s.data(), uint32(s.size()));
+    }
+
+    // Number of bytes
+    uint32 size() const { return _root->size; }
+
+    // Access byte at index. If i >= size() the behavior is undefined.
+    char get(uint32 i) const;
+
+    // Returns a rope with bytes inserted at pos. Returns null if pos > size().
+    ref<Rope> insert(uint32 pos, const char* data, uint32 size) const;
+    ref<Rope> insert(uint32 pos, const std::string& s) const {
+      return insert(pos, s.data(), uint32(s.size()));
+    }
+    ref<Rope> insert(uint32 pos, const ref<Rope>& r) const;
+
+    // Returns a rope with bytes added to the end
+    ref<Rope> append(const char* data, uint32 size) const {
+      return insert(this->size(), data, size);
+    }
+    ref<Rope> append(const std::string& s) const { return insert(size(), s); }
+
+    // Returns a rope without the len bytes at pos. Returns null if pos > size().
+    ref<Rope> erase(uint32 pos, uint32 len=END) const;
+
+    // Returns the len bytes at pos. Returns null if pos > size().
+    ref<Rope> substr(uint32 pos, uint32 len=END) const;
+
+    // Returns a rope with the bytes of this rope followed by the bytes of r
+    ref<Rope> concat(const ref<Rope>& r) const;
+
+    // Copy of the len bytes at pos
+    std::string str(uint32 pos=0, uint32 len=END) const;
+
+    // return a new TransientRope contaning the same bytes as this rope.
+    ref<TransientRope> asTransient() const;
+
+    // apply modification with a transient. F is called with a ref<TransientRope>.
+    template <typename F> ref<Rope> modify(F&& fn) const;
+
+    // Iteration in chunks of bytes which are stored in the same leaf (see RopeChunk),
+    // covering the len bytes at pos. forEachChunk calls fn(const RopeChunk&) for each
+    // chunk, while chunks returns a range for use with range-based for loops.
+    template <typename F> void forEachChunk(F&& fn, uint32 pos=0, uint32 len=END) const;
+    ChunkRange chunks(uint32 pos=0, uint32 len=END) const;
+
+    // range of chunks
+    struct ChunkRange {
+      struct iterator;
+      iterator begin() const;
+      iterator end() const;
+
+    private:
+      friend struct Rope;
+      ChunkRange(const Rope* r, uint32 start, uint32 end)
+        : _r(const_cast<Rope*>(r)), _start(start), _end(end) {}
+      ref<Rope> _r;
+      uint32    _start;
+      uint32    _end;
+    };
+
+  protected:
+    friend struct TransientRope;
+
+    Rope(ref<RopeNode> root) : _root(std::move(root)) {}
+    ref<Rope> withRoot(ref<RopeNode> root) const;
+
+    // Bytes [i, end) or as many of them as are in the leaf holding byte i
+    RopeChunk chunkAt(uint32 i, uint32 end) const;
+
+    ref<RopeNode> _root;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(Rope)
+  };
+
+
+  // Non-persistent version of Rope, for efficient batch modifications. Works like
+  // TransientArray: nodes created by the transient are modified in-place, so a series
+  // of edits close to each other copies a path through the tree only once.
+  struct TransientRope : RefCounted {
+    // Number of bytes
+    uint32 size() const { return _root->size; }
+
+    // Access byte at index. If i >= size() the behavior is undefined.
+    char get(uint32 i) const;
+
+    // "seal" the transient rope and return a persistent rope that refers to the same
+    // root. Returns null if this transient rope is not editable (e.g. makePersistent()
+    // has already been called.)
+    ref<Rope> makePersistent();
+
+    // Insert bytes at pos, append bytes, or erase the len bytes at pos. Returns null if
+    // this transient rope is not editable or if pos > size().
+    ref<TransientRope> insert(uint32 pos, const char* data, uint32 size);
+    ref<TransientRope> insert(uint32 pos, const std::string& s) {
+      return insert(pos, s.data(), uint32(s.size()));
+    }
+    ref<TransientRope> append(const char* data, uint32 size) {
+      return insert(this->size(), data, size);
+    }
+    ref<TransientRope> append(const std::string& s) { return insert(size(), s); }
+    ref<TransientRope> erase(uint32 pos, uint32 len=END);
+
+  protected:
+    friend struct Rope;
+
+    TransientRope(EditID edit, ref<RopeNode> root)
+      : _edit(edit), _root(std::move(root)) {}
+
+    EditID        _edit;
+    ref<RopeNode> _root;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(TransientRope)
+  };
+
+
+  // Bytes of a rope which are stored contiguously in the same leaf, as visited by
+  // Rope::forEachChunk and Rope::chunks. The bytes are valid for as long as the rope
+  // (or another rope sharing the leaf) exists.
+  struct RopeChunk {
+    const char* data() const { return _data; }
+    uint32      size() const { return _size; }
+    const char* begin() const { return _data; }
+    const char* end() const { return _data + _size; }
+    std::string str() const { return std::string(_data, _size); }
+  #if __cplusplus >= 201703L
+    operator std::string_view() const { return std::string_view(_data, _size); }
+  #endif
+
+    RopeChunk() {}
+    RopeChunk(const char* data, uint32 size) : _data(data), _size(size) {}
+
+  private:
+    const char* _data = nullptr;
+    uint32      _size = 0;
+  };
+
+
+  struct Rope::ChunkRange::iterator {
+    typedef std::forward_iterator_tag iterator_category;
+    typedef int64                     difference_type;
+    typedef RopeChunk                 value_type;
+    typedef const RopeChunk*          pointer;
+    typedef const RopeChunk&          reference;
+
+    const RopeChunk& operator*() const { return _chunk; }
+    const RopeChunk* operator->() const { return &_chunk; }
+    iterator& operator++() { // ++i
+      _i += _chunk.size();
+      if (_i < _end) {
+        _chunk = _r->chunkAt(_i, _end);
+      }
+      return *this;
+    }
+    bool operator==(const iterator& rhs) const { return _i == rhs._i; }
+    bool operator!=(const iterator& rhs) const { return _i != rhs._i; }
+
+  private:
+    friend struct ChunkRange;
+    iterator(const Rope* r, uint32 i, uint32 end) : _r(r), _i(i), _end(end) {
+      if (_i < _end) {
+        _chunk = _r->chunkAt(_i, _end);
+      }
+    }
+    const Rope* _r;
+    uint32      _i;
+    uint32      _end;
+    RopeChunk   _chunk;
+  };
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // implementation
+
+  template <typename F>
+  inline ref<Rope> Rope::modify(F&& fn) const {
+    auto t = asTransient();
+    fn(t);
+    return t->makePersistent();
+  }
+
+  template <typename F>
+  inline void Rope::forEachChunk(F&& fn, uint32 pos, uint32 len) const {
+    uint32 end = pos > size() ? pos : len > size() - pos ? size() : pos + len;
+    for (uint32 i = pos; i < end;) {
+      auto c = chunkAt(i, end);
+      fn(c);
+      i += c.size();
+    }
+  }
+
+  inline Rope::ChunkRange Rope::chunks(uint32 pos, uint32 len) const {
+    uint32 end = pos > size() ? pos : len > size() - pos ? size() : pos + len;
+    return ChunkRange(this, pos, end);
+  }
+
+  inline Rope::ChunkRange::iterator Rope::ChunkRange::begin() const {
+    return iterator(_r.ptr(), _start, _end);
+  }
+
+  inline Rope::ChunkRange::iterator Rope::ChunkRange::end() const {
+    return iterator(_r.ptr(), _end, _end);
+  }
+
+} // namespace
@@ -0,0 +1,329 @@
+#pragma once
+#include "hashtrie.h"
+#include <initializer_list>
+#include <iterator>
+
+namespace immutable {
+  template <typename T> struct TransientSet;
+
+  template <typename T>
+  struct SetTraits {
+    using Key = T;
+    using Entry = T;
+    static const T& key(const T& v) { return v; }
+  };
+
+
+  // Persistent hash set of values T. Values are hashed with std::hash<T> and compared
+  // with ==.
+  //
+  // Like Map, a set is a compressed hash trie (see HashTrieNode), so add, remove and
+  // contains are O(log32 n) and versions of a set share most of their nodes. The set
+  // operations unite, intersect and subtract skip subtrees which are shared by the two
+  // sets and reuse subtrees of either set where the result is the same, so combining
+  // two versions of a set costs about as much as the changes made between them.
+  template <typename T>
+  struct Set : RefCounted {
+    using TransientSetT = TransientSet<T>;
+    struct Iterator;
+
+    // The empty set
+    static ref<Set> empty();
+
+    // Create a set with the values of initializer list
+    static ref<Set> create(std::initializer_list<T>&&);
+
+    // Create a set with the values of the range [begin, end)
+    template <typename It> static ref<Set> create(It&& begin, const It& end);
+
+    // Number of values in this set
+    uint32 size() const { return _root->size; }
+
+    // True if v is in this set
+    bool contains(const T& v) const;
+
+    // Add value. Returns this set if v is already in the set.
+    ref<Set> add(const T& v) const;
+
+    // Remove value. Returns this set if v is not in the set.
+    ref<Set> remove(const T& v) const;
+
+    // Values which are in this set or other (union), in both this set and other,
+    // and in this set but not in other.
+    ref<Set> unite(const ref<Set>& other) const;
+    ref<Set> intersect(const ref<Set>& other) const;
+    ref<Set> subtract(const ref<Set>& other) const;
+
+    // return a new TransientSet contaning the same values as this set.
+    ref<TransientSetT> asTransient() const;
+
+    // apply modification with a transient. F is called with a ref<TransientSet<T>>.
+    template <typename F> ref<Set> modify(F&& fn) const;
+
+    // Iteration, in an unspecified order
+    Iterator begin() const { return Iterator(this); }
+    Iterator end() const { return Iterator(); }
+
+    // forward iterator
+    struct Iterator {
+      typedef std::forward_iterator_tag iterator_category;
+      typedef int64    difference_type;
+      typedef T        value_type;
+      typedef const T* pointer;
+      typedef const T& reference;
+
+      Iterator() {}
+      Iterator& operator++(); // ++i
+      Iterator operator++(int); // i++
+      const T& operator*() const { return *_e; }
+      const T* operator->() const { return _e; }
+
+      bool operator==(const Iterator& rhs) const { return _e == rhs._e; }
+      bool operator!=(const Iterator& rhs) const { return _e != rhs._e; }
+
+    protected:
+      friend struct Set;
+      using Node = HashTrieNode<SetTraits<T>>;
+      Iterator(const Set*);
+      void enter(const Node*);
+      void next(); // move to the first value of the next node with values
+
+      struct Range {
+        const ref<Node>* next;
+        const ref<Node>* end;
+      };
+      ref<Set>  _s;
+      const T*  _e = nullptr;    // current value
+      const T*  _eend = nullptr; // end of current node's values
+      Range     _stack[Node::MAX_DEPTH]; // subnodes left to visit, per level
+      uint32    _depth = 0;
+    };
+
+  protected:
+    friend struct TransientSet<T>;
+    using Node = HashTrieNode<SetTraits<T>>;
+
+    Set(ref<Node> root) : _root(std::move(root)) {}
+    ref<Set> withRoot(Node* root) const;
+
+    ref<Node> _root;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(Set)
+  };
+
+
+  // Non-persistent version of Set, for efficient batch modifications. Works like
+  // TransientMap.
+  template <typename T>
+  struct TransientSet : RefCounted {
+    // Number of values in this set
+    uint32 size() const { return _root->size; }
+
+    // "seal" the transient set and return a persistent set that refers to the same
+    // root. Returns null if this transient set is not editable (e.g. makePersistent()
+    // has already been called.)
+    ref<Set<T>> makePersistent();
+
+    // Add or remove value. Returns null if this transient set is not editable.
+    ref<TransientSet> add(const T& v);
+    ref<TransientSet> remove(const T& v);
+
+    // True if v is in this set
+    bool contains(const T& v) const;
+
+  protected:
+    friend struct Set<T>;
+    using Node = HashTrieNode<SetTraits<T>>;
+
+    TransientSet(EditID edit, ref<Node> root) : _edit(edit), _root(std::move(root)) {}
+
+    EditID    _edit;
+    ref<Node> _root;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(TransientSet)
+  };
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // implementation
+
+  template <typename T>
+  inline ref<Set<T>> Set<T>::empty() {
+    static ref<Set> e = new Set(Node::alloc(NO_EDIT, 0, 0, 0, 0));
+    return e;
+  }
+
+  template <typename T>
+  inline ref<Set<T>> Set<T>::create(std::initializer_list<T>&& v) {
+    return create(v.begin(), v.end());
+  }
+
+  template <typename T>
+  template <typename It>
+  inline ref<Set<T>> Set<T>::create(It&& begin, const It& end) {
+    auto t = empty()->asTransient();
+    for (auto it = begin; it != end; ++it) {
+      t->add(*it);
+    }
+    return t->makePersistent();
+  }
+
+
+  template <typename T>
+  inline ref<Set<T>> Set<T>::withRoot(Node* root) const {
+    if (root == _root.ptr()) {
+      return const_cast<Set*>(this);
+    }
+    if (root == nullptr) {
+      return empty();
+    }
+    return new Set(root);
+  }
+
+
+  template <typename T>
+  inline bool Set<T>::contains(const T& v) const {
+    return Node::find(_root.ptr(), v, HashTrieHash(v)) != nullptr;
+  }
+
+  template <typename T>
+  inline ref<Set<T>> Set<T>::add(const T& v) const {
+    bool added = false;
+    return withRoot(Node::set(_root.ptr(), NO_EDIT, 0, T(v), HashTrieHash(v), false, added));
+  }
+
+  template <typename T>
+  inline ref<Set<T>> Set<T>::remove(const T& v) const {
+    bool removed = false;
+    return withRoot(Node::remove(_root.ptr(), NO_EDIT, 0, v, HashTrieHash(v), removed));
+  }
+
+
+  template <typename T>
+  inline ref<Set<T>> Set<T>::unite(const ref<Set>& other) const {
+    auto root = Node::unite(_root.ptr(), other->_root.ptr(), 0);
+    return root == other->_root.ptr() ? other : withRoot(root);
+  }
+
+  template <typename T>
+  inline ref<Set<T>> Set<T>::intersect(const ref<Set>& other) const {
+    auto root = Node::intersect(_root.ptr(), other->_root.ptr(), 0);
+    return root == other->_root.ptr() ? other : withRoot(root);
+  }
+
+  template <typename T>
+  inline ref<Set<T>> Set<T>::subtract(const ref<Set>& other) const {
+    return withRoot(Node::subtract(_root.ptr(), other->_root.ptr(), 0));
+  }
+
+
+  template <typename T>
+  inline ref<TransientSet<T>> Set<T>::asTransient() const {
+    return new TransientSetT(newEditID(), _root);
+  }
+
+  template <typename T>
+  template <typename F>
+  inline ref<Set<T>> Set<T>::modify(F&& fn) const {
+    auto t = asTransient();
+    fn(t);
+    return t->makePersistent();
+  }
+
+
+  template <typename T>
+  inline Set<T>::Iterator::Iterator(const Set* s) : _s(const_cast<Set*>(s)) {
+    enter(s->_root.ptr());
+    if (_e == _eend) {
+      next();
+    }
+  }
+
+  template <typename T>
+  inline void Set<T>::Iterator::enter(const Node* n) {
+    _stack[_depth++] = Range{n->nodes(), n->nodes() + n->nnodes};
+    _e = n->entries();
+    _eend = _e + n->nentries;
+  }
+
+  template <typename T>
+  inline void Set<T>::Iterator::next() {
+    while (_depth > 0) {
+      auto& r = _stack[_depth - 1];
+      if (r.next == r.end) {
+        --_depth;
+        continue;
+      }
+      enter((r.next++)->ptr());
+      if (_e != _eend) {
+        return;
+      }
+    }
+    _e = nullptr;
+    _s = nullptr;
+  }
+
+  template <typename T>
+  inline typename Set<T>::Iterator& Set<T>::Iterator::operator++() { // ++i
+    if (++_e == _eend) {
+      next();
+    }
+    return *this;
+  }
+
+  template <typename T>
+  inline typename Set<T>::Iterator Set<T>::Iterator::operator++(int) { // i++
+    Iterator copy(*this);
+    operator++();
+    return copy;
+  }
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // TransientSet
+
+  template <typename T>
+  inline ref<Set<T>> TransientSet<T>::makePersistent() {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    _edit = NO_EDIT;
+    return new Set<T>(_root);
+  }
+
+  template <typename T>
+  inline ref<TransientSet<T>> TransientSet<T>::add(const T& v) {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    bool added = false;
+    auto root = Node::set(_root.ptr(), _edit, 0, T(v), HashTrieHash(v), false, added);
+    if (root != _root.ptr()) {
+      _root = root;
+    }
+    return this;
+  }
+
+  template <typename T>
+  inline ref<TransientSet<T>> TransientSet<T>::remove(const T& v) {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    bool removed = false;
+    auto root = Node::remove(_root.ptr(), _edit, 0, v, HashTrieHash(v), removed);
+    if (root != _root.ptr()) {
+      _root = root;
+    }
+    return this;
+  }
+
+  template <typename T>
+  inline bool TransientSet<T>::contains(const T& v) const {
+    return Node::find(_root.ptr(), v, HashTrieHash(v)) != nullptr;
+  }
+
+} // namespace
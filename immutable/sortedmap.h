@@ -0,0 +1,769 @@
+#pragma once
+#include "base.h"
+#include "alloc.h"
+#include <algorithm>
+#include <initializer_list>
+#include <iterator>
+#include <utility>
+
+namespace immutable {
+  template <typename K, typename V> struct TransientSortedMap;
+
+  // Node of a SortedMap's B+tree. Leaves hold up to LEAF_MAX entries sorted by key.
+  // Branches hold up to BRANCHES subtrees, and for each subtree i > 0 a key which is
+  // greater than all keys of subtree i-1 and less than or equal to all keys of subtree
+  // i (keys[0] is not used for lookups.) All nodes but the root have at least half as
+  // many entries or subtrees as they can hold.
+  //
+  // Like array nodes, nodes stamped with a transient's edit token are modified in-place
+  // by the transient (except when they are split or merged), while other nodes are
+  // copied with the change and stamped with the token. Operations which change a node
+  // return the new node with no references, or the node itself when it was modified
+  // in-place or not changed.
+  template <typename K, typename V>
+  struct SortedMapNode : RefCounted {
+    using Node = SortedMapNode;
+    using Entry = std::pair<K,V>;
+
+    // Leaves hold about 1 kB of entries, or at least 8 and at most 64 entries
+    static constexpr uint32 BRANCHES = 32;
+    static constexpr uint32 LEAF_MAX =
+      1024 / sizeof(Entry) < 8 ? 8 : 1024 / sizeof(Entry) > 64 ? 64 : 1024 / sizeof(Entry);
+    static constexpr uint32 MAX_DEPTH = 16;
+
+    static_assert(alignof(Entry) <= NodeAlloc::GRANULE, "Entry is over-aligned");
+    static_assert(alignof(K) <= NodeAlloc::GRANULE, "K is over-aligned");
+
+    EditID edit;
+    uint32 count; // number of entries (leaf) or subtrees (branch)
+    bool   leaf;
+
+    Entry*     entries() const { return (Entry*)(this + 1); }
+    ref<Node>* children() const { return (ref<Node>*)(this + 1); }
+    K*         keys() const { return (K*)((char*)this + keysOffset()); }
+
+    uint32 capacity() const { return leaf ? LEAF_MAX : BRANCHES; }
+    bool   underflows() const { return count < capacity() / 2; }
+
+    // Smallest key in this subtree, or a key less than that for a branch whose
+    // smallest keys have been removed
+    const K& minKey() const { return leaf ? entries()[0].first : keys()[0]; }
+
+    // Index of the first entry with key >= k, or of the subtree which may hold k
+    uint32 lowerBound(const K& k) const;
+    uint32 childIndex(const K& k) const;
+
+    // Returns an empty node
+    static Node* alloc(EditID, bool leaf);
+
+    // Sets the value of k to e.second. `added` is set if there was no entry with key k.
+    // If the node is split, the new right sibling is stored in `right`.
+    static Node* set(Node*, EditID, Entry&& e, bool& added, Node*& right);
+
+    // Removes the entry with key k. `removed` is set if there was such an entry.
+    // The returned node may underflow.
+    static Node* remove(Node*, EditID, const K& k, bool& removed);
+
+    // New root for a root which was split in root and right
+    static Node* grow(EditID, Node* root, Node* right);
+
+    // New root after a removal: the only subtree of a branch with a single subtree
+    static Node* shrink(Node* root) {
+      return (root->leaf || root->count > 1) ? root : root->children()[0].ptr();
+    }
+
+  protected:
+    SortedMapNode(EditID edit, bool leaf) : edit(edit), count(0), leaf(leaf) {}
+
+    static size_t keysOffset() {
+      size_t off = sizeof(Node) + BRANCHES * sizeof(ref<Node>);
+      return (off + alignof(K) - 1) & ~(alignof(K) - 1);
+    }
+    static size_t allocSize(bool leaf) {
+      return leaf ? sizeof(Node) + LEAF_MAX * sizeof(Entry)
+                  : keysOffset() + BRANCHES * sizeof(K);
+    }
+    static bool isEditable(const Node* n, EditID edit) {
+      return edit != NO_EDIT && n->edit == edit;
+    }
+
+    // Appends entries [start, end) of leaf src to leaf dst, or subtrees [start, end)
+    // of branch src to branch dst, moving them if src is editable (and so about to be
+    // replaced.) If key is not null, it's the key of the first appended subtree.
+    static void appendEntries(Node* dst, Node* src, EditID, uint32 start, uint32 end);
+    static void appendChildren(
+      Node* dst, Node* src, EditID, uint32 start, uint32 end, const K* key=nullptr);
+    static void appendChild(Node* dst, const K& key, Node* child);
+
+    static Node* replaceChild(Node*, EditID, uint32 i, Node* c);
+    static Node* insertChild(Node*, EditID, uint32 i, Node* c, Node* r, Node*& right);
+    static Node* rebalance(Node*, EditID, uint32 i, Node* c);
+
+    void dealloc();
+
+    IMMUTABLE_REFCOUNTED_IMPL(SortedMapNode)
+  };
+
+
+  // Persistent map from keys K to values V, ordered by key. Keys are compared with <.
+  //
+  // Entries are stored in a B+tree of wide nodes (see SortedMapNode), so lookups, set
+  // and remove are O(log n) and visit few, contiguous blocks of memory, while iteration
+  // in key order walks the leaves one after another. Like for Array, a new version of
+  // a map shares all nodes with the previous version except the nodes on the path to
+  // the changed entry.
+  template <typename K, typename V>
+  struct SortedMap : RefCounted {
+    using Entry = std::pair<K,V>;
+    using TransientSortedMapT = TransientSortedMap<K,V>;
+    struct Iterator;
+    struct Range;
+
+    // The empty map
+    static ref<SortedMap> empty();
+
+    // Create a map with the entries of initializer list. Later entries replace earlier
+    // entries with the same key.
+    static ref<SortedMap> create(std::initializer_list<Entry>&&);
+
+    // Create a map with the entries of the range [begin, end)
+    template <typename It> static ref<SortedMap> create(It&& begin, const It& end);
+
+    // Number of entries in this map
+    uint32 size() const { return _size; }
+
+    // Access value for key. find returns nullptr if there's no entry with key k.
+    // If there's no entry with key k the behavior of get is undefined.
+    const V* find(const K& k) const;
+    const V& get(const K& k) const;
+    bool contains(const K& k) const { return find(k) != nullptr; }
+
+    // Set value for key k, replacing the value of an existing entry. The value is
+    // constructed in-place from arg.
+    template <typename Arg> ref<SortedMap> set(const K& k, Arg&& arg) const;
+
+    // Remove the entry with key k. Returns this map if there's no such entry.
+    ref<SortedMap> remove(const K& k) const;
+
+    // return a new TransientSortedMap contaning the same entries as this map.
+    ref<TransientSortedMapT> asTransient() const;
+
+    // apply modification with a transient. F is called with a
+    // ref<TransientSortedMap<K,V>>.
+    template <typename F> ref<SortedMap> modify(F&& fn) const;
+
+    // Iteration in key order. lowerBound returns an iterator at the first entry with
+    // a key not less than k, and range the entries with keys in [lo, hi).
+    Iterator begin() const { return Iterator(this, nullptr); }
+    Iterator end() const { return Iterator(); }
+    Iterator lowerBound(const K& k) const { return Iterator(this, &k); }
+    Range    range(const K& lo, const K& hi) const;
+
+    // forward iterator
+    struct Iterator {
+      typedef std::forward_iterator_tag iterator_category;
+      typedef int64        difference_type;
+      typedef Entry        value_type;
+      typedef const Entry* pointer;
+      typedef const Entry& reference;
+
+      Iterator() {}
+      Iterator& operator++(); // ++i
+      Iterator operator++(int); // i++
+      const Entry& operator*() const { return *_e; }
+      const Entry* operator->() const { return _e; }
+
+      bool operator==(const Iterator& rhs) const { return _e == rhs._e; }
+      bool operator!=(const Iterator& rhs) const { return _e != rhs._e; }
+
+    protected:
+      friend struct SortedMap;
+      using Node = SortedMapNode<K,V>;
+      Iterator(const SortedMap*, const K* lo);
+      void descend(const Node* n, const K* lo);
+      void nextLeaf();
+
+      ref<SortedMap> _m;
+      const Entry*   _e = nullptr;    // current entry
+      const Entry*   _eend = nullptr; // end of current leaf's entries
+      const Node*    _path[Node::MAX_DEPTH]; // branches above the current leaf
+      uint32         _index[Node::MAX_DEPTH]; // subtree index in each branch
+      uint32         _depth = 0;
+    };
+
+    // Entries with keys in [lo, hi), as returned by range()
+    struct Range {
+      const Iterator& begin() const { return _begin; }
+      const Iterator& end() const { return _end; }
+      Iterator _begin, _end;
+    };
+
+  protected:
+    friend struct TransientSortedMap<K,V>;
+    using Node = SortedMapNode<K,V>;
+
+    SortedMap(ref<Node> root, uint32 size) : _root(std::move(root)), _size(size) {}
+
+    ref<Node> _root;
+    uint32    _size;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(SortedMap)
+  };
+
+
+  // Non-persistent version of SortedMap, for efficient batch modifications. Works
+  // like TransientMap.
+  template <typename K, typename V>
+  struct TransientSortedMap : RefCounted {
+    using Entry = std::pair<K,V>;
+
+    // Number of entries in this map
+    uint32 size() const { return _size; }
+
+    // "seal" the transient map and return a persistent map that refers to the same
+    // root. Returns null if this transient map is not editable (e.g. makePersistent()
+    // has already been called.)
+    ref<SortedMap<K,V>> makePersistent();
+
+    // Set value for key k. Returns null if this transient map is not editable.
+    template <typename Arg> ref<TransientSortedMap> set(const K& k, Arg&& arg);
+
+    // Remove the entry with key k. Returns null if this transient map is not editable.
+    ref<TransientSortedMap> remove(const K& k);
+
+    // Access value for key, like SortedMap::find and SortedMap::get
+    const V* find(const K& k) const;
+    const V& get(const K& k) const;
+    bool contains(const K& k) const { return find(k) != nullptr; }
+
+  protected:
+    friend struct SortedMap<K,V>;
+    using Node = SortedMapNode<K,V>;
+
+    TransientSortedMap(EditID edit, ref<Node> root, uint32 size)
+      : _edit(edit), _root(std::move(root)), _size(size) {}
+
+    EditID    _edit;
+    ref<Node> _root;
+    uint32    _size;
+
+    void dealloc() { delete this; }
+
+    IMMUTABLE_REFCOUNTED_IMPL(TransientSortedMap)
+  };
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // SortedMapNode
+
+  template <typename K, typename V>
+  inline SortedMapNode<K,V>* SortedMapNode<K,V>::alloc(EditID edit, bool leaf) {
+    return new (NodeAlloc::alloc(allocSize(leaf))) Node(edit, leaf);
+  }
+
+  template <typename K, typename V>
+  inline void SortedMapNode<K,V>::dealloc() {
+    if (leaf) {
+      auto e = entries();
+      for (uint32 i = 0; i < count; ++i) {
+        e[i].~Entry();
+      }
+    } else {
+      auto c = children();
+      auto k = keys();
+      for (uint32 i = 0; i < count; ++i) {
+        c[i].~ref<Node>();
+        k[i].~K();
+      }
+    }
+    bool isLeaf = leaf;
+    this->~SortedMapNode();
+    NodeAlloc::free(this, allocSize(isLeaf));
+  }
+
+
+  template <typename K, typename V>
+  inline uint32 SortedMapNode<K,V>::lowerBound(const K& k) const {
+    auto e = entries();
+    return uint32(std::lower_bound(e, e + count, k, [](const Entry& a, const K& k) {
+      return a.first < k;
+    }) - e);
+  }
+
+  template <typename K, typename V>
+  inline uint32 SortedMapNode<K,V>::childIndex(const K& k) const {
+    auto keys = this->keys();
+    return uint32(std::upper_bound(keys + 1, keys + count, k) - keys) - 1;
+  }
+
+
+  template <typename K, typename V>
+  inline void SortedMapNode<K,V>::appendEntries(
+    Node* dst, Node* src, EditID edit, uint32 start, uint32 end)
+  {
+    auto s = src->entries();
+    auto d = dst->entries() + dst->count;
+    if (isEditable(src, edit)) {
+      for (uint32 i = start; i < end; ++i) {
+        new (d++) Entry(std::move(s[i]));
+      }
+    } else {
+      for (uint32 i = start; i < end; ++i) {
+        new (d++) Entry(s[i]);
+      }
+    }
+    dst->count += end - start;
+  }
+
+  template <typename K, typename V>
+  inline void SortedMapNode<K,V>::appendChildren(
+    Node* dst, Node* src, EditID edit, uint32 start, uint32 end, const K* key)
+  {
+    bool move = isEditable(src, edit);
+    for (uint32 i = start; i < end; ++i) {
+      const K& k = (i == start && key) ? *key : src->keys()[i];
+      new (&dst->keys()[dst->count]) K(k);
+      if (move) {
+        new (&dst->children()[dst->count]) ref<Node>(std::move(src->children()[i]));
+      } else {
+        new (&dst->children()[dst->count]) ref<Node>(src->children()[i]);
+      }
+      dst->count++;
+    }
+  }
+
+  template <typename K, typename V>
+  inline void SortedMapNode<K,V>::appendChild(Node* dst, const K& key, Node* child) {
+    new (&dst->keys()[dst->count]) K(key);
+    new (&dst->children()[dst->count]) ref<Node>(child);
+    dst->count++;
+  }
+
+
+  template <typename K, typename V>
+  inline SortedMapNode<K,V>* SortedMapNode<K,V>::set(
+    Node* n, EditID edit, Entry&& e, bool& added, Node*& right)
+  {
+    if (!n->leaf) {
+      uint32 i = n->childIndex(e.first);
+      Node* child = n->children()[i].ptr();
+      Node* r = nullptr;
+      Node* c = set(child, edit, std::move(e), added, r);
+      if (r) {
+        return insertChild(n, edit, i, c, r, right);
+      }
+      return c == child ? n : replaceChild(n, edit, i, c);
+    }
+
+    uint32 i = n->lowerBound(e.first);
+    auto entries = n->entries();
+    if (i < n->count && !(e.first < entries[i].first)) {
+      // replace value
+      if (isEditable(n, edit)) {
+        entries[i].second = std::move(e.second);
+        return n;
+      }
+      auto m = alloc(edit, true);
+      appendEntries(m, n, edit, 0, i);
+      new (&m->entries()[i]) Entry(std::move(e));
+      m->count++;
+      appendEntries(m, n, edit, i + 1, n->count);
+      return m;
+    }
+
+    added = true;
+    if (n->count < LEAF_MAX && isEditable(n, edit)) {
+      if (i == n->count) {
+        new (&entries[i]) Entry(std::move(e));
+      } else {
+        new (&entries[n->count]) Entry(std::move(entries[n->count - 1]));
+        std::move_backward(entries + i, entries + n->count - 1, entries + n->count);
+        entries[i] = std::move(e);
+      }
+      n->count++;
+      return n;
+    }
+
+    // Copy with e inserted at i. A full leaf is split in two halves.
+    uint32 total = n->count + 1;
+    uint32 nleft = total <= LEAF_MAX ? total : total / 2;
+    auto m = alloc(edit, true);
+    if (total > LEAF_MAX) {
+      right = alloc(edit, true);
+    }
+    auto dst = [&](uint32 pos) { return pos < nleft ? m : right; };
+    for (uint32 j = 0; j < i; ++j) {
+      appendEntries(dst(j), n, edit, j, j + 1);
+    }
+    new (&dst(i)->entries()[dst(i)->count]) Entry(std::move(e));
+    dst(i)->count++;
+    for (uint32 j = i; j < n->count; ++j) {
+      appendEntries(dst(j + 1), n, edit, j, j + 1);
+    }
+    return m;
+  }
+
+
+  template <typename K, typename V>
+  inline SortedMapNode<K,V>* SortedMapNode<K,V>::replaceChild(
+    Node* n, EditID edit, uint32 i, Node* c)
+  {
+    if (isEditable(n, edit)) {
+      n->children()[i] = c;
+      return n;
+    }
+    auto m = alloc(edit, false);
+    appendChildren(m, n, edit, 0, i);
+    appendChild(m, n->keys()[i], c);
+    appendChildren(m, n, edit, i + 1, n->count);
+    return m;
+  }
+
+
+  template <typename K, typename V>
+  inline SortedMapNode<K,V>* SortedMapNode<K,V>::insertChild(
+    Node* n, EditID edit, uint32 i, Node* c, Node* r, Node*& right)
+  {
+    // Copy with c at i and r inserted after it. A full branch is split in two halves.
+    ref<Node> hold = r;
+    uint32 total = n->count + 1;
+    uint32 nleft = total <= BRANCHES ? total : total / 2;
+    auto m = alloc(edit, false);
+    Node* dst = m;
+    auto next = [&]() -> Node* {
+      if (dst == m && m->count == nleft) {
+        dst = right = alloc(edit, false);
+      }
+      return dst;
+    };
+    for (uint32 j = 0; j < i; ++j) {
+      appendChildren(next(), n, edit, j, j + 1);
+    }
+    appendChild(next(), n->keys()[i], c);
+    appendChild(next(), r->minKey(), r);
+    for (uint32 j = i + 1; j < n->count; ++j) {
+      appendChildren(next(), n, edit, j, j + 1);
+    }
+    return m;
+  }
+
+
+  template <typename K, typename V>
+  inline SortedMapNode<K,V>* SortedMapNode<K,V>::remove(
+    Node* n, EditID edit, const K& k, bool& removed)
+  {
+    if (!n->leaf) {
+      uint32 i = n->childIndex(k);
+      Node* child = n->children()[i].ptr();
+      Node* c = remove(child, edit, k, removed);
+      if (!removed) {
+        return n;
+      }
+      if (c->underflows() && n->count > 1) {
+        return rebalance(n, edit, i, c);
+      }
+      return c == child ? n : replaceChild(n, edit, i, c);
+    }
+
+    uint32 i = n->lowerBound(k);
+    auto entries = n->entries();
+    if (i == n->count || k < entries[i].first) {
+      return n;
+    }
+    removed = true;
+    if (isEditable(n, edit)) {
+      std::move(entries + i + 1, entries + n->count, entries + i);
+      entries[--n->count].~Entry();
+      return n;
+    }
+    auto m = alloc(edit, true);
+    appendEntries(m, n, edit, 0, i);
+    appendEntries(m, n, edit, i + 1, n->count);
+    return m;
+  }
+
+
+  template <typename K, typename V>
+  inline SortedMapNode<K,V>* SortedMapNode<K,V>::grow(EditID edit, Node* root, Node* right) {
+    auto m = alloc(edit, false);
+    appendChild(m, root->minKey(), root);
+    appendChild(m, right->minKey(), right);
+    return m;
+  }
+
+
+  // Merges c, the underflowing subtree i of n, with a sibling, or moves entries or
+  // subtrees from the sibling to c if they don't fit in one node
+  template <typename K, typename V>
+  inline SortedMapNode<K,V>* SortedMapNode<K,V>::rebalance(
+    Node* n, EditID edit, uint32 i, Node* c)
+  {
+    ref<Node> hold = c;
+    uint32 li = i > 0 ? i - 1 : i; // left of the two subtrees
+    Node* l = li == i ? c : n->children()[li].ptr();
+    Node* r = li == i ? n->children()[i + 1].ptr() : c;
+    const K& sep = n->keys()[li + 1];
+    uint32 total = l->count + r->count;
+
+    auto m = alloc(edit, false);
+    appendChildren(m, n, edit, 0, li);
+    if (total <= l->capacity()) {
+      auto merged = alloc(edit, l->leaf);
+      if (l->leaf) {
+        appendEntries(merged, l, edit, 0, l->count);
+        appendEntries(merged, r, edit, 0, r->count);
+      } else {
+        appendChildren(merged, l, edit, 0, l->count);
+        appendChildren(merged, r, edit, 0, r->count, &sep);
+      }
+      appendChild(m, n->keys()[li], merged);
+    } else {
+      // split the entries or subtrees of l and r evenly between two new nodes
+      uint32 nleft = total / 2;
+      auto l2 = alloc(edit, l->leaf);
+      auto r2 = alloc(edit, l->leaf);
+      if (l->leaf) {
+        if (nleft <= l->count) {
+          appendEntries(l2, l, edit, 0, nleft);
+          appendEntries(r2, l, edit, nleft, l->count);
+          appendEntries(r2, r, edit, 0, r->count);
+        } else {
+          appendEntries(l2, l, edit, 0, l->count);
+          appendEntries(l2, r, edit, 0, nleft - l->count);
+          appendEntries(r2, r, edit, nleft - l->count, r->count);
+        }
+      } else {
+        if (nleft <= l->count) {
+          appendChildren(l2, l, edit, 0, nleft);
+          appendChildren(r2, l, edit, nleft, l->count);
+          appendChildren(r2, r, edit, 0, r->count, &sep);
+        } else {
+          appendChildren(l2, l, edit, 0, l->count);
+          appendChildren(l2, r, edit, 0, nleft - l->count, &sep);
+          appendChildren(r2, r, edit, nleft - l->count, r->count);
+        }
+      }
+      appendChild(m, n->keys()[li], l2);
+      appendChild(m, r2->minKey(), r2);
+    }
+    appendChildren(m, n, edit, li + 2, n->count);
+    return m;
+  }
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // SortedMap
+
+  template <typename K, typename V>
+  inline ref<SortedMap<K,V>> SortedMap<K,V>::empty() {
+    static ref<SortedMap> e = new SortedMap(Node::alloc(NO_EDIT, true), 0);
+    return e;
+  }
+
+  template <typename K, typename V>
+  inline ref<SortedMap<K,V>> SortedMap<K,V>::create(std::initializer_list<Entry>&& v) {
+    return create(v.begin(), v.end());
+  }
+
+  template <typename K, typename V>
+  template <typename It>
+  inline ref<SortedMap<K,V>> SortedMap<K,V>::create(It&& begin, const It& end) {
+    auto t = empty()->asTransient();
+    for (auto it = begin; it != end; ++it) {
+      t->set(it->first, it->second);
+    }
+    return t->makePersistent();
+  }
+
+
+  template <typename K, typename V>
+  inline const V* SortedMap<K,V>::find(const K& k) const {
+    const Node* n = _root.ptr();
+    while (!n->leaf) {
+      n = n->children()[n->childIndex(k)].ptr();
+    }
+    uint32 i = n->lowerBound(k);
+    auto e = n->entries();
+    return (i < n->count && !(k < e[i].first)) ? &e[i].second : nullptr;
+  }
+
+  template <typename K, typename V>
+  inline const V& SortedMap<K,V>::get(const K& k) const {
+    auto v = find(k);
+    assert(v != nullptr);
+    return *v;
+  }
+
+
+  template <typename K, typename V>
+  template <typename Arg>
+  inline ref<SortedMap<K,V>> SortedMap<K,V>::set(const K& k, Arg&& arg) const {
+    bool added = false;
+    Node* right = nullptr;
+    Node* root = Node::set(_root.ptr(), NO_EDIT, Entry(k, fwd<Arg>(arg)), added, right);
+    if (right) {
+      root = Node::grow(NO_EDIT, root, right);
+    }
+    return new SortedMap(root, _size + added);
+  }
+
+  template <typename K, typename V>
+  inline ref<SortedMap<K,V>> SortedMap<K,V>::remove(const K& k) const {
+    bool removed = false;
+    ref<Node> root = Node::remove(_root.ptr(), NO_EDIT, k, removed);
+    if (!removed) {
+      return const_cast<SortedMap*>(this);
+    }
+    return new SortedMap(Node::shrink(root), _size - 1);
+  }
+
+
+  template <typename K, typename V>
+  inline ref<TransientSortedMap<K,V>> SortedMap<K,V>::asTransient() const {
+    return new TransientSortedMapT(newEditID(), _root, _size);
+  }
+
+  template <typename K, typename V>
+  template <typename F>
+  inline ref<SortedMap<K,V>> SortedMap<K,V>::modify(F&& fn) const {
+    auto t = asTransient();
+    fn(t);
+    return t->makePersistent();
+  }
+
+
+  template <typename K, typename V>
+  inline typename SortedMap<K,V>::Range SortedMap<K,V>::range(const K& lo, const K& hi) const {
+    if (!(lo < hi)) {
+      return Range{end(), end()};
+    }
+    return Range{lowerBound(lo), lowerBound(hi)};
+  }
+
+
+  template <typename K, typename V>
+  inline SortedMap<K,V>::Iterator::Iterator(const SortedMap* m, const K* lo)
+    : _m(const_cast<SortedMap*>(m))
+  {
+    descend(m->_root.ptr(), lo);
+  }
+
+  // Moves to the first entry not less than *lo (or the first entry if lo is null) in
+  // the subtree n, or past the subtree
+  template <typename K, typename V>
+  inline void SortedMap<K,V>::Iterator::descend(const Node* n, const K* lo) {
+    while (!n->leaf) {
+      uint32 i = lo ? n->childIndex(*lo) : 0;
+      _path[_depth] = n;
+      _index[_depth++] = i;
+      n = n->children()[i].ptr();
+    }
+    _e = n->entries() + (lo ? n->lowerBound(*lo) : 0);
+    _eend = n->entries() + n->count;
+    if (_e == _eend) {
+      nextLeaf();
+    }
+  }
+
+  template <typename K, typename V>
+  inline void SortedMap<K,V>::Iterator::nextLeaf() {
+    while (_depth > 0) {
+      const Node* n = _path[_depth - 1];
+      uint32 i = ++_index[_depth - 1];
+      if (i < n->count) {
+        // Note: all but the root have entries, so the leftmost leaf has an entry
+        descend(n->children()[i].ptr(), nullptr);
+        return;
+      }
+      --_depth;
+    }
+    _e = nullptr;
+    _m = nullptr;
+  }
+
+  template <typename K, typename V>
+  inline typename SortedMap<K,V>::Iterator& SortedMap<K,V>::Iterator::operator++() { // ++i
+    if (++_e == _eend) {
+      nextLeaf();
+    }
+    return *this;
+  }
+
+  template <typename K, typename V>
+  inline typename SortedMap<K,V>::Iterator SortedMap<K,V>::Iterator::operator++(int) { // i++
+    Iterator copy(*this);
+    operator++();
+    return copy;
+  }
+
+
+  // —————————————————————————————————————————————————————————————————————
+  // TransientSortedMap
+
+  template <typename K, typename V>
+  inline ref<SortedMap<K,V>> TransientSortedMap<K,V>::makePersistent() {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    _edit = NO_EDIT;
+    return new SortedMap<K,V>(_root, _size);
+  }
+
+  template <typename K, typename V>
+  template <typename Arg>
+  inline ref<TransientSortedMap<K,V>> TransientSortedMap<K,V>::set(const K& k, Arg&& arg) {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    bool added = false;
+    Node* right = nullptr;
+    Node* root = Node::set(_root.ptr(), _edit, Entry(k, fwd<Arg>(arg)), added, right);
+    if (right) {
+      root = Node::grow(_edit, root, right);
+    }
+    if (root != _root.ptr()) {
+      _root = root;
+    }
+    _size += added;
+    return this;
+  }
+
+  template <typename K, typename V>
+  inline ref<TransientSortedMap<K,V>> TransientSortedMap<K,V>::remove(const K& k) {
+    if (_edit == NO_EDIT) {
+      return nullptr;
+    }
+    bool removed = false;
+    Node* root = Node::remove(_root.ptr(), _edit, k, removed);
+    if (root != _root.ptr()) {
+      _root = root;
+    }
+    if (removed) {
+      ref<Node> shrunk = Node::shrink(_root.ptr());
+      _root = std::move(shrunk);
+      --_size;
+    }
+    return this;
+  }
+
+  template <typename K, typename V>
+  inline const V* TransientSortedMap<K,V>::find(const K& k) const {
+    const Node* n = _root.ptr();
+    while (!n->leaf) {
+      n = n->children()[n->childIndex(k)].ptr();
+    }
+    uint32 i = n->lowerBound(k);
+    auto e = n->entries();
+    return (i < n->count && !(k < e[i].first)) ? &e[i].second : nullptr;
+  }
+
+  template <typename K, typename V>
+  inline const V& TransientSortedMap<K,V>::get(const K& k) const {
+    auto v = find(k);
+    assert(v != nullptr);
+    return *v;
+  }
+
+} // namespace
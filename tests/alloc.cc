@@ -0,0 +1,102 @@
+#include "test.h"
+#include <immutable/alloc.h>
+#include <immutable/array.h>
+#include <string.h>
+#include <thread>
+
+using namespace immutable;
+
+TEST(NodeAlloc) {
+  bool prevCaching = NodeAlloc::setCaching(true);
+  NodeAlloc::resetStats();
+
+  // a freed block is handed out again for any size in the same size class
+  void* p = NodeAlloc::alloc(40);
+  assert(p != nullptr);
+  NodeAlloc::free(p, 40);
+  void* p2 = NodeAlloc::alloc(48);
+  assert(p2 == p);
+  auto s = NodeAlloc::stats();
+  assert(s.misses == 1);
+  assert(s.hits == 1);
+  assert(s.cached == 1);
+
+  // but not for other size classes
+  void* p3 = NodeAlloc::alloc(49);
+  assert(p3 != p2);
+  assert(NodeAlloc::stats().misses == 2);
+
+  // calloc zeroes recycled blocks
+  memset(p2, 0xff, 48);
+  NodeAlloc::free(p2, 48);
+  auto z = (uint8*)NodeAlloc::calloc(48);
+  assert(z == p2);
+  for (int i = 0; i < 48; ++i) {
+    assert(z[i] == 0);
+  }
+  NodeAlloc::free(z, 48);
+  NodeAlloc::free(p3, 49);
+
+  // large blocks bypass the free lists
+  s = NodeAlloc::stats();
+  void* big = NodeAlloc::alloc(NodeAlloc::MAX_SIZE + 1);
+  NodeAlloc::free(big, NodeAlloc::MAX_SIZE + 1);
+  assert(NodeAlloc::stats().misses == s.misses);
+  assert(NodeAlloc::stats().cached == s.cached);
+
+  // free lists are bounded
+  void* blocks[NodeAlloc::MAX_FREE + 10];
+  for (auto& b : blocks) {
+    b = NodeAlloc::alloc(64);
+  }
+  s = NodeAlloc::stats();
+  for (auto& b : blocks) {
+    NodeAlloc::free(b, 64);
+  }
+  assert(NodeAlloc::stats().released - s.released >= 10);
+
+  // disabling caching releases everything
+  NodeAlloc::setCaching(false);
+  s = NodeAlloc::stats();
+  p = NodeAlloc::alloc(64);
+  NodeAlloc::free(p, 64);
+  assert(NodeAlloc::stats().hits == s.hits);
+  assert(NodeAlloc::stats().released == s.released + 1);
+
+  NodeAlloc::setCaching(prevCaching);
+}
+
+
+TEST(NodeAllocArray) {
+  bool prevCaching = NodeAlloc::setCaching(true);
+
+  // nodes released by one version of an array are reused by the next
+  auto a = Array<int>::empty();
+  for (int i = 0; i < 100; ++i) {
+    a = a->push(i);
+  }
+  NodeAlloc::resetStats();
+  for (int i = 0; i < 100; ++i) {
+    a = a->set(i, i * 2);
+  }
+  auto s = NodeAlloc::stats();
+  assert(s.hits > 0);
+  assert(s.misses < s.hits);
+  for (int i = 0; i < 100; ++i) {
+    assert(a->get(i) == i * 2);
+  }
+
+  // nodes freed on another thread land in that thread's free lists
+  // (with biased reference counts, b is instead freed by its owner, this thread)
+  #ifndef IMMUTABLE_BIASED_REFCOUNT
+  auto b = Array<int>::create({1, 2, 3});
+  std::thread([&] {
+    NodeAlloc::setCaching(true);
+    NodeAlloc::resetStats();
+    b = nullptr;
+    assert(NodeAlloc::stats().cached > 0);
+  }).join();
+  #endif
+
+  NodeAlloc::setCaching(prevCaching);
+}
@@ -1,8 +1,10 @@
 #include "test.h"
 #include <immutable/array.h>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <thread>
+#include <unordered_set>
 #include <stdio.h>
 
 using namespace immutable;
@@ -122,6 +124,100 @@ TEST(ArrayCreate) {
 }
 
 
+TEST(ArrayCreateRandomAccess) {
+  // Random-access ranges are stored into leaves directly rather than pushed. The
+  // sizes are around leaf and branch boundaries, and the last ones are big enough
+  // for createParallel to use several threads.
+  uint32 sizes[] = {1, 31, 32, 33, 64, 65, 1024, 1056, 1057, 32*32*32 + 33, 200000};
+  for (uint32 n : sizes) {
+    std::vector<int> v;
+    std::vector<std::string> sv;
+    for (uint32 i = 0; i < n; ++i) {
+      v.push_back(int(i));
+      sv.push_back(std::to_string(i));
+    }
+    auto a = Array<int>::create(v);
+    auto b = Array<int>::createParallel(v, 4);
+    auto c = Array<std::string>::createParallel(sv, 3);
+    auto d = Array<std::string>::create(std::vector<std::string>(sv)); // moves values
+    assert(a->size() == n && b->size() == n && c->size() == n && d->size() == n);
+    for (uint32 i = 0; i < n; ++i) {
+      assert(a->get(i) == int(i));
+      assert(b->get(i) == int(i));
+      assert(c->get(i) == sv[i]);
+      assert(d->get(i) == sv[i]);
+    }
+
+    // the arrays work like any other array with the same values
+    auto b2 = b->push(-1)->set(0, -2);
+    assert(b2->size() == n + 1 && b2->get(0) == -2 && b2->last() == -1);
+    assert(b->pop()->size() == n - 1);
+    assert(b->compare(a) == 0);
+    auto t = c->asTransient();
+    t->push(std::string("x"))->set(n - 1, std::string("y"));
+    auto c2 = t->makePersistent();
+    assert(c2->get(n - 1) == "y" && c2->last() == "x");
+    assert(c->get(n - 1) == sv[n - 1]);
+  }
+
+  // empty ranges and initializer lists
+  assert(Array<int>::createParallel(std::vector<int>())->size() == 0);
+  auto e = Array<int>::create({1, 2, 3});
+  assert(e->size() == 3 && e->last() == 3);
+
+  // iterators are advanced to the end of the range
+  std::vector<int> v({1, 2, 3});
+  auto I = v.begin();
+  assert(Array<int>::create(I, v.end())->size() == 3);
+  assert(I == v.end());
+}
+
+
+TEST(ArrayBuilder) {
+  ArrayBuilder<int> b;
+  assert(b.size() == 0);
+  assert(b.build()->size() == 0);
+
+  // without reserve, with exact reserve, and with too few and too many reserved
+  uint32 sizes[] = {1, 31, 32, 33, 64, 65, 1057, 32*32*32 + 33};
+  ArrayBuilder<std::string> sb; // reused for all sizes
+  for (uint32 n : sizes) {
+    for (uint32 reserve : {uint32(0), n, n / 2, n + 40}) {
+      b.reserve(reserve);
+      sb.reserve(reserve);
+      for (uint32 i = 0; i < n; ++i) {
+        assert(b.emplace_back(int(i)) == int(i));
+        sb.push_back(std::to_string(i));
+      }
+      assert(b.size() == n && sb.size() == n);
+      auto a = b.build();
+      auto s = sb.build();
+      assert(b.size() == 0 && sb.size() == 0);
+      assert(a->size() == n && s->size() == n);
+      for (uint32 i = 0; i < n; ++i) {
+        assert(a->get(i) == int(i));
+        assert(s->get(i) == std::to_string(i));
+      }
+      auto a2 = a->push(-1)->pop()->pop();
+      assert(a2->size() == n - 1 && a->size() == n);
+      assert(s->set(n - 1, std::string("x"))->last() == "x");
+    }
+  }
+
+  // clear, and values left in a builder which is destroyed
+  b.emplace_back(1);
+  b.clear();
+  b.emplace_back(2);
+  assert(b.build()->get(0) == 2);
+  {
+    ArrayBuilder<std::string> sb2(100);
+    for (int i = 0; i < 50; ++i) {
+      sb2.emplace_back(3, 'x');
+    }
+  }
+}
+
+
 TEST(ArrayIterator) {
   auto a = mkvals(ArrayImp::BRANCHES * ArrayImp::BRANCHES);
 
@@ -193,6 +289,166 @@ TEST(ArrayIterator) {
 
 }
 
+
+TEST(ArrayRandomAccessIterator) {
+  static_assert(std::is_same<
+    std::iterator_traits<Array<int>::Iterator>::iterator_category,
+    std::random_access_iterator_tag>::value, "");
+  // distances between any two of up to 2^32 values fit
+  static_assert(std::is_same<Array<int>::Iterator::difference_type, int64>::value, "");
+
+  // sorted arrays, so that they can be searched
+  auto a = mkvals(ArrayImp::BRANCHES * 40 + 7);
+  auto relaxed = a->slice(0, 103)->concat(a->slice(103));
+  auto sliced = relaxed->slice(50, 1000);
+  for (auto& src : {a, relaxed, sliced}) {
+    std::vector<int> all(src->begin(), src->end());
+    int32 n = int32(src->size());
+    auto B = src->begin();
+    auto E = src->end();
+    assert(E - B == n && B - E == -n);
+    assert(std::distance(B, E) == n);
+    assert(B < E && E > B && B <= B && !(E < B));
+
+    // jumps within a leaf, across leaves and back
+    int32 steps[] = {1, 5, 31, 32, 33, 100, -2, -64, -1, 700};
+    auto I = B;
+    int32 i = 0;
+    for (int32 d : steps) {
+      i += d;
+      I += d;
+      assert(I - B == i && *I == all[i]);
+      assert(B[i] == all[i] && (B + i) == I && (I - i) == B);
+      assert(I[-i] == all[0] && I[n - 1 - i] == all[n - 1]);
+    }
+
+    // moving to the end and back from it
+    auto last = B + n;
+    assert(last == E && !last.valid() && last - B == n);
+    --last;
+    assert(*last == all[n - 1]);
+    last -= n - 1;
+    assert(last == B);
+
+    // standard algorithms
+    assert(std::is_sorted(B, E));
+    for (int32 k : {0, 1, 32, n / 2, n - 1}) {
+      auto F = std::lower_bound(B, E, all[k]);
+      assert(F - B == k && *F == all[k]);
+      assert(std::binary_search(B, E, all[k]));
+    }
+    assert(std::lower_bound(B, E, all[n - 1] + 1) == E);
+    assert(!std::binary_search(B, E, 0));
+  }
+
+  // ranged iterators
+  auto B = a->begin(10, 80);
+  assert(a->end() - B == 70 && B[69] == 80);
+  assert(std::upper_bound(B, a->end(), 40) - B == 30);
+}
+
+TEST(ArrayReverseIterator) {
+  auto e = Array<int>::empty();
+  assert(e->rbegin() == e->rend() && !e->rbegin().valid());
+
+  auto a = mkvals(ArrayImp::BRANCHES * 40 + 7);
+  auto relaxed = mkvals(ArrayImp::BRANCHES * 3 + 7)->concat(a);
+  auto sliced = relaxed->slice(50, 1000);
+  for (auto& src : {a, relaxed, sliced}) {
+    std::vector<int> all(src->begin(), src->end());
+    std::vector<int> rev(src->rbegin(), src->rend());
+    assert(std::equal(all.rbegin(), all.rend(), rev.begin()) && rev.size() == all.size());
+
+    // ranges, like begin(start, end)
+    uint32 bounds[][2] = {{0, 1}, {5, 40}, {31, 33}, {100, 100}, {200, END}, {0, 99999}};
+    for (auto& b : bounds) {
+      uint32 end = min(b[1], src->size());
+      uint32 i = end;
+      for (auto I = src->rbegin(b[0], b[1]); I != src->rend(); ++I) {
+        assert(I.index() == --i && *I == all[i]);
+      }
+      assert(i == min(b[0], end));
+    }
+
+    // stepping back and forth across leaves
+    auto I = src->rbegin();
+    for (uint32 k = 0; k < 40; ++k) { ++I; }
+    assert(*I == all[all.size() - 41]);
+    for (uint32 k = 0; k < 39; ++k) { --I; }
+    assert(*I-- == all[all.size() - 2] && *I == all.back());
+
+    // moving back from the end
+    auto J = src->rbegin(0, 3);
+    ++J; ++J; ++J;
+    assert(J == src->rend() && !J.valid());
+    --J;
+    assert(*J == all[0]);
+  }
+
+  // boxed values
+  auto s = a->map([] (int v) { return std::to_string(v); })->slice(3, 70);
+  auto R = s->rbegin();
+  assert(*R == "70" && R.value()->value == "70");
+}
+
+// Returns the values in [start, end) of a, visited by chunks and forEachChunk, after
+// checking that both visit the same chunks and that chunks are at most one leaf.
+template <typename T>
+static std::vector<T> chunkValues(const ref<Array<T>>& a, uint32 start=0, uint32 end=END) {
+  std::vector<T> vals;
+  std::vector<uint32> sizes;
+  for (auto& chunk : a->chunks(start, end)) {
+    assert(chunk.size() > 0 && chunk.size() <= ArrayImp::BRANCHES);
+    sizes.push_back(chunk.size());
+    for (auto& v : chunk) {
+      vals.push_back(v);
+    }
+  }
+  uint32 i = 0, n = 0;
+  a->forEachChunk([&] (const ArrayChunk<T>& chunk) {
+    assert(chunk.size() == sizes[n++]);
+    for (uint32 k = 0; k < chunk.size(); ++k) {
+      assert(chunk[k] == vals[i++]);
+    }
+  }, start, end);
+  assert(i == vals.size() && n == sizes.size());
+  return vals;
+}
+
+TEST(ArrayChunks) {
+  assert(chunkValues(Array<int>::empty()).size() == 0);
+
+  auto a = mkvals(ArrayImp::BRANCHES * 40 + 7);
+  auto relaxed = mkvals(ArrayImp::BRANCHES * 3 + 7)->concat(a);
+  auto sliced = relaxed->slice(50);
+  for (auto& src : {a, relaxed, sliced}) {
+    std::vector<int> all(src->begin(), src->end());
+    assert(chunkValues(src) == all);
+    // subranges, like begin(start, end)
+    uint32 bounds[][2] = {{0, 1}, {5, 40}, {31, 33}, {100, 100}, {200, END}, {0, 99999}};
+    for (auto& b : bounds) {
+      uint32 end = min(b[1], src->size());
+      assert(chunkValues(src, b[0], b[1]) ==
+             std::vector<int>(all.begin() + b[0], all.begin() + end));
+    }
+  }
+
+  // unboxed values are contiguous
+  int64_t sum = 0;
+  a->forEachChunk([&] (const ArrayChunk<int>& chunk) {
+    const int* p = chunk.data();
+    for (uint32 k = 0; k < chunk.size(); ++k) {
+      sum += p[k];
+    }
+  });
+  assert(sum == int64_t(a->size()) * (a->size() + 1) / 2);
+
+  // boxed values
+  auto s = a->map([] (int v) { return std::to_string(v); })->slice(3, 70);
+  auto svals = chunkValues(s);
+  assert(svals.size() == 67 && svals[0] == "4" && svals.back() == "70");
+}
+
 TEST(ArrayPop) {
   auto a = mkvals(ArrayImp::BRANCHES * ArrayImp::BRANCHES);
   
@@ -317,7 +573,6 @@ TEST(ArrayCons) {
 TEST(ArrayConcat) {
   auto a = Array<int>::create({1,2,3});
 
-  // concat (uses iterator "under the hood")
   // [1 2 3] concat [4 5 6] => [1 2 3 4 5 6]
   a = a->concat(Array<int>::create({4,5,6}));
   assert(a->size() == 6);
@@ -655,6 +910,180 @@ TEST(ArrayCompare) {
 }
 
 
+TEST(ArrayMismatch) {
+  auto e = Array<int>::empty();
+  auto a = mkvals(ArrayImp::BRANCHES * 40 + 7);
+  std::vector<int> vals(a->begin(), a->end());
+  assert(e->mismatch(e) == END && a->mismatch(a) == END);
+  assert(e->mismatch(a) == 0 && a->mismatch(e) == 0);
+
+  // arrays which share nodes, and arrays which don't
+  auto b = Array<int>::create(vals);
+  assert(a->mismatch(b) == END && a->compare(b) == 0);
+  for (uint32 i : {0u, 5u, 31u, 32u, 700u, a->size() - 8, a->size() - 1}) {
+    auto c = a->set(i, 0);
+    assert(a->mismatch(c) == i && c->mismatch(a) == i);
+    assert(b->mismatch(c) == i);
+    assert(a->compare(c) == 1 && c->compare(a) == -1);
+    assert(a->mismatch(c->set(i, a->get(i))) == END);
+  }
+
+  // prefixes
+  assert(a->mismatch(a->slice(0, 500)) == 500 && a->slice(0, 500)->mismatch(b) == 500);
+  assert(a->compare(a->slice(0, 500)) == 1);
+
+  // slices and relaxed tries
+  auto relaxed = a->slice(0, 103)->concat(a->slice(103));
+  assert(relaxed->mismatch(a) == END && a->mismatch(relaxed) == END);
+  assert(relaxed->set(1000, 0)->mismatch(a) == 1000);
+  assert(relaxed->mismatch(relaxed->set(20, 0)) == 20);
+  assert(a->slice(10)->mismatch(Array<int>::create(
+    std::vector<int>(vals.begin() + 10, vals.end()))) == END);
+  assert(a->slice(10)->mismatch(b->slice(10)) == END);
+  assert(a->slice(10)->mismatch(a->slice(11)) == 0);
+  assert(relaxed->slice(40, 900)->mismatch(a->slice(40, 900)->set(800, 0)) == 800);
+
+  // every position within leaves, with values of different sizes
+  std::vector<int64_t> lvals(200);
+  std::vector<uint8> bvals(200);
+  for (uint32 i = 0; i < 200; ++i) {
+    lvals[i] = int64_t(i) << 40;
+    bvals[i] = uint8(i);
+  }
+  auto l = Array<int64_t>::create(lvals);
+  auto l2 = Array<int64_t>::create(lvals);
+  auto u = Array<uint8>::create(bvals);
+  auto u2 = Array<uint8>::create(bvals);
+  for (uint32 i = 0; i < 200; ++i) {
+    assert(l->mismatch(l2->set(i, -1)) == i);
+    assert(u->mismatch(u2->set(i, 255)) == i);
+  }
+
+  // floating-point values compare by value
+  auto d = Array<double>::create({1.0, 0.0, 2.5});
+  assert(d->mismatch(Array<double>::create({1.0, -0.0, 2.5})) == END);
+  assert(d->mismatch(Array<double>::create({1.0, 0.0, 2.25})) == 2);
+
+  // boxed values
+  auto s = a->map([] (int v) { return std::to_string(v); });
+  auto s2 = Array<std::string>::create(std::vector<std::string>(s->begin(), s->end()));
+  assert(s->mismatch(s2) == END && s->mismatch(s2->set(900, "x")) == 900);
+}
+
+TEST(ArrayDiff) {
+  auto a = mkvals(ArrayImp::BRANCHES * ArrayImp::BRANCHES * 3 + 7);
+  assert(a->diff(a).empty());
+  assert(a->diff(Array<int>::create(std::vector<int>(a->begin(), a->end()))).empty());
+
+  auto b = a->set(5, 0)->set(6, 0)->set(40, 0)->set(2000, 0)->push(1)->push(2);
+  auto d = a->diff(b);
+  assert(d.size() == 4);
+  assert((d[0] == ArrayDiff{ArrayDiff::CHANGED, 5, 7}));
+  assert((d[1] == ArrayDiff{ArrayDiff::CHANGED, 40, 41}));
+  assert((d[2] == ArrayDiff{ArrayDiff::CHANGED, 2000, 2001}));
+  assert((d[3] == ArrayDiff{ArrayDiff::ADDED, a->size(), a->size() + 2}));
+  d = b->diff(a);
+  assert(d.size() == 4 && (d[3] == ArrayDiff{ArrayDiff::REMOVED, a->size(), b->size()}));
+
+  // a value set to the value it had is not a difference
+  assert(a->diff(a->set(100, 0)->set(100, a->get(100))).empty());
+
+  // Only the leaves which differ are compared, also when the trie grows taller and
+  // for relaxed tries. Note: a leaf is compared in several calls when it has changes.
+  auto c = a;
+  for (uint32 i = 0; i < ArrayImp::BRANCHES * ArrayImp::BRANCHES * 30; ++i) {
+    c = c->push(int(i));
+  }
+  c = c->set(1000, 0);
+  auto relaxed = a->slice(0, 103)->concat(a->slice(103));
+  for (auto& p : {std::make_pair(a, c), std::make_pair(relaxed, relaxed->set(1000, 0))}) {
+    uint32 calls = 0;
+    std::vector<std::pair<uint32,uint32>> ranges;
+    ArrayImp::diff(
+      (ArrayImp::A*)p.first.ptr(), (ArrayImp::A*)p.second.ptr(), p.first->size(),
+      [&] (ref<Object>* x, uint32 xi, ref<Object>* y, uint32 yi, uint32 n) {
+        ++calls;
+        uint32 k = 0;
+        while (k < n && ((int*)x)[xi + k] == ((int*)y)[yi + k]) {
+          ++k;
+        }
+        return k;
+      },
+      [&] (uint32 start, uint32 end) { ranges.emplace_back(start, end); });
+    assert(ranges.size() == 1 && ranges[0].first == 1000 && ranges[0].second == 1001);
+    assert(calls <= 8); // for more than 90 leaves
+  }
+
+  // slices, which are compared value by value
+  d = a->rest()->diff(a->slice(1)->set(3, 0));
+  assert(d.size() == 1 && (d[0] == ArrayDiff{ArrayDiff::CHANGED, 3, 4}));
+
+  // boxed values
+  auto s = Array<std::string>::create({"a", "b", "c"});
+  d = s->diff(s->set(1, "x")->pop());
+  assert(d.size() == 2 && (d[0] == ArrayDiff{ArrayDiff::CHANGED, 1, 2}));
+  assert((d[1] == ArrayDiff{ArrayDiff::REMOVED, 2, 3}));
+}
+
+TEST(ArrayHash) {
+  auto e = Array<int>::empty();
+  auto a = mkvals(ArrayImp::BRANCHES * ArrayImp::BRANCHES * 3 + 7);
+  std::vector<int> vals(a->begin(), a->end());
+  auto b = Array<int>::create(vals);
+  assert(e->hash() == Array<int>::create({1})->pop()->hash());
+  assert(a->hash() == b->hash() && a->equals(b) && b->equals(a));
+  assert(a->hash() != e->hash() && !a->equals(e));
+
+  // same values, different tries
+  auto relaxed = a->slice(0, 103)->concat(a->slice(103));
+  assert(relaxed->hash() == a->hash() && relaxed->equals(a));
+  assert(a->slice(10, 2000)->hash() ==
+         Array<int>::create(std::vector<int>(vals.begin() + 10, vals.begin() + 2000))->hash());
+  assert(a->rest()->hash() == a->slice(1)->hash());
+
+  // different values
+  auto c = a->set(1000, 0);
+  assert(c->hash() != a->hash() && !c->equals(a) && !a->equals(c));
+  assert(c->set(1000, a->get(1000))->hash() == a->hash());
+  assert(a->push(1)->hash() != a->hash() && a->pop()->hash() != a->hash());
+  assert(Array<int>::create({1, 2})->hash() != Array<int>::create({2, 1})->hash());
+
+  // hashes of subtrees are reused by new versions
+  auto leafHash = [] (uint32& calls) {
+    return [&calls] (ref<Object>* slots, uint32 start, uint32 n) {
+      ++calls;
+      uint64 h = 0;
+      for (uint32 k = start; k < start + n; ++k) {
+        h = h * ArrayImp::HASH_P + ArrayHashValue(((int*)slots)[k]);
+      }
+      return h;
+    };
+  };
+  uint32 calls = 0;
+  auto d = a->set(2000, 0)->push(5);
+  assert(ArrayImp::hash((ArrayImp::A*)d.ptr(), leafHash(calls)) == d->hash());
+  assert(calls <= 2); // the changed leaf and the tail
+  calls = 0;
+  auto r = relaxed->set(2000, 0);
+  assert(ArrayImp::hash((ArrayImp::A*)r.ptr(), leafHash(calls)) == r->hash());
+  assert(calls <= 2);
+
+  // boxed values
+  auto s = a->map([] (int v) { return std::to_string(v); });
+  auto s2 = Array<std::string>::create(std::vector<std::string>(s->begin(), s->end()));
+  assert(s->hash() == s2->hash() && s->equals(s2) && !s->equals(s2->set(3, "x")));
+
+  // as keys of unordered containers
+  std::unordered_set<ref<Array<int>>, std::hash<ref<Array<int>>>, ArrayEqualTo> set;
+  set.insert(a);
+  set.insert(b);
+  set.insert(relaxed);
+  set.insert(c);
+  assert(set.size() == 2 && set.count(Array<int>::create(vals)) == 1);
+}
+
+#ifndef IMMUTABLE_SINGLE_THREADED // arrays are shared between threads
+
 TEST(ArrayMultiThreaded) {
   uint32 count = ArrayImp::BRANCHES * ArrayImp::BRANCHES;
   auto a = mkvals(count);
@@ -691,3 +1120,608 @@ TEST(ArrayMultiThreaded) {
   t3.join();
   t4.join();
 }
+
+#endif
+
+
+// A trivially-copyable type which is forced to be stored boxed
+struct BoxedInt {
+  int v;
+  BoxedInt(int v) : v(v) {}
+  bool operator<(const BoxedInt& rhs) const { return v < rhs.v; }
+  bool operator>(const BoxedInt& rhs) const { return v > rhs.v; }
+};
+namespace immutable {
+  template <> struct ArrayUnboxed<BoxedInt> : std::false_type {};
+}
+namespace std {
+  template <> struct hash<BoxedInt> {
+    size_t operator()(const BoxedInt& b) const { return hash<int>()(b.v); }
+  };
+}
+
+struct Vec2 { float x, y; };
+
+
+TEST(ArrayUnboxed) {
+  // storage is decided by type
+  static_assert(Array<int>::UNBOXED, "");
+  static_assert(Array<double>::UNBOXED, "");
+  static_assert(Array<Vec2>::UNBOXED, "");
+  static_assert(!Array<std::string>::UNBOXED, "");
+  static_assert(!Array<BoxedInt>::UNBOXED, "");
+
+  uint32 count = ArrayImp::BRANCHES * ArrayImp::BRANCHES + 3;
+
+  // push, get and iteration
+  auto a = Array<double>::empty();
+  for (uint32 i = 0; i < count; ++i) {
+    a = a->push(double(i) + 0.5);
+    assert(a->get(i) == double(i) + 0.5);
+  }
+  { uint32 i = 0;
+    for (auto& v : *a) {
+      assert(v == double(i++) + 0.5);
+    }
+    assert(i == count);
+  }
+
+  // findValue returns a copy
+  assert(a->findValue(count) == nullptr);
+  assert(a->findValue(3)->value == 3.5);
+  assert(a->firstValue()->value == 0.5);
+  assert(a->lastValue()->value == double(count - 1) + 0.5);
+
+  // set does not affect the original
+  auto b = a->set(1, 111.0)->set(count - 1, 222.0);
+  assert(b->get(1) == 111.0 && a->get(1) == 1.5);
+  assert(b->get(count - 1) == 222.0 && a->get(count - 1) == double(count - 1) + 0.5);
+
+  // push(Value<T>*) copies the value
+  b = a->push(new Value<double>(7.0));
+  assert(b->last() == 7.0);
+
+  // pop all the way down and back up again
+  b = a;
+  while (b->size() > ArrayImp::BRANCHES) {
+    b = b->pop();
+    assert(b->last() == double(b->size() - 1) + 0.5);
+  }
+  b = b->pop()->push(1.0)->push(2.0);
+  assert(b->size() == ArrayImp::BRANCHES + 1);
+  assert(b->get(ArrayImp::BRANCHES - 1) == 1.0);
+  assert(b->get(ArrayImp::BRANCHES) == 2.0);
+  assert(b->get(0) == 0.5);
+
+  // transient
+  auto t = Array<Vec2>::empty()->asTransient();
+  for (uint32 i = 0; i < count; ++i) {
+    t->push(Vec2{float(i), float(i) * 2});
+  }
+  t->set(40, Vec2{-1, -2});
+  t->pop();
+  auto c = t->makePersistent();
+  assert(c->size() == count - 1);
+  assert(c->get(40).x == -1 && c->get(40).y == -2);
+  assert(c->get(41).x == 41 && c->get(41).y == 82);
+  assert(c->last().x == float(count - 2));
+
+  // slice, splice, cons and concat
+  auto d = Array<int>::create({1,2,3,4,5});
+  auto e = d->slice(1,4)->cons(0)->concat(d->slice(3));
+  assert(e->size() == 6);
+  int expect[] = {0, 2, 3, 4, 4, 5};
+  for (uint32 i = 0; i < e->size(); ++i) {
+    assert(e->get(i) == expect[i]);
+  }
+  std::vector<int> f({7,8});
+  e = d->splice(1, 4, f.begin(), f.end()); // => [1 7 8 5]
+  assert(e->size() == 4 && e->get(1) == 7 && e->get(2) == 8 && e->get(3) == 5);
+
+  // same operations on the boxed layout
+  auto g = Array<BoxedInt>::empty();
+  for (int i = 0; i < int(count); ++i) {
+    g = g->push(i);
+  }
+  g = g->set(2, 22)->pop();
+  assert(g->size() == count - 1);
+  assert(g->get(2).v == 22 && g->get(3).v == 3);
+  assert(g->compare(g->set(3, 4)) == -1);
+}
+
+
+TEST(ArraySliceModify) {
+  // modifying a slice which references a larger array
+  auto a = mkvals(ArrayImp::BRANCHES + 5)->slice(20);
+  assert(a->size() == 17);
+  auto b = a->push(100)->set(0, 200);
+  assert(b->size() == 18);
+  assert(b->get(0) == 200);
+  assert(b->get(1) == 22);
+  assert(b->last() == 100);
+  b = b->pop()->pop();
+  assert(b->size() == 16);
+  assert(b->last() == ArrayImp::BRANCHES + 4);
+}
+
+
+static int intval(int v) { return v; }
+static int intval(const BoxedInt& v) { return v.v; }
+
+template <typename T>
+static void assertArrayEq(const ref<Array<T>>& a, const std::vector<int>& m) {
+  assert(a->size() == m.size());
+  for (uint32 i = 0; i < m.size(); ++i) {
+    assert(intval(a->get(i)) == m[i]);
+  }
+  uint32 i = 0;
+  for (auto& v : *a) {
+    assert(intval(v) == m[i++]);
+  }
+  assert(i == m.size());
+}
+
+// Returns the ranges which differ between vectors a and b, like Array::diff
+static std::vector<ArrayDiff> naiveDiff(const std::vector<int>& a, const std::vector<int>& b) {
+  std::vector<ArrayDiff> ranges;
+  uint32 n = uint32(min(a.size(), b.size()));
+  for (uint32 i = 0; i < n; ++i) {
+    if (a[i] != b[i]) {
+      if (!ranges.empty() && ranges.back().end == i) {
+        ranges.back().end++;
+      } else {
+        ranges.push_back(ArrayDiff{ArrayDiff::CHANGED, i, i + 1});
+      }
+    }
+  }
+  if (n < b.size()) {
+    ranges.push_back(ArrayDiff{ArrayDiff::ADDED, n, uint32(b.size())});
+  } else if (n < a.size()) {
+    ranges.push_back(ArrayDiff{ArrayDiff::REMOVED, n, uint32(a.size())});
+  }
+  return ranges;
+}
+
+// Applies random concat, splice, slice, cons and modifications to arrays, comparing
+// the results to a std::vector. This exercises the relaxed (size table) branches
+// created by concatenation and slicing, including further modification of those.
+template <typename T>
+static void fuzzRelaxed(uint32 seed, uint32 iterations) {
+  auto rnd = [&seed](uint32 n) {
+    seed = seed * 1103515245 + 12345;
+    return n ? (seed >> 8) % n : 0;
+  };
+  int nextv = 0;
+  auto mk = [&](uint32 size, std::vector<int>& m) {
+    auto t = Array<T>::empty()->asTransient();
+    for (uint32 i = 0; i < size; ++i) {
+      m.push_back(nextv);
+      t->push(T(nextv++));
+    }
+    return t->makePersistent();
+  };
+
+  std::vector<int> m;
+  auto a = mk(rnd(3000), m);
+  std::vector<std::pair<ref<Array<T>>, std::vector<int>>> versions;
+
+  for (uint32 n = 0; n < iterations; ++n) {
+    uint32 size = a->size();
+    uint32 start = rnd(size + 1);
+    uint32 end = start + rnd(size - start + 1);
+    std::vector<int> m2;
+    switch (rnd(9)) {
+      case 0: { // concat
+        auto b = mk(rnd(2) ? rnd(40) : rnd(3000), m2);
+        if (rnd(2)) {
+          a = a->concat(b);
+          m.insert(m.end(), m2.begin(), m2.end());
+        } else {
+          a = b->concat(a);
+          m.insert(m.begin(), m2.begin(), m2.end());
+        }
+        break;
+      }
+      case 1: { // concat with self
+        a = a->concat(a);
+        m2 = m;
+        m.insert(m.end(), m2.begin(), m2.end());
+        break;
+      }
+      case 2: { // splice
+        auto b = mk(rnd(1000), m2);
+        a = a->splice(start, end, b);
+        m.erase(m.begin() + start, m.begin() + end);
+        // Note: splice at the start of an array adds values to the end (see ArraySplice)
+        m.insert(start ? m.begin() + start : m.end(), m2.begin(), m2.end());
+        break;
+      }
+      case 3: { // without
+        a = a->without(start, end);
+        m.erase(m.begin() + start, m.begin() + end);
+        break;
+      }
+      case 4: { // slice
+        a = a->slice(start, end);
+        m = std::vector<int>(m.begin() + start, m.begin() + end);
+        break;
+      }
+      case 5: { // cons
+        for (uint32 i = rnd(40); i > 0; --i) {
+          a = a->cons(T(nextv));
+          m.insert(m.begin(), nextv++);
+        }
+        break;
+      }
+      case 6: { // push, pop and set
+        for (uint32 i = rnd(80); i > 0; --i) {
+          a = a->push(T(nextv));
+          m.push_back(nextv++);
+        }
+        for (uint32 i = rnd(80); i > 0 && a->size(); --i) {
+          a = a->pop();
+          m.pop_back();
+        }
+        for (uint32 i = rnd(20); i > 0 && a->size(); --i) {
+          uint32 k = rnd(a->size());
+          a = a->set(k, T(nextv));
+          m[k] = nextv++;
+        }
+        break;
+      }
+      case 7: { // rest, which produces arrays with start offsets
+        for (uint32 i = rnd(2) ? rnd(80) : rnd(size + 1); i > 0 && a->size(); --i) {
+          a = a->rest();
+          m.erase(m.begin());
+        }
+        if (rnd(4) == 0) {
+          a = a->compact();
+        }
+        break;
+      }
+      case 8: { // transient push, set and pop
+        auto t = a->asTransient();
+        for (uint32 i = rnd(80); i > 0; --i) {
+          t->push(T(nextv));
+          m.push_back(nextv++);
+        }
+        for (uint32 i = rnd(20); i > 0 && t->size(); --i) {
+          uint32 k = rnd(t->size());
+          t->set(k, T(nextv));
+          m[k] = nextv++;
+        }
+        for (uint32 i = rnd(40); i > 0 && t->size(); --i) {
+          t->pop();
+          m.pop_back();
+        }
+        a = t->makePersistent();
+        break;
+      }
+    }
+    assertArrayEq(a, m);
+    if (a->size() > 40000) {
+      a = a->slice(a->size() - 10000);
+      m.erase(m.begin(), m.end() - 10000);
+    }
+    if (n % 10 == 0) {
+      versions.emplace_back(a, m);
+    }
+  }
+
+  // earlier versions are unaffected
+  for (auto& v : versions) {
+    assertArrayEq(v.first, v.second);
+  }
+
+  // differences between versions, which share nodes
+  for (size_t i = 1; i < versions.size(); ++i) {
+    auto& v1 = versions[i - 1];
+    auto& v2 = versions[i];
+    auto expected = naiveDiff(v1.second, v2.second);
+    assert(v1.first->diff(v2.first) == expected);
+    uint32 k = v1.first->mismatch(v2.first);
+    assert(expected.empty() ? k == END : k == expected[0].start);
+    assert(v1.first->equals(v2.first) == expected.empty());
+  }
+
+  // hashes depend on values only, not on how the trie is split
+  for (auto& v : versions) {
+    assert(v.first->hash() == Array<T>::create(v.second)->hash());
+  }
+}
+
+
+TEST(ArrayRelaxed) {
+  // concatenating arrays which are not multiples of BRANCHES in size
+  auto a = mkvals(ArrayImp::BRANCHES * 3 + 7);
+  auto b = mkvals(ArrayImp::BRANCHES * 40 + 1);
+  auto c = a->concat(b)->concat(a);
+  assert(c->size() == a->size() * 2 + b->size());
+  for (uint32 i = 0; i < c->size(); ++i) {
+    uint32 k = i < a->size() ? i :
+               i < a->size() + b->size() ? i - a->size() :
+               i - a->size() - b->size();
+    assert(c->get(i) == int(k + 1));
+  }
+
+  // the remaining operations
+  fuzzRelaxed<int>(1, 400);
+  fuzzRelaxed<BoxedInt>(2, 200);
+}
+
+
+TEST(ArrayMap) {
+  assert(Array<int>::empty()->map([] (int v) { return v; })->size() == 0);
+
+  // strict, relaxed and sliced arrays, mapped between unboxed and boxed values
+  auto a = mkvals(ArrayImp::BRANCHES * 40 + 1);
+  auto relaxed = mkvals(ArrayImp::BRANCHES * 3 + 7)->concat(a)->concat(mkvals(5));
+  auto sliced = a->slice(40);
+  for (auto& src : {a, relaxed, sliced}) {
+    auto s = src->map([] (int v) { return std::to_string(v); });
+    static_assert(std::is_same<decltype(s), ref<Array<std::string>>>::value, "");
+    auto n = s->map([] (const std::string& v) { return BoxedInt(std::stoi(v) * 2); });
+    assert(s->size() == src->size() && n->size() == src->size());
+    for (uint32 i = 0; i < src->size(); ++i) {
+      assert(s->get(i) == std::to_string(src->get(i)));
+      assert(n->get(i).v == src->get(i) * 2);
+    }
+    // the result is a regular array
+    assert(n->push(BoxedInt(-1))->pop()->pop()->size() == src->size() - 1);
+  }
+
+  // in parallel, with enough values for several threads
+  auto big = Array<int>::empty()->modify([] (ref<TransientArray<int>> t) {
+    for (int i = 0; i < 200000; ++i) {
+      t->push(i);
+    }
+  });
+  big = big->concat(mkvals(100))->concat(big);
+  for (uint32 threads : {1, 3, 4, 0}) {
+    auto m = big->parallelMap([] (int v) { return int64_t(v) * 3; }, threads);
+    assert(m->size() == big->size());
+    for (uint32 i = 0; i < big->size(); ++i) {
+      assert(m->get(i) == int64_t(big->get(i)) * 3);
+    }
+  }
+}
+
+
+TEST(ArrayReduce) {
+  auto sum = [] (int64_t acc, int v) { return acc + v; };
+  auto add = [] (int64_t a, int64_t b) { return a + b; };
+  assert(Array<int>::empty()->reduce(int64_t(7), sum) == 7);
+  assert(Array<int>::empty()->parallelReduce(int64_t(0), sum, add, 4) == 0);
+
+  // values are folded in order
+  auto a = mkvals(ArrayImp::BRANCHES * 40 + 1);
+  auto digits = a->slice(0, 12)->reduce(std::string(), [] (std::string acc, int v) {
+    return acc + std::to_string(v % 10);
+  });
+  assert(digits == "123456789012");
+
+  // strict, relaxed and sliced arrays, with enough values for several threads
+  auto big = Array<int>::empty()->modify([] (ref<TransientArray<int>> t) {
+    for (int i = 0; i < 200000; ++i) {
+      t->push(i + 1);
+    }
+  });
+  auto relaxed = big->concat(mkvals(100))->concat(big);
+  auto sliced = relaxed->slice(1000, relaxed->size() - 5);
+  for (auto& src : {a, big, relaxed, sliced}) {
+    int64_t expect = 0;
+    for (int v : *src) {
+      expect += v;
+    }
+    assert(src->reduce(int64_t(0), sum) == expect);
+    for (uint32 threads : {1, 2, 3, 4, 0}) {
+      assert(src->parallelReduce(int64_t(0), sum, add, threads) == expect);
+    }
+    // parts are combined in order
+    auto append = [] (std::vector<int> acc, int v) {
+      acc.push_back(v);
+      return acc;
+    };
+    auto concat = [] (std::vector<int> a, std::vector<int> b) {
+      a.insert(a.end(), b.begin(), b.end());
+      return a;
+    };
+    auto vals = src->parallelReduce(std::vector<int>(), append, concat, 4);
+    assert(vals == std::vector<int>(src->begin(), src->end()));
+  }
+}
+
+
+TEST(ArrayTransientEditTokens) {
+  // transients made on the same thread never modify each other's nodes
+  uint32 count = ArrayImp::BRANCHES * ArrayImp::BRANCHES + 10;
+  auto a = mkvals(count);
+  auto t1 = a->asTransient();
+  t1->set(1, 100);
+  auto b = t1->makePersistent();
+  auto t2 = b->asTransient();
+  t2->set(1, 200)->set(count - 1, 300)->push(400);
+  auto c = t2->makePersistent();
+  assert(a->get(1) == 2);
+  assert(b->get(1) == 100);
+  assert(b->get(count - 1) == int(count));
+  assert(b->size() == count);
+  assert(c->get(1) == 200);
+  assert(c->get(count - 1) == 300);
+  assert(c->get(count) == 400);
+
+  // a transient can be handed off to another thread and finished there
+  auto t = Array<int>::empty()->asTransient();
+  for (uint32 i = 0; i < count; ++i) {
+    t->push(int(i));
+  }
+  std::thread([&] {
+    for (uint32 i = 0; i < count; i += 2) {
+      t->set(i, -int(i));
+    }
+    t->push(-1);
+  }).join();
+  auto d = t->makePersistent();
+  assert(d->size() == count + 1);
+  for (uint32 i = 0; i < count; ++i) {
+    assert(d->get(i) == (i % 2 ? int(i) : -int(i)));
+  }
+  assert(d->get(count) == -1);
+}
+
+
+// Counts live instances
+struct Counted {
+  static int count;
+  int v;
+  Counted(int v) : v(v) { ++count; }
+  Counted(const Counted& c) : v(c.v) { ++count; }
+  ~Counted() { --count; }
+};
+int Counted::count = 0;
+
+
+TEST(ArraySliceRelease) {
+  // values before the start of a slice are released as the start moves forward
+  {
+    auto a = Array<Counted>::empty();
+    for (int i = 0; i < 10000; ++i) {
+      a = a->push(i);
+    }
+    assert(Counted::count == 10000);
+    while (a->size() > 100) {
+      a = a->rest();
+      // at most a leaf's worth of values before the start is retained
+      assert(Counted::count <= int(a->size() + ArrayImp::BRANCHES));
+      assert(a->first().v == int(10000 - a->size()));
+    }
+
+    // pushing and popping at the end of a slice
+    a = a->push(10000)->pop()->pop();
+    assert(a->size() == 99);
+    assert(a->last().v == 9998);
+    while (a->size() > 1) {
+      a = a->pop();
+    }
+    assert(a->first().v == 9900);
+    a = a->push(1)->push(2);
+    assert(a->size() == 3);
+    assert(a->get(2).v == 2);
+    a = a->pop()->pop()->pop();
+    assert(a->size() == 0);
+  }
+  assert(Counted::count == 0);
+
+  // compact releases all values outside of an array
+  {
+    auto a = Array<Counted>::empty();
+    for (int i = 0; i < 1000; ++i) {
+      a = a->push(i);
+    }
+    auto b = a->slice(500);
+    a = nullptr;
+    assert(Counted::count > int(b->size()));
+    b = b->compact();
+    assert(Counted::count == int(b->size()));
+    for (uint32 i = 0; i < b->size(); ++i) {
+      assert(b->get(i).v == int(i + 500));
+    }
+  }
+  assert(Counted::count == 0);
+}
+
+
+// Values with non-atomic reference counts
+struct LocalCounted : Counted {
+  LocalCounted(int v) : Counted(v) {}
+};
+namespace immutable {
+  template <> struct ArrayUnboxed<LocalCounted> : std::false_type {};
+  template <> struct RefCountPolicy<Value<LocalCounted>> { using type = LocalRefCount; };
+}
+
+
+TEST(ArrayLocalRefCount) {
+  static_assert(std::is_same<RefCountPolicy<Value<LocalCounted>>::type, LocalRefCount>::value, "");
+  {
+    auto a = Array<LocalCounted>::create({1, 2, 3});
+    auto v = a->getValue(1);
+    assert(!v->hasSingleRef());
+    auto b = a->set(1, 20);
+    a = nullptr;
+    assert(v->hasSingleRef());
+    assert(v->value.v == 2);
+    assert(b->get(1).v == 20);
+    assert(Counted::count == 4);
+  }
+  assert(Counted::count == 0);
+}
+
+
+TEST(ArrayObjectKinds) {
+  // values of different types held by the same kind of node are each deallocated
+  // by their own type's dealloc function
+  assert(Value<Counted>::kind() != Value<LocalCounted>::kind());
+  {
+    auto a = Array<Counted>::create({1, 2, 3});
+    auto b = Array<LocalCounted>::create({4, 5});
+    ref<Object> obj = a->getValue(0).ptr();
+    a = nullptr;
+    b = nullptr;
+    assert(Counted::count == 1);
+    assert(obj->hasSingleRef());
+  }
+  assert(Counted::count == 0);
+
+  // a copy of a value has its own reference count
+  ref<Value<Counted>> v = new Value<Counted>(1);
+  ref<Value<Counted>> v2 = new Value<Counted>(*v);
+  assert(v->hasSingleRef() && v2->hasSingleRef());
+  assert(v2->value.v == 1);
+  assert(Counted::count == 2);
+}
+
+
+#ifdef IMMUTABLE_BIASED_REFCOUNT
+
+TEST(ArrayBiasedRefCount) {
+  // an array released by another thread than its owner is freed once the owner has
+  // merged its counts
+  {
+    auto a = Array<Counted>::create({1, 2, 3});
+    std::thread([a=std::move(a)] () mutable {
+      a = nullptr;
+    }).join();
+    assert(Counted::count == 3);
+    BiasedRefCount::mergeQueued();
+    assert(Counted::count == 0);
+  }
+
+  // an array released after its owner has exited is freed by the releasing thread
+  {
+    ref<Array<Counted>> a;
+    std::thread([&] {
+      a = Array<Counted>::create({1, 2, 3})->push(4);
+    }).join();
+    assert(a->get(3).v == 4);
+    a = nullptr;
+    assert(Counted::count == 0);
+  }
+
+  // references held by both the owner and other threads
+  {
+    auto a = Array<Counted>::create({1, 2, 3});
+    ref<Array<Counted>> b;
+    std::thread([&] {
+      b = a->set(0, 10);
+      auto c = a;
+      a = nullptr;
+      assert(c->get(0).v == 1);
+    }).join();
+    assert(Counted::count == 4);
+    b = nullptr;
+    assert(Counted::count == 0);
+  }
+}
+
+#endif
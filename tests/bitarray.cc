@@ -0,0 +1,224 @@
+#include "test.h"
+#include <immutable/bitarray.h>
+#include <algorithm>
+#include <vector>
+#include <unordered_set>
+
+using namespace immutable;
+
+TEST(BitArrayBasics) {
+  auto a = BitArray::empty();
+  assert(a->size() == 0);
+  assert(a->begin() == a->end());
+  assert(a->pop() == a);
+  assert(a->set(0, true) == nullptr);
+  assert(a->findFirstSet() == END);
+  assert(a->popcount() == 0);
+
+  // values across several leaves of words, compared to std::vector<bool>
+  std::vector<bool> v;
+  for (uint32 i = 0; i < 5000; ++i) {
+    a = a->push(i % 3 == 0 || i % 7 == 0);
+    v.push_back(i % 3 == 0 || i % 7 == 0);
+  }
+  auto b = a;
+  for (uint32 i = 0; i < 5000; i += 5) {
+    b = b->set(i, !b->get(i));
+  }
+  assert(b->set(1, false) == b);
+  assert(std::vector<bool>(a->begin(), a->end()) == v);
+  for (uint32 i = 0; i < 5000; i += 5) {
+    v[i] = !v[i];
+  }
+  assert(std::vector<bool>(b->begin(), b->end()) == v);
+  assert(a->size() == 5000 && b->size() == 5000);
+  assert(uint32(std::count(v.begin(), v.end(), true)) == b->popcount());
+  assert(b->popcount(70, 4500) == uint32(std::count(v.begin() + 70, v.begin() + 4500, true)));
+  assert(b->first() == v[0] && b->last() == v[4999]);
+  assert(!b->equals(a));
+  assert(b->equals(BitArray::create(v)));
+
+  // slices at bit offsets, and pushing and popping across word boundaries
+  for (uint32 start : {0, 1, 63, 64, 65, 2100}) {
+    auto s = b->slice(start, start + 200);
+    std::vector<bool> sv(v.begin() + start, v.begin() + start + 200);
+    assert(std::vector<bool>(s->begin(), s->end()) == sv);
+    assert(s->popcount() == uint32(std::count(sv.begin(), sv.end(), true)));
+    assert(s->equals(BitArray::create(sv)));
+    for (uint32 i = 0; i < 100; ++i) {
+      s = s->pop();
+      sv.pop_back();
+    }
+    for (uint32 i = 0; i < 150; ++i) {
+      s = s->push(i % 2 == 0);
+      sv.push_back(i % 2 == 0);
+    }
+    assert(std::vector<bool>(s->begin(), s->end()) == sv);
+    assert(std::vector<bool>(s->begin(10, 90), s->end()) ==
+           std::vector<bool>(sv.begin() + 10, sv.begin() + 90));
+    uint32 i = 0;
+    for (auto it = s->begin(); it != s->end(); ++it, ++i) {
+      assert(it.index() == i && *it == sv[i]);
+    }
+  }
+  assert(std::vector<bool>(b->begin(), b->end()) == v);
+  assert(b->slice(10, 5) == nullptr && b->slice(0, 5001) == nullptr);
+  assert(b->slice(5, 5)->size() == 0);
+  assert(b->slice(0) == b);
+
+  // findFirstSet skips whole words of false values
+  auto c = BitArray::create(10000, false)->set(4321, true)->set(9999, true);
+  assert(c->findFirstSet() == 4321);
+  assert(c->findFirstSet(4321) == 4321);
+  assert(c->findFirstSet(4322) == 9999);
+  assert(c->slice(4322, 9999)->findFirstSet() == END);
+  assert(c->slice(100)->findFirstSet() == 4221);
+  assert(c->popcount() == 2);
+  assert(BitArray::create(130, true)->popcount(1, 129) == 128);
+  assert(BitArray::create({true, false, true})->pop()->push(false)->popcount() == 1);
+
+  // transients
+  auto t = b->slice(3)->asTransient();
+  std::vector<bool> tv(v.begin() + 3, v.end());
+  for (uint32 i = 0; i < 3000; ++i) {
+    t->push(i % 5 == 0);
+    tv.push_back(i % 5 == 0);
+    if (i % 4 == 0) {
+      t->set(i, true);
+      tv[i] = true;
+    }
+    if (i % 9 == 0) {
+      t->pop();
+      tv.pop_back();
+    }
+  }
+  assert(t->size() == tv.size() && t->get(100) == tv[100]);
+  auto d = t->makePersistent();
+  assert(t->makePersistent() == nullptr);
+  assert(t->push(true) == nullptr);
+  assert(std::vector<bool>(d->begin(), d->end()) == tv);
+  assert(std::vector<bool>(b->begin(), b->end()) == v);
+  auto e = d->modify([] (ref<TransientBitArray> t) {
+    t->set(0, true)->set(1, false);
+  });
+  assert(e->get(0) && !e->get(1) && e->size() == d->size());
+}
+
+
+TEST(BitArrayOperations) {
+  std::vector<bool> v;
+  for (uint32 i = 0; i < 3000; ++i) {
+    v.push_back(i % 3 == 0 || i % 11 == 0);
+  }
+  auto a = BitArray::create(v);
+  auto values = [] (const ref<BitArray>& a) {
+    return std::vector<bool>(a->begin(), a->end());
+  };
+
+  // concat, cons, splice and without at all combinations of bit offsets, where
+  // offsets which line up share words and others are shifted
+  for (uint32 start : {0, 1, 63, 64, 100}) {
+    for (uint32 len : {0, 1, 63, 64, 65, 700}) {
+      auto x = a->slice(start, start + len);
+      std::vector<bool> xv(v.begin() + start, v.begin() + start + len);
+      for (uint32 start2 : {0, 5, 64, 1000}) {
+        auto y = a->slice(start2, start2 + 300);
+        std::vector<bool> yv(v.begin() + start2, v.begin() + start2 + 300);
+        std::vector<bool> xyv = xv;
+        xyv.insert(xyv.end(), yv.begin(), yv.end());
+        assert(values(x->concat(y)) == xyv);
+        assert(x->concat(y)->equals(BitArray::create(xyv)));
+        assert(values(y->concat(x)->slice(300)) == xv);
+      }
+      auto c = x->cons(true)->cons(false);
+      std::vector<bool> cv = xv;
+      cv.insert(cv.begin(), {false, true});
+      assert(values(c) == cv);
+      assert(values(c->push(true)->rest()->rest()) == values(x->push(true)));
+      if (len >= 10) {
+        std::vector<bool> sv = xv;
+        sv.erase(sv.begin() + 3, sv.begin() + 10);
+        assert(values(x->without(3, 10)) == sv);
+        sv.insert(sv.begin() + 3, {true, true});
+        assert(values(x->splice(3, 10, BitArray::create({true, true}))) == sv);
+        assert(values(x->without(5)) == std::vector<bool>(xv.begin(), xv.begin() + 5));
+      }
+    }
+  }
+  // splice and without give the same values as for Array<bool>, for all ranges
+  auto bools = Array<bool>::create({true, true, true, false, false});
+  auto bits = BitArray::create(*bools);
+  auto ins = BitArray::create({false, true});
+  auto bins = Array<bool>::create({false, true});
+  std::vector<bool> insv = {false, true};
+  for (uint32 start = 0; start <= 5; ++start) {
+    for (uint32 end = start; end <= 5; ++end) {
+      auto x = bools->splice(start, end, bins);
+      std::vector<bool> xv(x->begin(), x->end());
+      assert(values(bits->splice(start, end, ins)) == xv);
+      assert(values(bits->splice(start, end, insv.begin(), insv.end())) == xv);
+      auto y = bools->without(start, end);
+      assert(values(bits->without(start, end)) == std::vector<bool>(y->begin(), y->end()));
+    }
+  }
+  assert(values(bits->splice(0, 3, ins)) == std::vector<bool>({false, false, false, true}));
+  assert(a->without(5, 5) == a);
+  assert(a->without(6, 5) == nullptr && a->without(0, 3001) == nullptr);
+  assert(a->splice(0, 3001, a) == nullptr);
+  assert(a->concat(BitArray::empty()) == a);
+  assert(BitArray::empty()->concat(a) == a);
+  std::vector<bool> pv = {true, false, true};
+  assert(values(a->slice(0, 2)->push(pv.begin(), pv.end())) ==
+         std::vector<bool>({v[0], v[1], true, false, true}));
+
+  // compare, mismatch, hash and equals
+  auto b = a->set(2000, !v[2000]);
+  assert(a->mismatch(b) == 2000);
+  assert(a->mismatch(a->slice(0, 100)) == 100);
+  assert(a->mismatch(a->slice(1)->cons(v[0])) == END);
+  assert(a->compare(b) == (v[2000] ? 1 : -1));
+  assert(b->compare(a) == -a->compare(b));
+  assert(a->compare(a->pop()) == 1 && a->pop()->compare(a) == -1);
+  assert(a->compare(a->slice(1)->cons(v[0])) == 0);
+  assert(a->hash() == a->slice(1)->cons(v[0])->hash());
+  assert(a->hash() != b->hash());
+  assert(BitArray::create(3, false)->hash() != BitArray::create(4, false)->hash());
+  assert(!a->equals(b) && a->equals(b->set(2000, v[2000])));
+  std::unordered_set<ref<BitArray>, std::hash<ref<BitArray>>, ArrayEqualTo> set;
+  set.insert(a);
+  set.insert(a->slice(0, 100));
+  assert(set.count(a->slice(1)->cons(v[0])) == 1 && set.count(b) == 0);
+
+  // reduce
+  assert(a->reduce(uint32(0), [] (uint32 n, bool v) { return n + v; }) == a->popcount());
+
+  // reverse iteration
+  std::vector<bool> rv(v.rbegin(), v.rend());
+  assert(std::vector<bool>(a->rbegin(), a->rend()) == rv);
+  assert(std::vector<bool>(a->rbegin(70, 200), a->rend()) ==
+         std::vector<bool>(v.rbegin() + 2800, v.rbegin() + 2930));
+  assert(a->rbegin(5, 5) == a->rend());
+  auto r = a->rbegin();
+  assert(r.index() == 2999);
+  ++r;
+  --r;
+  assert(r.index() == 2999 && *r == v[2999]);
+
+  // random-access iteration
+  auto it = a->begin();
+  assert(a->end() - it == 3000 && it - a->end() == -3000);
+  assert(a->begin(10, 20) + 10 == a->end() && a->end() - a->begin(10, 20) == 10);
+  assert(a->find(3000) == a->end() && *a->find(42) == v[42]);
+  for (uint32 i : {1000, 64, 63, 2999, 0, 1300}) {
+    auto j = it + i;
+    assert(j.index() == i && *j == v[i] && it[i] == v[i] && j - it == int32(i));
+    --j;
+    assert(i == 0 || (*j == v[i - 1] && j.index() == i - 1));
+  }
+  auto e = a->begin() + 3000;
+  assert(e == a->end() && !e.valid());
+  e -= 65;
+  assert(*e == v[2935] && *--e == v[2934] && e > it && it < e);
+  auto sorted = BitArray::create(100, false)->concat(BitArray::create(50, true));
+  assert(std::lower_bound(sorted->begin(), sorted->end(), true).index() == 100);
+}
@@ -0,0 +1,220 @@
+#include "test.h"
+#include <immutable/bitmap.h>
+#include <set>
+#include <vector>
+
+using namespace immutable;
+
+static void assertBitmapEq(const ref<Bitmap>& b, const std::set<uint32>& s) {
+  assert(b->cardinality() == s.size());
+  std::vector<uint32> values(b->begin(), b->end());
+  assert(values == std::vector<uint32>(s.begin(), s.end()));
+  for (auto v : s) {
+    assert(b->contains(v));
+  }
+}
+
+
+TEST(BitmapBasics) {
+  auto a = Bitmap::empty();
+  assert(a->cardinality() == 0);
+  assert(a->begin() == a->end());
+  assert(!a->contains(0));
+  assert(a->remove(1) == a);
+
+  auto b = a->add(5)->add(70000)->add(3)->add(0xffffffff);
+  assertBitmapEq(b, {3, 5, 70000, 0xffffffff});
+  assert(b->add(5) == b);
+  assert(b->remove(4) == b);
+  assert(b->remove(70001) == b);
+  assertBitmapEq(b->remove(70000), {3, 5, 0xffffffff});
+  assertBitmapEq(b->remove(3)->remove(5), {70000, 0xffffffff});
+  assert(a->cardinality() == 0);
+
+  auto c = Bitmap::create({9, 1, 4, 1});
+  assertBitmapEq(c, {1, 4, 9});
+
+  // an array container turns into a bitset as it grows, and back as it shrinks
+  std::set<uint32> s;
+  auto d = Bitmap::empty();
+  for (uint32 v = 0; v < 20000; v += 3) {
+    d = d->add(v);
+    s.insert(v);
+  }
+  assertBitmapEq(d, s);
+  for (uint32 v = 0; v < 20000; v += 6) {
+    d = d->remove(v);
+    s.erase(v);
+  }
+  assertBitmapEq(d, s);
+
+  // ranges
+  auto e = Bitmap::create({1, 200000})->addRange(10, 140000);
+  assert(e->cardinality() == 140000 - 10 + 2);
+  assert(e->contains(1) && !e->contains(9) && e->contains(10));
+  assert(e->contains(139999) && !e->contains(140000) && e->contains(200000));
+  uint32 n = 0;
+  for (auto v : *e) {
+    assert(v == (n == 0 ? 1 : n == e->cardinality() - 1 ? 200000 : n + 9));
+    ++n;
+  }
+  assert(n == e->cardinality());
+  auto f = e->remove(70000)->add(140000)->remove(10);
+  assert(f->cardinality() == e->cardinality() - 1);
+  assert(!f->contains(70000) && f->contains(140000) && !f->contains(10));
+  assert(Bitmap::empty()->addRange(0, 0x100000000)->cardinality() == 0x100000000);
+  assert(e->addRange(5, 5) == e);
+}
+
+
+TEST(BitmapOperations) {
+  auto a = Bitmap::create({1, 2, 3, 100000, 200000});
+  auto b = Bitmap::create({2, 3, 4, 200000, 300000});
+  assertBitmapEq(a->unite(b), {1, 2, 3, 4, 100000, 200000, 300000});
+  assertBitmapEq(a->intersect(b), {2, 3, 200000});
+  assertBitmapEq(a->subtract(b), {1, 100000});
+  assertBitmapEq(b->subtract(a), {4, 300000});
+  assert(a->intersectCardinality(b) == 3);
+
+  // results which are the same as one of the operands
+  auto c = a->add(5);
+  assert(a->unite(a) == a);
+  assert(a->unite(Bitmap::empty()) == a);
+  assert(Bitmap::empty()->unite(a) == a);
+  assert(c->unite(a) == c);
+  assert(a->unite(c) == c);
+  assert(a->intersect(c) == a);
+  assert(a->subtract(b->subtract(a)) == a);
+  assert(a->subtract(a)->cardinality() == 0);
+  assert(a->intersect(Bitmap::empty())->cardinality() == 0);
+
+  // bitsets with bitsets, arrays and runs
+  auto evens = Bitmap::empty()->modify([](ref<TransientBitmap> t) {
+    for (uint32 v = 0; v < 300000; v += 2) {
+      t->add(v);
+    }
+  });
+  auto thirds = Bitmap::empty()->modify([](ref<TransientBitmap> t) {
+    for (uint32 v = 0; v < 300000; v += 3) {
+      t->add(v);
+    }
+  });
+  auto sparse = Bitmap::create({1, 2, 3, 4, 65536 * 2 + 7, 65536 * 3 + 6});
+  auto range = Bitmap::empty()->addRange(1000, 150000);
+  std::vector<ref<Bitmap>> bitmaps = {evens, thirds, sparse, range, range->runOptimize()};
+  for (auto& x : bitmaps) {
+    for (auto& y : bitmaps) {
+      std::set<uint32> sx(x->begin(), x->end()), sy(y->begin(), y->end());
+      std::set<uint32> su = sx, si, sd;
+      su.insert(sy.begin(), sy.end());
+      for (auto v : sx) {
+        (sy.count(v) ? si : sd).insert(v);
+      }
+      assertBitmapEq(x->unite(y), su);
+      assertBitmapEq(x->intersect(y), si);
+      assertBitmapEq(x->subtract(y), sd);
+      assert(x->intersectCardinality(y) == si.size());
+    }
+  }
+}
+
+
+TEST(BitmapTransient) {
+  auto a = Bitmap::create({7});
+  auto t = a->asTransient();
+  std::set<uint32> s = {7};
+  for (uint32 i = 0; i < 100000; ++i) {
+    uint32 v = (i * 2654435761u) % 500000;
+    if (i % 4 == 3) {
+      t->remove(v);
+      s.erase(v);
+    } else {
+      t->add(v);
+      s.insert(v);
+    }
+  }
+  assert(t->cardinality() == s.size());
+  assert(t->contains(*s.begin()));
+  auto b = t->makePersistent();
+  assert(t->makePersistent() == nullptr);
+  assert(t->add(1) == nullptr);
+  assertBitmapEq(b, s);
+  assertBitmapEq(a, {7});
+
+  auto c = b->modify([](ref<TransientBitmap> t) {
+    t->add(1)->remove(7);
+  });
+  assertBitmapEq(b, s);
+  s.insert(1);
+  s.erase(7);
+  assertBitmapEq(c, s);
+}
+
+
+// Applies random changes to bitmaps and compares them to std::set
+TEST(BitmapFuzz) {
+  uint32 seed = 1;
+  auto rnd = [&seed](uint32 n) {
+    seed = seed * 1103515245 + 12345;
+    return n ? (seed >> 8) % n : 0;
+  };
+  // values are clustered in a few containers, so that they become dense
+  auto rndval = [&]() {
+    return rnd(4) * 65536 + (rnd(2) ? rnd(65536) : rnd(100));
+  };
+
+  for (uint32 round = 0; round < 10; ++round) {
+    auto b = Bitmap::empty();
+    std::set<uint32> s;
+    for (uint32 i = 0; i < 3000; ++i) {
+      switch (rnd(8)) {
+        case 0: case 1: case 2: {
+          uint32 v = rndval();
+          b = b->add(v);
+          s.insert(v);
+          break;
+        }
+        case 3: case 4: {
+          uint32 v = rnd(2) && !s.empty() ? *s.lower_bound(rndval() % (*s.rbegin() + 1)) : rndval();
+          b = b->remove(v);
+          s.erase(v);
+          break;
+        }
+        case 5: {
+          uint32 start = rndval();
+          uint32 end = start + rnd(rnd(4) ? 300 : 100000);
+          b = b->addRange(start, end);
+          for (uint32 v = start; v < end; ++v) {
+            s.insert(v);
+          }
+          break;
+        }
+        case 6: {
+          uint32 start = rndval();
+          auto r = Bitmap::empty()->addRange(start, start + rnd(5000));
+          b = b->subtract(r);
+          s.erase(s.lower_bound(start), s.lower_bound(start + uint32(r->cardinality())));
+          break;
+        }
+        case 7: {
+          // changes to runs containers, in place where a transient made them
+          b = b->runOptimize()->modify([&](ref<TransientBitmap> t) {
+            for (uint32 k = 0; k < 20; ++k) {
+              uint32 v = rndval();
+              if (rnd(2)) {
+                t->add(v);
+                s.insert(v);
+              } else {
+                t->remove(v);
+                s.erase(v);
+              }
+            }
+          });
+          break;
+        }
+      }
+      assert(b->cardinality() == s.size());
+    }
+    assertBitmapEq(b, s);
+  }
+}
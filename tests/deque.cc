@@ -0,0 +1,115 @@
+#include "test.h"
+#include <immutable/deque.h>
+#include <deque>
+#include <string>
+
+using namespace immutable;
+
+template <typename T>
+static void assertDequeEq(const ref<Deque<T>>& d, const std::deque<int>& m) {
+  assert(d->size() == m.size());
+  for (uint32 i = 0; i < m.size(); ++i) {
+    assert(d->get(i) == T(m[i]));
+  }
+  uint32 i = 0;
+  for (auto& v : *d) {
+    assert(v == T(m[i++]));
+  }
+  assert(i == m.size());
+  auto a = d->toArray();
+  assert(a->size() == m.size());
+  for (uint32 i = 0; i < m.size(); ++i) {
+    assert(a->get(i) == T(m[i]));
+  }
+}
+
+
+TEST(DequeBasics) {
+  auto d = Deque<int>::empty();
+  assert(d->size() == 0);
+  assert(d->rest()->size() == 0);
+  assert(d->pop()->size() == 0);
+
+  // [] cons(2) cons(1) push(3) => [1 2 3]
+  d = d->cons(2)->cons(1)->push(3);
+  assertDequeEq(d, {1, 2, 3});
+  assert(d->first() == 1);
+  assert(d->last() == 3);
+
+  // values added with cons can be removed with pop and vice versa
+  assertDequeEq(d->pop()->pop(), {1});
+  assertDequeEq(d->rest()->rest(), {3});
+  assertDequeEq(d->pop()->pop()->pop(), {});
+  assertDequeEq(d->rest()->rest()->rest(), {});
+
+  // set on either side
+  assertDequeEq(d->set(0, 10)->set(2, 30), {10, 2, 30});
+  assert(d->set(3, 1) == nullptr);
+  assert(d->getValue(1)->value == 2);
+
+  // from array
+  d = Deque<int>::create(Array<int>::create({1, 2, 3, 4}));
+  assertDequeEq(d->rest()->cons(0), {0, 2, 3, 4});
+  assertDequeEq(Deque<int>::create({5, 6}), {5, 6});
+}
+
+
+TEST(DequeQueue) {
+  // using a deque as a FIFO queue and as a LIFO stack at both ends
+  std::deque<int> m;
+  auto d = Deque<std::string>::empty();
+  int v = 0;
+  for (int round = 0; round < 40; ++round) {
+    for (int i = round * 7 % 100; i > 0; --i) {
+      if (round % 3) {
+        d = d->push(std::to_string(v));
+        m.push_back(v++);
+      } else {
+        d = d->cons(std::to_string(v));
+        m.push_front(v++);
+      }
+    }
+    for (int i = round * 5 % 90; i > 0 && m.size(); --i) {
+      if (round % 2) {
+        d = d->rest();
+        m.pop_front();
+      } else {
+        d = d->pop();
+        m.pop_back();
+      }
+    }
+    assert(d->size() == m.size());
+    for (uint32 i = 0; i < m.size(); ++i) {
+      assert(d->get(i) == std::to_string(m[i]));
+    }
+  }
+  // drain from the front
+  while (m.size()) {
+    assert(d->first() == std::to_string(m.front()));
+    d = d->rest();
+    m.pop_front();
+  }
+  assert(d->size() == 0);
+}
+
+
+TEST(DequeIterate) {
+  // values added with cons fill several leaves of the front buffer
+  std::deque<int> m;
+  auto d = Deque<int>::empty();
+  for (int i = 0; i < 3000; ++i) {
+    d = d->cons(i);
+    m.push_front(i);
+    if (i % 5 == 0) {
+      d = d->push(-i);
+      m.push_back(-i);
+    }
+  }
+  assertDequeEq(d, m);
+  for (int i = 0; i < 1500; ++i) {
+    d = d->rest();
+    m.pop_front();
+  }
+  assertDequeEq(d, m);
+  assertDequeEq(d->set(10, 7), [&] { auto c = m; c[10] = 7; return c; }());
+}
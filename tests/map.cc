@@ -0,0 +1,211 @@
+#include "test.h"
+#include <immutable/map.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace immutable;
+
+// Key with a poor hash function, so that many keys have the same hash and end up in
+// collision nodes
+struct CollidingKey {
+  int v;
+  bool operator==(const CollidingKey& rhs) const { return v == rhs.v; }
+};
+namespace std {
+  template <> struct hash<CollidingKey> {
+    size_t operator()(const CollidingKey& k) const { return size_t(k.v % 7); }
+  };
+}
+
+static int keyOf(int k) { return k; }
+static int keyOf(const CollidingKey& k) { return k.v; }
+
+template <typename V> static V valueOf(int v);
+template <> int valueOf<int>(int v) { return v; }
+template <> std::string valueOf<std::string>(int v) { return std::to_string(v); }
+
+template <typename K, typename V>
+static void assertMapEq(const ref<Map<K,V>>& a, const std::unordered_map<int,int>& m) {
+  assert(a->size() == m.size());
+  for (auto& e : m) {
+    assert(a->contains(K{e.first}));
+    assert(a->get(K{e.first}) == valueOf<V>(e.second));
+  }
+  uint32 n = 0;
+  for (auto& e : *a) {
+    ++n;
+    assert(m.find(keyOf(e.first)) != m.end());
+  }
+  assert(n == m.size());
+}
+
+
+TEST(MapBasics) {
+  auto a = Map<int,std::string>::empty();
+  assert(a->size() == 0);
+  assert(a->find(1) == nullptr);
+  assert(a->begin() == a->end());
+  assert(a->remove(1) == a);
+
+  auto b = a->set(1, "one")->set(2, "two")->set(3, "three");
+  assert(b->size() == 3);
+  assert(b->get(1) == "one");
+  assert(*b->find(2) == "two");
+  assert(b->contains(3));
+  assert(!b->contains(4));
+
+  // set replaces the value of an existing key
+  auto c = b->set(2, "zwei");
+  assert(c->size() == 3);
+  assert(c->get(2) == "zwei");
+  assert(b->get(2) == "two");
+
+  // remove
+  auto d = c->remove(1);
+  assert(d->size() == 2);
+  assert(!d->contains(1));
+  assert(c->contains(1));
+  assert(d->remove(1) == d);
+  assert(d->remove(2)->remove(3)->size() == 0);
+
+  auto e = Map<int,int>::create({{1, 10}, {2, 20}, {1, 11}});
+  assert(e->size() == 2);
+  assert(e->get(1) == 11);
+  uint32 n = 0;
+  for (auto& entry : *e) {
+    assert(entry.second == entry.first * 10 + (entry.first == 1));
+    ++n;
+  }
+  assert(n == 2);
+}
+
+
+TEST(MapTransient) {
+  auto a = Map<int,int>::create({{1, 1}, {2, 2}});
+  auto t = a->asTransient();
+  for (int i = 0; i < 1000; ++i) {
+    t->set(i, i * 2);
+  }
+  t->remove(0)->remove(-1);
+  assert(t->size() == 999);
+  assert(t->get(2) == 4);
+  assert(!t->contains(0));
+
+  auto b = t->makePersistent();
+  assert(b != nullptr);
+  assert(t->makePersistent() == nullptr);
+  assert(t->set(1, 1) == nullptr);
+  assert(t->remove(1) == nullptr);
+
+  // the original is unchanged
+  assert(a->size() == 2);
+  assert(a->get(2) == 2);
+  assert(b->size() == 999);
+  for (int i = 1; i < 1000; ++i) {
+    assert(b->get(i) == i * 2);
+  }
+
+  // a second transient never modifies the nodes of the first one's map
+  auto c = b->modify([](ref<TransientMap<int,int>> t) {
+    for (int i = 0; i < 1000; i += 2) {
+      t->set(i, -i);
+    }
+    for (int i = 1; i < 1000; i += 4) {
+      t->remove(i);
+    }
+  });
+  for (int i = 1; i < 1000; ++i) {
+    assert(b->get(i) == i * 2);
+    assert(c->contains(i) == (i % 4 != 1));
+    if (i % 2 == 0) {
+      assert(c->get(i) == -i);
+    }
+  }
+}
+
+
+// Applies random set and remove operations to maps, persistent and transient, comparing
+// the results to a std::unordered_map. Old versions are kept and checked at the end.
+template <typename K, typename V>
+static void fuzzMap(uint32 seed, uint32 iterations, int keyrange) {
+  auto rnd = [&seed](uint32 n) {
+    seed = seed * 1103515245 + 12345;
+    return n ? (seed >> 8) % n : 0;
+  };
+  std::unordered_map<int,int> m;
+  auto a = Map<K,V>::empty();
+  std::vector<std::pair<ref<Map<K,V>>, std::unordered_map<int,int>>> versions;
+
+  for (uint32 n = 0; n < iterations; ++n) {
+    if (rnd(4) == 0) {
+      auto t = a->asTransient();
+      for (uint32 i = rnd(200); i > 0; --i) {
+        int k = int(rnd(keyrange));
+        if (rnd(3) == 0) {
+          t->remove(K{k});
+          m.erase(k);
+        } else {
+          t->set(K{k}, valueOf<V>(int(n)));
+          m[k] = int(n);
+        }
+        assert(t->size() == m.size());
+      }
+      a = t->makePersistent();
+    } else {
+      int k = int(rnd(keyrange));
+      if (rnd(2) == 0) {
+        a = a->remove(K{k});
+        m.erase(k);
+      } else {
+        a = a->set(K{k}, valueOf<V>(int(n)));
+        m[k] = int(n);
+      }
+    }
+    assertMapEq(a, m);
+    if (rnd(8) == 0) {
+      versions.emplace_back(a, m);
+    }
+  }
+  for (auto& v : versions) {
+    assertMapEq(v.first, v.second);
+  }
+
+  // removing all entries in any order leaves an empty map
+  auto keys = std::vector<K>();
+  for (auto& e : *a) {
+    keys.push_back(e.first);
+  }
+  while (keys.size()) {
+    uint32 i = rnd(uint32(keys.size()));
+    a = a->remove(keys[i]);
+    keys.erase(keys.begin() + i);
+    assert(a->size() == keys.size());
+  }
+  assert(a->begin() == a->end());
+}
+
+TEST(MapFuzz) {
+  fuzzMap<int,int>(1, 2000, 3000);
+  fuzzMap<int,std::string>(2, 1000, 300);
+}
+
+TEST(MapCollisions) {
+  // all keys share one of 7 hashes
+  fuzzMap<CollidingKey,int>(3, 1000, 200);
+
+  auto a = Map<CollidingKey,int>::empty();
+  for (int i = 0; i < 100; ++i) {
+    a = a->set(CollidingKey{i}, i);
+  }
+  for (int i = 0; i < 100; ++i) {
+    assert(a->get(CollidingKey{i}) == i);
+  }
+  assert(!a->contains(CollidingKey{100}));
+  for (int i = 0; i < 100; i += 7) {
+    a = a->remove(CollidingKey{i});
+  }
+  assert(a->size() == 100 - 15);
+  assert(!a->contains(CollidingKey{7}));
+  assert(a->get(CollidingKey{8}) == 8);
+}
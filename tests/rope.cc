@@ -0,0 +1,165 @@
+#include "test.h"
+#include <immutable/rope.h>
+#include <string>
+
+using namespace immutable;
+
+static void assertRopeEq(const ref<Rope>& r, const std::string& s) {
+  assert(r->size() == s.size());
+  assert(r->str() == s);
+  std::string chunks;
+  for (auto& c : r->chunks()) {
+    assert(c.size() > 0);
+    chunks.append(c.data(), c.size());
+  }
+  assert(chunks == s);
+}
+
+// "0123456789012..." of n bytes starting at digit first
+static std::string digits(uint32 n, uint32 first=0) {
+  std::string s(n, ' ');
+  for (uint32 i = 0; i < n; ++i) {
+    s[i] = char('0' + (first + i) % 10);
+  }
+  return s;
+}
+
+
+TEST(RopeBasics) {
+  auto a = Rope::empty();
+  assert(a->size() == 0);
+  assert(a->str() == "");
+  assert(a->chunks().begin() == a->chunks().end());
+  assert(a->insert(1, "x") == nullptr);
+  assert(a->erase(0) == a);
+
+  auto b = Rope::create("hello world");
+  assertRopeEq(b, "hello world");
+  assert(b->get(4) == 'o');
+  assertRopeEq(b->insert(5, ","), "hello, world");
+  assertRopeEq(b->insert(0, ">> ")->append("!"), ">> hello world!");
+  assertRopeEq(b->erase(5, 6), "hello");
+  assertRopeEq(b->erase(5), "hello");
+  assertRopeEq(b->substr(6), "world");
+  assertRopeEq(b->substr(6, 100), "world");
+  assertRopeEq(b->concat(b->substr(5)), "hello world world");
+  assert(b->str(3, 5) == "lo wo");
+  assert(b->substr(12) == nullptr);
+  assert(b->erase(12) == nullptr);
+  assert(b->substr(0) == b);
+  assert(b->insert(3, "") == b);
+  assertRopeEq(b, "hello world");
+
+  // many leaves
+  auto s = digits(100000);
+  auto c = Rope::create(s);
+  assertRopeEq(c, s);
+  assert(c->get(54321) == '1');
+  uint32 nchunks = 0;
+  std::string part;
+  c->forEachChunk([&](const RopeChunk& chunk) {
+    part += chunk.str();
+    ++nchunks;
+  }, 40000, 10000);
+  assert(nchunks > 1);
+  assert(part == s.substr(40000, 10000));
+  assert(c->str(40000, 10000) == s.substr(40000, 10000));
+
+  auto d = c->insert(50000, b)->erase(10, 20000);
+  auto ds = s.substr(0, 50000) + "hello world" + s.substr(50000);
+  ds.erase(10, 20000);
+  assertRopeEq(d, ds);
+  assertRopeEq(c, s);
+  assertRopeEq(d->substr(29000, 2000), ds.substr(29000, 2000));
+  assertRopeEq(c->concat(c), s + s);
+  assertRopeEq(c->erase(0, 99990), digits(10));
+}
+
+
+TEST(RopeTransient) {
+  auto a = Rope::create("abc");
+  auto t = a->asTransient();
+  std::string s = "abc";
+  for (uint32 i = 0; i < 20000; ++i) {
+    uint32 pos = (i * 7919) % (uint32(s.size()) + 1);
+    t->insert(pos, digits(i % 5 + 1, i));
+    s.insert(pos, digits(i % 5 + 1, i));
+    if (i % 3 == 0) {
+      t->erase(pos / 2, 4);
+      s.erase(pos / 2, 4);
+    }
+  }
+  t->append(std::string(5000, 'x'));
+  s += std::string(5000, 'x');
+  assert(t->size() == s.size());
+  assert(t->get(100) == s[100]);
+  auto b = t->makePersistent();
+  assert(t->makePersistent() == nullptr);
+  assert(t->insert(0, "x") == nullptr);
+  assertRopeEq(b, s);
+  assertRopeEq(a, "abc");
+
+  auto c = b->modify([](ref<TransientRope> t) {
+    t->erase(0, 1000)->append("end");
+  });
+  assertRopeEq(c, s.substr(1000) + "end");
+  assertRopeEq(b, s);
+}
+
+
+// Applies random edits to ropes and compares them to std::string
+TEST(RopeFuzz) {
+  uint32 seed = 1;
+  auto rnd = [&seed](uint32 n) {
+    seed = seed * 1103515245 + 12345;
+    return n ? (seed >> 8) % n : 0;
+  };
+  // lengths are mostly small, sometimes spanning several leaves
+  auto rndlen = [&]() {
+    return rnd(8) == 0 ? rnd(20000) : rnd(50);
+  };
+
+  for (uint32 round = 0; round < 20; ++round) {
+    auto r = Rope::empty();
+    std::string s;
+    for (uint32 i = 0; i < 500; ++i) {
+      uint32 pos = rnd(uint32(s.size()) + 1);
+      uint32 len = rndlen();
+      switch (rnd(5)) {
+        case 0: case 1: {
+          auto bytes = digits(len, i);
+          r = r->insert(pos, bytes);
+          s.insert(pos, bytes);
+          break;
+        }
+        case 2:
+          r = r->erase(pos, len);
+          s.erase(pos, len);
+          break;
+        case 3: {
+          // move a range to another position
+          auto part = r->substr(pos, len);
+          auto rest = r->erase(pos, len);
+          auto spart = s.substr(pos, len);
+          s.erase(pos, len);
+          uint32 to = rnd(uint32(s.size()) + 1);
+          r = rest->insert(to, part);
+          s.insert(to, spart);
+          break;
+        }
+        case 4: {
+          auto tail = r->substr(pos);
+          r = r->substr(0, pos)->concat(Rope::create(digits(len)))->concat(tail);
+          s = s.substr(0, pos) + digits(len) + s.substr(pos);
+          break;
+        }
+      }
+      assert(r->size() == s.size());
+    }
+    assertRopeEq(r, s);
+    for (uint32 i = 0; i < 20 && s.size() > 0; ++i) {
+      uint32 pos = rnd(uint32(s.size()));
+      assert(r->get(pos) == s[pos]);
+    }
+  }
+}
@@ -0,0 +1,174 @@
+#include "test.h"
+#include <immutable/set.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+using namespace immutable;
+
+// Value with a poor hash function, so that many values end up in collision nodes
+struct CollidingValue {
+  int v;
+  bool operator==(const CollidingValue& rhs) const { return v == rhs.v; }
+};
+namespace std {
+  template <> struct hash<CollidingValue> {
+    size_t operator()(const CollidingValue& k) const { return size_t(k.v % 5); }
+  };
+}
+
+static int intOf(int v) { return v; }
+static int intOf(const CollidingValue& v) { return v.v; }
+
+template <typename T>
+static void assertSetEq(const ref<Set<T>>& s, const std::unordered_set<int>& m) {
+  assert(s->size() == m.size());
+  for (int v : m) {
+    assert(s->contains(T{v}));
+  }
+  uint32 n = 0;
+  for (auto& v : *s) {
+    ++n;
+    assert(m.count(intOf(v)));
+  }
+  assert(n == m.size());
+}
+
+
+TEST(SetBasics) {
+  auto a = Set<std::string>::empty();
+  assert(a->size() == 0);
+  assert(!a->contains("a"));
+  assert(a->begin() == a->end());
+  assert(a->remove("a") == a);
+
+  auto b = a->add("a")->add("b")->add("c");
+  assert(b->size() == 3);
+  assert(b->contains("b"));
+  assert(!b->contains("d"));
+  assert(b->add("b") == b);
+
+  auto c = b->remove("a");
+  assert(c->size() == 2);
+  assert(!c->contains("a"));
+  assert(b->contains("a"));
+  assert(c->remove("a") == c);
+
+  auto d = Set<int>::create({1, 2, 3, 2});
+  assert(d->size() == 3);
+  int sum = 0;
+  for (int v : *d) {
+    sum += v;
+  }
+  assert(sum == 6);
+
+  auto t = d->asTransient();
+  t->add(4)->add(5)->remove(1);
+  assert(t->size() == 4);
+  assert(t->contains(5));
+  auto e = t->makePersistent();
+  assert(t->makePersistent() == nullptr);
+  assert(t->add(6) == nullptr);
+  assertSetEq(e, {2, 3, 4, 5});
+  assertSetEq(d, {1, 2, 3});
+}
+
+
+TEST(SetOperations) {
+  auto a = Set<int>::create({1, 2, 3, 4});
+  auto b = Set<int>::create({3, 4, 5});
+  assertSetEq(a->unite(b), {1, 2, 3, 4, 5});
+  assertSetEq(a->intersect(b), {3, 4});
+  assertSetEq(a->subtract(b), {1, 2});
+  assertSetEq(b->subtract(a), {5});
+  assertSetEq(a->intersect(Set<int>::create({7})), {});
+  assertSetEq(a->subtract(a), {});
+
+  // results which are the same as an input are that input
+  assert(a->unite(a) == a);
+  assert(a->intersect(a) == a);
+  assert(a->unite(Set<int>::empty()) == a);
+  assert(Set<int>::empty()->unite(a) == a);
+  assert(a->subtract(Set<int>::empty()) == a);
+
+  // operations on versions of the same set reuse their nodes
+  auto big = Set<int>::empty()->modify([](ref<TransientSet<int>> t) {
+    for (int i = 0; i < 10000; ++i) {
+      t->add(i);
+    }
+  });
+  auto smaller = big->remove(77)->remove(5000);
+  auto bigger = big->add(-1);
+  assert(big->unite(smaller) == big);
+  assert(smaller->unite(big) == big);
+  assert(big->intersect(bigger) == big);
+  assert(bigger->intersect(big) == big);
+  assert(big->subtract(Set<int>::create({-5, 10001})) == big);
+  assertSetEq(bigger->subtract(smaller), {-1, 77, 5000});
+  assert(smaller->unite(bigger)->size() == 10001);
+  assert(smaller->intersect(bigger)->size() == 9998);
+}
+
+
+// Applies random set operations to sets derived from a common set and to sets built
+// independently, comparing the results to std::unordered_set
+template <typename T>
+static void fuzzSetOps(uint32 seed, uint32 iterations, int valuerange) {
+  auto rnd = [&seed](uint32 n) {
+    seed = seed * 1103515245 + 12345;
+    return n ? (seed >> 8) % n : 0;
+  };
+  auto randomize = [&](ref<Set<T>> s, std::unordered_set<int>& m, uint32 changes) {
+    for (uint32 i = 0; i < changes; ++i) {
+      int v = int(rnd(valuerange));
+      if (rnd(2)) {
+        s = s->add(T{v});
+        m.insert(v);
+      } else {
+        s = s->remove(T{v});
+        m.erase(v);
+      }
+    }
+    return s;
+  };
+
+  std::unordered_set<int> m0;
+  auto base = randomize(Set<T>::empty(), m0, valuerange);
+  for (uint32 n = 0; n < iterations; ++n) {
+    std::unordered_set<int> ma, mb;
+    ref<Set<T>> a, b;
+    if (rnd(3)) {
+      ma = mb = m0;
+      a = randomize(base, ma, rnd(50));
+      b = randomize(base, mb, rnd(50));
+    } else {
+      a = randomize(Set<T>::empty(), ma, rnd(valuerange));
+      b = randomize(Set<T>::empty(), mb, rnd(valuerange));
+    }
+
+    std::unordered_set<int> u = ma, i, d;
+    for (int v : mb) {
+      u.insert(v);
+    }
+    for (int v : ma) {
+      (mb.count(v) ? i : d).insert(v);
+    }
+    assertSetEq(a->unite(b), u);
+    assertSetEq(a->intersect(b), i);
+    assertSetEq(a->subtract(b), d);
+
+    // results are in canonical form, so removing all values leaves an empty set
+    auto r = a->intersect(b)->unite(a->subtract(b));
+    std::vector<T> values(r->begin(), r->end());
+    for (auto& v : values) {
+      r = r->remove(v);
+    }
+    assert(r->size() == 0);
+    assert(r->begin() == r->end());
+  }
+}
+
+TEST(SetFuzz) {
+  fuzzSetOps<int>(1, 300, 2000);
+  fuzzSetOps<CollidingValue>(2, 300, 100);
+}
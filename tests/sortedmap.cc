@@ -0,0 +1,181 @@
+#include "test.h"
+#include <immutable/sortedmap.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace immutable;
+
+template <typename V> static V valueOf(int v);
+template <> int valueOf<int>(int v) { return v; }
+template <> std::string valueOf<std::string>(int v) { return std::to_string(v); }
+
+template <typename V>
+static void assertSortedMapEq(const ref<SortedMap<int,V>>& a, const std::map<int,int>& m) {
+  assert(a->size() == m.size());
+  auto I = m.begin();
+  for (auto& e : *a) {
+    assert(I != m.end());
+    assert(e.first == I->first);
+    assert(e.second == valueOf<V>(I->second));
+    ++I;
+  }
+  assert(I == m.end());
+}
+
+
+TEST(SortedMapBasics) {
+  auto a = SortedMap<int,std::string>::empty();
+  assert(a->size() == 0);
+  assert(a->find(1) == nullptr);
+  assert(a->begin() == a->end());
+  assert(a->lowerBound(1) == a->end());
+  assert(a->remove(1) == a);
+
+  auto b = a->set(3, "three")->set(1, "one")->set(2, "two");
+  assert(b->size() == 3);
+  assert(b->get(1) == "one");
+  assert(*b->find(2) == "two");
+  assert(!b->contains(4));
+  std::string s;
+  for (auto& e : *b) {
+    s += e.second;
+  }
+  assert(s == "onetwothree");
+
+  auto c = b->set(2, "zwei")->remove(1);
+  assert(c->size() == 2);
+  assert(c->get(2) == "zwei");
+  assert(b->get(2) == "two");
+  assert(c->remove(1) == c);
+
+  auto d = SortedMap<int,int>::create({{5, 50}, {1, 10}, {3, 30}, {1, 11}});
+  assert(d->size() == 3);
+  assert(d->get(1) == 11);
+}
+
+
+TEST(SortedMapRange) {
+  // keys 0, 10, 20 ... 9990
+  auto a = SortedMap<int,int>::empty()->modify([](ref<TransientSortedMap<int,int>> t) {
+    for (int i = 999; i >= 0; --i) {
+      t->set(i * 10, i);
+    }
+  });
+  assert(a->size() == 1000);
+  assert(a->lowerBound(-5)->first == 0);
+  assert(a->lowerBound(0)->first == 0);
+  assert(a->lowerBound(15)->first == 20);
+  assert(a->lowerBound(5000)->first == 5000);
+  assert(a->lowerBound(9990)->first == 9990);
+  assert(a->lowerBound(9991) == a->end());
+
+  std::vector<int> keys;
+  for (auto& e : a->range(95, 150)) {
+    keys.push_back(e.first);
+  }
+  assert((keys == std::vector<int>{100, 110, 120, 130, 140}));
+
+  uint32 n = 0;
+  int prev = -1;
+  for (auto& e : a->range(0, 100000)) {
+    assert(e.first > prev);
+    prev = e.first;
+    ++n;
+  }
+  assert(n == 1000);
+
+  auto r = a->range(500, 500);
+  assert(r.begin() == r.end());
+  r = a->range(501, 509);
+  assert(r.begin() == r.end());
+  r = a->range(20000, 30000);
+  assert(r.begin() == r.end());
+}
+
+
+// Applies random set and remove operations to maps, persistent and transient, comparing
+// the results to a std::map. Old versions are kept and checked at the end.
+template <typename V>
+static void fuzzSortedMap(uint32 seed, uint32 iterations, int keyrange) {
+  auto rnd = [&seed](uint32 n) {
+    seed = seed * 1103515245 + 12345;
+    return n ? (seed >> 8) % n : 0;
+  };
+  std::map<int,int> m;
+  auto a = SortedMap<int,V>::empty();
+  std::vector<std::pair<ref<SortedMap<int,V>>, std::map<int,int>>> versions;
+
+  for (uint32 n = 0; n < iterations; ++n) {
+    // add or remove runs of keys, so that leaves are filled and emptied
+    int k = int(rnd(keyrange));
+    int run = int(rnd(100)) + 1;
+    bool add = rnd(5) < 3;
+    if (rnd(3) == 0) {
+      auto t = a->asTransient();
+      for (int i = 0; i < run; ++i) {
+        if (add) {
+          t->set(k + i, valueOf<V>(int(n)));
+          m[k + i] = int(n);
+        } else {
+          t->remove(k + i);
+          m.erase(k + i);
+        }
+      }
+      assert(t->size() == m.size());
+      a = t->makePersistent();
+    } else {
+      for (int i = 0; i < run; ++i) {
+        if (add) {
+          a = a->set(k + i, valueOf<V>(int(n)));
+          m[k + i] = int(n);
+        } else {
+          a = a->remove(k + i);
+          m.erase(k + i);
+        }
+      }
+    }
+    assertSortedMapEq(a, m);
+
+    // lowerBound and range agree with std::map
+    int lo = int(rnd(keyrange + 100));
+    int hi = lo + int(rnd(300));
+    auto I = m.lower_bound(lo);
+    auto J = m.lower_bound(hi);
+    auto it = a->lowerBound(lo);
+    assert((it == a->end()) == (I == m.end()));
+    if (I != m.end()) {
+      assert(it->first == I->first);
+    }
+    for (auto& e : a->range(lo, hi)) {
+      assert(I != J && e.first == I->first);
+      ++I;
+    }
+    assert(I == J);
+
+    if (rnd(8) == 0) {
+      versions.emplace_back(a, m);
+    }
+  }
+  for (auto& v : versions) {
+    assertSortedMapEq(v.first, v.second);
+  }
+
+  // removing all entries in any order leaves an empty map
+  std::vector<int> keys;
+  for (auto& e : *a) {
+    keys.push_back(e.first);
+  }
+  while (keys.size()) {
+    uint32 i = rnd(uint32(keys.size()));
+    a = a->remove(keys[i]);
+    keys.erase(keys.begin() + i);
+    assert(a->size() == keys.size());
+  }
+  assert(a->begin() == a->end());
+}
+
+TEST(SortedMapFuzz) {
+  fuzzSortedMap<int>(1, 1500, 5000);
+  fuzzSortedMap<std::string>(2, 800, 2000);
+}